@@ -0,0 +1,165 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Temporal supersampling.  See accum.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "accum.h"
+
+struct SampleAccumulator {
+  LPDIRECT3DDEVICE9 pd3dDevice;
+  UINT width, height;
+  LPDIRECT3DTEXTURE9 pTexture;          // Where the samples add up
+  LPDIRECT3DSURFACE9 pSurface;          // Its top level
+  LPDIRECT3DSURFACE9 pFrameTarget;      // Held between BeginSamples and ResolveSamples
+  UINT samples;
+};
+
+HRESULT CreateSampleAccumulator(LPDIRECT3DDEVICE9 pd3dDevice, UINT width, UINT height,
+                                SampleAccumulator **ppAccum) {
+  *ppAccum = NULL;
+
+  // Adding samples up needs blending into the target, which not every GPU that can draw into
+  // a floating-point one can do
+  LPDIRECT3D9 pD3D;
+  HRESULT hr = pd3dDevice->GetDirect3D(&pD3D);
+  if (FAILED(hr)) return hr;
+  D3DDISPLAYMODE mode;
+  if (SUCCEEDED(hr = pd3dDevice->GetDisplayMode(0, &mode))) {
+    hr = pD3D->CheckDeviceFormat(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, mode.Format,
+                                 D3DUSAGE_RENDERTARGET | D3DUSAGE_QUERY_POSTPIXELSHADER_BLENDING,
+                                 D3DRTYPE_TEXTURE, D3DFMT_A16B16G16R16F);
+  }
+  pD3D->Release();
+  if (FAILED(hr)) return D3DERR_NOTAVAILABLE;
+
+  SampleAccumulator *pAccum = new SampleAccumulator;
+  ZeroMemory(pAccum, sizeof(SampleAccumulator));
+  pAccum->pd3dDevice = pd3dDevice;
+  pd3dDevice->AddRef();
+  pAccum->width = width;
+  pAccum->height = height;
+
+  hr = pd3dDevice->CreateTexture(width, height, 1, D3DUSAGE_RENDERTARGET, D3DFMT_A16B16G16R16F,
+                                 D3DPOOL_DEFAULT, &pAccum->pTexture, NULL);
+  if (SUCCEEDED(hr)) hr = pAccum->pTexture->GetSurfaceLevel(0, &pAccum->pSurface);
+  if (FAILED(hr)) {
+    ReleaseSampleAccumulator(pAccum);
+    return hr;
+  }
+  *ppAccum = pAccum;
+  return S_OK;
+}
+
+/**
+ * The index'th number of the Halton sequence in base, between 0 and 1
+ */
+static float Halton(UINT index, UINT base) {
+  float result = 0.0f, fraction = 1.0f / base;
+  for (; index > 0; index /= base, fraction /= base) result += fraction * (index % base);
+  return result;
+}
+
+void GetSampleJitter(UINT sample, UINT samples, float shutter, float *pTime, float *pX, float *pY) {
+  // Times are spread evenly over the shutter, centred on the frame's own time
+  *pTime = ((sample + 0.5f) / samples - 0.5f) * shutter;
+
+  // Offsets come from the Halton (2, 3) sequence, which covers the pixel evenly however many
+  // samples there are.  Its points are then moved so their average is the middle of the pixel,
+  // or the picture as a whole would shift a little depending on the sample count.
+  float meanX = 0.0f, meanY = 0.0f;
+  for (UINT i = 0; i < samples; ++i) {
+    meanX += Halton(i + 1, 2);
+    meanY += Halton(i + 1, 3);
+  }
+  *pX = Halton(sample + 1, 2) - meanX / samples;
+  *pY = Halton(sample + 1, 3) - meanY / samples;
+}
+
+/**
+ * The texture factor level each sample is drawn with: 1 / samples, rounded up
+ */
+static UINT SampleLevel(UINT samples) {
+  return (255 + samples - 1) / samples;
+}
+
+float SampleOpacity(UINT samples) {
+  return SampleLevel(samples) / 255.0f;
+}
+
+HRESULT BeginSamples(SampleAccumulator *pAccum, UINT samples) {
+  LPDIRECT3DDEVICE9 pd3dDevice = pAccum->pd3dDevice;
+  HRESULT hr;
+  if (!pAccum->pFrameTarget && FAILED(hr = pd3dDevice->GetRenderTarget(0, &pAccum->pFrameTarget))) {
+    return hr;
+  }
+  pAccum->samples = samples;
+  if (FAILED(hr = pd3dDevice->SetRenderTarget(0, pAccum->pSurface))) return hr;
+  return pd3dDevice->Clear(0, NULL, D3DCLEAR_TARGET, D3DCOLOR_ARGB(0,0,0,0), 1.0f, 0);
+}
+
+HRESULT ResolveSamples(SampleAccumulator *pAccum) {
+  LPDIRECT3DSURFACE9 pFrameTarget = pAccum->pFrameTarget;
+  if (!pFrameTarget) return E_UNEXPECTED;
+  pAccum->pFrameTarget = NULL;
+  LPDIRECT3DDEVICE9 pd3dDevice = pAccum->pd3dDevice;
+  HRESULT hr = pd3dDevice->SetRenderTarget(0, pFrameTarget);
+  pFrameTarget->Release();
+  if (FAILED(hr)) return hr;
+
+  // The samples' weights were rounded up, so they add up to a little over 1.  Scale that back
+  // down with the texture factor as the sum is copied over.
+  UINT total = SampleLevel(pAccum->samples) * pAccum->samples;
+  UINT level = (255 * 255 + total / 2) / total;
+  if (level > 255) level = 255;
+
+  // One texel per pixel, sampled exactly, so nothing blurs the average further
+  DWORD minFilter, magFilter, mipFilter;
+  pd3dDevice->GetSamplerState(0, D3DSAMP_MINFILTER, &minFilter);
+  pd3dDevice->GetSamplerState(0, D3DSAMP_MAGFILTER, &magFilter);
+  pd3dDevice->GetSamplerState(0, D3DSAMP_MIPFILTER, &mipFilter);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MINFILTER, D3DTEXF_POINT);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MAGFILTER, D3DTEXF_POINT);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MIPFILTER, D3DTEXF_NONE);
+  pd3dDevice->SetRenderState(D3DRS_TEXTUREFACTOR, D3DCOLOR_XRGB(level, level, level));
+  pd3dDevice->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_TFACTOR);
+
+  float right = pAccum->width - 0.5f, bottom = pAccum->height - 0.5f;
+  struct {
+    FLOAT x,y,z,rhw;
+    FLOAT u, v;
+  } vertices[] = {
+    {-0.5f,bottom,0.5f,1,0,1},{-0.5f,-0.5f,0.5f,1,0,0},{right,-0.5f,0.5f,1,1,0},
+    {-0.5f,bottom,0.5f,1,0,1},{right,-0.5f,0.5f,1,1,0},{right,bottom,0.5f,1,1,1}
+  };
+  pd3dDevice->SetTexture(0, pAccum->pTexture);
+  pd3dDevice->SetFVF(D3DFVF_XYZRHW | D3DFVF_TEX1);
+  hr = pd3dDevice->DrawPrimitiveUP(D3DPT_TRIANGLELIST, 2, (void*)vertices, sizeof(FLOAT)*6);
+
+  // Back to the defaults everything else draws with
+  pd3dDevice->SetTexture(0, NULL);
+  pd3dDevice->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_CURRENT);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MINFILTER, minFilter);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MAGFILTER, magFilter);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MIPFILTER, mipFilter);
+  return hr;
+}
+
+UINT AdaptSampleCount(UINT samples, double secondsPerFrame, double budget) {
+  if (secondsPerFrame <= 0.0) return samples;
+  double scale = budget / secondsPerFrame;
+  if (scale > 2.0) scale = 2.0;
+  if (scale < 0.5) scale = 0.5;
+  double next = samples * scale + 0.5;
+  if (next < 1.0) return 1;
+  if (next > MAX_FRAME_SAMPLES) return MAX_FRAME_SAMPLES;
+  return (UINT)next;
+}
+
+void ReleaseSampleAccumulator(SampleAccumulator *pAccum) {
+  if (!pAccum) return;
+  if (pAccum->pFrameTarget) pAccum->pFrameTarget->Release();
+  if (pAccum->pSurface) pAccum->pSurface->Release();
+  if (pAccum->pTexture) pAccum->pTexture->Release();
+  pAccum->pd3dDevice->Release();
+  delete pAccum;
+}
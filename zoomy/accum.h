@@ -0,0 +1,74 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Temporal supersampling for offline export (-samples).
+//
+// A slow zoom over fine detail shimmers from frame to frame however the textures are filtered,
+// and encoders spend a lot of bits on the shimmer.  Export doesn't have to keep up with the
+// display, so each frame can instead be drawn several times, each sample at a slightly
+// different time within the frame's shutter interval and shifted by a different fraction of a
+// pixel, and the samples averaged.  That's antialiasing and motion blur in one.
+//
+// The samples are added up in a 16-bit floating-point target, each weighted by SampleOpacity,
+// so 8 bits per channel of precision aren't lost to the sum; ResolveSamples then copies the
+// average into the target the frame was being drawn on.  The jitter pattern is
+// fixed, so the same sample count gives the same frames on every run.
+//
+// Usage, one frame:
+//   BeginSamples()           - binds the accumulation target and clears it
+//   for each of the samples:
+//     GetSampleJitter(), then DrawPictureBlended(..., SampleOpacity(samples))
+//   ResolveSamples()         - puts the average on the target that was bound before
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <d3d9.h>
+
+// Most samples a frame can take
+#define MAX_FRAME_SAMPLES 64
+
+struct SampleAccumulator;
+
+/**
+ * Makes the accumulation target, width x height.  Fails with D3DERR_NOTAVAILABLE on GPUs that
+ * can't blend into a floating-point target.
+ */
+HRESULT CreateSampleAccumulator(LPDIRECT3DDEVICE9 pd3dDevice, UINT width, UINT height,
+                                SampleAccumulator **ppAccum);
+
+/**
+ * Where sample of samples should be drawn: *pTime is its offset from the frame's own time, in
+ * frames, spread across shutter (the fraction of the frame the shutter is open, 0 to 1); *pX
+ * and *pY are its offset in output pixels, within half a pixel either way.
+ */
+void GetSampleJitter(UINT sample, UINT samples, float shutter, float *pTime, float *pX, float *pY);
+
+/**
+ * The opacity to draw each of samples samples with.  This is rounded up to what the texture
+ * factor can hold exactly, and ResolveSamples takes out the difference.
+ */
+float SampleOpacity(UINT samples);
+
+/**
+ * Points the device at the accumulation target and clears it to black.  Call between
+ * BeginScene and EndScene, with the frame's own target bound.
+ */
+HRESULT BeginSamples(SampleAccumulator *pAccum, UINT samples);
+
+/**
+ * Points the device back at the frame's target and draws the average of the samples over all
+ * of it
+ */
+HRESULT ResolveSamples(SampleAccumulator *pAccum);
+
+/**
+ * Works out how many samples to take next, to keep a frame to about budget seconds, from how
+ * long the frames with samples samples each took lately.  Changes by no more than a factor of
+ * two at a time, so the odd slow frame (while tiles load, say) doesn't throw it.
+ */
+UINT AdaptSampleCount(UINT samples, double secondsPerFrame, double budget);
+
+/**
+ * Frees the target.  Safe to call with NULL.
+ */
+void ReleaseSampleAccumulator(SampleAccumulator *pAccum);
@@ -0,0 +1,181 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Batch file reading.  See batch.h for the format.
+//
+//--------------------------------------------------------------------------------------------------
+#include "batch.h"
+#include "options.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Batch files are shot lists, so anything bigger than this is almost certainly the wrong file
+#define BATCH_MAX_FILE_BYTES (16 * 1024 * 1024)
+
+/**
+ * Reads the next token of a line as a number.  Fails unless the whole token is one.
+ */
+static bool NextNumber(LPCSTR *pCursor, FLOAT *pValue) {
+  char token[64];
+  if (NULL == (*pCursor = NextToken(*pCursor, token, sizeof(token)))) return false;
+  char *end;
+  double value = strtod(token, &end);
+  if (end == token || *end) return false;
+  *pValue = (FLOAT)value;
+  return true;
+}
+
+/**
+ * Reads a rectangle as left, top, right and bottom.  It has to have some area.
+ */
+static bool NextRect(LPCSTR *pCursor, ZoomRect *pRect) {
+  if (!NextNumber(pCursor, &pRect->left) || !NextNumber(pCursor, &pRect->top) ||
+      !NextNumber(pCursor, &pRect->right) || !NextNumber(pCursor, &pRect->bottom)) {
+    return false;
+  }
+  return pRect->right > pRect->left && pRect->bottom > pRect->top;
+}
+
+/**
+ * Whether the next token is a number, which is how a line's views are told from its output
+ */
+static bool NumberIsNext(LPCSTR cursor) {
+  LPCSTR after = cursor;
+  FLOAT value;
+  return NextNumber(&after, &value);
+}
+
+/**
+ * Fills in a job from one line of the file.  Returns false if the line is malformed.
+ */
+static bool ParseJob(LPCSTR line, bool playlist, BatchJob *pJob) {
+  LPCSTR cursor = NextToken(line, pJob->imagePath, MAX_PATH);
+  if (!cursor) return false;
+
+  // A slide can be just the image
+  char extra[MAX_PATH];
+  if (playlist && NULL == NextToken(cursor, extra, sizeof(extra))) return true;
+
+  if (!NextRect(&cursor, &pJob->keys[0].view)) return false;
+  pJob->keyCount = 1;
+
+  // Then each view with how long it takes to get to it, until the output path
+  float total = 0.0f;
+  do {
+    if (pJob->keyCount == CAMERA_MAX_KEYS) return false;
+    CameraKey *pFrom = &pJob->keys[pJob->keyCount - 1];
+    if (!NextRect(&cursor, &pJob->keys[pJob->keyCount].view) ||
+        !NextNumber(&cursor, &pFrom->seconds) || pFrom->seconds < 0.0f) {
+      return false;
+    }
+    total += pFrom->seconds;
+    pJob->keyCount++;
+
+    char ease[16];
+    LPCSTR next = NextToken(cursor, ease, sizeof(ease));
+    if (next && 0 == lstrcmpi(ease, "ease")) {
+      pFrom->ease = EASE_SMOOTH;
+      cursor = next;
+    }
+  } while (NumberIsNext(cursor));
+
+  if (playlist) return total > 0.0f && NULL == NextToken(cursor, extra, sizeof(extra));
+  return total > 0.0f &&
+         NULL != (cursor = NextToken(cursor, pJob->outputPath, MAX_PATH)) &&
+         NULL == NextToken(cursor, extra, sizeof(extra));
+}
+
+HRESULT ReadBatchFile(LPCSTR path, bool playlist, BatchJob **ppJobs, UINT *pJobCount,
+                      UINT *pErrorLine) {
+  *ppJobs = NULL;
+  *pJobCount = 0;
+  *pErrorLine = 0;
+
+  // Read the whole file in, with a terminator so the last line ends like the others
+  HANDLE hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                            FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (INVALID_HANDLE_VALUE == hFile) return HRESULT_FROM_WIN32(GetLastError());
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(hFile, &size)) {
+    HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+    CloseHandle(hFile);
+    return hr;
+  }
+  if (size.QuadPart > BATCH_MAX_FILE_BYTES) {
+    CloseHandle(hFile);
+    return E_INVALIDARG;
+  }
+  DWORD bytes = (DWORD)size.QuadPart, bytesRead;
+  char *pText = new char[bytes + 1];
+  BOOL read = ReadFile(hFile, pText, bytes, &bytesRead, NULL);
+  HRESULT hr = read && bytesRead == bytes ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+  CloseHandle(hFile);
+  if (FAILED(hr)) {
+    delete[] pText;
+    return hr;
+  }
+  pText[bytes] = '\0';
+
+  // There can't be more jobs than lines
+  UINT lines = 1;
+  for (DWORD i = 0; i < bytes; ++i) {
+    if ('\n' == pText[i]) ++lines;
+  }
+  BatchJob *pJobs = new BatchJob[lines];
+  UINT jobCount = 0;
+
+  char *pLine = pText;
+  for (UINT lineNumber = 1; pLine; ++lineNumber) {
+    // Cut the line off at its end, whichever kind of line ending the file uses
+    char *pNext = strchr(pLine, '\n');
+    if (pNext) *pNext++ = '\0';
+    char *pReturn = strchr(pLine, '\r');
+    if (pReturn) *pReturn = '\0';
+
+    // Skip blank lines and comments
+    char *pFirst = pLine;
+    while (' ' == *pFirst || '\t' == *pFirst) ++pFirst;
+    if (*pFirst && '#' != *pFirst) {
+      ZeroMemory(&pJobs[jobCount], sizeof(BatchJob));
+      if (!ParseJob(pFirst, playlist, &pJobs[jobCount])) {
+        *pErrorLine = lineNumber;
+        hr = E_INVALIDARG;
+        break;
+      }
+      ++jobCount;
+    }
+    pLine = pNext;
+  }
+  delete[] pText;
+
+  if (FAILED(hr)) {
+    delete[] pJobs;
+    return hr;
+  }
+
+  *ppJobs = pJobs;
+  *pJobCount = jobCount;
+  return S_OK;
+}
+
+void ReleaseBatchJobs(BatchJob *pJobs) {
+  delete[] pJobs;
+}
+
+void BatchLog(LPCSTR format, ...) {
+  // wvsprintf never writes more than 1024 characters
+  char line[1024 + 2];
+  va_list args;
+  va_start(args, format);
+  int length = wvsprintf(line, format, args);
+  va_end(args);
+  if (length < 0) length = 0;
+  lstrcpy(line + length, "\n");
+  OutputDebugString(line);
+
+  // A windowed app only has standard output when it's been redirected somewhere
+  HANDLE hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+  if (hOutput && INVALID_HANDLE_VALUE != hOutput) {
+    DWORD written;
+    WriteFile(hOutput, line, (DWORD)length + 1, &written, NULL);
+  }
+}
@@ -0,0 +1,60 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Batch files, for rendering a whole shot list without anyone at the keyboard.
+//
+// Each line of a batch file is one job: the image, where the zoom starts and ends (left, top,
+// right and bottom in image pixels, the same corners Q/W/E/R pick), how many seconds it takes,
+// and where the frames go (anything -export accepts).  Paths with spaces go in double quotes.
+// Blank lines and lines starting with '#' are skipped.
+//
+//   # image               start                 end                    seconds  output
+//   "D:\shots\harbor.jpg" 0 0 8000 4500         3200 1800 4800 2700    20       "D:\out\harbor_%05d.png"
+//   D:\shots\peak.tif     1000 0 5000 2250      0 0 12000 6750         12.5     D:\out\peak.raw
+//
+// A tour through more views just carries on with another view and the seconds it takes to get
+// there, as many times as needed (up to CAMERA_MAX_KEYS views in all).  "ease" after the seconds
+// makes the camera slow to a stop at either end of that leg instead of sweeping through.
+//
+//   tour.jpg  0 0 8000 4500  2000 1000 3000 1562 8 ease  5000 400 5600 737 6  0 0 8000 4500 10  tour.mp4
+//
+// A playlist for -slideshow is the same, but with no outputs.  A playlist line can also be just
+// the image, which then gets the usual zoom: -time seconds from the whole image to the middle of
+// it.
+//
+//   # image               start                 end                    seconds
+//   "D:\shots\harbor.jpg" 0 0 8000 4500         3200 1800 4800 2700    20
+//   D:\shots\peak.tif
+//
+// Progress and failures are written to standard output (when it goes anywhere, e.g. when
+// redirected to a file) and to the debugger.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include "camera.h"
+
+struct BatchJob {
+  CHAR imagePath[MAX_PATH];
+  CameraKey keys[CAMERA_MAX_KEYS];  // Views in image pixels, before being fitted to the screen
+  UINT keyCount;                    // At least two, or none for a playlist line of just an image
+  CHAR outputPath[MAX_PATH];        // Empty in a playlist
+};
+
+/**
+ * Reads every job in a batch file, or with playlist, every slide in a playlist.  If a line can't
+ * be understood, fails with E_INVALIDARG and sets *pErrorLine to its (1-based) line number;
+ * otherwise *pErrorLine is 0.  Free the jobs with ReleaseBatchJobs.
+ */
+HRESULT ReadBatchFile(LPCSTR path, bool playlist, BatchJob **ppJobs, UINT *pJobCount,
+                      UINT *pErrorLine);
+
+/**
+ * Frees the jobs read by ReadBatchFile.  Safe to call with NULL.
+ */
+void ReleaseBatchJobs(BatchJob *pJobs);
+
+/**
+ * Writes a line of batch progress to standard output and the debugger.  Takes the same format
+ * as wsprintf and adds the newline itself.
+ */
+void BatchLog(LPCSTR format, ...);
@@ -0,0 +1,186 @@
+//--------------------------------------------------------------------------------------------------
+//
+// The benchmark's images, measurements and report.  See bench.h.  The run itself is in
+// zoomy.cpp, next to the other main loops.
+//
+//--------------------------------------------------------------------------------------------------
+#include "bench.h"
+#include <psapi.h>
+#include <stdlib.h>
+
+#pragma comment(lib,"psapi.lib")
+
+// Widths are all multiples of 4, so 24-bit rows need no padding
+static const BenchImage BENCH_IMAGES[BENCH_IMAGE_COUNT] = {
+  { "4mp_3x2",            2448,  1632 },
+  { "16mp_16x9",          5344,  3008 },
+  { "64mp_4x3",           9248,  6936 },
+  { "100mp_2x3",          8160,  12240 },
+  { "256mp_4x1",          32768, 8192 },
+  { "1gp_1x1",            32768, 32768 },
+};
+
+const BenchImage *GetBenchImage(UINT index) {
+  return index < BENCH_IMAGE_COUNT ? &BENCH_IMAGES[index] : NULL;
+}
+
+/**
+ * One row of a synthetic image, in BMP's BGR order.  Smooth gradients give the mips something
+ * to average, a fine checkerboard only resolves up close, and grid lines every 1024 pixels make
+ * any movement easy to see.  The same pixels come out every time.
+ */
+static void MakeBenchRow(const BenchImage *pImage, UINT y, BYTE *pRow) {
+  BYTE green = (BYTE)((ULONGLONG)y * 255 / (pImage->height - 1));
+  bool line_row = (y & 1023) < 4;
+  for (UINT x = 0; x < pImage->width; ++x, pRow += 3) {
+    if (line_row || (x & 1023) < 4) {
+      pRow[0] = pRow[1] = pRow[2] = 255;
+      continue;
+    }
+    pRow[0] = ((x >> 3) ^ (y >> 3)) & 1 ? 200 : 40;
+    pRow[1] = green;
+    pRow[2] = (BYTE)((ULONGLONG)x * 255 / (pImage->width - 1));
+  }
+}
+
+HRESULT MakeBenchImage(const BenchImage *pImage, LPSTR path) {
+  DWORD length = GetTempPath(MAX_PATH, path);
+  if (0 == length || length + lstrlen(pImage->name) + 16 > MAX_PATH) return E_FAIL;
+  lstrcat(path, "ZoomyBench");
+  if (!CreateDirectory(path, NULL) && ERROR_ALREADY_EXISTS != GetLastError()) {
+    return HRESULT_FROM_WIN32(GetLastError());
+  }
+  lstrcat(path, "\\");
+  lstrcat(path, pImage->name);
+  lstrcat(path, ".bmp");
+
+  // Use the one from last time if it's all there
+  DWORD rowBytes = pImage->width * 3;
+  ULONGLONG imageBytes = (ULONGLONG)rowBytes * pImage->height;
+  DWORD headerBytes = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+  WIN32_FILE_ATTRIBUTE_DATA existing;
+  if (GetFileAttributesEx(path, GetFileExInfoStandard, &existing) &&
+      (((ULONGLONG)existing.nFileSizeHigh << 32) | existing.nFileSizeLow) == headerBytes + imageBytes) {
+    return S_OK;
+  }
+
+  // Write it under another name first, so a run that's stopped halfway doesn't leave a
+  // truncated image behind to be picked up next time
+  char partialPath[MAX_PATH + 16];
+  wsprintf(partialPath, "%s.partial", path);
+  HANDLE hFile = CreateFile(partialPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (INVALID_HANDLE_VALUE == hFile) return HRESULT_FROM_WIN32(GetLastError());
+
+  BITMAPFILEHEADER file;
+  ZeroMemory(&file, sizeof(file));
+  file.bfType = 0x4d42;  // "BM"
+  file.bfSize = (DWORD)(headerBytes + imageBytes);
+  file.bfOffBits = headerBytes;
+  BITMAPINFOHEADER info;
+  ZeroMemory(&info, sizeof(info));
+  info.biSize = sizeof(info);
+  info.biWidth = (LONG)pImage->width;
+  info.biHeight = (LONG)pImage->height;
+  info.biPlanes = 1;
+  info.biBitCount = 24;
+  info.biCompression = BI_RGB;
+  info.biSizeImage = (DWORD)imageBytes;
+
+  DWORD written;
+  BOOL ok = WriteFile(hFile, &file, sizeof(file), &written, NULL) &&
+            WriteFile(hFile, &info, sizeof(info), &written, NULL);
+
+  // BMP rows go from the bottom up
+  BYTE *pRow = new BYTE[rowBytes];
+  for (UINT row = 0; ok && row < pImage->height; ++row) {
+    MakeBenchRow(pImage, pImage->height - 1 - row, pRow);
+    ok = WriteFile(hFile, pRow, rowBytes, &written, NULL) && written == rowBytes;
+  }
+  delete[] pRow;
+
+  HRESULT hr = ok ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+  CloseHandle(hFile);
+  if (SUCCEEDED(hr) && !MoveFileEx(partialPath, path, MOVEFILE_REPLACE_EXISTING)) {
+    hr = HRESULT_FROM_WIN32(GetLastError());
+  }
+  if (FAILED(hr)) DeleteFile(partialPath);
+  return hr;
+}
+
+void SampleBenchMemory(LPDIRECT3DDEVICE9 pd3dDevice, BenchMemory *pMemory) {
+  PROCESS_MEMORY_COUNTERS counters;
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) &&
+      counters.WorkingSetSize > pMemory->peakWorkingSet) {
+    pMemory->peakWorkingSet = counters.WorkingSetSize;
+  }
+
+  // Only an estimate, and rounded to the megabyte, but it's what Direct3D 9 has
+  UINT available = pd3dDevice->GetAvailableTextureMem();
+  if (0 == pMemory->textureMemoryStart) {
+    pMemory->textureMemoryStart = pMemory->textureMemoryLowest = available;
+  } else if (available < pMemory->textureMemoryLowest) {
+    pMemory->textureMemoryLowest = available;
+  }
+}
+
+struct BenchReport {
+  HANDLE hFile;
+};
+
+HRESULT CreateBenchReport(LPCSTR path, BenchReport **ppReport) {
+  *ppReport = NULL;
+  HANDLE hFile = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                            FILE_ATTRIBUTE_NORMAL, NULL);
+  if (INVALID_HANDLE_VALUE == hFile) return HRESULT_FROM_WIN32(GetLastError());
+  BenchReport *pReport = new BenchReport;
+  pReport->hFile = hFile;
+  *ppReport = pReport;
+  return S_OK;
+}
+
+void BenchWrite(BenchReport *pReport, LPCSTR format, ...) {
+  // wvsprintf never writes more than 1024 characters
+  char text[1024 + 1];
+  va_list args;
+  va_start(args, format);
+  int length = wvsprintf(text, format, args);
+  va_end(args);
+  if (length <= 0) return;
+  DWORD written;
+  WriteFile(pReport->hFile, text, (DWORD)length, &written, NULL);
+}
+
+/**
+ * qsort order for frame times
+ */
+static int CompareFrameTimes(const void *a, const void *b) {
+  UINT x = *(const UINT *)a, y = *(const UINT *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+void BenchWriteFrameTimes(BenchReport *pReport, UINT *pFrameTimes, UINT count, UINT refreshPeriod) {
+  ULONGLONG total = 0;
+  UINT missed = 0;
+  for (UINT i = 0; i < count; ++i) {
+    total += pFrameTimes[i];
+    UINT refreshes = refreshPeriod ? (pFrameTimes[i] + refreshPeriod / 2) / refreshPeriod : 1;
+    if (refreshes > 1) missed += refreshes - 1;
+  }
+  qsort(pFrameTimes, count, sizeof(UINT), CompareFrameTimes);
+
+  UINT mean = count ? (UINT)(total / count) : 0,
+       p50 = count ? pFrameTimes[count / 2] : 0,
+       p90 = count ? pFrameTimes[(count * 90) / 100] : 0,
+       p99 = count ? pFrameTimes[(count * 99) / 100] : 0,
+       max = count ? pFrameTimes[count - 1] : 0;
+  BenchWrite(pReport, "{ \"frames\": %u, \"mean_us\": %u, \"p50_us\": %u, \"p90_us\": %u, "
+             "\"p99_us\": %u, \"max_us\": %u, \"missed_refreshes\": %u }",
+             count, mean, p50, p90, p99, max, missed);
+}
+
+void ReleaseBenchReport(BenchReport *pReport) {
+  if (!pReport) return;
+  CloseHandle(pReport->hFile);
+  delete pReport;
+}
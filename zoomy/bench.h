@@ -0,0 +1,81 @@
+//--------------------------------------------------------------------------------------------------
+//
+// The benchmark, for telling whether a change made things faster or slower.
+//
+// "-benchmark <report.json>" makes a fixed set of synthetic images, from 4 megapixels to a
+// gigapixel in a few different shapes, and loads each through the same path as any other image
+// (with the texture cache off, so every load decodes).  Each then plays a fixed set of zooms: a
+// full fit in to 1:1, a full fit to 4x past 1:1, and a tour of the corners at 1:1.  Frame N of
+// a zoom always shows its view at N refreshes in, so every run draws exactly the same frames.
+// Where the GPU runs ps_3_0, every zoom is played twice, with the fixed-function sampler and
+// then through the shader filter (see filter.h), and each run is reported with its "filter".
+//
+// The report gives each image's load times, peak working set and the video memory it took, and
+// the distribution of frame times for each zoom, as JSON.  Times are in microseconds and memory in
+// megabytes, all integers.
+//
+// The images are plain 24-bit BMPs written to a "ZoomyBench" directory under %TEMP%, and are
+// kept there, since writing the biggest takes a while; it needs about 5 GB free.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <d3d9.h>
+
+// Version of the report's layout, bumped whenever a field changes meaning
+#define BENCH_REPORT_VERSION 2
+
+struct BenchImage {
+  LPCSTR name;
+  UINT width, height;
+};
+
+// How many images the benchmark runs
+#define BENCH_IMAGE_COUNT 6
+
+/**
+ * The index'th image the benchmark runs, smallest first
+ */
+const BenchImage *GetBenchImage(UINT index);
+
+/**
+ * Makes pImage's file in the benchmark directory, unless it's already there, and puts its path
+ * in path (MAX_PATH characters).
+ */
+HRESULT MakeBenchImage(const BenchImage *pImage, LPSTR path);
+
+/**
+ * The most memory a run has used so far.  Zero it, then sample it as often as the run allows.
+ */
+struct BenchMemory {
+  SIZE_T peakWorkingSet;        // Bytes
+  UINT textureMemoryStart;      // What GetAvailableTextureMem said when sampling started
+  UINT textureMemoryLowest;     // The least it has said since
+};
+
+void SampleBenchMemory(LPDIRECT3DDEVICE9 pd3dDevice, BenchMemory *pMemory);
+
+/**
+ * The report file, written as the benchmark goes so a run that crashes still leaves
+ * something behind
+ */
+struct BenchReport;
+
+HRESULT CreateBenchReport(LPCSTR path, BenchReport **ppReport);
+
+/**
+ * Appends to the report.  Takes the same format as wsprintf.
+ */
+void BenchWrite(BenchReport *pReport, LPCSTR format, ...);
+
+/**
+ * Writes frame times (microseconds, in the order they happened) as a JSON object of their
+ * count, mean, percentiles and maximum, and how many refreshes of refreshPeriod microseconds
+ * they missed.  Sorts the times in the process.
+ */
+void BenchWriteFrameTimes(BenchReport *pReport, UINT *pFrameTimes, UINT count, UINT refreshPeriod);
+
+/**
+ * Closes the report.  Safe to call with NULL.
+ */
+void ReleaseBenchReport(BenchReport *pReport);
@@ -0,0 +1,225 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Camera path.  See camera.h.
+//
+// Keys and samples are kept as a center and the logarithm of the width.  The height always
+// follows from the width, since every view is the shape of the screen.
+//
+//--------------------------------------------------------------------------------------------------
+#include "camera.h"
+#include <math.h>
+#include <string.h>
+
+/**
+ * One point on the path.  Everything is in double so views deep into a huge image keep their
+ * sub-pixel precision.
+ */
+struct CameraSample {
+  double x, y;                  // Center
+  double scale;                 // Natural log of the width
+};
+
+/**
+ * A key as a point on the path
+ */
+static CameraSample SampleFromView(const ZoomRect &view) {
+  CameraSample sample = { ((double)view.left + view.right) * 0.5,
+                          ((double)view.top + view.bottom) * 0.5,
+                          log((double)view.right - view.left) };
+  return sample;
+}
+
+/**
+ * Cubic Hermite interpolation between p0 and p1 with tangents m0 and m1, u of the way along
+ */
+static double Hermite(double p0, double m0, double p1, double m1, double u) {
+  double u2 = u * u, u3 = u2 * u;
+  return (2.0 * u3 - 3.0 * u2 + 1.0) * p0 + (u3 - 2.0 * u2 + u) * m0 +
+         (-2.0 * u3 + 3.0 * u2) * p1 + (u3 - u2) * m1;
+}
+
+/**
+ * When each key is reached, and where it and its tangent are on the path
+ */
+struct CameraKnots {
+  double times[CAMERA_MAX_KEYS];
+  CameraSample points[CAMERA_MAX_KEYS];
+  CameraSample tangents[CAMERA_MAX_KEYS];       // Per second
+};
+
+/**
+ * Whether the keys can be baked
+ */
+static bool ValidCameraKeys(const CameraKey *pKeys, UINT keyCount) {
+  if (0 == keyCount || keyCount > CAMERA_MAX_KEYS) return false;
+  for (UINT i = 0; i < keyCount; ++i) {
+    const ZoomRect &view = pKeys[i].view;
+    if (!(view.right > view.left && view.bottom > view.top)) return false;
+    if (i + 1 < keyCount && !(pKeys[i].seconds >= 0.0f)) return false;
+  }
+  return true;
+}
+
+/**
+ * Works out the knots for keys that ValidCameraKeys has passed
+ */
+static void FindCameraKnots(const CameraKey *pKeys, UINT keyCount, CameraKnots *pKnots) {
+  pKnots->times[0] = 0.0;
+  for (UINT i = 0; i < keyCount; ++i) {
+    pKnots->points[i] = SampleFromView(pKeys[i].view);
+    if (i > 0) pKnots->times[i] = pKnots->times[i - 1] + pKeys[i - 1].seconds;
+  }
+
+  // Catmull-Rom tangents, per second, each from the keys on either side; the ends only have
+  // one side.  Measuring them against time rather than per segment keeps the speed continuous
+  // through keys whose segments differ in length.
+  const double *times = pKnots->times;
+  const CameraSample *points = pKnots->points;
+  for (UINT i = 0; i < keyCount; ++i) {
+    UINT before = i > 0 ? i - 1 : i, after = i + 1 < keyCount ? i + 1 : i;
+    double span = times[after] - times[before];
+    double inverse = span > 0.0 ? 1.0 / span : 0.0;
+    pKnots->tangents[i].x = (points[after].x - points[before].x) * inverse;
+    pKnots->tangents[i].y = (points[after].y - points[before].y) * inverse;
+    pKnots->tangents[i].scale = (points[after].scale - points[before].scale) * inverse;
+  }
+}
+
+/**
+ * Works out samples first to last (inclusive) of the track's table.  Each sample only depends
+ * on the knots, so baking part of the table gives exactly what baking all of it would.
+ */
+static void BakeCameraSamples(const CameraKey *pKeys, UINT keyCount, const CameraKnots *pKnots,
+                              UINT first, UINT last, CameraTrack *pTrack) {
+  const double *times = pKnots->times;
+  UINT segment = 0;
+  for (UINT i = first; i <= last; ++i) {
+    double t = (double)i / CAMERA_SAMPLES_PER_SECOND;
+    if (t > pTrack->duration) t = pTrack->duration;
+    while (segment + 2 < keyCount && t >= times[segment + 1]) ++segment;
+
+    CameraSample *pSample = &pTrack->pSamples[i];
+    if (keyCount == 1) {
+      *pSample = pKnots->points[0];
+      continue;
+    }
+
+    // How far through the segment we are, eased if it asks for it
+    double length = times[segment + 1] - times[segment];
+    double u = length > 0.0 ? (t - times[segment]) / length : 1.0;
+    if (u < 0.0) u = 0.0;
+    if (u > 1.0) u = 1.0;
+    if (EASE_SMOOTH == pKeys[segment].ease) u = u * u * (3.0 - 2.0 * u);
+
+    const CameraSample &p0 = pKnots->points[segment], &p1 = pKnots->points[segment + 1];
+    const CameraSample &m0 = pKnots->tangents[segment], &m1 = pKnots->tangents[segment + 1];
+    pSample->x = Hermite(p0.x, m0.x * length, p1.x, m1.x * length, u);
+    pSample->y = Hermite(p0.y, m0.y * length, p1.y, m1.y * length, u);
+    pSample->scale = Hermite(p0.scale, m0.scale * length, p1.scale, m1.scale * length, u);
+  }
+}
+
+HRESULT BakeCameraTrack(const CameraKey *pKeys, UINT keyCount, CameraTrack *pTrack) {
+  ZeroMemory(pTrack, sizeof(CameraTrack));
+  if (!ValidCameraKeys(pKeys, keyCount)) return E_INVALIDARG;
+
+  CameraKnots knots;
+  FindCameraKnots(pKeys, keyCount, &knots);
+
+  const ZoomRect &first = pKeys[0].view;
+  pTrack->duration = knots.times[keyCount - 1];
+  pTrack->aspect = ((double)first.right - first.left) / ((double)first.bottom - first.top);
+  pTrack->sampleCount = (UINT)ceil(pTrack->duration * CAMERA_SAMPLES_PER_SECOND) + 1;
+  pTrack->pSamples = new CameraSample[pTrack->sampleCount];
+  pTrack->keyCount = keyCount;
+  CopyMemory(pTrack->keys, pKeys, sizeof(CameraKey) * keyCount);
+  BakeCameraSamples(pKeys, keyCount, &knots, 0, pTrack->sampleCount - 1, pTrack);
+
+  // Success
+  return S_OK;
+}
+
+HRESULT UpdateCameraTrack(const CameraKey *pKeys, UINT keyCount, CameraTrack *pTrack) {
+  if (!ValidCameraKeys(pKeys, keyCount)) {
+    ReleaseCameraTrack(pTrack);
+    return E_INVALIDARG;
+  }
+
+  // Anything that moves the keys in time, or changes how the camera gets between them, moves
+  // every sample after it, so only views can be changed in place
+  bool retimed = !pTrack->pSamples || keyCount != pTrack->keyCount;
+  for (UINT i = 0; !retimed && i + 1 < keyCount; ++i) {
+    retimed = pKeys[i].seconds != pTrack->keys[i].seconds || pKeys[i].ease != pTrack->keys[i].ease;
+  }
+  if (retimed) {
+    ReleaseCameraTrack(pTrack);
+    return BakeCameraTrack(pKeys, keyCount, pTrack);
+  }
+
+  // A key's view moves its own tangent and its neighbors', and each tangent shapes the
+  // segments on either side of its key, so the samples from two keys before the changed ones
+  // to two keys after them are all that move
+  UINT changed_first = keyCount, changed_last = 0;
+  for (UINT i = 0; i < keyCount; ++i) {
+    if (0 == memcmp(&pKeys[i].view, &pTrack->keys[i].view, sizeof(ZoomRect))) continue;
+    if (changed_first == keyCount) changed_first = i;
+    changed_last = i;
+  }
+  if (changed_first == keyCount) return S_FALSE;
+  UINT key_first = changed_first > 2 ? changed_first - 2 : 0,
+       key_last = changed_last + 2 < keyCount ? changed_last + 2 : keyCount - 1;
+
+  CameraKnots knots;
+  FindCameraKnots(pKeys, keyCount, &knots);
+  UINT first = (UINT)floor(knots.times[key_first] * CAMERA_SAMPLES_PER_SECOND),
+       last = (UINT)ceil(knots.times[key_last] * CAMERA_SAMPLES_PER_SECOND);
+  if (last > pTrack->sampleCount - 1) last = pTrack->sampleCount - 1;
+  if (first > last) first = last;
+
+  const ZoomRect &view = pKeys[0].view;
+  pTrack->aspect = ((double)view.right - view.left) / ((double)view.bottom - view.top);
+  CopyMemory(pTrack->keys, pKeys, sizeof(CameraKey) * keyCount);
+  BakeCameraSamples(pKeys, keyCount, &knots, first, last, pTrack);
+
+  // Success
+  return S_OK;
+}
+
+ZoomRect CameraTrackView(const CameraTrack *pTrack, double seconds) {
+  // Blend the two samples either side of this time
+  double position = seconds * CAMERA_SAMPLES_PER_SECOND;
+  double last = (double)(pTrack->sampleCount - 1);
+  if (!(position > 0.0)) position = 0.0;
+  if (position > last) position = last;
+  UINT index = (UINT)position;
+  if (index + 1 >= pTrack->sampleCount) index = pTrack->sampleCount > 1 ? pTrack->sampleCount - 2 : 0;
+  double f = position - index;
+  const CameraSample &a = pTrack->pSamples[index];
+  const CameraSample &b = pTrack->pSamples[index + 1 < pTrack->sampleCount ? index + 1 : index];
+
+  double x = a.x + (b.x - a.x) * f, y = a.y + (b.y - a.y) * f;
+  double width = exp(a.scale + (b.scale - a.scale) * f), height = width / pTrack->aspect;
+  ZoomRect view = { (float)(x - width * 0.5), (float)(y - height * 0.5),
+                    (float)(x + width * 0.5), (float)(y + height * 0.5) };
+  return view;
+}
+
+void ReleaseCameraTrack(CameraTrack *pTrack) {
+  delete[] pTrack->pSamples;
+  ZeroMemory(pTrack, sizeof(CameraTrack));
+}
+
+void SeekCameraPlayhead(CameraPlayhead *pPlayhead, const CameraTrack *pTrack, double seconds) {
+  if (!(seconds > 0.0)) seconds = 0.0;
+  if (seconds > pTrack->duration) seconds = pTrack->duration;
+  pPlayhead->seconds = seconds;
+}
+
+void AdvanceCameraPlayhead(CameraPlayhead *pPlayhead, const CameraTrack *pTrack, double elapsed) {
+  SeekCameraPlayhead(pPlayhead, pTrack, pPlayhead->seconds + elapsed * pPlayhead->rate);
+  if (IsCameraPlayheadAtEnd(pPlayhead, pTrack)) pPlayhead->playing = false;
+}
+
+bool IsCameraPlayheadAtEnd(const CameraPlayhead *pPlayhead, const CameraTrack *pTrack) {
+  return pPlayhead->seconds == (pPlayhead->rate < 0.0 ? 0.0 : pTrack->duration);
+}
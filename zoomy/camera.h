@@ -0,0 +1,103 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Where the camera is during the zoom.
+//
+// The zoom is a track of keyframes: views of the image, all the shape of the screen, with the
+// time it takes to get from each to the next.  The camera follows a Catmull-Rom spline through
+// their centers, and through the logarithm of their widths, so zooming in by 2x takes as long
+// at 100x as it does at 1x and the apparent speed stays even.  Each segment can also be eased,
+// which slows the camera to a stop at the keys on either side of it.
+//
+// The track is baked once, when the keys are set, into a table of CAMERA_SAMPLES_PER_SECOND
+// samples (and after that only the stretch around any key that moves); each frame just looks up
+// the two samples it falls between.  The view is always
+// worked out directly from how far through the zoom we are, never by adding up per-frame
+// steps, so it doesn't drift, doesn't depend on the frame rate, and is exactly the same live as
+// in an export.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include "zoomy.h"
+
+// Most keys in a track, including the first and last
+#define CAMERA_MAX_KEYS 64
+
+// How finely the track is baked
+#define CAMERA_SAMPLES_PER_SECOND 240
+
+// Values for CameraKey::ease
+#define EASE_LINEAR 0           // Keeps moving through the keys at either end
+#define EASE_SMOOTH 1           // Slows to a stop at the keys at either end
+
+struct CameraKey {
+  ZoomRect view;                // Fitted to the screen's shape (see PutScreenOverCoordinates)
+  float seconds;                // How long it takes to get from here to the next key
+  UINT ease;                    // One of the EASE_ values, for the segment to the next key
+};
+
+struct CameraSample;
+
+struct CameraTrack {
+  double duration;              // Seconds from the first key to the last
+  double aspect;                // Width over height of every view
+  UINT sampleCount;
+  CameraSample *pSamples;
+  UINT keyCount;                // The keys it was baked from, so UpdateCameraTrack can tell
+  CameraKey keys[CAMERA_MAX_KEYS];      // what has changed
+};
+
+/**
+ * Bakes keyCount keys into a track.  The last key's seconds and ease are ignored.  Any track
+ * already in pTrack must have been released.
+ */
+HRESULT BakeCameraTrack(const CameraKey *pKeys, UINT keyCount, CameraTrack *pTrack);
+
+/**
+ * Brings a baked (or zeroed) track up to date with keys that have been edited.  When only
+ * views have changed, just the samples they shape are baked again: those between the keys two
+ * either side of the changed ones, since each key's view sets its neighbors' tangents too.
+ * Moving one key of a long tour then costs a few segments, however long the tour is.  Adding
+ * or taking out keys, or changing their times or easing, bakes it all again.  Returns S_FALSE
+ * if nothing changed.  On failure the track is released.
+ */
+HRESULT UpdateCameraTrack(const CameraKey *pKeys, UINT keyCount, CameraTrack *pTrack);
+
+/**
+ * The view `seconds` into the track.  It stays at the first key before the start and at the
+ * last one after the end.
+ */
+ZoomRect CameraTrackView(const CameraTrack *pTrack, double seconds);
+
+/**
+ * Frees the sample table.  Safe to call on a zeroed track.
+ */
+void ReleaseCameraTrack(CameraTrack *pTrack);
+
+/**
+ * Where live playback is on a track, and which way and how fast it's going.  Seeking only sets
+ * the position, since every view is worked out straight from it, so a seek costs the same
+ * wherever it lands and nothing has to be set up again.
+ */
+struct CameraPlayhead {
+  double seconds;               // Into the track
+  double rate;                  // Track seconds per second played; negative plays it backwards
+  bool playing;                 // Whether it moves on by itself
+};
+
+/**
+ * Moves the playhead to `seconds` into the track, clamped to its ends
+ */
+void SeekCameraPlayhead(CameraPlayhead *pPlayhead, const CameraTrack *pTrack, double seconds);
+
+/**
+ * Moves the playhead on by elapsed seconds of playback at its rate, whether or not it's
+ * playing, and stops it playing if that reaches the end it's heading for
+ */
+void AdvanceCameraPlayhead(CameraPlayhead *pPlayhead, const CameraTrack *pTrack, double elapsed);
+
+/**
+ * Whether the playhead is at the end of the track it's heading for: the end going forwards,
+ * the start going backwards
+ */
+bool IsCameraPlayheadAtEnd(const CameraPlayhead *pPlayhead, const CameraTrack *pTrack);
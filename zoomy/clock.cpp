@@ -0,0 +1,14 @@
+//--------------------------------------------------------------------------------------------------
+//
+// High-resolution clock.  See clock.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "clock.h"
+
+double ClockSeconds() {
+  // The frequency is fixed at boot, so there's no harm in every thread asking for it
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
@@ -0,0 +1,14 @@
+//--------------------------------------------------------------------------------------------------
+//
+// A high-resolution clock.  GetTickCount only moves every 15.6 ms or so, which is most of a
+// frame at 60 Hz; QueryPerformanceCounter is good to well under a microsecond.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+
+/**
+ * Seconds since some arbitrary point in the past.  Only differences between two calls mean
+ * anything.  Safe to call from any thread.
+ */
+double ClockSeconds();
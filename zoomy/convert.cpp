@@ -0,0 +1,296 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Pixel conversion.  See convert.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "convert.h"
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <intrin.h>
+
+// Rows a converted source fetches from the one it wraps at a time
+#define CONVERT_BAND_ROWS 16
+
+// 0 until the CPU has been looked at, then 1 without SSSE3 and 2 with it
+static volatile LONG ssse3State = 0;
+
+/**
+ * Whether the CPU has SSSE3's byte shuffle.  Two threads may both ask the CPU the first time,
+ * which does no harm.
+ */
+static bool HasSsse3() {
+  if (!ssse3State) {
+    int info[4];
+    __cpuid(info, 1);
+    InterlockedExchange(&ssse3State, (info[2] & (1 << 9)) ? 2 : 1);
+  }
+  return 2 == ssse3State;
+}
+
+static bool HasSse2() {
+  return IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) != FALSE;
+}
+
+/**
+ * Spreads 3-byte pixels out to 4 with opaque alpha, swapping the first and third bytes if swap
+ */
+static void ExpandTriples(const BYTE *pIn, UINT width, BYTE *pOut, bool swap) {
+  UINT x = 0;
+  if (HasSsse3()) {
+    const __m128i order =
+        swap ? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+             : _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+
+    // Each load reads 16 bytes to use 12, so the last pixels or so are left to the plain loop
+    for (; x * 3 + 16 <= width * 3; x += 4) {
+      __m128i in = _mm_loadu_si128((const __m128i *)(pIn + x * 3));
+      _mm_storeu_si128((__m128i *)(pOut + x * 4), _mm_or_si128(_mm_shuffle_epi8(in, order), alpha));
+    }
+  }
+  UINT first = swap ? 2 : 0, third = swap ? 0 : 2;
+  for (; x < width; ++x) {
+    pOut[x * 4]     = pIn[x * 3 + first];
+    pOut[x * 4 + 1] = pIn[x * 3 + 1];
+    pOut[x * 4 + 2] = pIn[x * 3 + third];
+    pOut[x * 4 + 3] = 0xFF;
+  }
+}
+
+/**
+ * Turns RGBA pixels into BGRA
+ */
+static void SwapQuads(const BYTE *pIn, UINT width, BYTE *pOut) {
+  UINT x = 0;
+  if (HasSsse3()) {
+    const __m128i order = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    for (; x + 4 <= width; x += 4) {
+      __m128i in = _mm_loadu_si128((const __m128i *)(pIn + x * 4));
+      _mm_storeu_si128((__m128i *)(pOut + x * 4), _mm_shuffle_epi8(in, order));
+    }
+  }
+  for (; x < width; ++x) {
+    pOut[x * 4]     = pIn[x * 4 + 2];
+    pOut[x * 4 + 1] = pIn[x * 4 + 1];
+    pOut[x * 4 + 2] = pIn[x * 4];
+    pOut[x * 4 + 3] = pIn[x * 4 + 3];
+  }
+}
+
+/**
+ * Copies BGRx pixels with the unused byte made opaque alpha
+ */
+static void FillAlpha(const BYTE *pIn, UINT width, BYTE *pOut) {
+  UINT x = 0;
+  if (HasSse2()) {
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    for (; x + 4 <= width; x += 4) {
+      __m128i in = _mm_loadu_si128((const __m128i *)(pIn + x * 4));
+      _mm_storeu_si128((__m128i *)(pOut + x * 4), _mm_or_si128(in, alpha));
+    }
+  }
+  for (; x < width; ++x) *(DWORD *)(pOut + x * 4) = *(const DWORD *)(pIn + x * 4) | 0xFF000000;
+}
+
+/**
+ * Spreads grey values out to opaque BGRA pixels
+ */
+static void ExpandGray(const BYTE *pIn, UINT width, BYTE *pOut) {
+  UINT x = 0;
+  if (HasSse2()) {
+    const __m128i opaque = _mm_set1_epi8(-1);
+    for (; x + 16 <= width; x += 16) {
+      __m128i grey = _mm_loadu_si128((const __m128i *)(pIn + x));
+
+      // Pairs of grey, and pairs of grey and alpha, interleaved into grey grey grey alpha
+      __m128i low = _mm_unpacklo_epi8(grey, grey), high = _mm_unpackhi_epi8(grey, grey);
+      __m128i lowAlpha = _mm_unpacklo_epi8(grey, opaque),
+              highAlpha = _mm_unpackhi_epi8(grey, opaque);
+      __m128i *pTo = (__m128i *)(pOut + x * 4);
+      _mm_storeu_si128(pTo,     _mm_unpacklo_epi16(low, lowAlpha));
+      _mm_storeu_si128(pTo + 1, _mm_unpackhi_epi16(low, lowAlpha));
+      _mm_storeu_si128(pTo + 2, _mm_unpacklo_epi16(high, highAlpha));
+      _mm_storeu_si128(pTo + 3, _mm_unpackhi_epi16(high, highAlpha));
+    }
+  }
+  for (; x < width; ++x) {
+    pOut[x * 4] = pOut[x * 4 + 1] = pOut[x * 4 + 2] = pIn[x];
+    pOut[x * 4 + 3] = 0xFF;
+  }
+}
+
+/**
+ * Rounds count 16-bit values to 8 bits, packed into the start of the same buffer.  v / 257 is
+ * taken as ((v * 65281 >> 16) + 128) >> 8, which SSE2 can do 8 values at a time.
+ */
+static void Narrow16(BYTE *pData, UINT count) {
+  UINT i = 0;
+  if (HasSse2()) {
+    const __m128i scale = _mm_set1_epi16((short)65281), half = _mm_set1_epi16(128);
+
+    // Each store lands on bytes the loads of this or an earlier step have already read
+    for (; i + 16 <= count; i += 16) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(pData + i * 2)),
+              b = _mm_loadu_si128((const __m128i *)(pData + i * 2 + 16));
+      a = _mm_srli_epi16(_mm_add_epi16(_mm_mulhi_epu16(a, scale), half), 8);
+      b = _mm_srli_epi16(_mm_add_epi16(_mm_mulhi_epu16(b, scale), half), 8);
+      _mm_storeu_si128((__m128i *)(pData + i), _mm_packus_epi16(a, b));
+    }
+  }
+  for (; i < count; ++i) {
+    UINT value = *(const WORD *)(pData + i * 2);
+    pData[i] = (BYTE)((((value * 65281u) >> 16) + 128) >> 8);
+  }
+}
+
+bool FindPixelLayout(REFWICPixelFormatGUID format, PixelLayout *pLayout) {
+  static const struct {
+    const GUID *pFormat;
+    PixelLayout layout;
+  } layouts[] = {
+    { &GUID_WICPixelFormat32bppBGRA, PIXELS_BGRA32 },
+    { &GUID_WICPixelFormat32bppBGR,  PIXELS_BGR32 },
+    { &GUID_WICPixelFormat24bppBGR,  PIXELS_BGR24 },
+    { &GUID_WICPixelFormat24bppRGB,  PIXELS_RGB24 },
+    { &GUID_WICPixelFormat8bppGray,  PIXELS_GRAY8 },
+    { &GUID_WICPixelFormat48bppRGB,  PIXELS_RGB48 },
+    { &GUID_WICPixelFormat64bppRGBA, PIXELS_RGBA64 },
+    { &GUID_WICPixelFormat16bppGray, PIXELS_GRAY16 },
+  };
+  for (UINT i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i) {
+    if (IsEqualGUID(format, *layouts[i].pFormat)) {
+      *pLayout = layouts[i].layout;
+      return true;
+    }
+  }
+  return false;
+}
+
+UINT PixelLayoutBytes(PixelLayout layout) {
+  switch (layout) {
+    case PIXELS_BGR24:
+    case PIXELS_RGB24:  return 3;
+    case PIXELS_GRAY8:  return 1;
+    case PIXELS_RGB48:  return 6;
+    case PIXELS_RGBA64: return 8;
+    case PIXELS_GRAY16: return 2;
+    default:            return 4;
+  }
+}
+
+void ConvertRow(PixelLayout layout, BYTE *pIn, UINT width, BYTE *pOut) {
+  switch (layout) {
+    case PIXELS_BGRA32: CopyMemory(pOut, pIn, (SIZE_T)width * 4); break;
+    case PIXELS_BGR32:  FillAlpha(pIn, width, pOut); break;
+    case PIXELS_BGR24:  ExpandTriples(pIn, width, pOut, false); break;
+    case PIXELS_RGB24:  ExpandTriples(pIn, width, pOut, true); break;
+    case PIXELS_GRAY8:  ExpandGray(pIn, width, pOut); break;
+    case PIXELS_RGB48:
+      Narrow16(pIn, width * 3);
+      ExpandTriples(pIn, width, pOut, true);
+      break;
+    case PIXELS_RGBA64:
+      Narrow16(pIn, width * 4);
+      SwapQuads(pIn, width, pOut);
+      break;
+    case PIXELS_GRAY16:
+      Narrow16(pIn, width);
+      ExpandGray(pIn, width, pOut);
+      break;
+  }
+}
+
+/**
+ * A source that reads another a band of rows at a time and converts them with ConvertRow
+ */
+class ConvertedSource : public IWICBitmapSource {
+public:
+  LONG references;
+  IWICBitmapSource *pInner;
+  PixelLayout layout;
+  BYTE *pScratch;               // Where the band is read to, before it's converted
+  SIZE_T scratchBytes;
+
+  ConvertedSource(IWICBitmapSource *pFrom, PixelLayout from)
+      : references(1), pInner(pFrom), layout(from), pScratch(NULL), scratchBytes(0) {
+    pInner->AddRef();
+  }
+  ~ConvertedSource() {
+    delete[] pScratch;
+    pInner->Release();
+  }
+
+  STDMETHODIMP QueryInterface(REFIID riid, void **ppObject) {
+    if (IID_IUnknown == riid || IID_IWICBitmapSource == riid) {
+      *ppObject = static_cast<IWICBitmapSource *>(this);
+      AddRef();
+      return S_OK;
+    }
+    *ppObject = NULL;
+    return E_NOINTERFACE;
+  }
+  STDMETHODIMP_(ULONG) AddRef() { return (ULONG)InterlockedIncrement(&references); }
+  STDMETHODIMP_(ULONG) Release() {
+    LONG left = InterlockedDecrement(&references);
+    if (0 == left) delete this;
+    return (ULONG)left;
+  }
+
+  STDMETHODIMP GetSize(UINT *pWidth, UINT *pHeight) { return pInner->GetSize(pWidth, pHeight); }
+  STDMETHODIMP GetPixelFormat(WICPixelFormatGUID *pFormat) {
+    *pFormat = GUID_WICPixelFormat32bppBGRA;
+    return S_OK;
+  }
+  STDMETHODIMP GetResolution(double *pDpiX, double *pDpiY) {
+    return pInner->GetResolution(pDpiX, pDpiY);
+  }
+  STDMETHODIMP CopyPalette(IWICPalette *) { return WINCODEC_ERR_PALETTEUNAVAILABLE; }
+  STDMETHODIMP CopyPixels(const WICRect *pRect, UINT stride, UINT bufferSize, BYTE *pBuffer);
+};
+
+STDMETHODIMP ConvertedSource::CopyPixels(const WICRect *pRect, UINT stride, UINT bufferSize,
+                                         BYTE *pBuffer) {
+  UINT width, height;
+  HRESULT hr = pInner->GetSize(&width, &height);
+  if (FAILED(hr)) return hr;
+  WICRect whole = { 0, 0, (INT)width, (INT)height };
+  if (!pRect) pRect = &whole;
+  if (pRect->Width <= 0 || pRect->Height <= 0) return E_INVALIDARG;
+  UINT rowBytes = (UINT)pRect->Width * 4;
+  if (stride < rowBytes || bufferSize < stride * (pRect->Height - 1) + rowBytes) {
+    return WINCODEC_ERR_INSUFFICIENTBUFFER;
+  }
+
+  UINT innerStride = ((UINT)pRect->Width * PixelLayoutBytes(layout) + 3) & ~3u;
+  SIZE_T bytes = (SIZE_T)innerStride * CONVERT_BAND_ROWS;
+  if (scratchBytes < bytes) {
+    delete[] pScratch;
+    pScratch = new BYTE[bytes];
+    scratchBytes = bytes;
+  }
+  for (INT y = 0; SUCCEEDED(hr) && y < pRect->Height; y += CONVERT_BAND_ROWS) {
+    INT rows = pRect->Height - y < CONVERT_BAND_ROWS ? pRect->Height - y : CONVERT_BAND_ROWS;
+    WICRect band = { pRect->X, pRect->Y + y, pRect->Width, rows };
+    hr = pInner->CopyPixels(&band, innerStride, innerStride * rows, pScratch);
+    for (INT row = 0; SUCCEEDED(hr) && row < rows; ++row) {
+      ConvertRow(layout, pScratch + (SIZE_T)row * innerStride, (UINT)pRect->Width,
+                 pBuffer + (SIZE_T)(y + row) * stride);
+    }
+  }
+  return hr;
+}
+
+HRESULT CreateConvertedSource(IWICBitmapSource *pSource, IWICBitmapSource **ppConverted) {
+  WICPixelFormatGUID format;
+  PixelLayout layout;
+  HRESULT hr = pSource->GetPixelFormat(&format);
+  if (FAILED(hr)) return hr;
+  if (!FindPixelLayout(format, &layout)) return S_FALSE;
+  if (PIXELS_BGRA32 == layout) {
+    pSource->AddRef();
+    *ppConverted = pSource;
+  } else {
+    *ppConverted = new ConvertedSource(pSource, layout);
+  }
+  return S_OK;
+}
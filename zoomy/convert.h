@@ -0,0 +1,51 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Pixel conversion to 32-bit BGRA, for the formats images are usually stored in.
+//
+// WIC's own format converter works a pixel at a time.  The common layouts (24-bit RGB and BGR
+// from JPEG and TIFF, 16 bits a channel from PNG, greyscale) are converted here instead, a row at
+// a time, with SSSE3 byte shuffles where the CPU has them and SSE2 or plain code where it
+// doesn't.  Sixteen-bit channels are rounded to the nearest 8-bit value, as WIC rounds them.
+// Anything else (palettes, CMYK, floating point) still goes through WIC.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <wincodec.h>
+
+/**
+ * The layouts ConvertRow knows
+ */
+enum PixelLayout {
+  PIXELS_BGRA32,                // Already what's wanted
+  PIXELS_BGR32,                 // BGRA with the alpha byte unused
+  PIXELS_BGR24,
+  PIXELS_RGB24,
+  PIXELS_GRAY8,
+  PIXELS_RGB48,                 // Each channel 16 bits, little-endian
+  PIXELS_RGBA64,
+  PIXELS_GRAY16
+};
+
+/**
+ * Finds the layout of a WIC pixel format.  Returns false if it's not one ConvertRow knows.
+ */
+bool FindPixelLayout(REFWICPixelFormatGUID format, PixelLayout *pLayout);
+
+/**
+ * Bytes each pixel of a layout takes
+ */
+UINT PixelLayoutBytes(PixelLayout layout);
+
+/**
+ * Converts width pixels of layout at pIn to BGRA at pOut.  pIn is scratch: 16-bit layouts are
+ * narrowed to 8 bits in place on the way, so it's overwritten.
+ */
+void ConvertRow(PixelLayout layout, BYTE *pIn, UINT width, BYTE *pOut);
+
+/**
+ * Wraps pSource (a decoder frame, say) in a source that produces 32-bit BGRA through
+ * ConvertRow.  Returns S_FALSE, and sets nothing, if pSource's format isn't one ConvertRow knows.
+ * If it's already BGRA, *ppConverted is pSource itself, with another reference.
+ */
+HRESULT CreateConvertedSource(IWICBitmapSource *pSource, IWICBitmapSource **ppConverted);
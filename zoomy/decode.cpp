@@ -0,0 +1,381 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Image decoding through WIC.  See decode.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "decode.h"
+#include <math.h>
+#include "convert.h"
+#include "mapstream.h"
+#include "resample.h"
+
+#pragma comment(lib,"windowscodecs.lib")
+
+// Rows per CopyPixels call when decoding at full resolution, and rows per work item when
+// filtering mip levels
+#define DECODE_BAND_ROWS 64
+#define MIP_BAND_ROWS    64
+
+/**
+ * Opens the first frame of an image file.  The decoder reads it through a mapped window (see
+ * mapstream.h), or through WIC's own file stream if the file can't be mapped.
+ */
+static HRESULT OpenImageFrame(LPCSTR imagePath, IWICImagingFactory **ppFactory,
+                              IWICBitmapFrameDecode **ppFrame) {
+  WCHAR widePath[MAX_PATH];
+  if (!MultiByteToWideChar(CP_ACP, 0, imagePath, -1, widePath, MAX_PATH)) {
+    return HRESULT_FROM_WIN32(GetLastError());
+  }
+
+  IWICImagingFactory *pFactory = NULL;
+  IWICBitmapDecoder *pDecoder = NULL;
+  HRESULT hr = CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER,
+                                IID_IWICImagingFactory, (LPVOID *)&pFactory);
+  IStream *pStream;
+  if (SUCCEEDED(hr) && SUCCEEDED(CreateMappedFileStream(imagePath, &pStream))) {
+    // The decoder holds on to the stream
+    hr = pFactory->CreateDecoderFromStream(pStream, NULL, WICDecodeMetadataCacheOnDemand,
+                                           &pDecoder);
+    pStream->Release();
+  } else if (SUCCEEDED(hr)) {
+    hr = pFactory->CreateDecoderFromFilename(widePath, NULL, GENERIC_READ,
+                                             WICDecodeMetadataCacheOnDemand, &pDecoder);
+  }
+  if (SUCCEEDED(hr)) hr = pDecoder->GetFrame(0, ppFrame);
+
+  // The frame holds on to the decoder
+  if (pDecoder) pDecoder->Release();
+  if (FAILED(hr)) {
+    if (pFactory) pFactory->Release();
+    return hr;
+  }
+
+  *ppFactory = pFactory;
+  return S_OK;
+}
+
+HRESULT OpenImageSource(LPCSTR imagePath, IWICImagingFactory **ppFactory,
+                        IWICBitmapSource **ppSource) {
+  IWICImagingFactory *pFactory;
+  IWICBitmapFrameDecode *pFrame;
+  HRESULT hr = OpenImageFrame(imagePath, &pFactory, &pFrame);
+  if (FAILED(hr)) return hr;
+
+  // The common formats convert a row at a time (see convert.h), anything else through WIC
+  IWICBitmapSource *pSource = NULL;
+  hr = CreateConvertedSource(pFrame, &pSource);
+  if (S_FALSE == hr) {
+    IWICFormatConverter *pConverter = NULL;
+    hr = pFactory->CreateFormatConverter(&pConverter);
+    if (SUCCEEDED(hr)) {
+      hr = pConverter->Initialize(pFrame, GUID_WICPixelFormat32bppBGRA, WICBitmapDitherTypeNone,
+                                  NULL, 0.0, WICBitmapPaletteTypeCustom);
+    }
+    pSource = pConverter;
+  }
+
+  // The converter holds on to the frame
+  pFrame->Release();
+  if (FAILED(hr)) {
+    if (pSource) pSource->Release();
+    pFactory->Release();
+    return hr;
+  }
+
+  *ppFactory = pFactory;
+  *ppSource = pSource;
+  return S_OK;
+}
+
+/**
+ * Tries to have the codec itself decode straight to a smaller size.  Returns S_FALSE, having
+ * done nothing, if it can't get within the limits or produce a format we can use.
+ */
+static HRESULT DecodeWithSourceTransform(IWICBitmapFrameDecode *pFrame, UINT width, UINT height,
+                                         UINT maxWidth, UINT maxHeight, DecodedImage *pImage) {
+  IWICBitmapSourceTransform *pTransform;
+  if (FAILED(pFrame->QueryInterface(IID_IWICBitmapSourceTransform, (void **)&pTransform))) {
+    return S_FALSE;
+  }
+
+  // JPEG can only shrink by powers of two, so see what it can actually do for us
+  HRESULT hr = pTransform->GetClosestSize(&width, &height);
+  WICPixelFormatGUID format = GUID_WICPixelFormat32bppBGRA;
+  if (SUCCEEDED(hr)) hr = pTransform->GetClosestPixelFormat(&format);
+  bool bgra = IsEqualGUID(format, GUID_WICPixelFormat32bppBGRA) != 0,
+       bgr = IsEqualGUID(format, GUID_WICPixelFormat24bppBGR) != 0;
+  if (FAILED(hr) || width > maxWidth || height > maxHeight || !(bgra || bgr)) {
+    pTransform->Release();
+    return S_FALSE;
+  }
+
+  // JPEG usually hands back 24-bit pixels, which get spread out to 32 bits afterwards.  The
+  // proxy is small, so the extra copy doesn't matter.
+  UINT stride = bgra ? width * 4 : (width * 3 + 3) & ~3u;
+  BYTE *pDecoded = new BYTE[stride * height];
+  hr = pTransform->CopyPixels(NULL, width, height, &format, WICBitmapTransformRotate0,
+                              stride, stride * height, pDecoded);
+  pTransform->Release();
+  if (FAILED(hr)) {
+    delete[] pDecoded;
+    return S_FALSE;
+  }
+
+  BYTE *pPixels = pDecoded;
+  if (bgr) {
+    pPixels = new BYTE[width * height * 4];
+    for (UINT y = 0; y < height; ++y) {
+      ConvertRow(PIXELS_BGR24, pDecoded + y * stride, width, pPixels + y * width * 4);
+    }
+    delete[] pDecoded;
+  }
+
+  pImage->width = width;
+  pImage->height = height;
+  pImage->pPixels = pPixels;
+  return S_OK;
+}
+
+/**
+ * Works out the size of a proxy that fits inside the limits, keeping the aspect ratio
+ */
+static void FitProxy(UINT sourceWidth, UINT sourceHeight, UINT maxWidth, UINT maxHeight,
+                     UINT *pWidth, UINT *pHeight) {
+  double scale = 1.0;
+  if ((double)maxWidth / sourceWidth < scale) scale = (double)maxWidth / sourceWidth;
+  if ((double)maxHeight / sourceHeight < scale) scale = (double)maxHeight / sourceHeight;
+  UINT width = (UINT)(sourceWidth * scale), height = (UINT)(sourceHeight * scale);
+  *pWidth = width < 1 ? 1 : width;
+  *pHeight = height < 1 ? 1 : height;
+}
+
+/**
+ * Shrinks a 32-bit BGRA source to width x height with WIC's scaler
+ */
+static HRESULT ScaleProxy(IWICImagingFactory *pFactory, IWICBitmapSource *pSource, UINT width,
+                          UINT height, DecodedImage *pImage) {
+  IWICBitmapScaler *pScaler = NULL;
+  HRESULT hr = pFactory->CreateBitmapScaler(&pScaler);
+  if (SUCCEEDED(hr)) hr = pScaler->Initialize(pSource, width, height, WICBitmapInterpolationModeFant);
+  if (SUCCEEDED(hr)) {
+    pImage->width = width;
+    pImage->height = height;
+    pImage->pPixels = new BYTE[width * height * 4];
+    hr = pScaler->CopyPixels(NULL, width * 4, width * height * 4, pImage->pPixels);
+  }
+  if (pScaler) pScaler->Release();
+  return hr;
+}
+
+HRESULT DecodeProxyImage(LPCSTR imagePath, UINT maxWidth, UINT maxHeight, DecodedImage *pImage) {
+  ZeroMemory(pImage, sizeof(DecodedImage));
+
+  IWICImagingFactory *pFactory;
+  IWICBitmapFrameDecode *pFrame;
+  HRESULT hr = OpenImageFrame(imagePath, &pFactory, &pFrame);
+  if (FAILED(hr)) return hr;
+
+  UINT sourceWidth = 0, sourceHeight = 0, width = 1, height = 1;
+  hr = pFrame->GetSize(&sourceWidth, &sourceHeight);
+  if (SUCCEEDED(hr) && (0 == sourceWidth || 0 == sourceHeight)) hr = E_FAIL;
+  if (SUCCEEDED(hr)) FitProxy(sourceWidth, sourceHeight, maxWidth, maxHeight, &width, &height);
+
+  // The fast way...
+  if (SUCCEEDED(hr)) hr = DecodeWithSourceTransform(pFrame, width, height, maxWidth, maxHeight, pImage);
+
+  // ...and the general one: decode everything and let WIC shrink it as it goes
+  if (S_FALSE == hr) {
+    IWICFormatConverter *pConverter = NULL;
+    hr = pFactory->CreateFormatConverter(&pConverter);
+    if (SUCCEEDED(hr)) {
+      hr = pConverter->Initialize(pFrame, GUID_WICPixelFormat32bppBGRA, WICBitmapDitherTypeNone,
+                                  NULL, 0.0, WICBitmapPaletteTypeCustom);
+    }
+    if (SUCCEEDED(hr)) hr = ScaleProxy(pFactory, pConverter, width, height, pImage);
+    if (pConverter) pConverter->Release();
+  }
+
+  pFrame->Release();
+  pFactory->Release();
+  if (FAILED(hr)) {
+    FreeDecodedImage(pImage);
+    return hr;
+  }
+
+  pImage->sourceWidth = sourceWidth;
+  pImage->sourceHeight = sourceHeight;
+  return S_OK;
+}
+
+HRESULT DecodeProxyFromSource(IWICImagingFactory *pFactory, IWICBitmapSource *pSource,
+                              UINT maxWidth, UINT maxHeight, DecodedImage *pImage) {
+  ZeroMemory(pImage, sizeof(DecodedImage));
+  UINT sourceWidth = 0, sourceHeight = 0, width, height;
+  HRESULT hr = pSource->GetSize(&sourceWidth, &sourceHeight);
+  if (SUCCEEDED(hr) && (0 == sourceWidth || 0 == sourceHeight)) hr = E_FAIL;
+  if (FAILED(hr)) return hr;
+  FitProxy(sourceWidth, sourceHeight, maxWidth, maxHeight, &width, &height);
+  if (FAILED(hr = ScaleProxy(pFactory, pSource, width, height, pImage))) {
+    FreeDecodedImage(pImage);
+    return hr;
+  }
+  pImage->sourceWidth = sourceWidth;
+  pImage->sourceHeight = sourceHeight;
+  return S_OK;
+}
+
+void FreeDecodedImage(DecodedImage *pImage) {
+  delete[] pImage->pPixels;
+  ZeroMemory(pImage, sizeof(DecodedImage));
+}
+
+// sRGB values decoded to 16-bit linear light, and 14-bit linear light encoded back to sRGB
+static WORD srgbToLinear[256];
+static BYTE linearToSrgb[1 << 14];
+static volatile LONG srgbTablesReady = 0;
+
+/**
+ * Fills in the sRGB tables the first time they're needed.  Two threads may both fill them in,
+ * but they write the same values, so that does no harm.
+ */
+static void PrepareSrgbTables() {
+  if (srgbTablesReady) return;
+  for (UINT i = 0; i < 256; ++i) {
+    double value = i / 255.0;
+    value = value <= 0.04045 ? value / 12.92 : pow((value + 0.055) / 1.055, 2.4);
+    srgbToLinear[i] = (WORD)(value * 65535.0 + 0.5);
+  }
+  for (UINT i = 0; i < (1 << 14); ++i) {
+    double value = (i + 0.5) / (1 << 14);
+    value = value <= 0.0031308 ? value * 12.92 : 1.055 * pow(value, 1.0 / 2.4) - 0.055;
+    linearToSrgb[i] = (BYTE)(value * 255.0 + 0.5);
+  }
+  InterlockedExchange(&srgbTablesReady, 1);
+}
+
+void HalveRow(const BYTE *pAbove, const BYTE *pBelow, UINT sourceWidth, BYTE *pOut, UINT outWidth) {
+  PrepareSrgbTables();
+  for (UINT x = 0; x < outWidth; ++x) {
+    UINT left = (2 * x < sourceWidth ? 2 * x : sourceWidth - 1) * 4;
+    UINT right = (2 * x + 1 < sourceWidth ? 2 * x + 1 : sourceWidth - 1) * 4;
+
+    // Colour is averaged as light, so fine detail doesn't darken as it's filtered away.  The sum
+    // of four 16-bit values shifted down by 4 is their average in 14 bits.
+    for (UINT c = 0; c < 3; ++c) {
+      UINT sum = srgbToLinear[pAbove[left + c]] + srgbToLinear[pAbove[right + c]] +
+                 srgbToLinear[pBelow[left + c]] + srgbToLinear[pBelow[right + c]];
+      pOut[x * 4 + c] = linearToSrgb[sum >> 4];
+    }
+
+    // Alpha is already linear
+    pOut[x * 4 + 3] = (BYTE)((pAbove[left + 3] + pAbove[right + 3] +
+                              pBelow[left + 3] + pBelow[right + 3] + 2) >> 2);
+  }
+}
+
+/**
+ * One level of the mip chain being filtered from the level above it
+ */
+struct MipBatch {
+  const TextureLevels *pLevels;
+  UINT level;
+};
+
+static void FilterMipBand(UINT band, void *pContext) {
+  const MipBatch *pBatch = (const MipBatch *)pContext;
+  const TextureLevels *pLevels = pBatch->pLevels;
+  UINT level = pBatch->level, source = level - 1;
+
+  UINT y0 = band * MIP_BAND_ROWS, y1 = y0 + MIP_BAND_ROWS;
+  if (y1 > pLevels->height[level]) y1 = pLevels->height[level];
+  for (UINT y = y0; y < y1; ++y) {
+    UINT above = 2 * y < pLevels->height[source] ? 2 * y : pLevels->height[source] - 1;
+    UINT below = above + 1 < pLevels->height[source] ? above + 1 : above;
+    HalveRow(pLevels->pBits[source] + above * pLevels->pitch[source],
+             pLevels->pBits[source] + below * pLevels->pitch[source],
+             pLevels->width[source],
+             pLevels->pBits[level] + y * pLevels->pitch[level],
+             pLevels->width[level]);
+  }
+}
+
+HRESULT DecodeImageLevels(LPCSTR imagePath, const RECT *pRegion, WorkQueue *pQueue,
+                          const TextureLevels *pLevels, DECODEPROGRESSPROC pProgress,
+                          void *pContext) {
+  IWICImagingFactory *pFactory;
+  IWICBitmapSource *pSource;
+  HRESULT hr = OpenImageSource(imagePath, &pFactory, &pSource);
+  if (FAILED(hr)) return hr;
+  hr = DecodeSourceLevels(pFactory, pSource, pRegion, pQueue, pLevels, pProgress, pContext);
+  pSource->Release();
+  pFactory->Release();
+  return hr;
+}
+
+/**
+ * Passes resampling progress on as the share of the whole load it is
+ */
+struct ScaledProgress {
+  DECODEPROGRESSPROC pProgress;
+  void *pContext;
+  float share;
+};
+
+static BOOL ReportScaledProgress(float progress, void *pContext) {
+  const ScaledProgress *pScaled = (const ScaledProgress *)pContext;
+  return pScaled->pProgress(pScaled->share * progress, pScaled->pContext);
+}
+
+HRESULT DecodeSourceLevels(IWICImagingFactory *pFactory, IWICBitmapSource *pSource,
+                           const RECT *pRegion, WorkQueue *pQueue, const TextureLevels *pLevels,
+                           DECODEPROGRESSPROC pProgress, void *pContext) {
+  HRESULT hr = S_OK;
+  pSource->AddRef();
+
+  // Cut out the region first, so only it gets scaled.  Codecs that decode from the top still
+  // read down to its bottom, but nothing outside it is kept.
+  if (pRegion) {
+    IWICBitmapClipper *pClipper = NULL;
+    WICRect rect = { pRegion->left, pRegion->top, pRegion->right - pRegion->left,
+                     pRegion->bottom - pRegion->top };
+    hr = pFactory->CreateBitmapClipper(&pClipper);
+    if (SUCCEEDED(hr)) hr = pClipper->Initialize(pSource, &rect);
+    pSource->Release();
+    pSource = pClipper;
+  }
+
+  // Level 0 goes straight from the decoder into place, a band at a time so we can report
+  // progress and be cancelled.  Decoding is most of the work.  If level 0 isn't the size of the
+  // image (some GPUs need powers of two), it's scaled on the way in, on every worker.
+  const float decodeShare = 0.9f;
+  UINT width = pLevels->width[0], height = pLevels->height[0], sourceWidth, sourceHeight;
+  UINT pitch = (UINT)pLevels->pitch[0], y = 0;
+  if (SUCCEEDED(hr)) hr = pSource->GetSize(&sourceWidth, &sourceHeight);
+  if (SUCCEEDED(hr) && (sourceWidth != width || sourceHeight != height)) {
+    ScaledProgress scaled = { pProgress, pContext, decodeShare };
+    hr = ResampleImage(pSource, pQueue, width, height, pLevels->pBits[0], (INT)pitch,
+                       pProgress ? ReportScaledProgress : NULL, &scaled);
+    y = height;
+  }
+  for (; SUCCEEDED(hr) && y < height; y += DECODE_BAND_ROWS) {
+    UINT rows = height - y < DECODE_BAND_ROWS ? height - y : DECODE_BAND_ROWS;
+    WICRect band = { 0, (INT)y, (INT)width, (INT)rows };
+    hr = pSource->CopyPixels(&band, pitch, pitch * (rows - 1) + width * 4,
+                             pLevels->pBits[0] + y * pitch);
+    if (SUCCEEDED(hr) && pProgress && !pProgress(decodeShare * (y + rows) / height, pContext)) {
+      hr = E_ABORT;
+    }
+  }
+  if (pSource) pSource->Release();
+
+  // Then each mip level from the one before it, with the rows split across the pool
+  for (UINT level = 1; SUCCEEDED(hr) && level < pLevels->count; ++level) {
+    MipBatch batch = { pLevels, level };
+    ParallelFor(pQueue, (pLevels->height[level] + MIP_BAND_ROWS - 1) / MIP_BAND_ROWS,
+                FilterMipBand, &batch);
+    float progress = decodeShare + (1.0f - decodeShare) * level / (pLevels->count - 1);
+    if (pProgress && !pProgress(progress, pContext)) hr = E_ABORT;
+  }
+
+  return hr;
+}
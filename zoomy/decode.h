@@ -0,0 +1,91 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Image decoding through WIC.  Everything in here is safe to run on a worker thread (with COM
+// initialized), which is the point: none of it needs the Direct3D device.
+//
+// All decoded pixels are 32-bit BGRA, which has the same memory layout as D3DFMT_A8R8G8B8.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <wincodec.h>
+#include "workqueue.h"
+
+// A full mip chain for anything up to 32768 texels across
+#define DECODE_MAX_LEVELS 16
+
+/**
+ * Called during long decodes with how far along they are, from 0 to 1.  Returning FALSE
+ * cancels the decode, which then fails with E_ABORT.
+ */
+typedef BOOL (*DECODEPROGRESSPROC)(float progress, void *pContext);
+
+/**
+ * Pixels decoded into memory we own
+ */
+struct DecodedImage {
+  UINT width, height;                 // Size of pPixels, which is tightly packed
+  UINT sourceWidth, sourceHeight;     // Size of the image in the file
+  BYTE *pPixels;
+};
+
+/**
+ * Where to decode an image and its mip chain to.  Usually these are the locked levels of a
+ * texture that the UI thread created.
+ */
+struct TextureLevels {
+  UINT count;
+  UINT width[DECODE_MAX_LEVELS], height[DECODE_MAX_LEVELS];
+  BYTE *pBits[DECODE_MAX_LEVELS];
+  INT pitch[DECODE_MAX_LEVELS];
+};
+
+/**
+ * Opens an image and returns a source that produces 32-bit BGRA.  The factory is handed back
+ * too so callers can build more of a pipeline on the source.
+ */
+HRESULT OpenImageSource(LPCSTR imagePath, IWICImagingFactory **ppFactory,
+                        IWICBitmapSource **ppSource);
+
+/**
+ * Quickly decodes a reduced-resolution copy of an image that fits within maxWidth x maxHeight.
+ * Where the codec can scale while it decodes (JPEG scales in the DCT), that's used, which is
+ * many times faster than decoding everything and shrinking it afterwards.
+ */
+HRESULT DecodeProxyImage(LPCSTR imagePath, UINT maxWidth, UINT maxHeight, DecodedImage *pImage);
+
+/**
+ * Shrinks an already open 32-bit BGRA source to fit within maxWidth x maxHeight, the way
+ * DecodeProxyImage does when the codec can't scale for it
+ */
+HRESULT DecodeProxyFromSource(IWICImagingFactory *pFactory, IWICBitmapSource *pSource,
+                              UINT maxWidth, UINT maxHeight, DecodedImage *pImage);
+
+/**
+ * Frees the pixels of a decoded image
+ */
+void FreeDecodedImage(DecodedImage *pImage);
+
+/**
+ * Decodes an image, or just pRegion of it (in image pixels) if that isn't NULL, into
+ * pLevels->pBits[0], scaling it if level 0 isn't the same size, then box filters each level
+ * down into the next, spreading the rows across pQueue.  pProgress may be NULL.
+ */
+HRESULT DecodeImageLevels(LPCSTR imagePath, const RECT *pRegion, WorkQueue *pQueue,
+                          const TextureLevels *pLevels, DECODEPROGRESSPROC pProgress,
+                          void *pContext);
+
+/**
+ * DecodeImageLevels, from an already open 32-bit BGRA source (which isn't released)
+ */
+HRESULT DecodeSourceLevels(IWICImagingFactory *pFactory, IWICBitmapSource *pSource,
+                           const RECT *pRegion, WorkQueue *pQueue, const TextureLevels *pLevels,
+                           DECODEPROGRESSPROC pProgress, void *pContext);
+
+/**
+ * Box filters two rows of sourceWidth texels into one row of outWidth texels.  outWidth is
+ * usually half of sourceWidth, rounded either way; a texel past the end of the source row is
+ * taken to be the same as the last one.  Colour is taken to be sRGB, and averaged in linear
+ * light.
+ */
+void HalveRow(const BYTE *pAbove, const BYTE *pBelow, UINT sourceWidth, BYTE *pOut, UINT outWidth);
@@ -0,0 +1,160 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Direct3D setup for each present mode.  See display.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "display.h"
+
+typedef HRESULT (WINAPI *DIRECT3DCREATE9EXPROC)(UINT sdkVersion, IDirect3D9Ex **ppD3D);
+
+LPDIRECT3D9 CreateDirect3D(UINT presentMode) {
+  if (PRESENT_WINDOWED != presentMode) {
+    // Direct3DCreate9Ex only exists on Vista and later, so don't link to it directly
+    HMODULE hD3D9 = GetModuleHandle("d3d9.dll");
+    DIRECT3DCREATE9EXPROC pCreate9Ex =
+        hD3D9 ? (DIRECT3DCREATE9EXPROC)GetProcAddress(hD3D9, "Direct3DCreate9Ex") : NULL;
+    IDirect3D9Ex *pD3DEx;
+    if (pCreate9Ex && SUCCEEDED(pCreate9Ex(D3D_SDK_VERSION, &pD3DEx))) return pD3DEx;
+  }
+  return Direct3DCreate9(D3D_SDK_VERSION);
+}
+
+LPDIRECT3DDEVICE9 CreateDisplayDevice(HWND hWnd, LPDIRECT3D9 pD3D, UINT presentMode,
+                                      bool multithreaded, const D3DDISPLAYMODE *pMode,
+                                      D3DPRESENT_PARAMETERS *pPresentationParameters) {
+  IDirect3D9Ex *pD3DEx = NULL;
+  pD3D->QueryInterface(IID_IDirect3D9Ex, (void **)&pD3DEx);
+
+  // Set up the structure used to create the Direct3D device.
+  D3DPRESENT_PARAMETERS d3dpp;
+  ZeroMemory(&d3dpp, sizeof(d3dpp));
+  d3dpp.Windowed = TRUE;
+  d3dpp.SwapEffect = D3DSWAPEFFECT_DISCARD;
+  d3dpp.EnableAutoDepthStencil = TRUE;
+  d3dpp.AutoDepthStencilFormat = D3DFMT_D16;
+  d3dpp.hDeviceWindow = hWnd;
+  d3dpp.PresentationInterval = D3DPRESENT_INTERVAL_ONE; // Lock to VSYNC
+
+  if (PRESENT_FULLSCREEN == presentMode) {
+    // Take over the display at the mode it's already in, so nothing has to change mode
+    d3dpp.Windowed = FALSE;
+    d3dpp.BackBufferWidth = pMode->Width;
+    d3dpp.BackBufferHeight = pMode->Height;
+    d3dpp.BackBufferFormat = pMode->Format;
+    d3dpp.BackBufferCount = 1;
+    d3dpp.FullScreen_RefreshRateInHz = pMode->RefreshRate;
+  } else if (PRESENT_FLIPEX == presentMode && pD3DEx) {
+    // The desktop composes flip-model back buffers directly instead of copying them first
+    d3dpp.SwapEffect = D3DSWAPEFFECT_FLIPEX;
+    d3dpp.BackBufferCount = 2;
+    d3dpp.BackBufferFormat = D3DFMT_X8R8G8B8;
+  }
+
+  // Create the device
+  DWORD behavior = D3DCREATE_SOFTWARE_VERTEXPROCESSING | (multithreaded ? D3DCREATE_MULTITHREADED : 0);
+  LPDIRECT3DDEVICE9 pd3dDevice = NULL;
+  if (pD3DEx) {
+    D3DDISPLAYMODEEX fullscreenMode = { sizeof(D3DDISPLAYMODEEX), pMode->Width, pMode->Height,
+                                        pMode->RefreshRate, pMode->Format,
+                                        D3DSCANLINEORDERING_PROGRESSIVE };
+    IDirect3DDevice9Ex *pd3dDeviceEx;
+    if (SUCCEEDED(pD3DEx->CreateDeviceEx(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, hWnd,
+                                         behavior, &d3dpp,
+                                         d3dpp.Windowed ? NULL : &fullscreenMode,
+                                         &pd3dDeviceEx))) {
+      // Never let the CPU get more than a frame ahead of what's on screen
+      pd3dDeviceEx->SetMaximumFrameLatency(1);
+      pd3dDevice = pd3dDeviceEx;
+    }
+    pD3DEx->Release();
+  } else if (FAILED(pD3D->CreateDevice(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, hWnd,
+                                       behavior, &d3dpp, &pd3dDevice))) {
+    pd3dDevice = NULL;
+  }
+  if (!pd3dDevice) return NULL;
+
+  // Copy the parameters structure
+  CopyMemory(pPresentationParameters, &d3dpp, sizeof(d3dpp));
+
+  // Return the device
+  return pd3dDevice;
+}
+
+bool IsDeviceEx(LPDIRECT3DDEVICE9 pd3dDevice) {
+  IDirect3DDevice9Ex *pd3dDeviceEx;
+  if (FAILED(pd3dDevice->QueryInterface(IID_IDirect3DDevice9Ex, (void **)&pd3dDeviceEx))) {
+    return false;
+  }
+  pd3dDeviceEx->Release();
+  return true;
+}
+
+D3DPOOL DrawTexturePool(LPDIRECT3DDEVICE9 pd3dDevice) {
+  return IsDeviceEx(pd3dDevice) ? D3DPOOL_DEFAULT : D3DPOOL_MANAGED;
+}
+
+D3DPOOL UploadTexturePool(LPDIRECT3DDEVICE9 pd3dDevice) {
+  return IsDeviceEx(pd3dDevice) ? D3DPOOL_SYSTEMMEM : D3DPOOL_MANAGED;
+}
+
+HRESULT FinishTextureUpload(LPDIRECT3DDEVICE9 pd3dDevice, LPDIRECT3DTEXTURE9 *ppTexture) {
+  LPDIRECT3DTEXTURE9 pUpload = *ppTexture;
+  D3DSURFACE_DESC desc;
+  HRESULT hr = pUpload->GetLevelDesc(0, &desc);
+  if (FAILED(hr) || D3DPOOL_SYSTEMMEM != desc.Pool) return hr;
+
+  LPDIRECT3DTEXTURE9 pTexture;
+  hr = pd3dDevice->CreateTexture(desc.Width, desc.Height, pUpload->GetLevelCount(), 0,
+                                 desc.Format, D3DPOOL_DEFAULT, &pTexture, NULL);
+  if (FAILED(hr)) return hr;
+  if (FAILED(hr = pd3dDevice->UpdateTexture(pUpload, pTexture))) {
+    pTexture->Release();
+    return hr;
+  }
+
+  pUpload->Release();
+  *ppTexture = pTexture;
+  return S_OK;
+}
+
+void UpdatePresentStats(LPDIRECT3DDEVICE9 pd3dDevice, PresentStats *pStats) {
+  LPDIRECT3DSWAPCHAIN9 pSwapChain;
+  if (FAILED(pd3dDevice->GetSwapChain(0, &pSwapChain))) return;
+  IDirect3DSwapChain9Ex *pSwapChainEx;
+  HRESULT hr = pSwapChain->QueryInterface(IID_IDirect3DSwapChain9Ex, (void **)&pSwapChainEx);
+  pSwapChain->Release();
+  if (FAILED(hr)) return;
+
+  D3DPRESENTSTATS stats;
+  ZeroMemory(&stats, sizeof(stats));
+  hr = pSwapChainEx->GetPresentStatistics(&stats);
+  pSwapChainEx->Release();
+
+  // The counts can jump (after a mode change, for instance), so start over from the next ones
+  if (FAILED(hr)) {
+    pStats->started = false;
+    return;
+  }
+
+  // With one refresh per present, any extra refreshes between two presents are ones where the
+  // old frame was shown again
+  pStats->available = true;
+  if (pStats->started && stats.PresentCount != pStats->lastPresentCount) {
+    UINT presents = stats.PresentCount - pStats->lastPresentCount;
+    UINT refreshes = stats.PresentRefreshCount - pStats->lastRefreshCount;
+    pStats->presents += presents;
+    if (refreshes > presents) pStats->missedRefreshes += refreshes - presents;
+  }
+  pStats->started = true;
+  pStats->lastPresentCount = stats.PresentCount;
+  pStats->lastRefreshCount = stats.PresentRefreshCount;
+}
+
+void ResetPresentStats(PresentStats *pStats) {
+  pStats->presents = 0;
+  pStats->missedRefreshes = 0;
+}
+
+void RestartPresentStats(PresentStats *pStats) {
+  pStats->started = false;
+}
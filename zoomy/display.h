@@ -0,0 +1,83 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Getting frames onto the screen: creating Direct3D and the device for the chosen present mode
+// (see -present in options.h), and the present statistics that tell us whether any were missed.
+//
+// Direct3D 9Ex is loaded at run time, so the app still starts where it isn't available and just
+// falls back to the plain windowed device.  9Ex devices have no managed pool; instead their
+// default pool isn't lost when the device is.  Textures the app fills itself are made through
+// UploadTexturePool and FinishTextureUpload, which do the right thing for either kind.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <d3d9.h>
+#include "options.h"
+
+/**
+ * Counts kept from the swap chain's present statistics.  Only 9Ex flip-model and exclusive
+ * fullscreen swap chains have them.
+ */
+struct PresentStats {
+  bool available;               // Whether the swap chain has reported anything yet
+  UINT presents;                // Frames that reached the screen since the counts were reset
+  UINT missedRefreshes;         // Refreshes in that time where the previous frame stayed up
+  bool started;
+  UINT lastPresentCount, lastRefreshCount;
+};
+
+/**
+ * Creates Direct3D, as 9Ex if presentMode needs it and the system has it.  Returns NULL on
+ * failure.
+ */
+LPDIRECT3D9 CreateDirect3D(UINT presentMode);
+
+/**
+ * Sets up the device for hWnd.  pMode is the display's current mode, which exclusive fullscreen
+ * keeps.  9Ex devices are told to queue no more than one frame ahead.  multithreaded makes the
+ * device safe to share with the video encoder, at the cost of a lock around every call.
+ */
+LPDIRECT3DDEVICE9 CreateDisplayDevice(HWND hWnd, LPDIRECT3D9 pD3D, UINT presentMode,
+                                      bool multithreaded, const D3DDISPLAYMODE *pMode,
+                                      D3DPRESENT_PARAMETERS *pPresentationParameters);
+
+/**
+ * Whether the device is a Direct3D 9Ex device
+ */
+bool IsDeviceEx(LPDIRECT3DDEVICE9 pd3dDevice);
+
+/**
+ * The pool textures that are drawn from belong in: managed for ordinary devices, default for
+ * 9Ex ones
+ */
+D3DPOOL DrawTexturePool(LPDIRECT3DDEVICE9 pd3dDevice);
+
+/**
+ * The pool to create a texture in that the CPU is going to fill.  On ordinary devices this is
+ * the managed pool and the texture can be drawn as it is; on 9Ex devices it's system memory.
+ */
+D3DPOOL UploadTexturePool(LPDIRECT3DDEVICE9 pd3dDevice);
+
+/**
+ * Turns a filled texture from UploadTexturePool into one that can be drawn.  For system-memory
+ * textures this copies them to the GPU and swaps *ppTexture for the copy; managed ones are left
+ * alone.
+ */
+HRESULT FinishTextureUpload(LPDIRECT3DDEVICE9 pd3dDevice, LPDIRECT3DTEXTURE9 *ppTexture);
+
+/**
+ * Reads the swap chain's present statistics and adds any new frames to pStats.  Call after each
+ * Present; does nothing on swap chains that don't keep statistics.
+ */
+void UpdatePresentStats(LPDIRECT3DDEVICE9 pd3dDevice, PresentStats *pStats);
+
+/**
+ * Zeroes the counts, so they cover whatever is presented from now on
+ */
+void ResetPresentStats(PresentStats *pStats);
+
+/**
+ * Keeps the counts, but takes the next present as a fresh starting point, so the refreshes that
+ * go by while the loop sleeps aren't counted as missed
+ */
+void RestartPresentStats(PresentStats *pStats);
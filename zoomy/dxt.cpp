@@ -0,0 +1,213 @@
+//--------------------------------------------------------------------------------------------------
+//
+// DXT block compressor.  See dxt.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "dxt.h"
+#include <emmintrin.h>
+#include <limits.h>
+
+// Rows of blocks per work item
+#define DXT_BAND_BLOCK_ROWS 8
+
+struct CompressBatch {
+  const BYTE *pPixels;
+  INT pitch;
+  UINT width, height;
+  bool withAlpha;
+  bool sse2;
+  BYTE *pBlocks;
+  INT blockPitch;
+  UINT blockRows;
+};
+
+/**
+ * Copies a 4x4 block of pixels out of the image, repeating the edge pixels past its end
+ */
+static void GatherBlock(const CompressBatch *pBatch, UINT blockX, UINT blockY, BYTE *pBlock) {
+  UINT x0 = blockX * 4, y0 = blockY * 4;
+  bool inside = x0 + 4 <= pBatch->width;
+  for (UINT y = 0; y < 4; ++y) {
+    UINT sourceY = y0 + y < pBatch->height ? y0 + y : pBatch->height - 1;
+    const BYTE *pRow = pBatch->pPixels + (SIZE_T)sourceY * pBatch->pitch;
+    if (inside) {
+      CopyMemory(pBlock + y * 16, pRow + x0 * 4, 16);
+    } else {
+      for (UINT x = 0; x < 4; ++x) {
+        UINT sourceX = x0 + x < pBatch->width ? x0 + x : pBatch->width - 1;
+        *(DWORD *)(pBlock + y * 16 + x * 4) = *(const DWORD *)(pRow + sourceX * 4);
+      }
+    }
+  }
+}
+
+/**
+ * Finds the smallest and largest value of each channel over the 16 pixels of a block
+ */
+static void BlockBounds(const BYTE *pBlock, bool sse2, BYTE *pMin, BYTE *pMax) {
+  if (sse2) {
+    __m128i a = _mm_loadu_si128((const __m128i *)pBlock),
+            b = _mm_loadu_si128((const __m128i *)(pBlock + 16)),
+            c = _mm_loadu_si128((const __m128i *)(pBlock + 32)),
+            d = _mm_loadu_si128((const __m128i *)(pBlock + 48));
+    __m128i low = _mm_min_epu8(_mm_min_epu8(a, b), _mm_min_epu8(c, d)),
+            high = _mm_max_epu8(_mm_max_epu8(a, b), _mm_max_epu8(c, d));
+
+    // Fold the four pixels in each register down to one
+    low = _mm_min_epu8(low, _mm_shuffle_epi32(low, _MM_SHUFFLE(2, 3, 0, 1)));
+    low = _mm_min_epu8(low, _mm_shuffle_epi32(low, _MM_SHUFFLE(1, 0, 3, 2)));
+    high = _mm_max_epu8(high, _mm_shuffle_epi32(high, _MM_SHUFFLE(2, 3, 0, 1)));
+    high = _mm_max_epu8(high, _mm_shuffle_epi32(high, _MM_SHUFFLE(1, 0, 3, 2)));
+    *(DWORD *)pMin = (DWORD)_mm_cvtsi128_si32(low);
+    *(DWORD *)pMax = (DWORD)_mm_cvtsi128_si32(high);
+    return;
+  }
+
+  for (UINT c = 0; c < 4; ++c) pMin[c] = pMax[c] = pBlock[c];
+  for (UINT i = 1; i < 16; ++i) {
+    for (UINT c = 0; c < 4; ++c) {
+      BYTE value = pBlock[i * 4 + c];
+      if (value < pMin[c]) pMin[c] = value;
+      if (value > pMax[c]) pMax[c] = value;
+    }
+  }
+}
+
+static WORD To565(const int *pBGR) {
+  return (WORD)(((pBGR[2] >> 3) << 11) | ((pBGR[1] >> 2) << 5) | (pBGR[0] >> 3));
+}
+
+/**
+ * Expands a 5:6:5 colour back to 8 bits a channel, the way the GPU will
+ */
+static void From565(WORD color, int *pBGR) {
+  int b = color & 31, g = (color >> 5) & 63, r = color >> 11;
+  pBGR[0] = (b << 3) | (b >> 2);
+  pBGR[1] = (g << 2) | (g >> 4);
+  pBGR[2] = (r << 3) | (r >> 2);
+}
+
+/**
+ * Writes the 8-byte colour half of a block
+ */
+static void CompressColorBlock(const BYTE *pBlock, const BYTE *pMin, const BYTE *pMax,
+                               BYTE *pOut) {
+  // Pull the corners of the box in by a sixteenth of its size, which gets the end points
+  // closer to where most of the pixels are
+  int low[3], high[3];
+  for (UINT c = 0; c < 3; ++c) {
+    int inset = (pMax[c] - pMin[c]) >> 4;
+    low[c] = pMin[c] + inset;
+    high[c] = pMax[c] - inset;
+  }
+
+  // Four-colour mode needs the first end point to be the bigger one
+  WORD color0 = To565(high), color1 = To565(low);
+  if (color0 < color1) {
+    WORD swap = color0;
+    color0 = color1;
+    color1 = swap;
+  }
+
+  DWORD indices = 0;
+  if (color0 != color1) {
+    int palette[4][3];
+    From565(color0, palette[0]);
+    From565(color1, palette[1]);
+    for (UINT c = 0; c < 3; ++c) {
+      palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+      palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+    for (UINT i = 0; i < 16; ++i) {
+      const BYTE *pPixel = pBlock + i * 4;
+      DWORD best = 0;
+      int bestDistance = INT_MAX;
+      for (DWORD entry = 0; entry < 4; ++entry) {
+        int db = pPixel[0] - palette[entry][0], dg = pPixel[1] - palette[entry][1],
+            dr = pPixel[2] - palette[entry][2];
+        int distance = db * db + dg * dg + dr * dr;
+        if (distance < bestDistance) {
+          bestDistance = distance;
+          best = entry;
+        }
+      }
+      indices |= best << (2 * i);
+    }
+  }
+
+  pOut[0] = (BYTE)color0;
+  pOut[1] = (BYTE)(color0 >> 8);
+  pOut[2] = (BYTE)color1;
+  pOut[3] = (BYTE)(color1 >> 8);
+  *(DWORD *)(pOut + 4) = indices;
+}
+
+/**
+ * Writes the 8-byte alpha half of a DXT5 block, using the eight-value mode
+ */
+static void CompressAlphaBlock(const BYTE *pBlock, BYTE alpha0, BYTE alpha1, BYTE *pOut) {
+  ULONGLONG codes = 0;
+  if (alpha0 > alpha1) {
+    int palette[8] = { alpha0, alpha1 };
+    for (int i = 1; i < 7; ++i) palette[i + 1] = ((7 - i) * alpha0 + i * alpha1) / 7;
+    for (UINT i = 0; i < 16; ++i) {
+      int alpha = pBlock[i * 4 + 3];
+      ULONGLONG best = 0;
+      int bestDistance = INT_MAX;
+      for (UINT entry = 0; entry < 8; ++entry) {
+        int distance = alpha > palette[entry] ? alpha - palette[entry] : palette[entry] - alpha;
+        if (distance < bestDistance) {
+          bestDistance = distance;
+          best = entry;
+        }
+      }
+      codes |= best << (3 * i);
+    }
+  }
+
+  pOut[0] = alpha0;
+  pOut[1] = alpha1;
+  for (UINT i = 0; i < 6; ++i) pOut[2 + i] = (BYTE)(codes >> (8 * i));
+}
+
+static void CompressBand(UINT band, void *pContext) {
+  const CompressBatch *pBatch = (const CompressBatch *)pContext;
+  UINT blockColumns = (pBatch->width + 3) / 4;
+  UINT blockSize = pBatch->withAlpha ? 16 : 8;
+  UINT row1 = (band + 1) * DXT_BAND_BLOCK_ROWS;
+  if (row1 > pBatch->blockRows) row1 = pBatch->blockRows;
+
+  BYTE block[64], low[4], high[4];
+  for (UINT blockY = band * DXT_BAND_BLOCK_ROWS; blockY < row1; ++blockY) {
+    BYTE *pOut = pBatch->pBlocks + (SIZE_T)blockY * pBatch->blockPitch;
+    for (UINT blockX = 0; blockX < blockColumns; ++blockX, pOut += blockSize) {
+      GatherBlock(pBatch, blockX, blockY, block);
+      BlockBounds(block, pBatch->sse2, low, high);
+      if (pBatch->withAlpha) {
+        CompressAlphaBlock(block, high[3], low[3], pOut);
+        CompressColorBlock(block, low, high, pOut + 8);
+      } else {
+        CompressColorBlock(block, low, high, pOut);
+      }
+    }
+  }
+}
+
+bool ImageHasAlpha(const BYTE *pPixels, INT pitch, UINT width, UINT height) {
+  for (UINT y = 0; y < height; ++y) {
+    const DWORD *pRow = (const DWORD *)(pPixels + (SIZE_T)y * pitch);
+    for (UINT x = 0; x < width; ++x) {
+      if ((pRow[x] & 0xFF000000) != 0xFF000000) return true;
+    }
+  }
+  return false;
+}
+
+void CompressImage(WorkQueue *pQueue, const BYTE *pPixels, INT pitch, UINT width, UINT height,
+                   bool withAlpha, BYTE *pBlocks, INT blockPitch) {
+  CompressBatch batch = { pPixels, pitch, width, height, withAlpha,
+                          IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) != FALSE,
+                          pBlocks, blockPitch, (height + 3) / 4 };
+  ParallelFor(pQueue, (batch.blockRows + DXT_BAND_BLOCK_ROWS - 1) / DXT_BAND_BLOCK_ROWS,
+              CompressBand, &batch);
+}
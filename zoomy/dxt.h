@@ -0,0 +1,27 @@
+//--------------------------------------------------------------------------------------------------
+//
+// DXT1/DXT5 (BC1/BC3) block compression, so big images take 4 to 8 times less memory on the GPU.
+//
+// This is a range-fit compressor built for speed rather than the last bit of quality: each
+// channel's bounding box in a 4x4 block is inset a little and its corners become the end points.
+// That's well short of what an offline tool gets, but plenty for an image that's being shown
+// at or below one texel per pixel.  The bounding box search uses SSE2 when the CPU has it, and
+// rows of blocks are spread across the work queue.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include "workqueue.h"
+
+/**
+ * Whether any pixel of a 32-bit BGRA image is less than fully opaque
+ */
+bool ImageHasAlpha(const BYTE *pPixels, INT pitch, UINT width, UINT height);
+
+/**
+ * Compresses a 32-bit BGRA image into pBlocks, as DXT5 if withAlpha or DXT1 otherwise.
+ * pBlocks holds (height + 3) / 4 rows of blocks, blockPitch bytes apart.  A partial block at
+ * the right or bottom edge is padded with copies of the edge pixels.
+ */
+void CompressImage(WorkQueue *pQueue, const BYTE *pPixels, INT pitch, UINT width, UINT height,
+                   bool withAlpha, BYTE *pBlocks, INT blockPitch);
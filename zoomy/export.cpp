@@ -0,0 +1,426 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Offline frame export.  See export.h for how this fits together.
+//
+//--------------------------------------------------------------------------------------------------
+#include "export.h"
+#include <d3dx9.h>
+#include <wincodec.h>
+#include <string.h>
+
+struct FrameExporter;
+
+/**
+ * One frame on its way to disk
+ */
+struct FrameWrite {
+  FrameExporter *pExporter;
+  BYTE *pPixels;          // The frame as 32-bit BGRA, rows packed together
+  UINT frame;
+  HRESULT hr;
+  HANDLE hIdle;           // Set while no write is using this slot
+};
+
+struct FrameExporter {
+  LPDIRECT3DDEVICE9 pd3dDevice;
+  UINT width, height;
+
+  // Where frames are drawn, and the targets that were bound before export started
+  LPDIRECT3DSURFACE9 pRenderTarget;
+  LPDIRECT3DSURFACE9 pSavedRenderTarget;
+  LPDIRECT3DSURFACE9 pSavedDepthStencil;
+
+  // Readback ring.  Frame N lives in slot N % EXPORT_READBACK_DEPTH.
+  LPDIRECT3DSURFACE9 pReadback[EXPORT_READBACK_DEPTH];
+  LPDIRECT3DQUERY9 pReadbackDone[EXPORT_READBACK_DEPTH];
+  UINT framesQueued, framesWritten;
+  UINT firstFrame;        // The number the first frame gets in its file name or stream
+
+  // Output.  Either a raw stream (hRawFile is open) or an image sequence, written through WIC
+  // when pContainer is set and with D3DX when it isn't.
+  HANDLE hRawFile;
+  bool truncate;          // Whether hRawFile is cut off after the last frame, once it's written
+  CHAR pattern[MAX_PATH];
+  const GUID *pContainer;
+  D3DXIMAGE_FILEFORMAT imageFormat;
+
+  // Or, for video, the encoder, which takes frames straight from the GPU
+  VideoEncoder *pVideo;
+
+  // Writes in flight on the work queue.  Frame N is written from slot N % writeCount.
+  WorkQueue *pQueue;
+  FrameWrite writes[EXPORT_MAX_WRITES];
+  UINT writeCount;
+};
+
+/**
+ * Works out how to write images with a file extension: with the WIC encoder *ppContainer names
+ * or, where that's NULL, with D3DX as *pFormat.  Returns FALSE for anything neither can write.
+ */
+static BOOL ImageFormatFromExtension(LPCSTR extension, const GUID **ppContainer,
+                                     D3DXIMAGE_FILEFORMAT *pFormat) {
+  static const struct {
+    LPCSTR extension;
+    const GUID *pContainer;
+    D3DXIMAGE_FILEFORMAT format;
+  } formats[] = {
+    { ".png", &GUID_ContainerFormatPng, D3DXIFF_PNG },
+    { ".bmp", &GUID_ContainerFormatBmp, D3DXIFF_BMP },
+    { ".jpg", &GUID_ContainerFormatJpeg, D3DXIFF_JPG },
+    { ".jpeg", &GUID_ContainerFormatJpeg, D3DXIFF_JPG },
+    { ".tif", &GUID_ContainerFormatTiff, D3DXIFF_BMP },
+    { ".tiff", &GUID_ContainerFormatTiff, D3DXIFF_BMP },
+    { ".tga", NULL, D3DXIFF_TGA },
+    { ".dds", NULL, D3DXIFF_DDS },
+  };
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+    if (0 == lstrcmpi(extension, formats[i].extension)) {
+      *ppContainer = formats[i].pContainer;
+      *pFormat = formats[i].format;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/**
+ * Turns the user's output path into a wsprintf pattern with exactly one integer conversion.
+ * Anything else (stray %s and the like) is rejected rather than handed to wsprintf.
+ */
+static BOOL BuildSequencePattern(LPCSTR path, LPCSTR extension, char *pattern) {
+  LPCSTR percent = strchr(path, '%');
+  if (!percent) {
+    // No frame number in the path, so put one in front of the extension
+    size_t stem = (size_t)(extension - path);
+    if (stem + lstrlen("_%05d") + lstrlen(extension) >= MAX_PATH) return FALSE;
+    CopyMemory(pattern, path, stem);
+    lstrcpy(pattern + stem, "_%05d");
+    lstrcat(pattern, extension);
+    return TRUE;
+  }
+
+  // Allow %d, %5d and %05d, and nothing else
+  LPCSTR conversion = percent + 1;
+  while (*conversion >= '0' && *conversion <= '9') ++conversion;
+  if (*conversion != 'd' || strchr(conversion, '%')) return FALSE;
+  lstrcpyn(pattern, path, MAX_PATH);
+  return TRUE;
+}
+
+/**
+ * Writes bytes at an offset in a file.  Frames of a raw stream can finish encoding in any
+ * order, so each one goes straight to its own place.
+ */
+static HRESULT WriteAt(HANDLE hFile, ULONGLONG offset, const BYTE *pBytes, DWORD size) {
+  OVERLAPPED overlapped;
+  ZeroMemory(&overlapped, sizeof(overlapped));
+  overlapped.Offset = (DWORD)offset;
+  overlapped.OffsetHigh = (DWORD)(offset >> 32);
+  DWORD written;
+  if (!WriteFile(hFile, pBytes, size, &written, &overlapped) || written != size) {
+    return HRESULT_FROM_WIN32(GetLastError());
+  }
+  return S_OK;
+}
+
+/**
+ * Encodes a packed 32-bit BGRA frame into an image file through WIC.  The encoder converts it
+ * to whatever pixel format the container wants (JPEG has no fourth channel, for one).
+ */
+static HRESULT EncodeImageFile(LPCSTR fileName, REFGUID container, BYTE *pPixels, UINT width,
+                               UINT height) {
+  WCHAR widePath[MAX_PATH + 16];
+  if (!MultiByteToWideChar(CP_ACP, 0, fileName, -1, widePath, MAX_PATH + 16)) {
+    return HRESULT_FROM_WIN32(GetLastError());
+  }
+
+  IWICImagingFactory *pFactory = NULL;
+  IWICBitmap *pBitmap = NULL;
+  IWICStream *pStream = NULL;
+  IWICBitmapEncoder *pEncoder = NULL;
+  IWICBitmapFrameEncode *pFrame = NULL;
+  IPropertyBag2 *pProperties = NULL;
+  HRESULT hr = CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER,
+                                IID_IWICImagingFactory, (LPVOID *)&pFactory);
+  if (SUCCEEDED(hr)) {
+    hr = pFactory->CreateBitmapFromMemory(width, height, GUID_WICPixelFormat32bppBGR, width * 4,
+                                          width * height * 4, pPixels, &pBitmap);
+  }
+  if (SUCCEEDED(hr)) hr = pFactory->CreateStream(&pStream);
+  if (SUCCEEDED(hr)) hr = pStream->InitializeFromFilename(widePath, GENERIC_WRITE);
+  if (SUCCEEDED(hr)) hr = pFactory->CreateEncoder(container, NULL, &pEncoder);
+  if (SUCCEEDED(hr)) hr = pEncoder->Initialize(pStream, WICBitmapEncoderNoCache);
+  if (SUCCEEDED(hr)) hr = pEncoder->CreateNewFrame(&pFrame, &pProperties);
+  if (SUCCEEDED(hr)) hr = pFrame->Initialize(pProperties);
+  if (SUCCEEDED(hr)) hr = pFrame->SetSize(width, height);
+  WICPixelFormatGUID format = GUID_WICPixelFormat32bppBGR;
+  if (SUCCEEDED(hr)) hr = pFrame->SetPixelFormat(&format);
+  if (SUCCEEDED(hr)) hr = pFrame->WriteSource(pBitmap, NULL);
+  if (SUCCEEDED(hr)) hr = pFrame->Commit();
+  if (SUCCEEDED(hr)) hr = pEncoder->Commit();
+
+  if (pProperties) pProperties->Release();
+  if (pFrame)      pFrame->Release();
+  if (pEncoder)    pEncoder->Release();
+  if (pStream)     pStream->Release();
+  if (pBitmap)     pBitmap->Release();
+  if (pFactory)    pFactory->Release();
+  return hr;
+}
+
+/**
+ * Work item that writes one frame, then frees up its slot
+ */
+static void WriteFrameJob(void *pContext) {
+  FrameWrite *pWrite = (FrameWrite *)pContext;
+  FrameExporter *pExporter = pWrite->pExporter;
+
+  if (INVALID_HANDLE_VALUE != pExporter->hRawFile) {
+    DWORD frameBytes = pExporter->width * pExporter->height * 4;
+    pWrite->hr = WriteAt(pExporter->hRawFile, (ULONGLONG)pWrite->frame * frameBytes,
+                         pWrite->pPixels, frameBytes);
+  } else {
+    char fileName[MAX_PATH + 16];
+    wsprintf(fileName, pExporter->pattern, pWrite->frame);
+    pWrite->hr = EncodeImageFile(fileName, *pExporter->pContainer, pWrite->pPixels,
+                                 pExporter->width, pExporter->height);
+  }
+  SetEvent(pWrite->hIdle);
+}
+
+/**
+ * Waits until a write slot is free, and returns the result of the write that last used it
+ */
+static HRESULT WaitForWrite(FrameWrite *pWrite) {
+  if (!pWrite->hIdle) return S_OK;
+  WaitForSingleObject(pWrite->hIdle, INFINITE);
+  HRESULT hr = pWrite->hr;
+  pWrite->hr = S_OK;
+  return hr;
+}
+
+/**
+ * Waits for every write in flight.  Returns the first error any of them hit.
+ */
+static HRESULT WaitForAllWrites(FrameExporter *pExporter) {
+  HRESULT hr = S_OK;
+  for (UINT i = 0; i < pExporter->writeCount; ++i) {
+    HRESULT hrWrite = WaitForWrite(&pExporter->writes[i]);
+    if (SUCCEEDED(hr)) hr = hrWrite;
+  }
+  return hr;
+}
+
+HRESULT CreateFrameExporter(LPDIRECT3DDEVICE9 pd3dDevice, WorkQueue *pQueue, UINT width,
+                            UINT height, UINT fps, const VideoSettings *pVideo,
+                            LPCSTR outputPath, UINT firstFrame, bool segment, bool last,
+                            FrameExporter **ppExporter) {
+  *ppExporter = NULL;
+
+  LPCSTR extension = strrchr(outputPath, '.');
+  if (!extension || strchr(extension, '\\') || strchr(extension, '/')) return E_INVALIDARG;
+
+  FrameExporter *pExporter = new FrameExporter;
+  ZeroMemory(pExporter, sizeof(FrameExporter));
+  pExporter->pd3dDevice = pd3dDevice;
+  pExporter->width = width;
+  pExporter->height = height;
+  pExporter->hRawFile = INVALID_HANDLE_VALUE;
+  pExporter->pQueue = pQueue;
+  pExporter->firstFrame = firstFrame;
+  pd3dDevice->AddRef();
+
+  // Pick the kind of output from the extension
+  HRESULT hr = S_OK;
+  bool raw = 0 == lstrcmpi(extension, ".raw");
+  if (IsVideoPath(outputPath)) {
+    hr = CreateVideoEncoder(pd3dDevice, width, height, fps, pVideo, outputPath, &pExporter->pVideo);
+  } else if (raw) {
+    pExporter->hRawFile = CreateFile(outputPath, GENERIC_WRITE, segment ? FILE_SHARE_WRITE : 0,
+                                     NULL, segment ? OPEN_ALWAYS : CREATE_ALWAYS,
+                                     FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == pExporter->hRawFile) hr = HRESULT_FROM_WIN32(GetLastError());
+    pExporter->truncate = segment && last;
+  } else if (!ImageFormatFromExtension(extension, &pExporter->pContainer,
+                                       &pExporter->imageFormat) ||
+             !BuildSequencePattern(outputPath, extension, pExporter->pattern)) {
+    hr = E_INVALIDARG;
+  }
+
+  // One write slot per worker, so every core can be encoding a frame
+  if (SUCCEEDED(hr) && (raw || pExporter->pContainer)) {
+    UINT writeCount = WorkQueueThreadCount(pQueue);
+    pExporter->writeCount = writeCount < EXPORT_MAX_WRITES ? writeCount : EXPORT_MAX_WRITES;
+    for (UINT i = 0; SUCCEEDED(hr) && i < pExporter->writeCount; ++i) {
+      FrameWrite *pWrite = &pExporter->writes[i];
+      pWrite->pExporter = pExporter;
+      pWrite->pPixels = new BYTE[width * height * 4];
+      if (NULL == (pWrite->hIdle = CreateEvent(NULL, TRUE, TRUE, NULL))) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+      }
+    }
+  }
+
+  // The offscreen target.  It doesn't need to be lockable since we read it back with
+  // GetRenderTargetData, which lets the driver keep it in the fastest memory it has.
+  // Video frames are drawn into the encoder's own targets instead and never read back.
+  if (SUCCEEDED(hr) && !pExporter->pVideo) {
+    hr = pd3dDevice->CreateRenderTarget(width, height, D3DFMT_X8R8G8B8, D3DMULTISAMPLE_NONE, 0,
+                                        FALSE, &pExporter->pRenderTarget, NULL);
+  }
+
+  // The readback ring.  Event queries are optional; without them, locking a surface just
+  // blocks until its copy finishes, which is still correct.
+  for (UINT i = 0; SUCCEEDED(hr) && !pExporter->pVideo && i < EXPORT_READBACK_DEPTH; ++i) {
+    hr = pd3dDevice->CreateOffscreenPlainSurface(width, height, D3DFMT_X8R8G8B8, D3DPOOL_SYSTEMMEM,
+                                                 &pExporter->pReadback[i], NULL);
+    if (SUCCEEDED(hr) &&
+        FAILED(pd3dDevice->CreateQuery(D3DQUERYTYPE_EVENT, &pExporter->pReadbackDone[i]))) {
+      pExporter->pReadbackDone[i] = NULL;
+    }
+  }
+
+  // Remember the targets we're replacing
+  if (SUCCEEDED(hr)) hr = pd3dDevice->GetRenderTarget(0, &pExporter->pSavedRenderTarget);
+  if (SUCCEEDED(hr) && FAILED(pd3dDevice->GetDepthStencilSurface(&pExporter->pSavedDepthStencil))) {
+    pExporter->pSavedDepthStencil = NULL;
+  }
+
+  if (FAILED(hr)) {
+    ReleaseFrameExporter(pExporter);
+    return hr;
+  }
+
+  *ppExporter = pExporter;
+  return S_OK;
+}
+
+HRESULT BeginExportFrame(FrameExporter *pExporter) {
+  // The depth buffer is sized for the back buffer, and we don't use it anyway
+  LPDIRECT3DDEVICE9 pd3dDevice = pExporter->pd3dDevice;
+  pd3dDevice->SetDepthStencilSurface(NULL);
+  if (pExporter->pVideo) return pd3dDevice->SetRenderTarget(0, BeginVideoFrame(pExporter->pVideo));
+  return pd3dDevice->SetRenderTarget(0, pExporter->pRenderTarget);
+}
+
+/**
+ * Waits for the oldest frame in the ring to arrive in system memory, then either hands a copy of
+ * it to the work queue to be written or, for the formats only D3DX writes, writes it here.
+ * Returns any error from the earlier write whose slot it takes.
+ */
+static HRESULT WriteOldestFrame(FrameExporter *pExporter) {
+  UINT frame = pExporter->framesWritten;
+  UINT slot = frame % EXPORT_READBACK_DEPTH;
+  LPDIRECT3DSURFACE9 pSurface = pExporter->pReadback[slot];
+
+  // By now this has almost always finished, so this loop rarely spins
+  if (pExporter->pReadbackDone[slot]) {
+    while (S_FALSE == pExporter->pReadbackDone[slot]->GetData(NULL, 0, D3DGETDATA_FLUSH)) {
+      YieldProcessor();
+    }
+  }
+
+  HRESULT hr;
+  if (0 == pExporter->writeCount) {
+    char fileName[MAX_PATH + 16];
+    wsprintf(fileName, pExporter->pattern, pExporter->firstFrame + frame);
+    if (FAILED(hr = D3DXSaveSurfaceToFile(fileName, pExporter->imageFormat, pSurface, NULL, NULL))) {
+      return hr;
+    }
+    pExporter->framesWritten++;
+    return S_OK;
+  }
+
+  // Wait for this frame's slot to come free
+  FrameWrite *pWrite = &pExporter->writes[frame % pExporter->writeCount];
+  if (FAILED(hr = WaitForWrite(pWrite))) return hr;
+
+  // Pack the rows together, since the surface pitch is whatever the driver felt like
+  D3DLOCKED_RECT locked;
+  if (FAILED(hr = pSurface->LockRect(&locked, NULL, D3DLOCK_READONLY))) return hr;
+  UINT rowBytes = pExporter->width * 4;
+  for (UINT y = 0; y < pExporter->height; ++y) {
+    CopyMemory(pWrite->pPixels + y * rowBytes, (const BYTE *)locked.pBits + y * locked.Pitch,
+               rowBytes);
+  }
+  pSurface->UnlockRect();
+
+  // The surface is free again as soon as it's copied, so the rest happens off this thread
+  pWrite->frame = pExporter->firstFrame + frame;
+  ResetEvent(pWrite->hIdle);
+  QueueWork(pExporter->pQueue, WriteFrameJob, pWrite);
+  pExporter->framesWritten++;
+  return S_OK;
+}
+
+HRESULT EndExportFrame(FrameExporter *pExporter) {
+  if (pExporter->pVideo) return EndVideoFrame(pExporter->pVideo);
+
+  // If the ring is full, make room by writing out the oldest frame
+  HRESULT hr;
+  if (pExporter->framesQueued - pExporter->framesWritten == EXPORT_READBACK_DEPTH &&
+      FAILED(hr = WriteOldestFrame(pExporter))) {
+    return hr;
+  }
+
+  // Queue the copy of the frame that was just drawn
+  UINT slot = pExporter->framesQueued % EXPORT_READBACK_DEPTH;
+  if (FAILED(hr = pExporter->pd3dDevice->GetRenderTargetData(pExporter->pRenderTarget,
+                                                             pExporter->pReadback[slot]))) {
+    return hr;
+  }
+  if (pExporter->pReadbackDone[slot]) pExporter->pReadbackDone[slot]->Issue(D3DISSUE_END);
+  pExporter->framesQueued++;
+
+  // Success
+  return S_OK;
+}
+
+HRESULT FinishFrameExporter(FrameExporter *pExporter) {
+  HRESULT hr = S_OK;
+  while (SUCCEEDED(hr) && pExporter->framesWritten < pExporter->framesQueued) {
+    hr = WriteOldestFrame(pExporter);
+  }
+  HRESULT hrWrites = WaitForAllWrites(pExporter);
+  if (SUCCEEDED(hr)) hr = hrWrites;
+
+  // Cut off anything an earlier, longer render left past the last frame
+  if (SUCCEEDED(hr) && pExporter->truncate) {
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG)(pExporter->firstFrame + pExporter->framesQueued) *
+                   pExporter->width * pExporter->height * 4;
+    if (!SetFilePointerEx(pExporter->hRawFile, end, NULL, FILE_BEGIN) ||
+        !SetEndOfFile(pExporter->hRawFile)) {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+  }
+  if (SUCCEEDED(hr) && pExporter->pVideo) hr = FinishVideoEncoder(pExporter->pVideo);
+
+  // Put the back buffer back
+  LPDIRECT3DDEVICE9 pd3dDevice = pExporter->pd3dDevice;
+  if (pExporter->pSavedRenderTarget) pd3dDevice->SetRenderTarget(0, pExporter->pSavedRenderTarget);
+  pd3dDevice->SetDepthStencilSurface(pExporter->pSavedDepthStencil);
+  return hr;
+}
+
+void ReleaseFrameExporter(FrameExporter *pExporter) {
+  if (!pExporter) return;
+
+  // Writes still in flight use the slots and the file
+  WaitForAllWrites(pExporter);
+  for (UINT i = 0; i < pExporter->writeCount; ++i) {
+    if (pExporter->writes[i].hIdle) CloseHandle(pExporter->writes[i].hIdle);
+    delete[] pExporter->writes[i].pPixels;
+  }
+  ReleaseVideoEncoder(pExporter->pVideo);
+  for (UINT i = 0; i < EXPORT_READBACK_DEPTH; ++i) {
+    if (pExporter->pReadbackDone[i]) pExporter->pReadbackDone[i]->Release();
+    if (pExporter->pReadback[i])     pExporter->pReadback[i]->Release();
+  }
+  if (pExporter->pRenderTarget)      pExporter->pRenderTarget->Release();
+  if (pExporter->pSavedRenderTarget) pExporter->pSavedRenderTarget->Release();
+  if (pExporter->pSavedDepthStencil) pExporter->pSavedDepthStencil->Release();
+  if (INVALID_HANDLE_VALUE != pExporter->hRawFile) CloseHandle(pExporter->hRawFile);
+  pExporter->pd3dDevice->Release();
+  delete pExporter;
+}
@@ -0,0 +1,80 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Offline frame export.  Instead of pointing a screen recorder at the window, the zoom can be
+// rendered into an offscreen render target at a fixed timestep and written straight to disk.
+// Nothing depends on how fast the machine is, so the output is identical on every run and is
+// usually produced faster than real time.
+//
+// Frames are read back through a small ring of system-memory surfaces.  The copy for frame N
+// is queued with GetRenderTargetData and only locked EXPORT_READBACK_DEPTH - 1 frames later,
+// by which point the GPU has long since finished it, so reading back never stalls the pipeline.
+// Encoding and writing the frame then happens on the work queue, several frames at once, while
+// the next ones render.  (TGA and DDS, which only D3DX can write, are still written in line.)
+//
+// MP4 output skips all of that: frames go straight from the GPU to a hardware encoder (see
+// video.h).
+//
+// Usage:
+//   CreateFrameExporter(...)
+//   for each frame:
+//     BeginExportFrame()   - binds the offscreen target
+//     ... BeginScene / draw / EndScene ...
+//     EndExportFrame()     - queues the readback and writes whichever frame is ready
+//   FinishFrameExporter()  - writes the frames still in flight and restores the back buffer
+//   ReleaseFrameExporter()
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <d3d9.h>
+#include "video.h"
+#include "workqueue.h"
+
+// Number of readback surfaces in flight.  Three is enough to hide the copy on every GPU we've
+// tried while keeping system memory use modest at 4K.
+#define EXPORT_READBACK_DEPTH 3
+
+// Most frames being encoded on the work queue at once.  Each one holds a copy of the frame.
+#define EXPORT_MAX_WRITES 8
+
+struct FrameExporter;
+
+/**
+ * Creates the offscreen target and readback ring.  outputPath is either a printf-style image
+ * sequence pattern ("shot_%05d.png"; if there's no '%', "_%05d" is inserted before the extension)
+ * or a file ending in ".raw", which receives tightly packed 32-bit BGRA frames back to back.
+ * Frames are encoded and written on pQueue.  A path ending in ".mp4" is encoded as fps video
+ * with the settings in pVideo instead, which needs a device created for it (see video.h).
+ *
+ * Frames are numbered from firstFrame.  For one segment of a longer zoom (see segment.h), a
+ * raw stream is opened without being truncated, and shared with the processes writing the other
+ * segments' frames into it.  If last is set as well, the stream is cut off after this segment's
+ * frames once they're written, so nothing is left past them from a longer stream rendered before.
+ */
+HRESULT CreateFrameExporter(LPDIRECT3DDEVICE9 pd3dDevice, WorkQueue *pQueue, UINT width,
+                            UINT height, UINT fps, const VideoSettings *pVideo,
+                            LPCSTR outputPath, UINT firstFrame, bool segment, bool last,
+                            FrameExporter **ppExporter);
+
+/**
+ * Points the device at the exporter's render target.  Call before BeginScene.
+ */
+HRESULT BeginExportFrame(FrameExporter *pExporter);
+
+/**
+ * Queues the readback of the frame just rendered, then hands the oldest frame in the ring to the
+ * work queue to be written once the ring is full.  Call after EndScene.  Errors from writing
+ * earlier frames are returned here as they come in.
+ */
+HRESULT EndExportFrame(FrameExporter *pExporter);
+
+/**
+ * Writes out every frame still in the ring, waits for every write to finish and puts the
+ * original render target back
+ */
+HRESULT FinishFrameExporter(FrameExporter *pExporter);
+
+/**
+ * Frees all of the exporter's resources.  Safe to call with NULL.
+ */
+void ReleaseFrameExporter(FrameExporter *pExporter);
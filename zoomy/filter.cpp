@@ -0,0 +1,227 @@
+//--------------------------------------------------------------------------------------------------
+//
+// The shader image filter.  See filter.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "filter.h"
+#include "display.h"
+#include <d3dx9.h>
+
+// Puts the quad's corners where the constants say:
+//   c0  Target rectangle: left, top, width, height, in pixels
+//   c1  2 / target width, -2 / target height
+//   c2  Texture rectangle: left, top, width, height, in texture coordinates
+// Pixel coordinates are pulled back by half a pixel so texels line up the way they do for the
+// pretransformed vertices everything else is drawn with.
+static const char VERTEX_SHADER[] =
+  "float4 targetRect : register(c0);\n"
+  "float4 targetScale : register(c1);\n"
+  "float4 textureRect : register(c2);\n"
+  "void main(float2 corner : POSITION, out float4 position : POSITION,\n"
+  "          out float2 uv : TEXCOORD0) {\n"
+  "  float2 pixel = targetRect.xy + corner * targetRect.zw - 0.5;\n"
+  "  position = float4(pixel * targetScale.xy + float2(-1.0, 1.0), 0.5, 1.0);\n"
+  "  uv = textureRect.xy + corner * textureRect.zw;\n"
+  "}\n";
+
+// TAPS x TAPS texels around each pixel, weighted by a Lanczos2 window:
+//   c0  Size of the level sampled: width, height, 1 / width, 1 / height
+//   c1  1 / the window's stretch across and down, in texels; the level sampled
+//   c2  Opacity
+// The weights are separable, so each axis's are worked out once and the sum normalised at the
+// end, which also takes care of the window hanging over the taps at the largest stretch.
+static const char PIXEL_SHADER[] =
+  "sampler image : register(s0);\n"
+  "float4 levelSize : register(c0);\n"
+  "float4 window : register(c1);\n"
+  "float4 opacity : register(c2);\n"
+  "float Lanczos2(float x) {\n"
+  "  x = max(abs(x), 0.0001);\n"
+  "  float pix = 3.14159265 * x;\n"
+  "  return x < 2.0 ? 2.0 * sin(pix) * sin(pix * 0.5) / (pix * pix) : 0.0;\n"
+  "}\n"
+  "float4 main(float2 uv : TEXCOORD0) : COLOR {\n"
+  "  float2 position = uv * levelSize.xy - 0.5;\n"
+  "  float2 first = floor(position) - (TAPS / 2 - 1);\n"
+  "  float across[TAPS], down[TAPS];\n"
+  "  float2 total = 0.0;\n"
+  "  [unroll] for (int i = 0; i < TAPS; ++i) {\n"
+  "    float2 offset = (first + i - position) * window.xy;\n"
+  "    across[i] = Lanczos2(offset.x);\n"
+  "    down[i] = Lanczos2(offset.y);\n"
+  "    total += float2(across[i], down[i]);\n"
+  "  }\n"
+  "  float4 sum = 0.0;\n"
+  "  [unroll] for (int y = 0; y < TAPS; ++y) {\n"
+  "    float4 row = 0.0;\n"
+  "    [unroll] for (int x = 0; x < TAPS; ++x) {\n"
+  "      float2 texel = (first + float2(x, y) + 0.5) * levelSize.zw;\n"
+  "      row += across[x] * tex2Dlod(image, float4(texel, 0.0, window.z));\n"
+  "    }\n"
+  "    sum += down[y] * row;\n"
+  "  }\n"
+  "  float4 color = saturate(sum / (total.x * total.y));\n"
+  "  return float4(color.rgb * opacity.x, color.a);\n"
+  "}\n";
+
+// Taps across each pixel's window when magnifying, and when shrinking
+#define MAGNIFY_TAPS 4
+#define SHRINK_TAPS  8
+
+struct ImageFilter {
+  LPDIRECT3DDEVICE9 pd3dDevice;
+  LPDIRECT3DVERTEXBUFFER9 pQuad;        // Four corners, (0, 0) to (1, 1), as a strip
+  LPDIRECT3DVERTEXDECLARATION9 pDeclaration;
+  LPDIRECT3DVERTEXSHADER9 pVertexShader;
+  LPDIRECT3DPIXELSHADER9 pMagnify, pShrink;
+};
+
+bool CanFilterImages(LPDIRECT3DDEVICE9 pd3dDevice) {
+  // The device does its vertex processing in software, which runs vs_3_0 whatever the GPU is
+  D3DCAPS9 caps;
+  return SUCCEEDED(pd3dDevice->GetDeviceCaps(&caps)) &&
+         caps.PixelShaderVersion >= D3DPS_VERSION(3, 0);
+}
+
+/**
+ * Compiles one of the shaders above, with TAPS defined as taps
+ */
+static HRESULT CompileShader(LPCSTR source, UINT length, LPCSTR profile, UINT taps,
+                             LPD3DXBUFFER *ppCode) {
+  char tapsValue[16];
+  wsprintf(tapsValue, "%u", taps);
+  D3DXMACRO defines[] = { { "TAPS", tapsValue }, { NULL, NULL } };
+  LPD3DXBUFFER pErrors = NULL;
+  HRESULT hr = D3DXCompileShader(source, length, defines, NULL, "main", profile,
+                                 D3DXSHADER_OPTIMIZATION_LEVEL3, ppCode, &pErrors, NULL);
+  if (pErrors) {
+    OutputDebugString((LPCSTR)pErrors->GetBufferPointer());
+    pErrors->Release();
+  }
+  return hr;
+}
+
+static HRESULT CreatePixelShader(LPDIRECT3DDEVICE9 pd3dDevice, UINT taps,
+                                 LPDIRECT3DPIXELSHADER9 *ppShader) {
+  LPD3DXBUFFER pCode;
+  HRESULT hr = CompileShader(PIXEL_SHADER, sizeof(PIXEL_SHADER) - 1, "ps_3_0", taps, &pCode);
+  if (FAILED(hr)) return hr;
+  hr = pd3dDevice->CreatePixelShader((const DWORD *)pCode->GetBufferPointer(), ppShader);
+  pCode->Release();
+  return hr;
+}
+
+HRESULT CreateImageFilter(LPDIRECT3DDEVICE9 pd3dDevice, ImageFilter **ppFilter) {
+  if (!CanFilterImages(pd3dDevice)) return D3DERR_NOTAVAILABLE;
+  ImageFilter *pFilter = new ImageFilter;
+  ZeroMemory(pFilter, sizeof(ImageFilter));
+  pFilter->pd3dDevice = pd3dDevice;
+
+  // The quad never changes, so it's written once
+  HRESULT hr = pd3dDevice->CreateVertexBuffer(4 * 2 * sizeof(FLOAT), D3DUSAGE_WRITEONLY, 0,
+                                              DrawTexturePool(pd3dDevice), &pFilter->pQuad, NULL);
+  void *pVertices;
+  if (SUCCEEDED(hr) && SUCCEEDED(hr = pFilter->pQuad->Lock(0, 0, &pVertices, 0))) {
+    static const FLOAT corners[] = { 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f };
+    CopyMemory(pVertices, corners, sizeof(corners));
+    pFilter->pQuad->Unlock();
+  }
+
+  static const D3DVERTEXELEMENT9 elements[] = {
+    { 0, 0, D3DDECLTYPE_FLOAT2, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_POSITION, 0 },
+    D3DDECL_END()
+  };
+  if (SUCCEEDED(hr)) hr = pd3dDevice->CreateVertexDeclaration(elements, &pFilter->pDeclaration);
+
+  LPD3DXBUFFER pCode = NULL;
+  if (SUCCEEDED(hr)) {
+    hr = CompileShader(VERTEX_SHADER, sizeof(VERTEX_SHADER) - 1, "vs_3_0", 0, &pCode);
+  }
+  if (SUCCEEDED(hr)) {
+    hr = pd3dDevice->CreateVertexShader((const DWORD *)pCode->GetBufferPointer(),
+                                        &pFilter->pVertexShader);
+  }
+  if (pCode) pCode->Release();
+  if (SUCCEEDED(hr)) hr = CreatePixelShader(pd3dDevice, MAGNIFY_TAPS, &pFilter->pMagnify);
+  if (SUCCEEDED(hr)) hr = CreatePixelShader(pd3dDevice, SHRINK_TAPS, &pFilter->pShrink);
+
+  if (FAILED(hr)) {
+    ReleaseImageFilter(pFilter);
+    return hr;
+  }
+  *ppFilter = pFilter;
+  return S_OK;
+}
+
+void DrawFilteredImage(ImageFilter *pFilter, LPDIRECT3DTEXTURE9 pTexture, float x1, float y1,
+                       float x2, float y2, float u1, float v1, float u2, float v2,
+                       float target_width, float target_height, float opacity) {
+  D3DSURFACE_DESC top;
+  if (!(x2 > x1 && y2 > y1) || FAILED(pTexture->GetLevelDesc(0, &top))) return;
+
+  // Texels of level 0 under each pixel, which picks the level: the smallest that still has at
+  // least one texel per pixel, with the window stretched over the rest.  Past the last level,
+  // the stretch stops at what the taps can reach.
+  float scale_x = (u2 > u1 ? u2 - u1 : u1 - u2) * top.Width / (x2 - x1),
+        scale_y = (v2 > v1 ? v2 - v1 : v1 - v2) * top.Height / (y2 - y1);
+  float scale = scale_x > scale_y ? scale_x : scale_y;
+  UINT level = 0, levels = pTexture->GetLevelCount();
+  while (level + 1 < levels && scale >= (float)(2 << level)) ++level;
+  D3DSURFACE_DESC desc;
+  if (FAILED(pTexture->GetLevelDesc(level, &desc))) return;
+  float stretch_x = scale_x * desc.Width / top.Width,
+        stretch_y = scale_y * desc.Height / top.Height;
+  if (stretch_x < 1.0f) stretch_x = 1.0f;
+  if (stretch_x > 2.0f) stretch_x = 2.0f;
+  if (stretch_y < 1.0f) stretch_y = 1.0f;
+  if (stretch_y > 2.0f) stretch_y = 2.0f;
+  bool shrinking = stretch_x > 1.0f || stretch_y > 1.0f;
+
+  LPDIRECT3DDEVICE9 pd3dDevice = pFilter->pd3dDevice;
+  float vertexConstants[3][4] = {
+    { x1, y1, x2 - x1, y2 - y1 },
+    { 2.0f / target_width, -2.0f / target_height, 0.0f, 0.0f },
+    { u1, v1, u2 - u1, v2 - v1 }
+  };
+  float pixelConstants[3][4] = {
+    { (float)desc.Width, (float)desc.Height, 1.0f / desc.Width, 1.0f / desc.Height },
+    { 1.0f / stretch_x, 1.0f / stretch_y, (float)level, 0.0f },
+    { opacity, opacity, opacity, opacity }
+  };
+
+  // Every tap lands on a texel's middle, so point sampling reads it exactly
+  DWORD minFilter, magFilter, mipFilter;
+  pd3dDevice->GetSamplerState(0, D3DSAMP_MINFILTER, &minFilter);
+  pd3dDevice->GetSamplerState(0, D3DSAMP_MAGFILTER, &magFilter);
+  pd3dDevice->GetSamplerState(0, D3DSAMP_MIPFILTER, &mipFilter);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MINFILTER, D3DTEXF_POINT);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MAGFILTER, D3DTEXF_POINT);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MIPFILTER, D3DTEXF_POINT);
+
+  pd3dDevice->SetTexture(0, pTexture);
+  pd3dDevice->SetVertexDeclaration(pFilter->pDeclaration);
+  pd3dDevice->SetStreamSource(0, pFilter->pQuad, 0, 2 * sizeof(FLOAT));
+  pd3dDevice->SetVertexShader(pFilter->pVertexShader);
+  pd3dDevice->SetPixelShader(shrinking ? pFilter->pShrink : pFilter->pMagnify);
+  pd3dDevice->SetVertexShaderConstantF(0, &vertexConstants[0][0], 3);
+  pd3dDevice->SetPixelShaderConstantF(0, &pixelConstants[0][0], 3);
+  pd3dDevice->DrawPrimitive(D3DPT_TRIANGLESTRIP, 0, 2);
+
+  // Back to the fixed-function pipeline everything else draws with
+  pd3dDevice->SetVertexShader(NULL);
+  pd3dDevice->SetPixelShader(NULL);
+  pd3dDevice->SetStreamSource(0, NULL, 0, 0);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MINFILTER, minFilter);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MAGFILTER, magFilter);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MIPFILTER, mipFilter);
+}
+
+void ReleaseImageFilter(ImageFilter *pFilter) {
+  if (!pFilter) return;
+  if (pFilter->pShrink) pFilter->pShrink->Release();
+  if (pFilter->pMagnify) pFilter->pMagnify->Release();
+  if (pFilter->pVertexShader) pFilter->pVertexShader->Release();
+  if (pFilter->pDeclaration) pFilter->pDeclaration->Release();
+  if (pFilter->pQuad) pFilter->pQuad->Release();
+  delete pFilter;
+}
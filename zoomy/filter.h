@@ -0,0 +1,48 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Drawing the image through a Lanczos filter in a pixel shader, instead of the fixed-function
+// anisotropic sampler (see -filter).
+//
+// Anisotropic filtering is made for surfaces seen at an angle; a whole image shrunk evenly gets
+// little more than trilinear filtering from it, which shimmers and leaves moire in fine detail
+// when a big image is fitted to the screen.  Here each pixel is instead a Lanczos window two
+// lobes wide, applied to the mip level just above the view's scale and stretched to the rest
+// of the way, so it's always between one and two texels across: 8x8 taps when shrinking, and
+// 4x4 (much like bicubic) when magnifying.  It takes ps_3_0, for the explicit level of detail
+// and the number of instructions.
+//
+// The quad is a static vertex buffer of its four corners; where it goes on the target and
+// which part of the texture it shows are shader constants, so nothing gets built per draw.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <d3d9.h>
+
+struct ImageFilter;
+
+/**
+ * Whether the device can run the filter's shaders
+ */
+bool CanFilterImages(LPDIRECT3DDEVICE9 pd3dDevice);
+
+/**
+ * Compiles the shaders and makes the vertex buffer.  The buffer is managed (or, on 9Ex devices,
+ * in the default pool, which they never lose), so nothing needs making again after a reset.
+ */
+HRESULT CreateImageFilter(LPDIRECT3DDEVICE9 pd3dDevice, ImageFilter **ppFilter);
+
+/**
+ * Draws the part of pTexture from (u1, v1) to (u2, v2) over the target rectangle from (x1, y1)
+ * to (x2, y2), in pixels, of a target_width x target_height render target, darkened to opacity.
+ * The sampler's address modes and the blend states are left as the caller set them; the
+ * filters and shaders are put back as they were.
+ */
+void DrawFilteredImage(ImageFilter *pFilter, LPDIRECT3DTEXTURE9 pTexture, float x1, float y1,
+                       float x2, float y2, float u1, float v1, float u2, float v2,
+                       float target_width, float target_height, float opacity);
+
+/**
+ * Frees the filter.  Safe to call with NULL.
+ */
+void ReleaseImageFilter(ImageFilter *pFilter);
@@ -0,0 +1,266 @@
+//--------------------------------------------------------------------------------------------------
+//
+// The decoded image cache.  See imagecache.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "imagecache.h"
+#include "texcache.h"
+
+// Rows per CopyPixels call while an image is decoded into the cache
+#define CACHE_BAND_ROWS 64
+
+/**
+ * One decoded image.  The cache holds a reference while it's an entry, and every source handed
+ * out over it holds one more.
+ */
+struct CachedImage {
+  LONG references;
+  ULONGLONG hash;               // HashImageFile of the file it came from
+  UINT width, height;
+  BYTE *pPixels;                // Tightly packed BGRA, from VirtualAlloc
+  SIZE_T bytes;
+  ULONGLONG lastUsed;           // When the cache last handed it out, in ImageCache::uses
+};
+
+static void AddRefImage(CachedImage *pImage) {
+  InterlockedIncrement(&pImage->references);
+}
+
+static void ReleaseImage(CachedImage *pImage) {
+  if (0 == InterlockedDecrement(&pImage->references)) {
+    VirtualFree(pImage->pPixels, 0, MEM_RELEASE);
+    delete pImage;
+  }
+}
+
+struct ImageCache {
+  CRITICAL_SECTION lock;        // Guards everything below
+  SIZE_T budget;
+  CachedImage *pEntries[IMAGE_CACHE_MAX_ENTRIES];
+  UINT count;
+  ULONGLONG uses;               // Counts up every time an entry is handed out
+  ImageCacheStats stats;
+};
+
+/**
+ * A WIC source over a cached image's pixels, which it reads straight out of the cache's memory
+ */
+class CachedImageSource : public IWICBitmapSource {
+public:
+  LONG references;
+  CachedImage *pImage;
+
+  CachedImageSource(CachedImage *pFrom) : references(1), pImage(pFrom) { AddRefImage(pImage); }
+  ~CachedImageSource() { ReleaseImage(pImage); }
+
+  STDMETHODIMP QueryInterface(REFIID riid, void **ppObject) {
+    if (IID_IUnknown == riid || IID_IWICBitmapSource == riid) {
+      *ppObject = static_cast<IWICBitmapSource *>(this);
+      AddRef();
+      return S_OK;
+    }
+    *ppObject = NULL;
+    return E_NOINTERFACE;
+  }
+  STDMETHODIMP_(ULONG) AddRef() { return (ULONG)InterlockedIncrement(&references); }
+  STDMETHODIMP_(ULONG) Release() {
+    LONG left = InterlockedDecrement(&references);
+    if (0 == left) delete this;
+    return (ULONG)left;
+  }
+
+  STDMETHODIMP GetSize(UINT *pWidth, UINT *pHeight) {
+    *pWidth = pImage->width;
+    *pHeight = pImage->height;
+    return S_OK;
+  }
+  STDMETHODIMP GetPixelFormat(WICPixelFormatGUID *pFormat) {
+    *pFormat = GUID_WICPixelFormat32bppBGRA;
+    return S_OK;
+  }
+  STDMETHODIMP GetResolution(double *pDpiX, double *pDpiY) {
+    *pDpiX = *pDpiY = 96.0;
+    return S_OK;
+  }
+  STDMETHODIMP CopyPalette(IWICPalette *) { return WINCODEC_ERR_PALETTEUNAVAILABLE; }
+  STDMETHODIMP CopyPixels(const WICRect *pRect, UINT stride, UINT bufferSize, BYTE *pBuffer);
+};
+
+STDMETHODIMP CachedImageSource::CopyPixels(const WICRect *pRect, UINT stride, UINT bufferSize,
+                                           BYTE *pBuffer) {
+  WICRect whole = { 0, 0, (INT)pImage->width, (INT)pImage->height };
+  if (!pRect) pRect = &whole;
+  if (pRect->X < 0 || pRect->Y < 0 || pRect->Width <= 0 || pRect->Height <= 0 ||
+      (UINT)(pRect->X + pRect->Width) > pImage->width ||
+      (UINT)(pRect->Y + pRect->Height) > pImage->height) {
+    return E_INVALIDARG;
+  }
+  UINT rowBytes = (UINT)pRect->Width * 4;
+  if (stride < rowBytes || bufferSize < stride * (pRect->Height - 1) + rowBytes) {
+    return WINCODEC_ERR_INSUFFICIENTBUFFER;
+  }
+  const BYTE *pIn = pImage->pPixels + ((SIZE_T)pRect->Y * pImage->width + pRect->X) * 4;
+  for (INT y = 0; y < pRect->Height; ++y) {
+    CopyMemory(pBuffer + (SIZE_T)y * stride, pIn + (SIZE_T)y * pImage->width * 4, rowBytes);
+  }
+  return S_OK;
+}
+
+HRESULT CreateImageCache(SIZE_T budgetBytes, ImageCache **ppCache) {
+  ImageCache *pCache = new ImageCache;
+  ZeroMemory(pCache, sizeof(ImageCache));
+  InitializeCriticalSection(&pCache->lock);
+  pCache->budget = budgetBytes;
+  *ppCache = pCache;
+  return S_OK;
+}
+
+/**
+ * Takes entry i out of the cache.  The lock must be held.
+ */
+static void RemoveEntry(ImageCache *pCache, UINT i) {
+  CachedImage *pImage = pCache->pEntries[i];
+  pCache->stats.bytes -= pImage->bytes;
+  pCache->pEntries[i] = pCache->pEntries[--pCache->count];
+  ReleaseImage(pImage);
+}
+
+/**
+ * Finds an image and marks it used, returning it with a reference for the caller, or NULL.  The
+ * lock must be held.
+ */
+static CachedImage *FindEntry(ImageCache *pCache, ULONGLONG hash) {
+  for (UINT i = 0; i < pCache->count; ++i) {
+    CachedImage *pImage = pCache->pEntries[i];
+    if (pImage->hash == hash) {
+      pImage->lastUsed = ++pCache->uses;
+      AddRefImage(pImage);
+      return pImage;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Drops the least recently used images until one of size bytes fits.  The lock must be held.
+ */
+static void MakeRoom(ImageCache *pCache, SIZE_T bytes) {
+  while (pCache->count && (IMAGE_CACHE_MAX_ENTRIES == pCache->count ||
+                           pCache->stats.bytes + bytes > pCache->budget)) {
+    UINT oldest = 0;
+    for (UINT i = 1; i < pCache->count; ++i) {
+      if (pCache->pEntries[i]->lastUsed < pCache->pEntries[oldest]->lastUsed) oldest = i;
+    }
+    RemoveEntry(pCache, oldest);
+    ++pCache->stats.evictions;
+  }
+}
+
+/**
+ * Decodes a whole image into memory of its own.  Returns S_FALSE if it's bigger than budget.
+ */
+static HRESULT DecodeWholeImage(LPCSTR imagePath, SIZE_T budget, DECODEPROGRESSPROC pProgress,
+                                void *pContext, CachedImage **ppImage) {
+  IWICImagingFactory *pFactory;
+  IWICBitmapSource *pSource;
+  HRESULT hr = OpenImageSource(imagePath, &pFactory, &pSource);
+  if (FAILED(hr)) return hr;
+  pFactory->Release();
+
+  UINT width = 0, height = 0;
+  hr = pSource->GetSize(&width, &height);
+  if (SUCCEEDED(hr) && (0 == width || 0 == height)) hr = E_FAIL;
+  ULONGLONG bytes = (ULONGLONG)width * height * 4;
+  if (SUCCEEDED(hr) && bytes > budget) hr = S_FALSE;
+  BYTE *pPixels = NULL;
+  if (S_OK == hr) {
+    pPixels = (BYTE *)VirtualAlloc(NULL, (SIZE_T)bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!pPixels) hr = E_OUTOFMEMORY;
+  }
+
+  // A band at a time, so the decode can report progress and be cancelled
+  for (UINT y = 0; S_OK == hr && y < height; y += CACHE_BAND_ROWS) {
+    UINT rows = height - y < CACHE_BAND_ROWS ? height - y : CACHE_BAND_ROWS;
+    WICRect band = { 0, (INT)y, (INT)width, (INT)rows };
+    hr = pSource->CopyPixels(&band, width * 4, width * 4 * rows, pPixels + (SIZE_T)y * width * 4);
+    if (SUCCEEDED(hr) && pProgress && !pProgress((float)(y + rows) / height, pContext)) {
+      hr = E_ABORT;
+    }
+  }
+  pSource->Release();
+  if (S_OK != hr) {
+    if (pPixels) VirtualFree(pPixels, 0, MEM_RELEASE);
+    return hr;
+  }
+
+  CachedImage *pImage = new CachedImage;
+  ZeroMemory(pImage, sizeof(CachedImage));
+  pImage->references = 1;
+  pImage->width = width;
+  pImage->height = height;
+  pImage->pPixels = pPixels;
+  pImage->bytes = (SIZE_T)bytes;
+  *ppImage = pImage;
+  return S_OK;
+}
+
+HRESULT OpenCachedImage(ImageCache *pCache, LPCSTR imagePath, bool fill, bool count,
+                        DECODEPROGRESSPROC pProgress, void *pContext,
+                        IWICImagingFactory **ppFactory, IWICBitmapSource **ppSource) {
+  ULONGLONG hash;
+  HRESULT hr = HashImageFile(imagePath, &hash);
+  if (FAILED(hr)) return hr;
+
+  EnterCriticalSection(&pCache->lock);
+  CachedImage *pImage = FindEntry(pCache, hash);
+  if (count && pImage) ++pCache->stats.hits;
+  if (count && !pImage) ++pCache->stats.misses;
+  LeaveCriticalSection(&pCache->lock);
+
+  // Decoding happens outside the lock, so other workers can still get at what's cached
+  if (!pImage) {
+    if (!fill) return S_FALSE;
+    CachedImage *pDecoded;
+    hr = DecodeWholeImage(imagePath, pCache->budget, pProgress, pContext, &pDecoded);
+    if (S_OK != hr) return hr;
+    pDecoded->hash = hash;
+
+    // Another worker may have cached the same image meanwhile, in which case that one's kept
+    EnterCriticalSection(&pCache->lock);
+    pImage = FindEntry(pCache, hash);
+    if (!pImage) {
+      MakeRoom(pCache, pDecoded->bytes);
+      pDecoded->lastUsed = ++pCache->uses;
+      pCache->pEntries[pCache->count++] = pDecoded;
+      pCache->stats.bytes += pDecoded->bytes;
+      pImage = pDecoded;
+      AddRefImage(pImage);
+      pDecoded = NULL;
+    }
+    LeaveCriticalSection(&pCache->lock);
+    if (pDecoded) ReleaseImage(pDecoded);
+  }
+
+  IWICImagingFactory *pFactory;
+  hr = CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER,
+                        IID_IWICImagingFactory, (LPVOID *)&pFactory);
+  if (SUCCEEDED(hr)) {
+    *ppFactory = pFactory;
+    *ppSource = new CachedImageSource(pImage);
+  }
+  ReleaseImage(pImage);
+  return hr;
+}
+
+void GetImageCacheStats(ImageCache *pCache, ImageCacheStats *pStats) {
+  EnterCriticalSection(&pCache->lock);
+  *pStats = pCache->stats;
+  LeaveCriticalSection(&pCache->lock);
+}
+
+void ReleaseImageCache(ImageCache *pCache) {
+  if (!pCache) return;
+  while (pCache->count) RemoveEntry(pCache, pCache->count - 1);
+  DeleteCriticalSection(&pCache->lock);
+  delete pCache;
+}
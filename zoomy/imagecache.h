@@ -0,0 +1,67 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Decoded images kept in memory, for playlists and batch files that use the same image again.
+//
+// A batch that makes several clips from one photo, or a slideshow that comes back to an image,
+// would otherwise decode it from the file every time.  The texture cache (texcache.h) only helps
+// when the very same texture is wanted again; a different crop, or the other of compressed and
+// uncompressed, still needs the image decoded.  This cache keeps the full-resolution image itself,
+// as 32-bit BGRA, and hands it out as a WIC source, so whatever is made from it (crops, scaled
+// levels, proxies) is made from memory instead.
+//
+// Entries are keyed by HashImageFile, so an image that changes on disk is decoded again, and two
+// paths to the same file share an entry.  The least recently used entries are dropped to keep
+// the total within the cache's budget.  A source handed out keeps its entry's pixels alive even
+// if the entry is dropped meanwhile, so the memory in use can briefly go over the budget by the
+// images being read at the time.
+//
+// Everything here is safe to call from any thread.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <wincodec.h>
+#include "decode.h"
+
+// Most images the cache holds at once, whatever their size
+#define IMAGE_CACHE_MAX_ENTRIES 32
+
+/**
+ * How the cache has done since it was made
+ */
+struct ImageCacheStats {
+  UINT hits;                    // Counted lookups that found the image in memory
+  UINT misses;                  // Counted lookups that didn't, whether or not it was then cached
+  UINT evictions;               // Images dropped to make room
+  SIZE_T bytes;                 // What the images in the cache take now
+};
+
+struct ImageCache;
+
+/**
+ * Makes an empty cache that holds at most budgetBytes of pixels
+ */
+HRESULT CreateImageCache(SIZE_T budgetBytes, ImageCache **ppCache);
+
+/**
+ * Returns a source for the whole of an image, in 32-bit BGRA, from the cache.  If the image isn't
+ * cached and fill is set, it's decoded into the cache first, with pProgress (which may be NULL)
+ * told how far along that is.  Returns S_FALSE, having set nothing, if the image isn't cached
+ * and either fill isn't set or it's too big to cache; the caller decodes it the usual way.  The
+ * factory is handed back too, as OpenImageSource hands it back.  Only lookups with count set
+ * go in the hits and misses, so a load that looks more than once can count just one of them.
+ */
+HRESULT OpenCachedImage(ImageCache *pCache, LPCSTR imagePath, bool fill, bool count,
+                        DECODEPROGRESSPROC pProgress, void *pContext,
+                        IWICImagingFactory **ppFactory, IWICBitmapSource **ppSource);
+
+/**
+ * Copies out the cache's counters
+ */
+void GetImageCacheStats(ImageCache *pCache, ImageCacheStats *pStats);
+
+/**
+ * Drops every image and frees the cache.  Sources handed out stay usable.  Safe to call with
+ * NULL.
+ */
+void ReleaseImageCache(ImageCache *pCache);
@@ -0,0 +1,161 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Memory-mapped file streams.  See mapstream.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "mapstream.h"
+#include <wincodec.h>
+
+class MappedFileStream : public IStream {
+public:
+  LONG references;
+  HANDLE hFile, hMapping;
+  ULONGLONG size;               // Of the whole file
+  ULONGLONG position;
+  const BYTE *pWindow;          // What's mapped now, or NULL...
+  ULONGLONG windowStart;        // ...from here in the file...
+  DWORD windowSize;             // ...for this many bytes
+
+  MappedFileStream() : references(1), hFile(INVALID_HANDLE_VALUE), hMapping(NULL), size(0),
+                       position(0), pWindow(NULL), windowStart(0), windowSize(0) {}
+  ~MappedFileStream() {
+    if (pWindow) UnmapViewOfFile(pWindow);
+    if (hMapping) CloseHandle(hMapping);
+    if (INVALID_HANDLE_VALUE != hFile) CloseHandle(hFile);
+  }
+
+  STDMETHODIMP QueryInterface(REFIID riid, void **ppObject) {
+    if (IID_IUnknown == riid || IID_ISequentialStream == riid || IID_IStream == riid) {
+      *ppObject = static_cast<IStream *>(this);
+      AddRef();
+      return S_OK;
+    }
+    *ppObject = NULL;
+    return E_NOINTERFACE;
+  }
+  STDMETHODIMP_(ULONG) AddRef() { return (ULONG)InterlockedIncrement(&references); }
+  STDMETHODIMP_(ULONG) Release() {
+    LONG left = InterlockedDecrement(&references);
+    if (0 == left) delete this;
+    return (ULONG)left;
+  }
+
+  STDMETHODIMP Read(void *pBuffer, ULONG count, ULONG *pRead);
+  STDMETHODIMP Seek(LARGE_INTEGER move, DWORD origin, ULARGE_INTEGER *pPosition);
+  STDMETHODIMP Stat(STATSTG *pStat, DWORD flags);
+
+  // It's only ever read
+  STDMETHODIMP Write(const void *, ULONG, ULONG *) { return STG_E_ACCESSDENIED; }
+  STDMETHODIMP SetSize(ULARGE_INTEGER) { return STG_E_ACCESSDENIED; }
+  STDMETHODIMP CopyTo(IStream *, ULARGE_INTEGER, ULARGE_INTEGER *, ULARGE_INTEGER *) {
+    return E_NOTIMPL;
+  }
+  STDMETHODIMP Commit(DWORD) { return S_OK; }
+  STDMETHODIMP Revert() { return S_OK; }
+  STDMETHODIMP LockRegion(ULARGE_INTEGER, ULARGE_INTEGER, DWORD) { return STG_E_INVALIDFUNCTION; }
+  STDMETHODIMP UnlockRegion(ULARGE_INTEGER, ULARGE_INTEGER, DWORD) { return STG_E_INVALIDFUNCTION; }
+  STDMETHODIMP Clone(IStream **ppStream) {
+    *ppStream = NULL;
+    return E_NOTIMPL;
+  }
+
+private:
+  HRESULT MapWindow(ULONGLONG offset);
+};
+
+/**
+ * Maps the window holding offset, which must be inside the file
+ */
+HRESULT MappedFileStream::MapWindow(ULONGLONG offset) {
+  if (pWindow) {
+    UnmapViewOfFile(pWindow);
+    pWindow = NULL;
+  }
+  ULONGLONG start = offset - offset % MAPPED_STREAM_WINDOW;
+  DWORD bytes = (DWORD)(size - start < MAPPED_STREAM_WINDOW ? size - start : MAPPED_STREAM_WINDOW);
+  pWindow = (const BYTE *)MapViewOfFile(hMapping, FILE_MAP_READ, (DWORD)(start >> 32),
+                                        (DWORD)start, bytes);
+  if (!pWindow) return HRESULT_FROM_WIN32(GetLastError());
+  windowStart = start;
+  windowSize = bytes;
+  return S_OK;
+}
+
+STDMETHODIMP MappedFileStream::Read(void *pBuffer, ULONG count, ULONG *pRead) {
+  BYTE *pOut = (BYTE *)pBuffer;
+  ULONG done = 0;
+  HRESULT hr = S_OK;
+  while (done < count && position < size) {
+    if (!pWindow || position < windowStart || position >= windowStart + windowSize) {
+      if (FAILED(hr = MapWindow(position))) break;
+    }
+    DWORD offset = (DWORD)(position - windowStart);
+    ULONG bytes = windowSize - offset < count - done ? windowSize - offset : count - done;
+
+    // A page that can't be read (the file shrank, or the disk failed) raises an exception
+    // rather than returning an error
+    __try {
+      CopyMemory(pOut + done, pWindow + offset, bytes);
+    } __except (EXCEPTION_IN_PAGE_ERROR == GetExceptionCode() ? EXCEPTION_EXECUTE_HANDLER
+                                                              : EXCEPTION_CONTINUE_SEARCH) {
+      hr = STG_E_READFAULT;
+      break;
+    }
+    done += bytes;
+    position += bytes;
+  }
+  if (pRead) *pRead = done;
+  if (FAILED(hr)) return hr;
+  return done == count ? S_OK : S_FALSE;
+}
+
+STDMETHODIMP MappedFileStream::Seek(LARGE_INTEGER move, DWORD origin, ULARGE_INTEGER *pPosition) {
+  LONGLONG base;
+  switch (origin) {
+    case STREAM_SEEK_SET: base = 0; break;
+    case STREAM_SEEK_CUR: base = (LONGLONG)position; break;
+    case STREAM_SEEK_END: base = (LONGLONG)size; break;
+    default: return STG_E_INVALIDFUNCTION;
+  }
+  LONGLONG target = base + move.QuadPart;
+  if (target < 0) return STG_E_INVALIDFUNCTION;
+
+  // Past the end is allowed; reads there just come back empty
+  position = (ULONGLONG)target;
+  if (pPosition) pPosition->QuadPart = position;
+  return S_OK;
+}
+
+STDMETHODIMP MappedFileStream::Stat(STATSTG *pStat, DWORD) {
+  ZeroMemory(pStat, sizeof(STATSTG));
+  pStat->type = STGTY_STREAM;
+  pStat->cbSize.QuadPart = size;
+  pStat->grfMode = STGM_READ | STGM_SHARE_DENY_WRITE;
+  return S_OK;
+}
+
+HRESULT CreateMappedFileStream(LPCSTR path, IStream **ppStream) {
+  *ppStream = NULL;
+  MappedFileStream *pStream = new MappedFileStream;
+  HRESULT hr = S_OK;
+  pStream->hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+  LARGE_INTEGER size;
+  if (INVALID_HANDLE_VALUE == pStream->hFile || !GetFileSizeEx(pStream->hFile, &size)) {
+    hr = HRESULT_FROM_WIN32(GetLastError());
+  } else if (0 == size.QuadPart) {
+    // Empty files can't be mapped, and aren't images anyway
+    hr = WINCODEC_ERR_STREAMREAD;
+  } else {
+    pStream->size = (ULONGLONG)size.QuadPart;
+    pStream->hMapping = CreateFileMapping(pStream->hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!pStream->hMapping) hr = HRESULT_FROM_WIN32(GetLastError());
+  }
+
+  if (FAILED(hr)) {
+    pStream->Release();
+    return hr;
+  }
+  *ppStream = pStream;
+  return S_OK;
+}
@@ -0,0 +1,23 @@
+//--------------------------------------------------------------------------------------------------
+//
+// A read-only IStream over a memory-mapped file, for handing images to WIC.
+//
+// Decoders read straight out of the system file cache through a window of the file mapped into
+// the address space, so none of the file is copied into memory of our own, and since only the
+// window is ever mapped, even files bigger than a 32-bit process's address space can be read.
+// The window slides along as the decoder reads, which for strip- and row-ordered formats (TIFF,
+// PNG, baseline JPEG) means each part of the file is mapped about once.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <objidl.h>
+
+// How much of the file is mapped at once.  A multiple of the 64 KB allocation granularity.
+#define MAPPED_STREAM_WINDOW (16 * 1024 * 1024)
+
+/**
+ * Opens path for reading and returns a stream over it.  Safe to use from one thread at a time,
+ * like any other stream, and not necessarily the one that made it.
+ */
+HRESULT CreateMappedFileStream(LPCSTR path, IStream **ppStream);
@@ -0,0 +1,212 @@
+//--------------------------------------------------------------------------------------------------
+//
+// GPU mip chains.  See mipchain.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "mipchain.h"
+
+bool CanGenerateMipChain(LPDIRECT3DDEVICE9 pd3dDevice) {
+  LPDIRECT3D9 pD3D;
+  D3DDEVICE_CREATION_PARAMETERS creation;
+  D3DDISPLAYMODE mode;
+  if (FAILED(pd3dDevice->GetDirect3D(&pD3D))) return false;
+  HRESULT hr = pd3dDevice->GetCreationParameters(&creation);
+  if (SUCCEEDED(hr)) hr = pd3dDevice->GetDisplayMode(0, &mode);
+
+  // Each check on its own, since drivers differ on which usages they'll answer for together
+  static const DWORD usages[] = {
+    D3DUSAGE_RENDERTARGET, D3DUSAGE_QUERY_SRGBREAD, D3DUSAGE_QUERY_SRGBWRITE,
+    D3DUSAGE_QUERY_FILTER
+  };
+  for (UINT i = 0; SUCCEEDED(hr) && i < sizeof(usages) / sizeof(usages[0]); ++i) {
+    hr = pD3D->CheckDeviceFormat(creation.AdapterOrdinal, creation.DeviceType, mode.Format,
+                                 usages[i], D3DRTYPE_TEXTURE, D3DFMT_A8R8G8B8);
+  }
+  pD3D->Release();
+  return SUCCEEDED(hr);
+}
+
+/**
+ * Draws pFrom into the whole of the current render target, width x height texels, reading
+ * from (0, 0) to (right, bottom) in pFrom's texture coordinates.  Sampler 0 is left as set up.
+ */
+static HRESULT DrawLevel(LPDIRECT3DDEVICE9 pd3dDevice, LPDIRECT3DTEXTURE9 pFrom, UINT width,
+                         UINT height, float right, float bottom) {
+  float x2 = width - 0.5f, y2 = height - 0.5f;
+  struct {
+    FLOAT x,y,z,rhw;
+    FLOAT u, v;
+  } vertices[] = {
+    {-0.5f,y2,0.5f,1,0,bottom},{-0.5f,-0.5f,0.5f,1,0,0},{x2,-0.5f,0.5f,1,right,0},
+    {-0.5f,y2,0.5f,1,0,bottom},{x2,-0.5f,0.5f,1,right,0},{x2,y2,0.5f,1,right,bottom}
+  };
+  HRESULT hr = pd3dDevice->BeginScene();
+  if (FAILED(hr)) return hr;
+  pd3dDevice->SetTexture(0, pFrom);
+  pd3dDevice->SetFVF(D3DFVF_XYZRHW | D3DFVF_TEX1);
+  hr = pd3dDevice->DrawPrimitiveUP(D3DPT_TRIANGLELIST, 2, (void*)vertices, sizeof(FLOAT)*6);
+  pd3dDevice->SetTexture(0, NULL);
+  pd3dDevice->EndScene();
+  return hr;
+}
+
+/**
+ * Where in pFrom's texture coordinates the far edge of a level size texels across lands, when
+ * it's drawn from the top-left from texels of a texture textureSize across
+ */
+static float HalvedEdge(UINT size, UINT from, UINT textureSize) {
+  // A texel is the middle of a 2x2 block of the one above, unless that's only one texel across,
+  // and then it's that texel's middle (the texel next to it may be left over from a bigger level)
+  return from > 1 ? 2.0f * size / textureSize : 1.0f / textureSize;
+}
+
+/**
+ * Draws level of pTexture, halving the top-left fromWidth x fromHeight texels of pFrom, which
+ * is textureWidth x textureHeight in all
+ */
+static HRESULT DrawHalvedLevel(LPDIRECT3DDEVICE9 pd3dDevice, LPDIRECT3DTEXTURE9 pTexture,
+                               UINT level, LPDIRECT3DTEXTURE9 pFrom, UINT fromWidth,
+                               UINT fromHeight, UINT textureWidth, UINT textureHeight) {
+  D3DSURFACE_DESC desc;
+  LPDIRECT3DSURFACE9 pSurface;
+  HRESULT hr = pTexture->GetLevelDesc(level, &desc);
+  if (SUCCEEDED(hr)) hr = pTexture->GetSurfaceLevel(level, &pSurface);
+  if (FAILED(hr)) return hr;
+  if (SUCCEEDED(hr = pd3dDevice->SetRenderTarget(0, pSurface))) {
+    hr = DrawLevel(pd3dDevice, pFrom, desc.Width, desc.Height,
+                   HalvedEdge(desc.Width, fromWidth, textureWidth),
+                   HalvedEdge(desc.Height, fromHeight, textureHeight));
+  }
+  pSurface->Release();
+  return hr;
+}
+
+struct MipChainBuild {
+  LPDIRECT3DDEVICE9 pd3dDevice;
+  LPDIRECT3DTEXTURE9 pTexture;
+  LPDIRECT3DTEXTURE9 pScratch;  // Holds the level above while the next is drawn from it
+  UINT scratchWidth, scratchHeight;
+  UINT levelCount;
+  UINT level;                   // The next level to draw
+};
+
+HRESULT CreateMipChainBuild(LPDIRECT3DDEVICE9 pd3dDevice, LPDIRECT3DTEXTURE9 pTexture,
+                            UINT first, MipChainBuild **ppBuild) {
+  *ppBuild = NULL;
+  if (0 == first) return E_INVALIDARG;
+
+  // The biggest level ever copied to the scratch texture is the one above the first drawn
+  UINT levelCount = pTexture->GetLevelCount();
+  LPDIRECT3DTEXTURE9 pScratch = NULL;
+  D3DSURFACE_DESC desc;
+  ZeroMemory(&desc, sizeof(desc));
+  if (first < levelCount) {
+    HRESULT hr = pTexture->GetLevelDesc(first - 1, &desc);
+    if (SUCCEEDED(hr)) {
+      hr = pd3dDevice->CreateTexture(desc.Width, desc.Height, 1, D3DUSAGE_RENDERTARGET,
+                                     D3DFMT_A8R8G8B8, D3DPOOL_DEFAULT, &pScratch, NULL);
+    }
+    if (FAILED(hr)) return hr;
+  }
+
+  MipChainBuild *pBuild = new MipChainBuild;
+  ZeroMemory(pBuild, sizeof(MipChainBuild));
+  pBuild->pd3dDevice = pd3dDevice;
+  pd3dDevice->AddRef();
+  pBuild->pTexture = pTexture;
+  pTexture->AddRef();
+  pBuild->pScratch = pScratch;
+  pBuild->scratchWidth = desc.Width;
+  pBuild->scratchHeight = desc.Height;
+  pBuild->levelCount = levelCount;
+  pBuild->level = first;
+  *ppBuild = pBuild;
+  return S_OK;
+}
+
+/**
+ * Copies the level above pBuild->level to the scratch texture and draws the level from it.
+ * *pBytes gets the size of the level drawn.
+ */
+static HRESULT DrawNextLevel(MipChainBuild *pBuild, SIZE_T *pBytes) {
+  LPDIRECT3DTEXTURE9 pTexture = pBuild->pTexture;
+  UINT level = pBuild->level;
+  LPDIRECT3DSURFACE9 pAbove, pCopy;
+  D3DSURFACE_DESC above, desc;
+  HRESULT hr = pTexture->GetLevelDesc(level - 1, &above);
+  if (SUCCEEDED(hr)) hr = pTexture->GetLevelDesc(level, &desc);
+  if (SUCCEEDED(hr)) hr = pTexture->GetSurfaceLevel(level - 1, &pAbove);
+  if (FAILED(hr)) return hr;
+  if (SUCCEEDED(hr = pBuild->pScratch->GetSurfaceLevel(0, &pCopy))) {
+    RECT rect = { 0, 0, (LONG)above.Width, (LONG)above.Height };
+    hr = pBuild->pd3dDevice->StretchRect(pAbove, &rect, pCopy, &rect, D3DTEXF_POINT);
+    pCopy->Release();
+  }
+  pAbove->Release();
+  if (SUCCEEDED(hr)) {
+    hr = DrawHalvedLevel(pBuild->pd3dDevice, pTexture, level, pBuild->pScratch, above.Width,
+                         above.Height, pBuild->scratchWidth, pBuild->scratchHeight);
+  }
+  *pBytes = (SIZE_T)desc.Width * desc.Height * 4;
+  return hr;
+}
+
+HRESULT ContinueMipChainBuild(MipChainBuild *pBuild, UploadBudget *pBudget) {
+  if (pBuild->level >= pBuild->levelCount) return S_OK;
+
+  LPDIRECT3DDEVICE9 pd3dDevice = pBuild->pd3dDevice;
+  LPDIRECT3DSURFACE9 pSavedTarget = NULL, pSavedDepthStencil = NULL;
+  HRESULT hr = pd3dDevice->GetRenderTarget(0, &pSavedTarget);
+  if (FAILED(hr)) return hr;
+
+  // Render targets here can be bigger than the depth buffer, which mustn't be bound with them
+  if (FAILED(pd3dDevice->GetDepthStencilSurface(&pSavedDepthStencil))) pSavedDepthStencil = NULL;
+  pd3dDevice->SetDepthStencilSurface(NULL);
+  DWORD minFilter, magFilter, mipFilter, addressU, addressV;
+  pd3dDevice->GetSamplerState(0, D3DSAMP_MINFILTER, &minFilter);
+  pd3dDevice->GetSamplerState(0, D3DSAMP_MAGFILTER, &magFilter);
+  pd3dDevice->GetSamplerState(0, D3DSAMP_MIPFILTER, &mipFilter);
+  pd3dDevice->GetSamplerState(0, D3DSAMP_ADDRESSU, &addressU);
+  pd3dDevice->GetSamplerState(0, D3DSAMP_ADDRESSV, &addressV);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MIPFILTER, D3DTEXF_NONE);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_ADDRESSU, D3DTADDRESS_CLAMP);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_ADDRESSV, D3DTADDRESS_CLAMP);
+
+  // Every level is filtered in linear light
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MINFILTER, D3DTEXF_LINEAR);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MAGFILTER, D3DTEXF_LINEAR);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_SRGBTEXTURE, TRUE);
+  pd3dDevice->SetRenderState(D3DRS_SRGBWRITEENABLE, TRUE);
+  do {
+    SIZE_T bytes;
+    if (FAILED(hr = DrawNextLevel(pBuild, &bytes))) break;
+    ++pBuild->level;
+    if (pBudget) {
+      pBudget->frameBytes = bytes < pBudget->frameBytes ? pBudget->frameBytes - bytes : 0;
+    }
+  } while (pBuild->level < pBuild->levelCount && (!pBudget || pBudget->frameBytes > 0));
+
+  // Back to the way everything else draws
+  pd3dDevice->SetRenderState(D3DRS_SRGBWRITEENABLE, FALSE);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_SRGBTEXTURE, FALSE);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MINFILTER, minFilter);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MAGFILTER, magFilter);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MIPFILTER, mipFilter);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_ADDRESSU, addressU);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_ADDRESSV, addressV);
+  pd3dDevice->SetRenderTarget(0, pSavedTarget);
+  pSavedTarget->Release();
+  pd3dDevice->SetDepthStencilSurface(pSavedDepthStencil);
+  if (pSavedDepthStencil) pSavedDepthStencil->Release();
+
+  if (FAILED(hr)) return hr;
+  return pBuild->level == pBuild->levelCount ? S_OK : S_FALSE;
+}
+
+void ReleaseMipChainBuild(MipChainBuild *pBuild) {
+  if (!pBuild) return;
+  if (pBuild->pScratch) pBuild->pScratch->Release();
+  pBuild->pTexture->Release();
+  pBuild->pd3dDevice->Release();
+  delete pBuild;
+}
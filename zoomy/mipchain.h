@@ -0,0 +1,55 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Mip chains filtered on the GPU instead of the CPU.
+//
+// Each level is drawn from the one above it into a render-target texture, with one bilinear
+// sample at the shared corner of every 2x2 block of texels: a box filter, like HalveRow's.
+// The samples are read with D3DSAMP_SRGBTEXTURE and written with D3DRS_SRGBWRITEENABLE, so
+// the averaging happens on light rather than on sRGB-encoded values, and a zoomed-out view
+// isn't darker than the image.  (GPUs from before Direct3D 10 may filter before decoding, which
+// comes out the same as the old way.)
+//
+// The chain is drawn a few levels a frame, within an UploadBudget like the upload before it,
+// straight into the texture that gets drawn: the full-resolution image is uploaded into its top
+// levels, so there's never a second copy of it on the GPU.  A texture can't be drawn from while
+// it's being drawn into, so each level is copied to a scratch texture, the size of the first
+// level drawn's parent, before the next is drawn from it.
+//
+//   CreateMipChainBuild()   - once the top levels are in
+//   ContinueMipChainBuild() - each frame until it returns S_OK
+//   ReleaseMipChainBuild()  - when it's done or given up on
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <d3d9.h>
+#include "upload.h"
+
+/**
+ * Whether the device can draw into A8R8G8B8 textures, read them as sRGB and write sRGB, which
+ * a MipChainBuild needs
+ */
+bool CanGenerateMipChain(LPDIRECT3DDEVICE9 pd3dDevice);
+
+struct MipChainBuild;
+
+/**
+ * Starts drawing the levels of pTexture from first on (first is at least 1), each from the one
+ * above it.  pTexture must be an A8R8G8B8 render-target texture in the default pool with every
+ * level above first already filled in.  The build holds a reference to it.
+ */
+HRESULT CreateMipChainBuild(LPDIRECT3DDEVICE9 pd3dDevice, LPDIRECT3DTEXTURE9 pTexture,
+                            UINT first, MipChainBuild **ppBuild);
+
+/**
+ * Draws as many more levels as pBudget has room for this frame (always at least one), and takes
+ * them out of the budget; with pBudget NULL, draws all that are left.  Returns S_FALSE while
+ * there are more, and S_OK once the chain is complete.  Must be called outside BeginScene and
+ * EndScene; the render target, depth buffer and sampler states are put back afterwards.
+ */
+HRESULT ContinueMipChainBuild(MipChainBuild *pBuild, UploadBudget *pBudget);
+
+/**
+ * Frees the build.  Safe to call with NULL.
+ */
+void ReleaseMipChainBuild(MipChainBuild *pBuild);
@@ -0,0 +1,244 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Command-line parsing.  See options.h for the list of switches.
+//
+//--------------------------------------------------------------------------------------------------
+#include "options.h"
+#include "accum.h"
+#include "segment.h"
+#include <stdlib.h>
+#include <string.h>
+
+LPCSTR NextToken(LPCSTR cursor, char *buffer, size_t bufferSize) {
+  while (*cursor == ' ' || *cursor == '\t') ++cursor;
+  if (!*cursor) return NULL;
+
+  size_t length = 0;
+  bool quoted = false;
+  for (; *cursor; ++cursor) {
+    if (*cursor == '"') {
+      quoted = !quoted;
+      continue;
+    }
+    if (!quoted && (*cursor == ' ' || *cursor == '\t')) break;
+    if (length + 1 < bufferSize) buffer[length++] = *cursor;
+  }
+  buffer[length] = '\0';
+  return cursor;
+}
+
+// Names -output knows
+static const struct {
+  LPCSTR name;
+  UINT width, height;
+} OUTPUT_SIZES[] = {
+  { "720p",     1280, 720 },
+  { "1080p",    1920, 1080 },
+  { "1440p",    2560, 1440 },
+  { "4k",       3840, 2160 },
+  { "vertical", 1080, 1920 },
+};
+
+/**
+ * Reads an -output size, either one of OUTPUT_SIZES or "<width>x<height>".  Video encoders need
+ * both to be even.
+ */
+static bool ParseOutputSize(LPCSTR value, UINT *pWidth, UINT *pHeight) {
+  for (UINT i = 0; i < sizeof(OUTPUT_SIZES) / sizeof(OUTPUT_SIZES[0]); ++i) {
+    if (0 == lstrcmpi(value, OUTPUT_SIZES[i].name)) {
+      *pWidth = OUTPUT_SIZES[i].width;
+      *pHeight = OUTPUT_SIZES[i].height;
+      return true;
+    }
+  }
+  LPCSTR separator = strchr(value, 'x');
+  if (!separator) separator = strchr(value, 'X');
+  if (!separator) return false;
+  int width = atoi(value), height = atoi(separator + 1);
+  if (width < 16 || height < 16 || (width & 1) || (height & 1)) return false;
+  *pWidth = (UINT)width;
+  *pHeight = (UINT)height;
+  return true;
+}
+
+/**
+ * Shows a message box explaining which argument was wrong
+ */
+static BOOL BadArgument(LPCSTR argument) {
+  char message[MAX_PATH + 64];
+  wsprintf(message, "Didn't understand the command-line argument \"%s\"", argument);
+  MessageBox(NULL, message, "Zoomy", MB_OK | MB_ICONERROR);
+  return FALSE;
+}
+
+BOOL ParseCommandLine(LPCSTR lpCmdLine, ZoomyOptions *pOptions) {
+  ZeroMemory(pOptions, sizeof(ZoomyOptions));
+  pOptions->exportFps = 60;
+  pOptions->exportSamples = 1;
+  pOptions->shutter = 0.5f;
+  pOptions->time = 30.0f;
+  pOptions->tiles = TILES_AUTO;
+  pOptions->tilePoolSize = 128;
+  pOptions->lookahead = 2.0f;
+  pOptions->prefetchBudget = 2;
+  pOptions->compress = COMPRESS_AUTO;
+  DWORD tempLength = GetTempPath(MAX_PATH, pOptions->cacheDirectory);
+  if (0 == tempLength || tempLength + 6 > MAX_PATH) {
+    pOptions->cacheDirectory[0] = '\0';
+  } else {
+    lstrcat(pOptions->cacheDirectory, "Zoomy");
+  }
+  pOptions->present = PRESENT_WINDOWED;
+  pOptions->codec = CODEC_H264;
+  pOptions->bitrate = 0;
+  pOptions->fade = 1.0f;
+  pOptions->cropMargin = -1.0f;
+  pOptions->projects = TRUE;
+  pOptions->imageCacheBudget = 256 * 1024 * 1024;
+  pOptions->filter = FILTER_FIXED;
+
+  char token[MAX_PATH], value[MAX_PATH];
+  LPCSTR cursor = lpCmdLine ? lpCmdLine : "";
+  while (NULL != (cursor = NextToken(cursor, token, sizeof(token)))) {
+
+    // Switches can start with either '-' or '/'
+    if (token[0] != '-' && token[0] != '/') return BadArgument(token);
+    LPCSTR name = token + 1;
+
+    // Every switch takes exactly one value
+    if (NULL == (cursor = NextToken(cursor, value, sizeof(value)))) return BadArgument(token);
+
+    if (0 == lstrcmpi(name, "export")) {
+      lstrcpyn(pOptions->exportPath, value, MAX_PATH);
+    } else if (0 == lstrcmpi(name, "fps")) {
+      int fps = atoi(value);
+      if (fps <= 0) return BadArgument(value);
+      pOptions->exportFps = (UINT)fps;
+    } else if (0 == lstrcmpi(name, "samples")) {
+      if (0 == lstrcmpi(value, "auto")) {
+        pOptions->exportSamples = 0;
+      } else {
+        int samples = atoi(value);
+        if (samples < 1 || samples > MAX_FRAME_SAMPLES) return BadArgument(value);
+        pOptions->exportSamples = (UINT)samples;
+      }
+    } else if (0 == lstrcmpi(name, "shutter")) {
+      float shutter = (float)atof(value);
+      if (shutter < 0.0f || shutter > 1.0f || (0.0f == shutter && '0' != value[0])) {
+        return BadArgument(value);
+      }
+      pOptions->shutter = shutter;
+    } else if (0 == lstrcmpi(name, "time")) {
+      float time = (float)atof(value);
+      if (time <= 0.0f) return BadArgument(value);
+      pOptions->time = time;
+    } else if (0 == lstrcmpi(name, "tiles")) {
+      if (0 == lstrcmpi(value, "auto"))      pOptions->tiles = TILES_AUTO;
+      else if (0 == lstrcmpi(value, "on"))   pOptions->tiles = TILES_ON;
+      else if (0 == lstrcmpi(value, "off"))  pOptions->tiles = TILES_OFF;
+      else return BadArgument(value);
+    } else if (0 == lstrcmpi(name, "tilepool")) {
+      int count = atoi(value);
+      if (count < 2) return BadArgument(value);
+      pOptions->tilePoolSize = (UINT)count;
+    } else if (0 == lstrcmpi(name, "lookahead")) {
+      float lookahead = (float)atof(value);
+      if (lookahead < 0.0f) return BadArgument(value);
+      pOptions->lookahead = lookahead;
+    } else if (0 == lstrcmpi(name, "prefetch")) {
+      int budget = atoi(value);
+      if (budget < 0) return BadArgument(value);
+      pOptions->prefetchBudget = (UINT)budget;
+    } else if (0 == lstrcmpi(name, "compress")) {
+      if (0 == lstrcmpi(value, "auto"))      pOptions->compress = COMPRESS_AUTO;
+      else if (0 == lstrcmpi(value, "on"))   pOptions->compress = COMPRESS_ON;
+      else if (0 == lstrcmpi(value, "off"))  pOptions->compress = COMPRESS_OFF;
+      else return BadArgument(value);
+    } else if (0 == lstrcmpi(name, "cache")) {
+      if (0 == lstrcmpi(value, "off")) value[0] = '\0';
+      lstrcpyn(pOptions->cacheDirectory, value, MAX_PATH);
+    } else if (0 == lstrcmpi(name, "present")) {
+      if (0 == lstrcmpi(value, "windowed"))        pOptions->present = PRESENT_WINDOWED;
+      else if (0 == lstrcmpi(value, "flipex"))     pOptions->present = PRESENT_FLIPEX;
+      else if (0 == lstrcmpi(value, "fullscreen")) pOptions->present = PRESENT_FULLSCREEN;
+      else if (0 == lstrcmpi(value, "shared"))     pOptions->present = PRESENT_SHARED;
+      else return BadArgument(value);
+    } else if (0 == lstrcmpi(name, "codec")) {
+      if (0 == lstrcmpi(value, "h264"))      pOptions->codec = CODEC_H264;
+      else if (0 == lstrcmpi(value, "hevc")) pOptions->codec = CODEC_HEVC;
+      else return BadArgument(value);
+    } else if (0 == lstrcmpi(name, "bitrate")) {
+      float mbps = (float)atof(value);
+      if (mbps <= 0.0f || mbps > 1000.0f) return BadArgument(value);
+      pOptions->bitrate = (UINT)(mbps * 1000000.0f);
+    } else if (0 == lstrcmpi(name, "batch")) {
+      lstrcpyn(pOptions->batchPath, value, MAX_PATH);
+    } else if (0 == lstrcmpi(name, "segments")) {
+      // Segments started by -segments get -segment as well, which takes precedence
+      int segments = atoi(value);
+      if (segments < 1 || segments > SEGMENT_MAX) return BadArgument(value);
+      if (0 == pOptions->segment) pOptions->segmentCount = (UINT)segments;
+    } else if (0 == lstrcmpi(name, "segment")) {
+      LPCSTR slash = strchr(value, '/');
+      if (!slash) return BadArgument(value);
+      int segments = atoi(slash + 1);
+      if (segments < 1 || segments > SEGMENT_MAX) return BadArgument(value);
+      char join[32];
+      wsprintf(join, "join/%d", segments);
+      if (0 == lstrcmpi(value, join)) {
+        pOptions->segment = SEGMENT_JOIN;
+      } else {
+        int segment = atoi(value);
+        if (segment < 1 || segment > segments) return BadArgument(value);
+        pOptions->segment = (UINT)segment;
+      }
+      pOptions->segmentCount = (UINT)segments;
+    } else if (0 == lstrcmpi(name, "slideshow")) {
+      lstrcpyn(pOptions->slideshowPath, value, MAX_PATH);
+    } else if (0 == lstrcmpi(name, "fade")) {
+      float fade = (float)atof(value);
+      if (fade < 0.0f) return BadArgument(value);
+      pOptions->fade = fade;
+    } else if (0 == lstrcmpi(name, "telemetry")) {
+      lstrcpyn(pOptions->telemetryPath, value, MAX_PATH);
+    } else if (0 == lstrcmpi(name, "benchmark")) {
+      lstrcpyn(pOptions->benchmarkPath, value, MAX_PATH);
+    } else if (0 == lstrcmpi(name, "output")) {
+      if (!ParseOutputSize(value, &pOptions->outputWidth, &pOptions->outputHeight)) {
+        return BadArgument(value);
+      }
+    } else if (0 == lstrcmpi(name, "crop")) {
+      if (0 == lstrcmpi(value, "off")) {
+        pOptions->cropMargin = -1.0f;
+      } else {
+        float margin = (float)atof(value);
+        if (margin < 0.0f || (0.0f == margin && '0' != value[0])) return BadArgument(value);
+        pOptions->cropMargin = margin;
+      }
+    } else if (0 == lstrcmpi(name, "project")) {
+      pOptions->projects = 0 != lstrcmpi(value, "off");
+      lstrcpyn(pOptions->projectPath, pOptions->projects ? value : "", MAX_PATH);
+    } else if (0 == lstrcmpi(name, "membudget")) {
+      int megabytes = atoi(value);
+      if (megabytes < 1 || megabytes > 2048) return BadArgument(value);
+      pOptions->decodeBudget = (UINT)megabytes * 1024 * 1024;
+    } else if (0 == lstrcmpi(name, "imagecache")) {
+      if (0 == lstrcmpi(value, "off")) {
+        pOptions->imageCacheBudget = 0;
+      } else {
+        int megabytes = atoi(value);
+        if (megabytes < 1 || megabytes > 1024) return BadArgument(value);
+        pOptions->imageCacheBudget = (UINT)megabytes * 1024 * 1024;
+      }
+    } else if (0 == lstrcmpi(name, "filter")) {
+      if (0 == lstrcmpi(value, "fixed"))        pOptions->filter = FILTER_FIXED;
+      else if (0 == lstrcmpi(value, "lanczos")) pOptions->filter = FILTER_LANCZOS;
+      else return BadArgument(value);
+    } else {
+      return BadArgument(token);
+    }
+  }
+
+  // Success
+  return TRUE;
+}
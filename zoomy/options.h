@@ -0,0 +1,153 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Command-line options.  Everything here has a default that matches the interactive behavior
+// of the app, so running zoomy.exe with no arguments works exactly as it always has.
+//
+//   -export <path>   Enables offline export (press X to render the zoom).  The path is either an
+//                    image sequence pattern like "frames\shot_%05d.png", a raw BGRA stream
+//                    ending in ".raw", or a video ending in ".mp4", which is encoded on the GPU.
+//   -fps <n>         Frame rate used by offline export.  Defaults to 60.
+//   -samples <n>     Samples averaged into every exported frame, jittered in time and across the
+//                    pixel, for antialiasing and motion blur (see accum.h).  Defaults to 1; up
+//                    to 64.  "auto" takes as many as keep the export at about real time.
+//   -shutter <f>     Fraction of each frame's time its samples are spread over, from 0 (no
+//                    motion blur, just antialiasing) to 1.  Defaults to 0.5.
+//   -codec <name>    "h264" (the default) or "hevc", for exporting to .mp4.
+//   -bitrate <mbps>  Bit rate of exported video in Mbit/s.  Defaults to about a tenth of a bit
+//                    per pixel per frame, e.g. 12 for 1080p60.
+//   -time <seconds>  Length of the zoom.  Defaults to 30.
+//   -tiles <mode>    "auto" (the default) streams the image as tiles only when it is bigger than
+//                    the largest texture the GPU supports; "on" always does, "off" never does.
+//   -tilepool <n>    Number of 512x512 tile textures kept on the GPU.  Defaults to 128 (128 MB).
+//   -lookahead <s>   How many seconds of the zoom ahead of the camera have their tiles
+//                    prefetched.  Defaults to 2.
+//   -prefetch <n>    Most tiles prefetched per frame.  Defaults to 2; 0 turns prefetching off.
+//   -compress <mode> Whether the image texture is DXT compressed, which takes a quarter (or, for
+//                    images with transparency, half) the memory of the uncompressed texture.
+//                    "auto" (the default) compresses textures of 64 MB and up, and goes back to
+//                    uncompressed if the zoom magnifies the image past one texel per pixel,
+//                    where compression would show.  "on" always compresses; "off" never does.
+//   -cache <dir>     Where finished textures are kept so the same image opens instantly next
+//                    time.  Defaults to a "Zoomy" directory under %TEMP%; "off" turns the
+//                    cache off.
+//   -present <mode>  How frames get to the screen.  "windowed" (the default) is a plain window
+//                    composited by the desktop.  "flipex" uses a Direct3D 9Ex flip-model swap
+//                    chain, which skips a copy and a frame of latency on Windows 7 and later.
+//                    "fullscreen" takes the display over exclusively at its current mode.  Both
+//                    of the latter queue at most one frame ahead and keep present statistics.
+//                    "shared" draws into shared textures a capture plugin can read directly,
+//                    and keeps the window as a preview (see share.h).  It needs Direct3D 9Ex.
+//   -batch <file>    Renders every job in a batch file one after the other, with no window and no
+//                    file dialog, then exits.  See batch.h for the file format.  -fps, -tiles,
+//                    -compress and the rest still apply to every job; -present doesn't.
+//   -segments <n>    Splits a -batch render into n runs of frames, rendered at once by n copies
+//                    of the app, and joins them up again.  See segment.h.  Up to 64.
+//   -segment <i>/<n> Renders only the i'th of n runs of every -batch job's frames, for rendering
+//                    on several machines; "join/<n>" puts the parts together once they're done.
+//   -slideshow <file> Plays a playlist of images one after the other, crossfading from each to
+//                    the next, with no file dialog.  Playlists are batch files without the
+//                    outputs (again, see batch.h).  ESC stops the show.
+//   -fade <seconds>  How long each crossfade of a slideshow takes.  Defaults to 1.
+//   -telemetry <out> Records how long each phase of every live frame takes, on the CPU and the
+//                    GPU, into a CSV file, or as ETW events with "etw" (see telemetry.h).  T
+//                    shows the frame-time overlay either way.
+//   -benchmark <out> Loads and zooms a fixed set of synthetic images, writes how long it all took
+//                    to a JSON report, and exits.  See bench.h.  -tiles, -compress, -present
+//                    and the like apply, so their settings can be compared.
+//   -output <size>   Resolution of everything drawn: "720p", "1080p", "1440p", "4k",
+//                    "vertical" (1080x1920), or any even "<width>x<height>", such as
+//                    "2048x858".  Defaults to the display's own.  Frames are drawn offscreen at
+//                    this size and the window shows them letterboxed (see preview.h), so the
+//                    display mode never needs changing for a recording.
+//   -crop <margin>   Loads only the part of the image the zoom shows, and only at the detail it
+//                    needs, once the zoom is set up.  The margin is how much more to load around
+//                    it, as a fraction of its size (e.g. 0.1); "off" (the default) loads the
+//                    whole image.  See picture.h.
+//   -project <file>  Opens a project (see project.h) instead of asking for an image, or starts
+//                    one there if it doesn't exist yet.  Without it, each image's project is kept
+//                    next to it; "off" doesn't keep one at all.
+//   -membudget <MB>  Most memory a decode may hold.  Tile pyramids are built in bands that fit in
+//                    it (64 MB by default), and with -tiles auto, images whose untiled decode
+//                    wouldn't fit are tiled whatever their size.  See pyramid.h.
+//   -imagecache <MB> How much memory -batch and -slideshow keep decoded images in, for jobs and
+//                    slides that use an image again (see imagecache.h).  Defaults to 256; "off"
+//                    decodes every one from its file.
+//   -filter <mode>   How the image is sampled when it's drawn.  "fixed" (the default) is the
+//                    GPU's anisotropic filtering.  "lanczos" draws it through a Lanczos filter
+//                    sized to the zoom in a pixel shader, which keeps fine detail from shimmering
+//                    on far-out fits; it needs ps_3_0.  See filter.h.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+
+// Values for ZoomyOptions::tiles
+#define TILES_AUTO 0
+#define TILES_ON   1
+#define TILES_OFF  2
+
+// Values for ZoomyOptions::compress
+#define COMPRESS_AUTO 0
+#define COMPRESS_ON   1
+#define COMPRESS_OFF  2
+
+// Values for ZoomyOptions::present
+#define PRESENT_WINDOWED   0
+#define PRESENT_FLIPEX     1
+#define PRESENT_FULLSCREEN 2
+#define PRESENT_SHARED     3
+
+// ZoomyOptions::segment when joining the parts of a render rather than making one
+#define SEGMENT_JOIN 0xFFFFFFFF
+
+// Values for ZoomyOptions::filter
+#define FILTER_FIXED   0
+#define FILTER_LANCZOS 1
+
+// Values for ZoomyOptions::codec
+#define CODEC_H264 0
+#define CODEC_HEVC 1
+
+struct ZoomyOptions {
+  CHAR  exportPath[MAX_PATH];   // Empty when export is disabled
+  UINT  exportFps;
+  UINT  exportSamples;          // Samples per exported frame, or 0 to fit them to the GPU
+  FLOAT shutter;                // Fraction of a frame the samples are spread over
+  FLOAT time;
+  UINT  tiles;                  // One of the TILES_ values
+  UINT  tilePoolSize;
+  FLOAT lookahead;
+  UINT  prefetchBudget;
+  UINT  compress;               // One of the COMPRESS_ values
+  CHAR  cacheDirectory[MAX_PATH];  // Empty when the texture cache is off
+  UINT  present;                // One of the PRESENT_ values
+  CHAR  batchPath[MAX_PATH];    // Empty unless running a batch file
+  UINT  segment;                // Which run of frames (from 1) to render, SEGMENT_JOIN, or 0
+  UINT  segmentCount;           // How many runs the batch is split into, or 0 for one render
+  UINT  codec;                  // One of the CODEC_ values
+  UINT  bitrate;                // Bits per second of exported video, or 0 to pick one
+  CHAR  slideshowPath[MAX_PATH];  // Empty unless playing a slideshow
+  FLOAT fade;                   // Seconds each slideshow crossfade takes
+  CHAR  telemetryPath[MAX_PATH];  // CSV file, "etw", or empty to not record frame times
+  CHAR  benchmarkPath[MAX_PATH];  // Where the benchmark report goes; empty unless benchmarking
+  FLOAT cropMargin;             // Extra around the zoom loaded with -crop, or negative when off
+  UINT  outputWidth, outputHeight;  // Resolution frames are drawn at, or 0 for the display's
+  UINT  decodeBudget;           // Bytes a decode may hold with -membudget, or 0 when not set
+  CHAR  projectPath[MAX_PATH];  // The project -project names, or empty for the image's own
+  BOOL  projects;               // Whether sessions are kept in projects at all
+  UINT  imageCacheBudget;       // Bytes of decoded images kept for reuse, or 0 when that's off
+  UINT  filter;                 // One of the FILTER_ values
+};
+
+/**
+ * Copies the next whitespace-separated token out of the command line into buffer, handling
+ * double-quoted tokens so paths with spaces work.  Returns a pointer just past the token, or
+ * NULL when there are no more tokens.  Batch files are split up the same way.
+ */
+LPCSTR NextToken(LPCSTR cursor, char *buffer, size_t bufferSize);
+
+/**
+ * Fills in the defaults, then overrides them with whatever was passed on the command line.
+ * Returns FALSE (after telling the user) if an argument couldn't be understood.
+ */
+BOOL ParseCommandLine(LPCSTR lpCmdLine, ZoomyOptions *pOptions);
@@ -0,0 +1,899 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Background loading of the picture.  See picture.h for the steps.
+//
+// Only one job is ever in flight for a picture.  The worker fills in the load's results and sets
+// hDone; the UI thread looks at hDone each frame and, once it's set, does whatever needs the
+// device and queues the next job.  The worker never touches the device, so the device doesn't
+// need D3DCREATE_MULTITHREADED.  The load stays around after it's done, so the full-resolution
+// texture can be made again in another format (see ReloadPicture).
+//
+// Compressed textures can't be decoded into directly, so for those the image and its mips are
+// decoded into memory of our own first and then compressed level by level into the texture.
+//
+// A crop is made by the same stage as the full-resolution texture, just from part of the image
+// at a smaller size.  It can be asked for before the stage starts, so it's all that's loaded, or
+// afterwards, when it's made the same way ReloadPicture remakes the texture.
+//
+// On 9Ex devices the decoded texture is in system memory, and has to be copied to the GPU
+// before it can be drawn.  That's done over as many frames as it takes (see upload.h), so even
+// a texture of hundreds of megabytes goes up without a frame ever being held up for it.  Where
+// the GPU can, an uncompressed texture's mips are drawn on the GPU (see mipchain.h), so the
+// worker only decodes levels 0 and 1 and only those have to be copied.  They're copied straight
+// into the top of the render-target texture the rest of the chain is drawn into, a few levels
+// a frame after the upload.  If the GPU can't make or draw that texture after all, the texture
+// is decoded again with every mip filtered on the CPU, with the proxy up in the meantime.
+//
+// The batch and slideshow loaders can hand a picture the decoded image cache (imagecache.h).
+// Both jobs then read from it when the image is there, and if the picture is told the image will
+// be wanted again, the full-resolution job decodes it into the cache before making anything
+// from it.
+//
+//--------------------------------------------------------------------------------------------------
+#include "picture.h"
+#include <d3dx9.h>
+#include <math.h>
+#include "decode.h"
+#include "display.h"
+#include "dxt.h"
+#include "imagecache.h"
+#include "mipchain.h"
+#include "texcache.h"
+#include "pyramid.h"
+#include "upload.h"
+
+// Under -compress auto, textures with a top level at least this big are compressed
+#define COMPRESS_AUTO_BYTES (64 * 1024 * 1024)
+
+// How much of the full-resolution job's progress decoding the image into the cache counts for,
+// when it does that first
+#define IMAGE_CACHE_FILL_SHARE 0.8f
+
+enum PictureLoadStage {
+  LOAD_PROXY,         // Decoding the proxy
+  LOAD_FULL,          // Decoding the full-resolution texture or building the tile pyramid
+  LOAD_UPLOAD,        // Copying the decoded texture to the GPU, a band of rows each frame
+  LOAD_DONE           // Nothing in flight
+};
+
+struct PictureLoad {
+  LPDIRECT3DDEVICE9 pd3dDevice;
+  WorkQueue *pQueue;
+  ImageCache *pImageCache;        // Decoded images shared with other pictures, or NULL
+  bool keepImage;                 // Whether to decode the image into pImageCache if it isn't there
+  bool cacheCounted;              // Whether a pImageCache lookup has gone in its hits and misses
+  CHAR imagePath[MAX_PATH];
+  CHAR cacheDirectory[MAX_PATH];  // Empty when the texture cache is off
+  UINT tiles, tilePoolSize, compress;
+  UINT decodeBudget;              // From -membudget, or 0
+  UINT proxyWidth, proxyHeight;
+  UINT sourceWidth, sourceHeight;
+  bool decodable;                 // Whether WIC could read the image, so it can be reloaded
+  bool hasAlpha;                  // Whether the proxy had any transparent pixels
+  bool keepProxy;                 // Whether the proxy is kept under the full image, for -crop
+  bool gpuMips;                   // Whether uncompressed textures' mips are drawn on the GPU
+
+  // The crop the full-resolution stage makes instead of the whole image, if cropRequested
+  bool cropRequested;
+  RECT cropRegion;                // In image pixels, clipped to the image once its size is known
+  float cropScale;                // Texels per image pixel
+  float shownScale;               // cropScale of the crop the picture has now
+  LPDIRECT3DTEXTURE9 pProxyTexture;  // The proxy, while the full image is up in its place
+
+  PictureLoadStage stage;
+  HANDLE hDone;                   // Set when the job for the current stage has finished
+  HRESULT hr;                     // What the job returned
+  volatile LONG cancel;           // Set to make the job give up as soon as it can
+  volatile float progress;        // How far along the full-resolution job is
+  float progressStart, progressShare;  // The part of it the current step of the job covers
+
+  // Results, depending on the stage
+  DecodedImage proxy;
+  LPDIRECT3DTEXTURE9 pFullTexture;
+  D3DFORMAT format;               // pFullTexture's format
+  TextureLevels locked;           // pFullTexture's levels, locked while the worker fills them
+  TextureLevels pixels;           // Where the worker decodes to: the locked levels, unless...
+  bool compressing;               // ...they're compressed, and pixels is memory of our own
+  bool cropping;                  // Whether pFullTexture is the crop rather than the whole image
+  UINT gpuLevels;                 // Levels in all when the GPU draws the ones under level 1,
+                                  // or 0 if it doesn't
+  TilePyramid *pPyramid;
+  TextureUpload *pUpload;         // pFullTexture on its way to the GPU, during LOAD_UPLOAD
+  MipChainBuild *pMips;           // Its mips being drawn, once the upload is done
+};
+
+static BOOL LoadProgress(float progress, void *pContext) {
+  PictureLoad *pLoad = (PictureLoad *)pContext;
+  pLoad->progress = pLoad->progressStart + progress * pLoad->progressShare;
+  return !pLoad->cancel;
+}
+
+static void DecodeProxyJob(void *pContext) {
+  PictureLoad *pLoad = (PictureLoad *)pContext;
+
+  // An image that's already in memory is shrunk from there, which beats decoding it again.
+  // The lookup isn't counted; the full-resolution one is the load's hit or miss.
+  IWICImagingFactory *pFactory;
+  IWICBitmapSource *pSource;
+  if (pLoad->pImageCache && S_OK == OpenCachedImage(pLoad->pImageCache, pLoad->imagePath, false,
+                                                    false, NULL, NULL, &pFactory, &pSource)) {
+    pLoad->hr = DecodeProxyFromSource(pFactory, pSource, pLoad->proxyWidth, pLoad->proxyHeight,
+                                      &pLoad->proxy);
+    pSource->Release();
+    pFactory->Release();
+  } else {
+    pLoad->hr = DecodeProxyImage(pLoad->imagePath, pLoad->proxyWidth, pLoad->proxyHeight,
+                                 &pLoad->proxy);
+  }
+  SetEvent(pLoad->hDone);
+}
+
+/**
+ * Decodes the full-resolution image (or the crop) into the levels, from the image cache if the
+ * picture has one and the image is there or should be put there
+ */
+static HRESULT DecodeLevels(PictureLoad *pLoad, const RECT *pRegion) {
+  IWICImagingFactory *pFactory;
+  IWICBitmapSource *pSource;
+  HRESULT hr = S_FALSE;
+  pLoad->progressStart = 0.0f;
+  pLoad->progressShare = pLoad->keepImage ? IMAGE_CACHE_FILL_SHARE : 1.0f;
+  if (pLoad->pImageCache) {
+    hr = OpenCachedImage(pLoad->pImageCache, pLoad->imagePath, pLoad->keepImage,
+                         !pLoad->cacheCounted, LoadProgress, pLoad, &pFactory, &pSource);
+    pLoad->cacheCounted = true;
+  }
+  if (S_OK != hr) {
+    pLoad->progressShare = 1.0f;
+    if (E_ABORT == hr) return hr;
+    return DecodeImageLevels(pLoad->imagePath, pRegion, pLoad->pQueue, &pLoad->pixels,
+                             LoadProgress, pLoad);
+  }
+
+  // Whatever's left of the progress is making the levels, which is quick from memory
+  pLoad->progressStart = pLoad->progress;
+  pLoad->progressShare = 1.0f - pLoad->progress;
+  hr = DecodeSourceLevels(pFactory, pSource, pRegion, pLoad->pQueue, &pLoad->pixels,
+                          LoadProgress, pLoad);
+  pSource->Release();
+  pFactory->Release();
+  return hr;
+}
+
+static void DecodeFullJob(void *pContext) {
+  PictureLoad *pLoad = (PictureLoad *)pContext;
+
+  // If this exact texture has been made from this exact file before, just read it back
+  CHAR cachePath[MAX_PATH];
+  const RECT *pRegion = pLoad->cropping ? &pLoad->cropRegion : NULL;
+  bool cache = pLoad->cacheDirectory[0] &&
+               SUCCEEDED(TextureCachePath(pLoad->cacheDirectory, pLoad->imagePath, pRegion,
+                                          &pLoad->locked, pLoad->format, cachePath));
+  if (cache && SUCCEEDED(ReadTextureCache(cachePath, &pLoad->locked, pLoad->format))) {
+    pLoad->hr = S_OK;
+    SetEvent(pLoad->hDone);
+    return;
+  }
+
+  HRESULT hr = DecodeLevels(pLoad, pRegion);
+  if (pLoad->compressing) {
+    for (UINT level = 0; SUCCEEDED(hr) && level < pLoad->locked.count; ++level) {
+      CompressImage(pLoad->pQueue, pLoad->pixels.pBits[level], pLoad->pixels.pitch[level],
+                    pLoad->pixels.width[level], pLoad->pixels.height[level], pLoad->hasAlpha,
+                    pLoad->locked.pBits[level], pLoad->locked.pitch[level]);
+      if (pLoad->cancel) hr = E_ABORT;
+    }
+  }
+
+  // Not being able to save to the cache only means the next load is slower
+  if (SUCCEEDED(hr) && cache) WriteTextureCache(cachePath, &pLoad->locked, pLoad->format);
+  pLoad->hr = hr;
+  SetEvent(pLoad->hDone);
+}
+
+static void BuildPyramidJob(void *pContext) {
+  PictureLoad *pLoad = (PictureLoad *)pContext;
+  pLoad->progressStart = 0.0f;
+  pLoad->progressShare = 1.0f;
+  pLoad->hr = BuildTilePyramid(pLoad->imagePath, pLoad->decodeBudget, LoadProgress, pLoad,
+                               &pLoad->pPyramid);
+  SetEvent(pLoad->hDone);
+}
+
+/**
+ * Unlocks every level of the full-resolution texture that's still locked, and frees the
+ * memory the image was decoded to, if it was our own
+ */
+static void UnlockLevels(PictureLoad *pLoad) {
+  for (UINT level = 0; level < pLoad->locked.count; ++level) {
+    pLoad->pFullTexture->UnlockRect(level);
+  }
+  if (pLoad->compressing) {
+    for (UINT level = 0; level < pLoad->pixels.count; ++level) {
+      VirtualFree(pLoad->pixels.pBits[level], 0, MEM_RELEASE);
+    }
+  }
+  ZeroMemory(&pLoad->locked, sizeof(TextureLevels));
+  ZeroMemory(&pLoad->pixels, sizeof(TextureLevels));
+  pLoad->compressing = false;
+}
+
+/**
+ * Ends the current stage.  Whatever it made that the picture didn't take is released.
+ */
+static void FinishStage(PictureLoad *pLoad) {
+  if (pLoad->pFullTexture) {
+    UnlockLevels(pLoad);
+    pLoad->pFullTexture->Release();
+    pLoad->pFullTexture = NULL;
+  }
+  ReleaseTilePyramid(pLoad->pPyramid);
+  pLoad->pPyramid = NULL;
+  ReleaseTextureUpload(pLoad->pUpload);
+  pLoad->pUpload = NULL;
+  ReleaseMipChainBuild(pLoad->pMips);
+  pLoad->pMips = NULL;
+  FreeDecodedImage(&pLoad->proxy);
+  pLoad->stage = LOAD_DONE;
+}
+
+/**
+ * Whether the device can sample textures of a format
+ */
+static bool DeviceSupportsFormat(LPDIRECT3DDEVICE9 pd3dDevice, D3DFORMAT format) {
+  LPDIRECT3D9 pD3D;
+  D3DDEVICE_CREATION_PARAMETERS creation;
+  D3DDISPLAYMODE mode;
+  if (FAILED(pd3dDevice->GetDirect3D(&pD3D))) return false;
+  HRESULT hr = pd3dDevice->GetCreationParameters(&creation);
+  if (SUCCEEDED(hr)) hr = pd3dDevice->GetDisplayMode(0, &mode);
+  if (SUCCEEDED(hr)) {
+    hr = pD3D->CheckDeviceFormat(creation.AdapterOrdinal, creation.DeviceType, mode.Format, 0,
+                                 D3DRTYPE_TEXTURE, format);
+  }
+  pD3D->Release();
+  return SUCCEEDED(hr);
+}
+
+/**
+ * WIC couldn't read the file (DDS files with formats it doesn't know, for instance), so load
+ * it the old way instead, all at once on this thread.
+ */
+static HRESULT LoadWithD3DX(Picture *pPicture) {
+  PictureLoad *pLoad = pPicture->pLoad;
+  if (TILES_ON == pLoad->tiles) return E_FAIL;
+
+  D3DXIMAGE_INFO imageInfo;
+  HRESULT hr = D3DXGetImageInfoFromFile(pLoad->imagePath, &imageInfo);
+  if (SUCCEEDED(hr)) {
+    hr = D3DXCreateTextureFromFileEx(pLoad->pd3dDevice, pLoad->imagePath, D3DX_DEFAULT,
+                                     D3DX_DEFAULT, D3DX_DEFAULT, 0, D3DFMT_UNKNOWN,
+                                     UploadTexturePool(pLoad->pd3dDevice), D3DX_DEFAULT,
+                                     D3DX_DEFAULT, 0, NULL, NULL, &pPicture->pTexture);
+  }
+  if (SUCCEEDED(hr) && FAILED(hr = FinishTextureUpload(pLoad->pd3dDevice, &pPicture->pTexture))) {
+    pPicture->pTexture->Release();
+    pPicture->pTexture = NULL;
+  }
+  if (FAILED(hr)) return hr;
+  pPicture->width = (float)imageInfo.Width;
+  pPicture->height = (float)imageInfo.Height;
+  return S_OK;
+}
+
+/**
+ * Puts the decoded proxy into a texture that D3DX sizes to suit the device, with mips filtered
+ * in linear light
+ */
+static HRESULT CreateProxyTexture(LPDIRECT3DDEVICE9 pd3dDevice, const DecodedImage *pProxy,
+                                  LPDIRECT3DTEXTURE9 *ppTexture) {
+  LPDIRECT3DTEXTURE9 pTexture;
+  HRESULT hr = D3DXCreateTexture(pd3dDevice, pProxy->width, pProxy->height, D3DX_DEFAULT, 0,
+                                 D3DFMT_A8R8G8B8, UploadTexturePool(pd3dDevice), &pTexture);
+  if (FAILED(hr)) return hr;
+
+  LPDIRECT3DSURFACE9 pSurface;
+  if (SUCCEEDED(hr = pTexture->GetSurfaceLevel(0, &pSurface))) {
+    RECT source = { 0, 0, (LONG)pProxy->width, (LONG)pProxy->height };
+    hr = D3DXLoadSurfaceFromMemory(pSurface, NULL, NULL, pProxy->pPixels, D3DFMT_A8R8G8B8,
+                                   pProxy->width * 4, NULL, &source,
+                                   D3DX_FILTER_BOX | D3DX_FILTER_SRGB, 0);
+    pSurface->Release();
+  }
+  if (SUCCEEDED(hr)) hr = D3DXFilterTexture(pTexture, NULL, 0, D3DX_FILTER_BOX | D3DX_FILTER_SRGB);
+  if (SUCCEEDED(hr)) hr = FinishTextureUpload(pd3dDevice, &pTexture);
+  if (FAILED(hr)) {
+    pTexture->Release();
+    return hr;
+  }
+
+  *ppTexture = pTexture;
+  return S_OK;
+}
+
+static UINT RoundUpToPowerOfTwo(UINT value) {
+  UINT power = 1;
+  while (power < value) power <<= 1;
+  return power;
+}
+
+/**
+ * The size the full-resolution stage would make its texture if the device had no limits: the
+ * size of the image, or of the crop.  A crop that turns out to be empty, or the whole image at
+ * full resolution, isn't worth making and is dropped.
+ */
+static void FullImageSize(PictureLoad *pLoad, UINT *pWidth, UINT *pHeight) {
+  *pWidth = pLoad->sourceWidth;
+  *pHeight = pLoad->sourceHeight;
+  if (!pLoad->cropRequested) return;
+
+  RECT *pRegion = &pLoad->cropRegion;
+  if (pRegion->left < 0) pRegion->left = 0;
+  if (pRegion->top < 0) pRegion->top = 0;
+  if (pRegion->right > (LONG)pLoad->sourceWidth) pRegion->right = (LONG)pLoad->sourceWidth;
+  if (pRegion->bottom > (LONG)pLoad->sourceHeight) pRegion->bottom = (LONG)pLoad->sourceHeight;
+  UINT width = pRegion->right > pRegion->left ? pRegion->right - pRegion->left : 0,
+       height = pRegion->bottom > pRegion->top ? pRegion->bottom - pRegion->top : 0;
+  bool whole = width == pLoad->sourceWidth && height == pLoad->sourceHeight &&
+               pLoad->cropScale >= 1.0f;
+  if (0 == width || 0 == height || whole) {
+    pLoad->cropRequested = false;
+    return;
+  }
+  *pWidth = (UINT)ceil(width * pLoad->cropScale);
+  *pHeight = (UINT)ceil(height * pLoad->cropScale);
+  if (0 == *pWidth) *pWidth = 1;
+  if (0 == *pHeight) *pHeight = 1;
+}
+
+/**
+ * Whether to compress the full-resolution texture: when asked to, or when it would be big
+ * enough to crowd out everything else on the GPU.  If the zoom turns out to need more detail,
+ * ReloadPicture puts it back.
+ */
+static bool ChooseCompression(PictureLoad *pLoad) {
+  UINT width, height;
+  FullImageSize(pLoad, &width, &height);
+  D3DFORMAT compressedFormat = pLoad->hasAlpha ? D3DFMT_DXT5 : D3DFMT_DXT1;
+  bool compress = COMPRESS_ON == pLoad->compress ||
+                  (COMPRESS_AUTO == pLoad->compress &&
+                   (ULONGLONG)width * height * 4 >= COMPRESS_AUTO_BYTES);
+  return compress && DeviceSupportsFormat(pLoad->pd3dDevice, compressedFormat);
+}
+
+/**
+ * Creates the full-resolution texture with all its levels locked, ready for a worker to decode
+ * into.  The texture is width x height when the device allows it; otherwise it's the nearest
+ * size it does allow, and the image is scaled to fit.  Compressed textures get memory of our
+ * own to decode into as well.
+ */
+static HRESULT CreateFullTexture(PictureLoad *pLoad, const D3DCAPS9 *pCaps, UINT width,
+                                 UINT height, bool compress) {
+  if (pCaps->TextureCaps & D3DPTEXTURECAPS_POW2) {
+    width = RoundUpToPowerOfTwo(width);
+    height = RoundUpToPowerOfTwo(height);
+  }
+  if (compress) {
+    // The top level of a compressed texture has to be whole blocks
+    width = (width + 3) & ~3;
+    height = (height + 3) & ~3;
+  }
+  if (width > pCaps->MaxTextureWidth) width = pCaps->MaxTextureWidth;
+  if (height > pCaps->MaxTextureHeight) height = pCaps->MaxTextureHeight;
+
+  // A full mip chain
+  UINT levels = 1;
+  for (UINT size = width > height ? width : height; size > 1; size >>= 1) ++levels;
+  if (levels > DECODE_MAX_LEVELS) levels = DECODE_MAX_LEVELS;
+
+  // When the GPU draws the mips, only levels 0 and 1 are decoded.  Level 1 comes from the CPU
+  // so the GPU never needs a copy of level 0 to draw from.
+  pLoad->gpuLevels = !compress && pLoad->gpuMips ? levels : 0;
+  if (pLoad->gpuLevels && levels > 2) levels = 2;
+
+  D3DFORMAT format = compress ? (pLoad->hasAlpha ? D3DFMT_DXT5 : D3DFMT_DXT1) : D3DFMT_A8R8G8B8;
+  pLoad->format = format;
+  HRESULT hr = pLoad->pd3dDevice->CreateTexture(width, height, levels, 0, format,
+                                                UploadTexturePool(pLoad->pd3dDevice),
+                                                &pLoad->pFullTexture, NULL);
+  if (FAILED(hr)) return hr;
+
+  TextureLevels *pLocked = &pLoad->locked, *pPixels = &pLoad->pixels;
+  pLoad->compressing = compress;
+  for (UINT level = 0; level < levels; ++level) {
+    D3DLOCKED_RECT locked;
+    if (FAILED(hr = pLoad->pFullTexture->LockRect(level, &locked, NULL, 0))) break;
+    pLocked->width[level] = width;
+    pLocked->height[level] = height;
+    pLocked->pBits[level] = (BYTE *)locked.pBits;
+    pLocked->pitch[level] = locked.Pitch;
+    pLocked->count = level + 1;
+
+    if (compress) {
+      pPixels->width[level] = width;
+      pPixels->height[level] = height;
+      pPixels->pitch[level] = width * 4;
+      pPixels->pBits[level] = (BYTE *)VirtualAlloc(NULL, (SIZE_T)width * height * 4,
+                                                   MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+      if (!pPixels->pBits[level]) {
+        hr = E_OUTOFMEMORY;
+        break;
+      }
+      pPixels->count = level + 1;
+    }
+
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+  if (!compress) *pPixels = *pLocked;
+  return hr;
+}
+
+/**
+ * Makes the full-resolution texture and has a worker fill it
+ */
+static HRESULT QueueFullDecode(PictureLoad *pLoad, const D3DCAPS9 *pCaps, bool compress) {
+  pLoad->stage = LOAD_FULL;
+  pLoad->progress = 0.0f;
+  UINT width, height;
+  FullImageSize(pLoad, &width, &height);
+  pLoad->cropping = pLoad->cropRequested;
+  HRESULT hr = CreateFullTexture(pLoad, pCaps, width, height, compress);
+  if (FAILED(hr)) return hr;
+  ResetEvent(pLoad->hDone);
+  QueueWork(pLoad->pQueue, DecodeFullJob, pLoad);
+  return S_FALSE;
+}
+
+/**
+ * The proxy is in; put it on screen and start on the full-resolution image
+ */
+static HRESULT StartFullLoad(Picture *pPicture) {
+  PictureLoad *pLoad = pPicture->pLoad;
+  HRESULT hr = CreateProxyTexture(pLoad->pd3dDevice, &pLoad->proxy, &pPicture->pTexture);
+  if (FAILED(hr)) return hr;
+  UINT width = pLoad->proxy.sourceWidth, height = pLoad->proxy.sourceHeight;
+  pPicture->width = (float)width;
+  pPicture->height = (float)height;
+  pLoad->sourceWidth = width;
+  pLoad->sourceHeight = height;
+  pLoad->decodable = true;
+  pLoad->hasAlpha = ImageHasAlpha(pLoad->proxy.pPixels, pLoad->proxy.width * 4,
+                                  pLoad->proxy.width, pLoad->proxy.height);
+  FreeDecodedImage(&pLoad->proxy);
+
+  // An image too big for a texture may still have a crop that fits in one
+  D3DCAPS9 caps;
+  if (FAILED(hr = pLoad->pd3dDevice->GetDeviceCaps(&caps))) return hr;
+  UINT fullWidth, fullHeight;
+  FullImageSize(pLoad, &fullWidth, &fullHeight);
+  bool tiled;
+  if (TILES_AUTO == pLoad->tiles) {
+    tiled = fullWidth > caps.MaxTextureWidth || fullHeight > caps.MaxTextureHeight;
+
+    // The whole mip chain is decoded into memory at once (twice over, when it's compressed), so
+    // an explicit budget tiles anything it couldn't hold
+    if (pLoad->decodeBudget) {
+      ULONGLONG bytes = (ULONGLONG)fullWidth * fullHeight * 4 * 4 / 3;
+      if (ChooseCompression(pLoad)) bytes *= 2;
+      if (bytes > pLoad->decodeBudget) tiled = true;
+    }
+  } else {
+    tiled = TILES_ON == pLoad->tiles;
+  }
+
+  if (tiled) {
+    pLoad->cropRequested = false;
+    pLoad->stage = LOAD_FULL;
+    pLoad->progress = 0.0f;
+    ResetEvent(pLoad->hDone);
+    QueueWork(pLoad->pQueue, BuildPyramidJob, pLoad);
+    return S_FALSE;
+  }
+
+  return QueueFullDecode(pLoad, &caps, ChooseCompression(pLoad));
+}
+
+/**
+ * The full-resolution image is on the GPU; swap it in for the proxy
+ */
+static HRESULT SwapInFullImage(Picture *pPicture) {
+  PictureLoad *pLoad = pPicture->pLoad;
+  TileCache *pTiles = NULL;
+  if (!pLoad->pFullTexture) {
+    // The cache takes the pyramid whether or not it succeeds
+    HRESULT hr = CreateTileCache(pLoad->pd3dDevice, pLoad->pPyramid, pLoad->tilePoolSize, &pTiles);
+    pLoad->pPyramid = NULL;
+    if (FAILED(hr)) return hr;
+  }
+
+  if (pLoad->cropping) {
+    // The crop goes over the proxy, which is all that's needed underneath it
+    if (pPicture->pCropTexture) pPicture->pCropTexture->Release();
+    pPicture->pCropTexture = pLoad->pFullTexture;
+    const RECT &region = pLoad->cropRegion;
+    ZoomRect crop = { (float)region.left, (float)region.top, (float)region.right,
+                      (float)region.bottom };
+    pPicture->crop = crop;
+    pLoad->shownScale = pLoad->cropScale;
+    if (pLoad->pProxyTexture) {
+      pPicture->pTexture->Release();
+      pPicture->pTexture = pLoad->pProxyTexture;
+      pLoad->pProxyTexture = NULL;
+    }
+  } else {
+    // With -crop the proxy is put aside, to go back under a crop later
+    if (pLoad->keepProxy && !pLoad->pProxyTexture && !pTiles) {
+      pLoad->pProxyTexture = pPicture->pTexture;
+    } else {
+      pPicture->pTexture->Release();
+    }
+    if (pPicture->pCropTexture) {
+      pPicture->pCropTexture->Release();
+      pPicture->pCropTexture = NULL;
+    }
+    pPicture->pTexture = pLoad->pFullTexture;
+    pPicture->pTiles = pTiles;
+  }
+  pLoad->pFullTexture = NULL;
+  return S_OK;
+}
+
+/**
+ * The GPU couldn't make or draw the mip chain.  Throws away what there is of the texture and
+ * decodes it again with the CPU filtering every level, the proxy staying up meanwhile.  Returns
+ * S_FALSE, as the load is on its way again.
+ */
+static HRESULT DecodeWithCpuMips(PictureLoad *pLoad) {
+  ReleaseMipChainBuild(pLoad->pMips);
+  pLoad->pMips = NULL;
+  ReleaseTextureUpload(pLoad->pUpload);
+  pLoad->pUpload = NULL;
+  if (pLoad->pFullTexture) {
+    pLoad->pFullTexture->Release();
+    pLoad->pFullTexture = NULL;
+  }
+  pLoad->gpuMips = false;
+  pLoad->cropRequested = pLoad->cropping;
+
+  D3DCAPS9 caps;
+  HRESULT hr = pLoad->pd3dDevice->GetDeviceCaps(&caps);
+  if (FAILED(hr)) return hr;
+  OutputDebugString("Pan-Zoom Image: the GPU couldn't draw the mips, so the CPU will\n");
+  return QueueFullDecode(pLoad, &caps, false);
+}
+
+/**
+ * The full-resolution image has been decoded.  Copies as much of it to the GPU as pBudget has
+ * room for, and then draws as much of its mip chain on the GPU as there's room left for, and
+ * swaps it in once it's all there.  Returns S_FALSE until then.
+ */
+static HRESULT UploadFullImage(Picture *pPicture, UploadBudget *pBudget) {
+  PictureLoad *pLoad = pPicture->pLoad;
+  HRESULT hr;
+  if (LOAD_UPLOAD != pLoad->stage && pLoad->pFullTexture) {
+    // Managed textures go up by themselves when they're first drawn
+    UnlockLevels(pLoad);
+    D3DSURFACE_DESC desc;
+    if (FAILED(hr = pLoad->pFullTexture->GetLevelDesc(0, &desc))) return hr;
+    if (D3DPOOL_SYSTEMMEM == desc.Pool) {
+      // With GPU mips, the top levels go straight into the texture the rest are drawn into
+      bool gpuMips = pLoad->gpuLevels > 2;
+      hr = CreateTextureUpload(pLoad->pd3dDevice, pLoad->pFullTexture,
+                               gpuMips ? D3DUSAGE_RENDERTARGET : 0,
+                               gpuMips ? pLoad->gpuLevels : 0, &pLoad->pUpload);
+      if (FAILED(hr)) return gpuMips ? DecodeWithCpuMips(pLoad) : hr;
+      pLoad->stage = LOAD_UPLOAD;
+    }
+  }
+
+  if (pLoad->pUpload) {
+    if (S_OK != (hr = ContinueTextureUpload(pLoad->pUpload, pBudget))) return hr;
+    pLoad->pFullTexture->Release();
+    pLoad->pFullTexture = TakeUploadedTexture(pLoad->pUpload);
+    ReleaseTextureUpload(pLoad->pUpload);
+    pLoad->pUpload = NULL;
+
+    // The top levels are up; the rest are drawn from them over the next frames
+    if (pLoad->gpuLevels > 2 &&
+        FAILED(CreateMipChainBuild(pLoad->pd3dDevice, pLoad->pFullTexture, 2, &pLoad->pMips))) {
+      return DecodeWithCpuMips(pLoad);
+    }
+  }
+  if (pLoad->pMips) {
+    hr = ContinueMipChainBuild(pLoad->pMips, pBudget);
+    if (FAILED(hr)) return DecodeWithCpuMips(pLoad);
+    if (S_FALSE == hr) return hr;
+    ReleaseMipChainBuild(pLoad->pMips);
+    pLoad->pMips = NULL;
+  }
+  return SwapInFullImage(pPicture);
+}
+
+HRESULT OpenPicture(LPDIRECT3DDEVICE9 pd3dDevice, WorkQueue *pQueue, LPCSTR imagePath,
+                    const ZoomyOptions *pOptions, UINT proxyWidth, UINT proxyHeight,
+                    ImageCache *pImageCache, bool keepImage, Picture *pPicture) {
+  ZeroMemory(pPicture, sizeof(Picture));
+
+  PictureLoad *pLoad = new PictureLoad;
+  ZeroMemory(pLoad, sizeof(PictureLoad));
+  if (NULL == (pLoad->hDone = CreateEvent(NULL, TRUE, FALSE, NULL))) {
+    delete pLoad;
+    return HRESULT_FROM_WIN32(GetLastError());
+  }
+  pLoad->pd3dDevice = pd3dDevice;
+  pLoad->pQueue = pQueue;
+  pLoad->pImageCache = pImageCache;
+  pLoad->keepImage = pImageCache && keepImage;
+  lstrcpyn(pLoad->imagePath, imagePath, MAX_PATH);
+  lstrcpyn(pLoad->cacheDirectory, pOptions->cacheDirectory, MAX_PATH);
+  pLoad->tiles = pOptions->tiles;
+  pLoad->tilePoolSize = pOptions->tilePoolSize;
+  pLoad->compress = pOptions->compress;
+  pLoad->decodeBudget = pOptions->decodeBudget;
+  pLoad->proxyWidth = proxyWidth;
+  pLoad->proxyHeight = proxyHeight;
+  pLoad->keepProxy = pOptions->cropMargin >= 0.0f;
+  pLoad->gpuMips = IsDeviceEx(pd3dDevice) && CanGenerateMipChain(pd3dDevice);
+  pLoad->stage = LOAD_PROXY;
+  pPicture->pLoad = pLoad;
+
+  QueueWork(pQueue, DecodeProxyJob, pLoad);
+  return S_OK;
+}
+
+HRESULT UpdatePicture(Picture *pPicture, UploadBudget *pBudget) {
+  PictureLoad *pLoad = pPicture->pLoad;
+  if (!pLoad || LOAD_DONE == pLoad->stage) return S_OK;
+
+  HRESULT hr;
+  if (LOAD_UPLOAD == pLoad->stage) {
+    hr = UploadFullImage(pPicture, pBudget);
+  } else {
+    if (WAIT_OBJECT_0 != WaitForSingleObject(pLoad->hDone, 0)) return S_FALSE;
+    hr = pLoad->hr;
+    if (LOAD_PROXY == pLoad->stage) {
+      hr = SUCCEEDED(hr) ? StartFullLoad(pPicture) : LoadWithD3DX(pPicture);
+    } else if (SUCCEEDED(hr)) {
+      hr = UploadFullImage(pPicture, pBudget);
+    }
+  }
+  if (S_FALSE == hr) return hr;
+
+  FinishStage(pLoad);
+  return hr;
+}
+
+HRESULT ReloadPicture(Picture *pPicture, bool compress) {
+  PictureLoad *pLoad = pPicture->pLoad;
+  if (!pLoad || LOAD_DONE != pLoad->stage || !pLoad->decodable || pPicture->pTiles) {
+    return S_FALSE;
+  }
+
+  D3DCAPS9 caps;
+  HRESULT hr = pLoad->pd3dDevice->GetDeviceCaps(&caps);
+  if (SUCCEEDED(hr)) hr = QueueFullDecode(pLoad, &caps, compress);
+  if (FAILED(hr)) {
+    FinishStage(pLoad);
+    return hr;
+  }
+  return S_OK;
+}
+
+HRESULT CropPicture(Picture *pPicture, const ZoomRect &region, float scale) {
+  PictureLoad *pLoad = pPicture->pLoad;
+  if (!pLoad || pPicture->pTiles || LOAD_FULL == pLoad->stage || LOAD_UPLOAD == pLoad->stage) {
+    return S_FALSE;
+  }
+  if (!(scale > 0.0f)) return E_INVALIDARG;
+  if (scale > 1.0f) scale = 1.0f;
+
+  // Nothing to do if the crop there is already has it covered
+  const ZoomRect &crop = pPicture->crop;
+  if (pPicture->pCropTexture && region.left >= crop.left && region.top >= crop.top &&
+      region.right <= crop.right && region.bottom <= crop.bottom && scale <= pLoad->shownScale) {
+    return S_FALSE;
+  }
+
+  RECT rect = { (LONG)floor(region.left), (LONG)floor(region.top), (LONG)ceil(region.right),
+                (LONG)ceil(region.bottom) };
+  pLoad->cropRequested = true;
+  pLoad->cropRegion = rect;
+  pLoad->cropScale = scale;
+
+  // Before the proxy is in, the crop is simply what gets loaded after it
+  if (LOAD_PROXY == pLoad->stage) return S_OK;
+  if (!pLoad->decodable) {
+    pLoad->cropRequested = false;
+    return S_FALSE;
+  }
+
+  // If the zoom needs the whole image after all, a crop there is now has to give way to it
+  UINT width, height;
+  FullImageSize(pLoad, &width, &height);
+  if (!pLoad->cropRequested && !pPicture->pCropTexture) return S_FALSE;
+
+  D3DCAPS9 caps;
+  HRESULT hr = pLoad->pd3dDevice->GetDeviceCaps(&caps);
+  if (SUCCEEDED(hr)) hr = QueueFullDecode(pLoad, &caps, ChooseCompression(pLoad));
+  if (FAILED(hr)) {
+    FinishStage(pLoad);
+    return hr;
+  }
+  return S_OK;
+}
+
+bool IsPictureLoading(const Picture *pPicture) {
+  return pPicture->pLoad && LOAD_DONE != pPicture->pLoad->stage;
+}
+
+bool IsPictureUploading(const Picture *pPicture) {
+  return pPicture->pLoad && LOAD_UPLOAD == pPicture->pLoad->stage;
+}
+
+bool IsPictureStreaming(const Picture *pPicture) {
+  return pPicture->pTiles && TilesPending(pPicture->pTiles);
+}
+
+bool IsPictureCompressed(const Picture *pPicture) {
+  LPDIRECT3DTEXTURE9 pTexture = pPicture->pCropTexture ? pPicture->pCropTexture : pPicture->pTexture;
+  D3DSURFACE_DESC desc;
+  if (!pTexture || FAILED(pTexture->GetLevelDesc(0, &desc))) return false;
+  return D3DFMT_DXT1 == desc.Format || D3DFMT_DXT5 == desc.Format;
+}
+
+float PictureLoadProgress(const Picture *pPicture) {
+  return IsPictureLoading(pPicture) ? pPicture->pLoad->progress : 1.0f;
+}
+
+void PreloadPicture(const Picture *pPicture) {
+  if (pPicture->pTexture) pPicture->pTexture->PreLoad();
+  if (pPicture->pCropTexture) pPicture->pCropTexture->PreLoad();
+  if (pPicture->pTiles) PreloadTileCache(pPicture->pTiles);
+}
+
+void DrawImage(LPDIRECT3DDEVICE9 pd3dDevice, LPDIRECT3DTEXTURE9 pTexture, const ZoomRect &view,
+               float target_width, float target_height, float image_width, float image_height,
+               ImageFilter *pFilter, float opacity) {
+  float u1 = view.left / image_width, v1 = view.top / image_height,
+        u2 = view.right / image_width, v2 = view.bottom / image_height;
+  if (pFilter) {
+    DrawFilteredImage(pFilter, pTexture, 0.0f, 0.0f, target_width, target_height, u1, v1, u2, v2,
+                      target_width, target_height, opacity);
+    return;
+  }
+
+  // Select the image
+  pd3dDevice->SetTexture(0, pTexture);
+
+  // Render vertices directly from a structure in system memory. This is not
+  // good as a general-purpose way of drawing vertices, but what we are doing
+  // doesn't tax the GPU at all so efficiency doesn't matter.
+  struct {
+    FLOAT x,y,z,rhw;
+    FLOAT u, v;
+  } vertices[] = {
+    {0.0f,target_height,0.5f,1,u1,v2},{0.0f,0.0f,0.5f,1,u1,v1},{target_width,0.0f,0.5f,1,u2,v1},
+    {0.0f,target_height,0.5f,1,u1,v2},{target_width,0.0f,0.5f,1,u2,v1},{target_width,target_height,0.5f,1,u2,v2}
+  };
+  pd3dDevice->SetFVF(D3DFVF_XYZRHW | D3DFVF_TEX1);
+  pd3dDevice->DrawPrimitiveUP(D3DPT_TRIANGLELIST, 2, (void*)vertices, sizeof(FLOAT)*6);
+}
+
+/**
+ * Whether the crop covers the whole view, so nothing under it shows
+ */
+static bool CropCoversView(const Picture *pPicture, const ZoomRect &view) {
+  const ZoomRect &crop = pPicture->crop;
+  return pPicture->pCropTexture && view.left >= crop.left && view.top >= crop.top &&
+         view.right <= crop.right && view.bottom <= crop.bottom;
+}
+
+/**
+ * Draws the part of the crop that's under view, wherever it falls on the target.  pFilter and
+ * opacity are as for DrawImage.
+ */
+static void DrawCrop(LPDIRECT3DDEVICE9 pd3dDevice, const Picture *pPicture, const ZoomRect &view,
+                     float target_width, float target_height, ImageFilter *pFilter,
+                     float opacity) {
+  const ZoomRect &crop = pPicture->crop;
+  float left = view.left > crop.left ? view.left : crop.left,
+        top = view.top > crop.top ? view.top : crop.top,
+        right = view.right < crop.right ? view.right : crop.right,
+        bottom = view.bottom < crop.bottom ? view.bottom : crop.bottom;
+  if (!(right > left && bottom > top)) return;
+
+  float sx = target_width / (view.right - view.left), sy = target_height / (view.bottom - view.top);
+  float x1 = (left - view.left) * sx, y1 = (top - view.top) * sy,
+        x2 = (right - view.left) * sx, y2 = (bottom - view.top) * sy;
+  float cw = crop.right - crop.left, ch = crop.bottom - crop.top;
+  float u1 = (left - crop.left) / cw, v1 = (top - crop.top) / ch,
+        u2 = (right - crop.left) / cw, v2 = (bottom - crop.top) / ch;
+
+  // The crop doesn't go on past its edges the way the whole image repeats, so keep filtering
+  // from wrapping around to the far side of it
+  pd3dDevice->SetSamplerState(0, D3DSAMP_ADDRESSU, D3DTADDRESS_CLAMP);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_ADDRESSV, D3DTADDRESS_CLAMP);
+  if (pFilter) {
+    DrawFilteredImage(pFilter, pPicture->pCropTexture, x1, y1, x2, y2, u1, v1, u2, v2,
+                      target_width, target_height, opacity);
+  } else {
+    struct {
+      FLOAT x,y,z,rhw;
+      FLOAT u, v;
+    } vertices[] = {
+      {x1,y2,0.5f,1,u1,v2},{x1,y1,0.5f,1,u1,v1},{x2,y1,0.5f,1,u2,v1},
+      {x1,y2,0.5f,1,u1,v2},{x2,y1,0.5f,1,u2,v1},{x2,y2,0.5f,1,u2,v2}
+    };
+    pd3dDevice->SetTexture(0, pPicture->pCropTexture);
+    pd3dDevice->SetFVF(D3DFVF_XYZRHW | D3DFVF_TEX1);
+    pd3dDevice->DrawPrimitiveUP(D3DPT_TRIANGLELIST, 2, (void*)vertices, sizeof(FLOAT)*6);
+  }
+  pd3dDevice->SetSamplerState(0, D3DSAMP_ADDRESSU, D3DTADDRESS_WRAP);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_ADDRESSV, D3DTADDRESS_WRAP);
+}
+
+void DrawPicture(LPDIRECT3DDEVICE9 pd3dDevice, const Picture *pPicture, const ZoomRect &view,
+                 float target_width, float target_height, UINT tileLoads, ImageFilter *pFilter) {
+  if (pPicture->pTiles) {
+    // Tiles don't repeat the way the single texture does, so clear around the image
+    pd3dDevice->Clear(0, NULL, D3DCLEAR_TARGET, D3DCOLOR_XRGB(0,0,0), 1.0f, 0);
+    UpdateTileCache(pPicture->pTiles, view, target_width, tileLoads);
+    DrawTiles(pPicture->pTiles, view, target_width, target_height);
+  } else if (pPicture->pTexture) {
+    // With a crop, the proxy only fills in where the crop doesn't reach
+    if (!CropCoversView(pPicture, view)) {
+      DrawImage(pd3dDevice, pPicture->pTexture, view, target_width, target_height,
+                pPicture->width, pPicture->height, pFilter, 1.0f);
+    }
+    if (pPicture->pCropTexture) {
+      DrawCrop(pd3dDevice, pPicture, view, target_width, target_height, pFilter, 1.0f);
+    }
+  }
+}
+
+void DrawPictureBlended(LPDIRECT3DDEVICE9 pd3dDevice, const Picture *pPicture,
+                        const ZoomRect &view, float target_width, float target_height,
+                        UINT tileLoads, ImageFilter *pFilter, float opacity) {
+  // Scale the texture by a gray texture factor and add it to the target
+  BYTE level = (BYTE)(opacity <= 0.0f ? 0 : opacity >= 1.0f ? 255 : (int)(opacity * 255.0f + 0.5f));
+  pd3dDevice->SetRenderState(D3DRS_TEXTUREFACTOR, D3DCOLOR_XRGB(level, level, level));
+  pd3dDevice->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_TFACTOR);
+  pd3dDevice->SetRenderState(D3DRS_ALPHABLENDENABLE, TRUE);
+  pd3dDevice->SetRenderState(D3DRS_SRCBLEND, D3DBLEND_ONE);
+  pd3dDevice->SetRenderState(D3DRS_DESTBLEND, D3DBLEND_ONE);
+
+  // Unlike DrawPicture, this mustn't clear around tiled pictures, or it would wipe out
+  // whatever is underneath.  The caller clears once, before the first picture.
+  if (pPicture->pTiles) {
+    UpdateTileCache(pPicture->pTiles, view, target_width, tileLoads);
+    DrawTiles(pPicture->pTiles, view, target_width, target_height);
+  } else if (CropCoversView(pPicture, view)) {
+    DrawCrop(pd3dDevice, pPicture, view, target_width, target_height, pFilter, opacity);
+  } else if (pPicture->pTexture) {
+    // Adding the crop over the proxy would count it twice, so it's one or the other
+    DrawImage(pd3dDevice, pPicture->pTexture, view, target_width, target_height,
+              pPicture->width, pPicture->height, pFilter, opacity);
+  }
+
+  // Back to the defaults everything else draws with
+  pd3dDevice->SetRenderState(D3DRS_ALPHABLENDENABLE, FALSE);
+  pd3dDevice->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_CURRENT);
+}
+
+void ReleasePicture(Picture *pPicture) {
+  if (pPicture->pLoad) {
+    // The job may still be using the load, so stop it and wait for it to let go
+    PictureLoad *pLoad = pPicture->pLoad;
+    InterlockedExchange(&pLoad->cancel, 1);
+    if (LOAD_DONE != pLoad->stage) WaitForSingleObject(pLoad->hDone, INFINITE);
+    FinishStage(pLoad);
+    if (pLoad->pProxyTexture) pLoad->pProxyTexture->Release();
+    CloseHandle(pLoad->hDone);
+    delete pLoad;
+  }
+  if (pPicture->pTexture) pPicture->pTexture->Release();
+  if (pPicture->pCropTexture) pPicture->pCropTexture->Release();
+  ReleaseTileCache(pPicture->pTiles);
+  ZeroMemory(pPicture, sizeof(Picture));
+}
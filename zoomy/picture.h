@@ -0,0 +1,148 @@
+//--------------------------------------------------------------------------------------------------
+//
+// The image being zoomed, and how it gets loaded.
+//
+// Loading happens on the work queue in two steps, so the UI thread never waits on a decode:
+//
+//  1. A reduced-resolution proxy about the size of the screen.  This is quick (JPEGs are scaled
+//     while they're decoded), and as soon as it's on the GPU the user can start setting up the
+//     zoom.
+//  2. The full-resolution image: either every level of a texture, decoded straight into the
+//     texture's locked memory (or compressed into it, see -compress), or a tile pyramid for
+//     images too big for one texture.  When it's ready it goes up to the GPU a band at a time
+//     over the next few frames (see upload.h), then replaces the proxy between two frames.
+//
+// Call UpdatePicture once per frame to move things along.
+//
+// With -crop, once the zoom is known, only the part of the image it covers is loaded, and only
+// at the detail it needs (see CropPicture).  That crop is drawn over the proxy, which stays as
+// the picture's texture and fills in anywhere the crop doesn't reach.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <d3d9.h>
+#include "filter.h"
+#include "imagecache.h"
+#include "options.h"
+#include "tiles.h"
+#include "upload.h"
+#include "workqueue.h"
+#include "zoomy.h"
+
+struct PictureLoad;
+
+/**
+ * At most one of pTexture and pTiles is set.  Neither is until the proxy has arrived.
+ */
+struct Picture {
+  LPDIRECT3DTEXTURE9 pTexture;  // The whole image, or the proxy while pLoad is still set
+  TileCache *pTiles;            // A tile pyramid streamed in as needed, for huge images
+  float width, height;          // Size of the full-resolution image, even while showing the proxy
+  PictureLoad *pLoad;           // What the picture is loaded from, and any load in flight
+  LPDIRECT3DTEXTURE9 pCropTexture;  // Part of the image, drawn over pTexture, after CropPicture
+  ZoomRect crop;                // The part pCropTexture covers, in image pixels
+};
+
+/**
+ * Starts loading an image in the background.  The proxy is made to fit within
+ * proxyWidth x proxyHeight.  If pImageCache isn't NULL, the image is read from it when it's
+ * there, and with keepImage, decoded into it when it isn't, for another picture to use later.
+ */
+HRESULT OpenPicture(LPDIRECT3DDEVICE9 pd3dDevice, WorkQueue *pQueue, LPCSTR imagePath,
+                    const ZoomyOptions *pOptions, UINT proxyWidth, UINT proxyHeight,
+                    ImageCache *pImageCache, bool keepImage, Picture *pPicture);
+
+/**
+ * Takes whatever the workers have finished and puts it on the GPU, copying no more of the
+ * full-resolution texture than pBudget has room for this frame (or all of it, with pBudget
+ * NULL).  Returns S_FALSE while the full-resolution image is still on its way, S_OK once
+ * everything is loaded, or an error if a step failed (if only the full-resolution step failed,
+ * the proxy stays in place).
+ */
+HRESULT UpdatePicture(Picture *pPicture, UploadBudget *pBudget);
+
+/**
+ * Makes the full-resolution texture again in the background, compressed or not, and swaps it in
+ * once it's ready (UpdatePicture still has to be called).  Returns S_FALSE, and does nothing, if
+ * the picture is tiled, still loading, or was loaded without WIC.
+ */
+HRESULT ReloadPicture(Picture *pPicture, bool compress);
+
+/**
+ * Loads just region of the image (in image pixels; it's clipped to the image), at scale texels
+ * per image pixel (at most 1), in place of the full-resolution image.  Called before the proxy
+ * is in, the crop is what gets loaded after it; called once everything is loaded, the crop is
+ * made in the background and swapped in (UpdatePicture still has to be called), and the
+ * full-resolution texture gives way to the proxy.  Returns S_FALSE, and does nothing, if the
+ * picture is tiled (tiles only ever load what's on screen anyway), if the full-resolution load
+ * is under way, or if the crop would be the whole image.
+ */
+HRESULT CropPicture(Picture *pPicture, const ZoomRect &region, float scale);
+
+/**
+ * Whether anything is still being loaded in the background
+ */
+bool IsPictureLoading(const Picture *pPicture);
+
+/**
+ * Whether the full-resolution texture is being copied to the GPU, which UpdatePicture only does
+ * a frame at a time
+ */
+bool IsPictureUploading(const Picture *pPicture);
+
+/**
+ * Whether the last DrawPicture left tiles under its view for later, so drawing it again would
+ * show more detail even if nothing else changed
+ */
+bool IsPictureStreaming(const Picture *pPicture);
+
+/**
+ * Whether the picture is currently drawn from a DXT-compressed texture
+ */
+bool IsPictureCompressed(const Picture *pPicture);
+
+/**
+ * How far along the full-resolution load is, from 0 to 1.  Returns 1 when nothing is loading.
+ */
+float PictureLoadProgress(const Picture *pPicture);
+
+/**
+ * Uploads the picture to the GPU now rather than when it's next drawn.  On ordinary devices
+ * everything the picture owns lives in the managed pool, which keeps a copy in system memory,
+ * so after a device reset this is a plain upload with no file I/O or decoding.  (9Ex devices
+ * don't lose the picture in the first place.)
+ */
+void PreloadPicture(const Picture *pPicture);
+
+/**
+ * Draws the part of a texture under view so that it fills a target_width x target_height
+ * target, through pFilter if it isn't NULL and with the fixed-function sampler otherwise.
+ * opacity only matters to pFilter; the fixed-function path is darkened by the texture factor,
+ * as DrawPictureBlended sets it.  Must be called between BeginScene and EndScene.
+ */
+void DrawImage(LPDIRECT3DDEVICE9 pd3dDevice, LPDIRECT3DTEXTURE9 pTexture, const ZoomRect &view,
+               float target_width, float target_height, float image_width, float image_height,
+               ImageFilter *pFilter, float opacity);
+
+/**
+ * Draws the picture under view.  For tiled pictures this first loads up to tileLoads of the
+ * missing tiles.  Textures are drawn through pFilter if it isn't NULL (see filter.h); tiles
+ * always use the fixed-function sampler.  Must be called between BeginScene and EndScene.
+ */
+void DrawPicture(LPDIRECT3DDEVICE9 pd3dDevice, const Picture *pPicture, const ZoomRect &view,
+                 float target_width, float target_height, UINT tileLoads, ImageFilter *pFilter);
+
+/**
+ * Draws the picture the way DrawPicture does, but adds it, darkened to opacity, onto what's
+ * already in the target instead of replacing it.  Drawing two pictures this way onto black with
+ * opacities adding up to 1 crossfades between them.
+ */
+void DrawPictureBlended(LPDIRECT3DDEVICE9 pd3dDevice, const Picture *pPicture,
+                        const ZoomRect &view, float target_width, float target_height,
+                        UINT tileLoads, ImageFilter *pFilter, float opacity);
+
+/**
+ * Cancels any load in progress and frees everything
+ */
+void ReleasePicture(Picture *pPicture);
@@ -0,0 +1,148 @@
+//--------------------------------------------------------------------------------------------------
+//
+// The letterboxed preview of the output.  See preview.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "preview.h"
+
+struct PreviewTarget {
+  LPDIRECT3DDEVICE9 pd3dDevice;
+  UINT width, height;                   // The output's size
+  LPDIRECT3DSURFACE9 pTarget;           // Made again after every device reset
+  LPDIRECT3DSURFACE9 pBackBuffer;       // Held between BeginPreviewFrame and EndPreviewFrame
+  LPDIRECT3DSURFACE9 pDepthStencil;     // Unbound between them, and held to put back
+  RECT rect;                            // Where the output goes on the back buffer
+};
+
+void GetPreviewRect(UINT width, UINT height, UINT target_width, UINT target_height, RECT *pRect) {
+  UINT w = target_width, h = target_height;
+  if ((ULONGLONG)width * target_height > (ULONGLONG)height * target_width) {
+    h = (UINT)((ULONGLONG)height * target_width / width);
+  } else {
+    w = (UINT)((ULONGLONG)width * target_height / height);
+  }
+  pRect->left = (LONG)(target_width - w) / 2;
+  pRect->top = (LONG)(target_height - h) / 2;
+  pRect->right = pRect->left + (LONG)w;
+  pRect->bottom = pRect->top + (LONG)h;
+}
+
+/**
+ * Makes the target, and works out where it goes on the back buffer as it is now
+ */
+static HRESULT CreateTargets(PreviewTarget *pPreview) {
+  LPDIRECT3DDEVICE9 pd3dDevice = pPreview->pd3dDevice;
+  LPDIRECT3DSURFACE9 pBackBuffer;
+  HRESULT hr = pd3dDevice->GetBackBuffer(0, 0, D3DBACKBUFFER_TYPE_MONO, &pBackBuffer);
+  if (FAILED(hr)) return hr;
+  D3DSURFACE_DESC desc;
+  hr = pBackBuffer->GetDesc(&desc);
+  pBackBuffer->Release();
+  if (FAILED(hr)) return hr;
+  GetPreviewRect(pPreview->width, pPreview->height, desc.Width, desc.Height, &pPreview->rect);
+
+  return pd3dDevice->CreateRenderTarget(pPreview->width, pPreview->height, D3DFMT_X8R8G8B8,
+                                        D3DMULTISAMPLE_NONE, 0, FALSE, &pPreview->pTarget, NULL);
+}
+
+HRESULT CreatePreviewTarget(LPDIRECT3DDEVICE9 pd3dDevice, UINT width, UINT height,
+                            PreviewTarget **ppPreview) {
+  *ppPreview = NULL;
+  PreviewTarget *pPreview = new PreviewTarget;
+  ZeroMemory(pPreview, sizeof(PreviewTarget));
+  pPreview->pd3dDevice = pd3dDevice;
+  pd3dDevice->AddRef();
+  pPreview->width = width;
+  pPreview->height = height;
+
+  HRESULT hr = CreateTargets(pPreview);
+  if (FAILED(hr)) {
+    ReleasePreviewTarget(pPreview);
+    return hr;
+  }
+  *ppPreview = pPreview;
+  return S_OK;
+}
+
+HRESULT BeginPreviewFrame(PreviewTarget *pPreview) {
+  if (!pPreview) return S_OK;
+  if (!pPreview->pTarget) return E_UNEXPECTED;
+  LPDIRECT3DDEVICE9 pd3dDevice = pPreview->pd3dDevice;
+  HRESULT hr;
+  if (!pPreview->pBackBuffer && FAILED(hr = pd3dDevice->GetRenderTarget(0, &pPreview->pBackBuffer))) {
+    return hr;
+  }
+
+  // The depth buffer is sized for the back buffer, and the output can be bigger, so it mustn't
+  // be bound with the target (we don't use it anyway)
+  if (!pPreview->pDepthStencil &&
+      FAILED(pd3dDevice->GetDepthStencilSurface(&pPreview->pDepthStencil))) {
+    pPreview->pDepthStencil = NULL;
+  }
+  pd3dDevice->SetDepthStencilSurface(NULL);
+  return pd3dDevice->SetRenderTarget(0, pPreview->pTarget);
+}
+
+/**
+ * Binds the depth buffer BeginPreviewFrame took off again, and lets go of it
+ */
+static void RestoreDepthStencil(PreviewTarget *pPreview) {
+  if (!pPreview->pDepthStencil) return;
+  pPreview->pd3dDevice->SetDepthStencilSurface(pPreview->pDepthStencil);
+  pPreview->pDepthStencil->Release();
+  pPreview->pDepthStencil = NULL;
+}
+
+HRESULT EndPreviewFrame(PreviewTarget *pPreview) {
+  if (!pPreview) return S_OK;
+  LPDIRECT3DSURFACE9 pBackBuffer = pPreview->pBackBuffer;
+  if (!pBackBuffer) return E_UNEXPECTED;
+  pPreview->pBackBuffer = NULL;
+
+  // Black bars where the output doesn't reach, then one filtered copy on the GPU
+  LPDIRECT3DDEVICE9 pd3dDevice = pPreview->pd3dDevice;
+  HRESULT hr = pd3dDevice->SetRenderTarget(0, pBackBuffer);
+  RestoreDepthStencil(pPreview);
+  if (SUCCEEDED(hr)) hr = pd3dDevice->Clear(0, NULL, D3DCLEAR_TARGET, D3DCOLOR_XRGB(0,0,0), 1.0f, 0);
+  if (SUCCEEDED(hr)) {
+    hr = pd3dDevice->StretchRect(pPreview->pTarget, NULL, pBackBuffer, &pPreview->rect,
+                                 D3DTEXF_LINEAR);
+  }
+  pBackBuffer->Release();
+  return hr;
+}
+
+void PreviewToOutput(UINT width, UINT height, UINT target_width, UINT target_height,
+                     POINT *pPoint) {
+  RECT rect;
+  GetPreviewRect(width, height, target_width, target_height, &rect);
+  LONG x = pPoint->x < rect.left ? rect.left : (pPoint->x > rect.right ? rect.right : pPoint->x),
+       y = pPoint->y < rect.top ? rect.top : (pPoint->y > rect.bottom ? rect.bottom : pPoint->y);
+  pPoint->x = (LONG)((LONGLONG)(x - rect.left) * width / (rect.right - rect.left));
+  pPoint->y = (LONG)((LONGLONG)(y - rect.top) * height / (rect.bottom - rect.top));
+}
+
+void PreviewDeviceLost(PreviewTarget *pPreview) {
+  if (!pPreview) return;
+  RestoreDepthStencil(pPreview);
+  if (pPreview->pBackBuffer) {
+    pPreview->pBackBuffer->Release();
+    pPreview->pBackBuffer = NULL;
+  }
+  if (pPreview->pTarget) {
+    pPreview->pTarget->Release();
+    pPreview->pTarget = NULL;
+  }
+}
+
+HRESULT PreviewDeviceReset(PreviewTarget *pPreview) {
+  if (!pPreview || pPreview->pTarget) return S_OK;
+  return CreateTargets(pPreview);
+}
+
+void ReleasePreviewTarget(PreviewTarget *pPreview) {
+  if (!pPreview) return;
+  PreviewDeviceLost(pPreview);
+  pPreview->pd3dDevice->Release();
+  delete pPreview;
+}
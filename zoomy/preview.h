@@ -0,0 +1,62 @@
+//--------------------------------------------------------------------------------------------------
+//
+// The live preview of an output resolution that isn't the display's (-output).
+//
+// Frames are drawn once, at the output resolution, into an offscreen render target, and that is
+// scaled onto the back buffer on the GPU, letterboxed to keep its shape, so a 4K zoom can be set
+// up on a 1440p monitor (or a vertical one on a landscape monitor) without touching the desktop
+// mode.  Exports and shared frames are drawn at the output resolution too, into targets of their
+// own, so what's recorded matches what was previewed exactly.
+//
+// With -present shared, the shared targets already are offscreen, and EndSharedFrame does the
+// same letterboxing; no preview target is made.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <d3d9.h>
+
+struct PreviewTarget;
+
+// Everything but CreatePreviewTarget does nothing when passed NULL, so the loops can call them
+// whether or not the output is a different size from the display.
+
+/**
+ * Makes the offscreen target, width x height
+ */
+HRESULT CreatePreviewTarget(LPDIRECT3DDEVICE9 pd3dDevice, UINT width, UINT height,
+                            PreviewTarget **ppPreview);
+
+/**
+ * Points the device at the offscreen target.  Call before BeginScene.
+ */
+HRESULT BeginPreviewFrame(PreviewTarget *pPreview);
+
+/**
+ * Scales the frame onto the back buffer and points the device back at it.  Call after EndScene.
+ */
+HRESULT EndPreviewFrame(PreviewTarget *pPreview);
+
+/**
+ * Where a width x height frame goes on a target_width x target_height back buffer: as big as
+ * fits without changing its shape, in the middle
+ */
+void GetPreviewRect(UINT width, UINT height, UINT target_width, UINT target_height, RECT *pRect);
+
+/**
+ * Turns a point on the back buffer into the same point on the frame GetPreviewRect put there,
+ * for picking.  Points outside the frame come back clamped to its edges.
+ */
+void PreviewToOutput(UINT width, UINT height, UINT target_width, UINT target_height,
+                     POINT *pPoint);
+
+/**
+ * Frees what a device reset would, before the reset, and makes it again afterwards
+ */
+void PreviewDeviceLost(PreviewTarget *pPreview);
+HRESULT PreviewDeviceReset(PreviewTarget *pPreview);
+
+/**
+ * Frees the target.  Safe to call with NULL.
+ */
+void ReleasePreviewTarget(PreviewTarget *pPreview);
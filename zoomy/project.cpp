@@ -0,0 +1,278 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Project files.  See project.h for the format.
+//
+//--------------------------------------------------------------------------------------------------
+#include "project.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Projects are a handful of lines, so anything bigger than this is the wrong file
+#define PROJECT_MAX_FILE_BYTES (64 * 1024)
+
+/**
+ * Reads the next token of a line as a number.  Fails unless the whole token is one.
+ */
+static bool NextNumber(LPCSTR *pCursor, FLOAT *pValue) {
+  char token[64];
+  if (NULL == (*pCursor = NextToken(*pCursor, token, sizeof(token)))) return false;
+  char *end;
+  double value = strtod(token, &end);
+  if (end == token || *end) return false;
+  *pValue = (FLOAT)value;
+  return true;
+}
+
+/**
+ * Reads a box as left, top, right and bottom.  It has to have some area.
+ */
+static bool NextRect(LPCSTR *pCursor, ZoomRect *pRect) {
+  if (!NextNumber(pCursor, &pRect->left) || !NextNumber(pCursor, &pRect->top) ||
+      !NextNumber(pCursor, &pRect->right) || !NextNumber(pCursor, &pRect->bottom)) {
+    return false;
+  }
+  return pRect->right > pRect->left && pRect->bottom > pRect->top;
+}
+
+/**
+ * Fills in the setting one line of the file holds.  Returns false if the line is malformed.
+ */
+static bool ParseProjectLine(LPCSTR line, Project *pProject, bool *pHasStart, bool *pHasEnd) {
+  char name[16], extra[MAX_PATH];
+  LPCSTR cursor = NextToken(line, name, sizeof(name));
+  if (!cursor) return false;
+
+  if (0 == lstrcmpi(name, "image")) {
+    cursor = NextToken(cursor, pProject->imagePath, MAX_PATH);
+    return cursor && !NextToken(cursor, extra, sizeof(extra));
+  } else if (0 == lstrcmpi(name, "source")) {
+    char hex[32];
+    if (NULL == (cursor = NextToken(cursor, hex, sizeof(hex)))) return false;
+    char *end;
+    pProject->sourceHash = _strtoui64(hex, &end, 16);
+    return !*end && !NextToken(cursor, extra, sizeof(extra));
+  } else if (0 == lstrcmpi(name, "switches")) {
+    // The rest of the line, as it is, since it's parsed as a command line later
+    while (' ' == *cursor || '\t' == *cursor) ++cursor;
+    lstrcpyn(pProject->switches, cursor, PROJECT_MAX_SWITCHES);
+    return true;
+  } else if (0 == lstrcmpi(name, "start")) {
+    *pHasStart = true;
+    return NextRect(&cursor, &pProject->start) && !NextToken(cursor, extra, sizeof(extra));
+  } else if (0 == lstrcmpi(name, "end")) {
+    *pHasEnd = true;
+    return NextRect(&cursor, &pProject->end) && !NextToken(cursor, extra, sizeof(extra));
+  } else if (0 == lstrcmpi(name, "stop")) {
+    if (pProject->stopCount == CAMERA_MAX_KEYS - 2) return false;
+    return NextRect(&cursor, &pProject->stops[pProject->stopCount++]) &&
+           !NextToken(cursor, extra, sizeof(extra));
+  }
+  return false;
+}
+
+HRESULT ReadProject(LPCSTR path, Project *pProject, UINT *pErrorLine) {
+  ZeroMemory(pProject, sizeof(Project));
+  *pErrorLine = 0;
+
+  // Read the whole file in, with a terminator so the last line ends like the others
+  HANDLE hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                            FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (INVALID_HANDLE_VALUE == hFile) return HRESULT_FROM_WIN32(GetLastError());
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(hFile, &size)) {
+    HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+    CloseHandle(hFile);
+    return hr;
+  }
+  if (size.QuadPart > PROJECT_MAX_FILE_BYTES) {
+    CloseHandle(hFile);
+    return E_INVALIDARG;
+  }
+  DWORD bytes = (DWORD)size.QuadPart, bytesRead;
+  char *pText = new char[bytes + 1];
+  BOOL read = ReadFile(hFile, pText, bytes, &bytesRead, NULL);
+  HRESULT hr = read && bytesRead == bytes ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+  CloseHandle(hFile);
+  if (FAILED(hr)) {
+    delete[] pText;
+    return hr;
+  }
+  pText[bytes] = '\0';
+
+  bool hasStart = false, hasEnd = false;
+  char *pLine = pText;
+  for (UINT lineNumber = 1; pLine; ++lineNumber) {
+    // Cut the line off at its end, whichever kind of line ending the file uses
+    char *pNext = strchr(pLine, '\n');
+    if (pNext) *pNext++ = '\0';
+    char *pReturn = strchr(pLine, '\r');
+    if (pReturn) *pReturn = '\0';
+
+    // Skip blank lines and comments
+    char *pFirst = pLine;
+    while (' ' == *pFirst || '\t' == *pFirst) ++pFirst;
+    if (*pFirst && '#' != *pFirst && !ParseProjectLine(pFirst, pProject, &hasStart, &hasEnd)) {
+      *pErrorLine = lineNumber;
+      hr = E_INVALIDARG;
+      break;
+    }
+    pLine = pNext;
+  }
+  delete[] pText;
+
+  // Every project is of an image, and the boxes only mean anything together
+  if (SUCCEEDED(hr) && (!pProject->imagePath[0] || hasStart != hasEnd)) hr = E_INVALIDARG;
+  pProject->hasBoxes = hasStart && hasEnd;
+  return hr;
+}
+
+/**
+ * Writes value with up to three decimals, since wsprintf has no floating point
+ */
+static void FormatNumber(char *text, float value) {
+  LONGLONG thousandths = (LONGLONG)(value * 1000.0f + (value < 0.0f ? -0.5f : 0.5f));
+  LPCSTR sign = "";
+  if (thousandths < 0) {
+    sign = "-";
+    thousandths = -thousandths;
+  }
+  UINT whole = (UINT)(thousandths / 1000), fraction = (UINT)(thousandths % 1000);
+  if (0 == fraction) {
+    wsprintf(text, "%s%u", sign, whole);
+  } else {
+    // Leave off the zeros at the end
+    UINT digits = 3;
+    while (0 == fraction % 10) {
+      fraction /= 10;
+      --digits;
+    }
+    wsprintf(text, digits == 3 ? "%s%u.%03u" : digits == 2 ? "%s%u.%02u" : "%s%u.%u", sign, whole,
+             fraction);
+  }
+}
+
+/**
+ * Appends a line with a name and a box to text
+ */
+static void AppendBox(char *text, LPCSTR name, const ZoomRect &box) {
+  char left[32], top[32], right[32], bottom[32];
+  FormatNumber(left, box.left);
+  FormatNumber(top, box.top);
+  FormatNumber(right, box.right);
+  FormatNumber(bottom, box.bottom);
+  wsprintf(text + lstrlen(text), "%s %s %s %s %s\r\n", name, left, top, right, bottom);
+}
+
+HRESULT WriteProject(LPCSTR path, const Project *pProject) {
+  // Big enough for the longest paths and switches, and every box
+  char *pText = new char[2 * MAX_PATH + PROJECT_MAX_SWITCHES + CAMERA_MAX_KEYS * 160 + 256];
+  lstrcpy(pText, "# Zoomy project\r\n");
+  lstrcat(pText, "image \"");
+  lstrcat(pText, pProject->imagePath);
+  lstrcat(pText, "\"\r\n");
+  if (pProject->sourceHash) {
+    wsprintf(pText + lstrlen(pText), "source %08x%08x\r\n", (DWORD)(pProject->sourceHash >> 32),
+             (DWORD)pProject->sourceHash);
+  }
+  if (pProject->switches[0]) {
+    lstrcat(pText, "switches ");
+    lstrcat(pText, pProject->switches);
+    lstrcat(pText, "\r\n");
+  }
+  if (pProject->hasBoxes) {
+    AppendBox(pText, "start", pProject->start);
+    for (UINT i = 0; i < pProject->stopCount; ++i) AppendBox(pText, "stop", pProject->stops[i]);
+    AppendBox(pText, "end", pProject->end);
+  }
+
+  // Write it all somewhere else first, then put it in place in one go
+  char temporaryPath[MAX_PATH + 8];
+  HRESULT hr = S_OK;
+  if (lstrlen(path) + 5 > MAX_PATH) {
+    hr = HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+  } else {
+    lstrcpy(temporaryPath, path);
+    lstrcat(temporaryPath, ".new");
+    HANDLE hFile = CreateFile(temporaryPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == hFile) {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+    } else {
+      DWORD length = (DWORD)lstrlen(pText), written;
+      if (!WriteFile(hFile, pText, length, &written, NULL) || written != length) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+      }
+      CloseHandle(hFile);
+      if (SUCCEEDED(hr) &&
+          !MoveFileEx(temporaryPath, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+      }
+      if (FAILED(hr)) DeleteFile(temporaryPath);
+    }
+  }
+  delete[] pText;
+  return hr;
+}
+
+/**
+ * Appends " -name value" to switches, with the value quoted if it's a path
+ */
+static void AppendSwitch(char *switches, LPCSTR name, LPCSTR value, bool quoted) {
+  if (lstrlen(switches) + lstrlen(name) + lstrlen(value) + 6 >= PROJECT_MAX_SWITCHES) return;
+  lstrcat(switches, switches[0] ? " -" : "-");
+  lstrcat(switches, name);
+  lstrcat(switches, quoted ? " \"" : " ");
+  lstrcat(switches, value);
+  if (quoted) lstrcat(switches, "\"");
+}
+
+void GetProjectSwitches(const ZoomyOptions *pOptions, char *switches) {
+  static const LPCSTR modes[] = { "auto", "on", "off" };
+  switches[0] = '\0';
+  char value[64];
+
+  FormatNumber(value, pOptions->time);
+  AppendSwitch(switches, "time", value, false);
+  wsprintf(value, "%u", pOptions->exportFps);
+  AppendSwitch(switches, "fps", value, false);
+  if (pOptions->outputWidth) {
+    wsprintf(value, "%ux%u", pOptions->outputWidth, pOptions->outputHeight);
+    AppendSwitch(switches, "output", value, false);
+  }
+  if (pOptions->exportPath[0]) AppendSwitch(switches, "export", pOptions->exportPath, true);
+  if (1 != pOptions->exportSamples) {
+    if (0 == pOptions->exportSamples) {
+      lstrcpy(value, "auto");
+    } else {
+      wsprintf(value, "%u", pOptions->exportSamples);
+    }
+    AppendSwitch(switches, "samples", value, false);
+    FormatNumber(value, pOptions->shutter);
+    AppendSwitch(switches, "shutter", value, false);
+  }
+  AppendSwitch(switches, "codec", CODEC_HEVC == pOptions->codec ? "hevc" : "h264", false);
+  if (pOptions->bitrate) {
+    FormatNumber(value, pOptions->bitrate / 1000000.0f);
+    AppendSwitch(switches, "bitrate", value, false);
+  }
+  AppendSwitch(switches, "tiles", modes[pOptions->tiles], false);
+  AppendSwitch(switches, "compress", modes[pOptions->compress], false);
+  AppendSwitch(switches, "filter", FILTER_LANCZOS == pOptions->filter ? "lanczos" : "fixed",
+               false);
+  if (pOptions->cropMargin >= 0.0f) {
+    FormatNumber(value, pOptions->cropMargin);
+    AppendSwitch(switches, "crop", value, false);
+  }
+  if (pOptions->cacheDirectory[0]) {
+    AppendSwitch(switches, "cache", pOptions->cacheDirectory, true);
+  } else {
+    AppendSwitch(switches, "cache", "off", false);
+  }
+}
+
+HRESULT GetImageProjectPath(LPCSTR imagePath, char *projectPath) {
+  if (lstrlen(imagePath) + 6 >= MAX_PATH) return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+  lstrcpy(projectPath, imagePath);
+  lstrcat(projectPath, ".zoomy");
+  return S_OK;
+}
@@ -0,0 +1,68 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Project files, which keep a session's boxes and settings between runs.
+//
+// While a zoom is being set up, everything about it is saved to a project file as soon as it
+// changes: next to the image as "<image>.zoomy", or to the file -project names.  Opening the
+// same image again (or "zoomy.exe -project harbor.jpg.zoomy", with no file dialog at all) puts
+// every box back, and since the textures are in the texture cache by then, the picture comes up
+// without being decoded again.  A closed or crashed session loses nothing.
+//
+// A project is a text file split up into tokens the way batch files are, one setting per line:
+//
+//   # Zoomy project
+//   image "D:\shots\harbor.jpg"
+//   source 9f3ab7c201d4e855
+//   switches -time 30 -fps 60 -output 1920x1080 -export "D:\out\harbor.mp4" -cache "D:\cache"
+//   start 0 0 8000 4500
+//   stop 2000 1000 3000 1562.5
+//   end 3200 1800 4800 2700
+//
+// "source" is the image's hash from the texture cache (see texcache.h), so a project whose
+// image has changed since can say so.  "switches" are the command-line switches the session
+// was run with that shape its output; they apply again when the project is opened, though any
+// given on the command line then take precedence.  The boxes are in image pixels, and there
+// can be up to CAMERA_MAX_KEYS - 2 stops.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include "camera.h"
+#include "options.h"
+
+// Longest "switches" line a project can have
+#define PROJECT_MAX_SWITCHES 2048
+
+struct Project {
+  CHAR imagePath[MAX_PATH];
+  ULONGLONG sourceHash;             // The image's HashImageFile when saved, or 0 if unknown
+  CHAR switches[PROJECT_MAX_SWITCHES];
+  bool hasBoxes;                    // Whether start and end were set
+  ZoomRect start, end;
+  ZoomRect stops[CAMERA_MAX_KEYS - 2];
+  UINT stopCount;
+};
+
+/**
+ * Reads a project file.  If a line can't be understood, fails with E_INVALIDARG and sets
+ * *pErrorLine to its (1-based) line number; otherwise *pErrorLine is 0.
+ */
+HRESULT ReadProject(LPCSTR path, Project *pProject, UINT *pErrorLine);
+
+/**
+ * Writes a project file.  It's written to a temporary file first and moved over the old one,
+ * so a crash part way through never leaves a broken project behind.
+ */
+HRESULT WriteProject(LPCSTR path, const Project *pProject);
+
+/**
+ * Writes out the switches in pOptions that a project keeps, as they'd be typed on the command
+ * line
+ */
+void GetProjectSwitches(const ZoomyOptions *pOptions, char *switches);
+
+/**
+ * Where the project for an image goes when -project doesn't say: next to it, as
+ * "<image>.zoomy".  Fails if that would be too long a path.
+ */
+HRESULT GetImageProjectPath(LPCSTR imagePath, char *projectPath);
@@ -0,0 +1,281 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Tile pyramid builder.  See pyramid.h for the layout.
+//
+// Rows are pushed into level 0 as they come out of the decoder.  Each level keeps a band of the
+// last few rows it was given, as many as the memory budget allows; whenever the band fills up,
+// its rows are cut into the tiles they fall in and written straight to those tiles' places in
+// the file, so a tile is written a band's worth of rows at a time.  Every pair of rows a level
+// receives is also averaged down into one row of the next level, so the whole pyramid falls out
+// of a single pass over the source.
+//
+//--------------------------------------------------------------------------------------------------
+#include "pyramid.h"
+#include "decode.h"
+
+struct LevelBuilder {
+  UINT width, height, columns, rows;
+  BYTE *pBand;            // bandRows rows, each width * 4 bytes
+  UINT bandStart;         // The level row in the band's first row
+  UINT rowsReceived;
+};
+
+struct PyramidBuilder {
+  TilePyramid *pPyramid;
+  LevelBuilder levels[PYRAMID_MAX_LEVELS];
+  UINT bandRows;          // Rows in every level's band; always even
+  BYTE *pTile;            // Scratch space for assembling rows of one tile
+  HRESULT hr;             // First write error, if any
+};
+
+/**
+ * Returns the band row holding row y of a level
+ */
+static BYTE *BandRow(const LevelBuilder *pLevel, UINT y) {
+  return pLevel->pBand + (SIZE_T)(y - pLevel->bandStart) * pLevel->width * 4;
+}
+
+/**
+ * Writes pBytes at a byte offset in the tile file.  Positional I/O keeps readers on other
+ * threads from having to share a file pointer with us.
+ */
+static HRESULT WriteAt(HANDLE hFile, ULONGLONG offset, const BYTE *pBytes, DWORD size) {
+  OVERLAPPED overlapped;
+  ZeroMemory(&overlapped, sizeof(overlapped));
+  overlapped.Offset = (DWORD)offset;
+  overlapped.OffsetHigh = (DWORD)(offset >> 32);
+  DWORD written;
+  if (!WriteFile(hFile, pBytes, size, &written, &overlapped) || written != size) {
+    return HRESULT_FROM_WIN32(GetLastError());
+  }
+  return S_OK;
+}
+
+/**
+ * Writes the rows of a level's band into every tile they fall in.  Rows above the first and
+ * below the last of the level, for the gutter around the image and the unused part of the
+ * tiles on the bottom, repeat the edge row, so they go out with the band holding it.
+ */
+static void FlushBand(PyramidBuilder *pBuilder, UINT level) {
+  LevelBuilder *pLevel = &pBuilder->levels[level];
+  const INT width = (INT)pLevel->width, height = (INT)pLevel->height;
+  const INT b0 = (INT)pLevel->bandStart, b1 = (INT)pLevel->rowsReceived;
+  if (b1 <= b0) return;
+
+  // A row is in at most two rows of tiles, where their gutters overlap
+  INT firstTileRow = (b0 + TILE_GUTTER) / TILE_CONTENT_SIZE - 1;
+  if (firstTileRow < 0) firstTileRow = 0;
+  INT lastTileRow = (b1 - 1 + TILE_GUTTER) / TILE_CONTENT_SIZE;
+  if (lastTileRow >= (INT)pLevel->rows) lastTileRow = (INT)pLevel->rows - 1;
+
+  const UINT rowBytes = TILE_TEXTURE_SIZE * 4;
+  for (INT tileRow = firstTileRow; tileRow <= lastTileRow; ++tileRow) {
+    INT y0 = tileRow * TILE_CONTENT_SIZE - TILE_GUTTER;
+
+    // The tile rows whose texels come from this band
+    INT t0 = (0 == b0 && y0 < 0) ? 0 : b0 - y0, t1 = height == b1 ? TILE_TEXTURE_SIZE : b1 - y0;
+    if (t0 < 0) t0 = 0;
+    if (t1 > TILE_TEXTURE_SIZE) t1 = TILE_TEXTURE_SIZE;
+    if (t0 >= t1) continue;
+
+    for (UINT column = 0; column < pLevel->columns; ++column) {
+      INT x0 = (INT)(column * TILE_CONTENT_SIZE) - TILE_GUTTER;
+
+      // Work out which texels of the tile actually come from the level.  The rest are edge
+      // texels repeated outward, for the gutter around the image and the unused part of the
+      // tiles on the right.
+      INT first = x0 < 0 ? -x0 : 0;
+      INT last = width - x0 < TILE_TEXTURE_SIZE ? width - x0 : TILE_TEXTURE_SIZE;
+
+      for (INT t = t0; t < t1; ++t) {
+        INT y = y0 + t;
+        if (y < 0) y = 0;
+        if (y >= height) y = height - 1;
+        const DWORD *pSource = (const DWORD *)BandRow(pLevel, (UINT)y);
+        DWORD *pDest = (DWORD *)(pBuilder->pTile + (t - t0) * rowBytes);
+        for (INT x = 0; x < first; ++x) pDest[x] = pSource[0];
+        CopyMemory(pDest + first, pSource + x0 + first, (last - first) * 4);
+        for (INT x = last; x < TILE_TEXTURE_SIZE; ++x) pDest[x] = pSource[width - 1];
+      }
+
+      if (SUCCEEDED(pBuilder->hr)) {
+        TilePyramid *pPyramid = pBuilder->pPyramid;
+        ULONGLONG tile = pPyramid->firstTile[level] + tileRow * pLevel->columns + column;
+        pBuilder->hr = WriteAt(pPyramid->hFile, tile * TILE_BYTES + t0 * rowBytes,
+                               pBuilder->pTile, (t1 - t0) * rowBytes);
+      }
+    }
+  }
+}
+
+/**
+ * Takes in the level's next row, already in place in its band.  Passes every second row on to
+ * the next level down in size, and writes the band out once it's full or the level has ended.
+ */
+static void ReceiveRow(PyramidBuilder *pBuilder, UINT level) {
+  LevelBuilder *pLevel = &pBuilder->levels[level];
+  UINT y = pLevel->rowsReceived++;
+  bool lastRow = (y == pLevel->height - 1);
+
+  // Box filter each pair of rows down into the next level.  An odd last row is paired with
+  // itself, and so is an odd last column.  Bands start on even rows, so both rows of a pair
+  // are always in it.
+  if (level + 1 < pBuilder->pPyramid->levelCount && ((y & 1) || lastRow)) {
+    LevelBuilder *pNext = &pBuilder->levels[level + 1];
+    HalveRow(BandRow(pLevel, (y & 1) ? y - 1 : y), BandRow(pLevel, y), pLevel->width,
+             BandRow(pNext, pNext->rowsReceived), pNext->width);
+    ReceiveRow(pBuilder, level + 1);
+  }
+
+  if (lastRow || pLevel->rowsReceived - pLevel->bandStart == pBuilder->bandRows) {
+    FlushBand(pBuilder, level);
+    pLevel->bandStart = pLevel->rowsReceived;
+  }
+}
+
+/**
+ * Works out the size of every level and where its tiles go in the file
+ */
+static void LayOutPyramid(TilePyramid *pPyramid, UINT width, UINT height) {
+  UINT tiles = 0;
+  UINT level = 0;
+  for (;;) {
+    pPyramid->width[level] = width;
+    pPyramid->height[level] = height;
+    pPyramid->columns[level] = (width + TILE_CONTENT_SIZE - 1) / TILE_CONTENT_SIZE;
+    pPyramid->rows[level] = (height + TILE_CONTENT_SIZE - 1) / TILE_CONTENT_SIZE;
+    pPyramid->firstTile[level] = tiles;
+    tiles += pPyramid->columns[level] * pPyramid->rows[level];
+    ++level;
+    if ((width <= TILE_CONTENT_SIZE && height <= TILE_CONTENT_SIZE) || level == PYRAMID_MAX_LEVELS) {
+      break;
+    }
+    width = (width + 1) / 2;
+    height = (height + 1) / 2;
+  }
+  pPyramid->levelCount = level;
+  pPyramid->tileCount = tiles;
+}
+
+/**
+ * Opens a temporary file for the tiles that is deleted as soon as we close it
+ */
+static HANDLE CreateTileFile() {
+  char directory[MAX_PATH], path[MAX_PATH];
+  if (!GetTempPath(MAX_PATH, directory) || !GetTempFileName(directory, "zmy", 0, path)) {
+    return INVALID_HANDLE_VALUE;
+  }
+  return CreateFile(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                    CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+}
+
+HRESULT BuildTilePyramid(LPCSTR imagePath, SIZE_T budget, DECODEPROGRESSPROC pProgress,
+                         void *pContext, TilePyramid **ppPyramid) {
+  *ppPyramid = NULL;
+
+  IWICImagingFactory *pFactory;
+  IWICBitmapSource *pSource;
+  HRESULT hr = OpenImageSource(imagePath, &pFactory, &pSource);
+  if (FAILED(hr)) return hr;
+
+  UINT width, height;
+  if (FAILED(hr = pSource->GetSize(&width, &height)) || 0 == width || 0 == height) {
+    pSource->Release();
+    pFactory->Release();
+    return FAILED(hr) ? hr : E_FAIL;
+  }
+
+  TilePyramid *pPyramid = new TilePyramid;
+  ZeroMemory(pPyramid, sizeof(TilePyramid));
+  LayOutPyramid(pPyramid, width, height);
+  pPyramid->hFile = CreateTileFile();
+  if (INVALID_HANDLE_VALUE == pPyramid->hFile) hr = HRESULT_FROM_WIN32(GetLastError());
+
+  // Make the bands as tall as the budget allows.  Taller bands mean fewer, bigger writes.
+  if (0 == budget) budget = PYRAMID_DEFAULT_BUDGET;
+  ULONGLONG bytesPerRow = 0;
+  for (UINT level = 0; level < pPyramid->levelCount; ++level) {
+    bytesPerRow += (ULONGLONG)pPyramid->width[level] * 4;
+  }
+  ULONGLONG bandRows = budget > TILE_BYTES ? (budget - TILE_BYTES) / bytesPerRow : 0;
+  if (bandRows > TILE_TEXTURE_SIZE) bandRows = TILE_TEXTURE_SIZE;
+  if (bandRows < 2) bandRows = 2;
+
+  // Set up a band for every level
+  PyramidBuilder builder;
+  ZeroMemory(&builder, sizeof(builder));
+  builder.pPyramid = pPyramid;
+  builder.bandRows = (UINT)bandRows & ~1u;
+  builder.pTile = new BYTE[TILE_BYTES];
+  for (UINT level = 0; level < pPyramid->levelCount; ++level) {
+    LevelBuilder *pLevel = &builder.levels[level];
+    pLevel->width = pPyramid->width[level];
+    pLevel->height = pPyramid->height[level];
+    pLevel->columns = pPyramid->columns[level];
+    pLevel->rows = pPyramid->rows[level];
+    pLevel->pBand = new BYTE[(SIZE_T)builder.bandRows * pLevel->width * 4];
+  }
+
+  // Decode the source a band at a time, straight into level 0's band, and feed it through
+  UINT stride = width * 4;
+  for (UINT y = 0; SUCCEEDED(hr) && y < height; y += builder.bandRows) {
+    UINT bandRows = height - y < builder.bandRows ? height - y : builder.bandRows;
+    WICRect band = { 0, (INT)y, (INT)width, (INT)bandRows };
+    if (FAILED(hr = pSource->CopyPixels(&band, stride, stride * bandRows,
+                                        builder.levels[0].pBand))) {
+      break;
+    }
+    for (UINT row = 0; row < bandRows; ++row) ReceiveRow(&builder, 0);
+    hr = builder.hr;
+
+    if (SUCCEEDED(hr) && pProgress && !pProgress((float)(y + bandRows) / height, pContext)) {
+      hr = E_ABORT;
+    }
+  }
+
+  // Clean up the builder
+  for (UINT level = 0; level < pPyramid->levelCount; ++level) delete[] builder.levels[level].pBand;
+  delete[] builder.pTile;
+  pSource->Release();
+  pFactory->Release();
+
+  if (FAILED(hr)) {
+    ReleaseTilePyramid(pPyramid);
+    return hr;
+  }
+
+  *ppPyramid = pPyramid;
+  return S_OK;
+}
+
+HRESULT ReadPyramidTile(const TilePyramid *pPyramid, UINT level, UINT column, UINT row,
+                        BYTE *pDest, INT pitch) {
+  ULONGLONG tile = pPyramid->firstTile[level] + row * pPyramid->columns[level] + column;
+  ULONGLONG offset = tile * TILE_BYTES;
+
+  // Read straight into the destination when the rows are packed, otherwise row by row
+  const UINT rowBytes = TILE_TEXTURE_SIZE * 4;
+  UINT reads = pitch == (INT)rowBytes ? 1 : TILE_TEXTURE_SIZE;
+  DWORD readSize = pitch == (INT)rowBytes ? TILE_BYTES : rowBytes;
+  for (UINT i = 0; i < reads; ++i) {
+    OVERLAPPED overlapped;
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD bytesRead;
+    if (!ReadFile(pPyramid->hFile, pDest + i * pitch, readSize, &bytesRead, &overlapped) ||
+        bytesRead != readSize) {
+      return HRESULT_FROM_WIN32(GetLastError());
+    }
+    offset += readSize;
+  }
+
+  // Success
+  return S_OK;
+}
+
+void ReleaseTilePyramid(TilePyramid *pPyramid) {
+  if (!pPyramid) return;
+  if (pPyramid->hFile && INVALID_HANDLE_VALUE != pPyramid->hFile) CloseHandle(pPyramid->hFile);
+  delete pPyramid;
+}
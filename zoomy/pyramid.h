@@ -0,0 +1,60 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Tile pyramids for images that are too big to load as a single texture.
+//
+// The source image is decoded exactly once, top to bottom, a band of rows at a time.  Each level
+// of the pyramid is half the size of the one below it, and each is cut into tiles of
+// TILE_TEXTURE_SIZE x TILE_TEXTURE_SIZE texels: TILE_CONTENT_SIZE texels of image plus a
+// TILE_GUTTER texel border copied from the neighbouring tiles, so bilinear filtering doesn't
+// show seams where tiles meet.  The tiles are written to a temporary file as each band comes
+// in, so building takes a fixed memory budget, whatever the size of the image; only the
+// height of the bands depends on its width.
+//
+// Levels are numbered from 0 (full resolution) up to levelCount - 1, which always fits in a
+// single tile.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include "decode.h"
+
+#define TILE_TEXTURE_SIZE   512
+#define TILE_GUTTER         1
+#define TILE_CONTENT_SIZE   (TILE_TEXTURE_SIZE - 2 * TILE_GUTTER)
+#define TILE_BYTES          (TILE_TEXTURE_SIZE * TILE_TEXTURE_SIZE * 4)
+
+// Enough for TILE_CONTENT_SIZE << 15, which is well past anything WIC will decode
+#define PYRAMID_MAX_LEVELS  16
+
+struct TilePyramid {
+  UINT levelCount;
+  UINT width[PYRAMID_MAX_LEVELS], height[PYRAMID_MAX_LEVELS];    // Level size in texels
+  UINT columns[PYRAMID_MAX_LEVELS], rows[PYRAMID_MAX_LEVELS];    // Level size in tiles
+  UINT firstTile[PYRAMID_MAX_LEVELS];                            // Index of the level's tile 0
+  UINT tileCount;
+  HANDLE hFile;                                                  // Where the tiles live
+};
+
+// Bytes of bands a build holds when it isn't given a budget
+#define PYRAMID_DEFAULT_BUDGET (64 * 1024 * 1024)
+
+/**
+ * Decodes the image through WIC and builds its tile pyramid, holding no more than budget bytes
+ * (0 for PYRAMID_DEFAULT_BUDGET) of decoded rows at once.  Images too wide for even two rows of
+ * every level to fit go over it.  pProgress may be NULL.  The caller must have initialized COM
+ * on this thread.
+ */
+HRESULT BuildTilePyramid(LPCSTR imagePath, SIZE_T budget, DECODEPROGRESSPROC pProgress,
+                         void *pContext, TilePyramid **ppPyramid);
+
+/**
+ * Reads one tile (TILE_TEXTURE_SIZE rows of 32-bit BGRA) into pDest.  Safe to call from several
+ * threads at once.
+ */
+HRESULT ReadPyramidTile(const TilePyramid *pPyramid, UINT level, UINT column, UINT row,
+                        BYTE *pDest, INT pitch);
+
+/**
+ * Closes (and so deletes) the tile file.  Safe to call with NULL.
+ */
+void ReleaseTilePyramid(TilePyramid *pPyramid);
@@ -0,0 +1,258 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Parallel image scaling.  See resample.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "resample.h"
+#include <emmintrin.h>
+#include <math.h>
+
+// Lobes of the Lanczos window on each side of its middle
+#define LANCZOS_LOBES 3
+
+// Weights are fixed point with this many bits of fraction, and rows filtered across keep this
+// many bits below the 8 of each channel, for the filter down to round off at the end
+#define WEIGHT_BITS 14
+#define ROW_BITS    6
+
+/**
+ * Which source pixels (or rows) each output pixel (or row) is made from, and how much each one
+ * counts for.  Every output has the same number of taps, some of them weighted 0, so the passes
+ * don't need to look at where each one ends.
+ */
+struct FilterTaps {
+  UINT taps;                    // Per output
+  UINT *pFirst;                 // The first source pixel of each output
+  SHORT *pWeights;              // taps for each output, adding up to 1 << WEIGHT_BITS
+};
+
+static double Lanczos(double x) {
+  if (x < 0.0) x = -x;
+  if (x < 1e-9) return 1.0;
+  if (x >= LANCZOS_LOBES) return 0.0;
+  double pix = 3.14159265358979323846 * x;
+  return LANCZOS_LOBES * sin(pix) * sin(pix / LANCZOS_LOBES) / (pix * pix);
+}
+
+/**
+ * Works out the taps for scaling sourceSize pixels to size
+ */
+static void BuildTaps(UINT sourceSize, UINT size, FilterTaps *pTaps) {
+  double ratio = (double)sourceSize / size, stretch = ratio > 1.0 ? ratio : 1.0;
+  double radius = LANCZOS_LOBES * stretch;
+  UINT taps = (UINT)ceil(radius * 2.0) + 1;
+  if (taps > sourceSize) taps = sourceSize;
+  pTaps->taps = taps;
+  pTaps->pFirst = new UINT[size];
+  pTaps->pWeights = new SHORT[(SIZE_T)size * taps];
+  double *pExact = new double[taps];
+
+  for (UINT i = 0; i < size; ++i) {
+    // Every source pixel inside the window, which is placed so all of them are among the taps
+    double middle = (i + 0.5) * ratio - 0.5;
+    INT left = (INT)floor(middle - radius) + 1, right = (INT)ceil(middle + radius) - 1;
+    if (left < 0) left = 0;
+    if (right > (INT)sourceSize - 1) right = (INT)sourceSize - 1;
+    UINT first = (UINT)left + taps > sourceSize ? sourceSize - taps : (UINT)left;
+    double total = 0.0;
+    for (UINT t = 0; t < taps; ++t) {
+      INT source = (INT)(first + t);
+      pExact[t] = source >= left && source <= right ? Lanczos((source - middle) / stretch) : 0.0;
+      total += pExact[t];
+    }
+
+    // Rounding leaves the sum a little off, which goes on the biggest weight
+    SHORT *pWeights = pTaps->pWeights + (SIZE_T)i * taps;
+    INT sum = 0;
+    UINT biggest = 0;
+    for (UINT t = 0; t < taps; ++t) {
+      pWeights[t] = (SHORT)floor(pExact[t] / total * (1 << WEIGHT_BITS) + 0.5);
+      sum += pWeights[t];
+      if (pWeights[t] > pWeights[biggest]) biggest = t;
+    }
+    pWeights[biggest] = (SHORT)(pWeights[biggest] + (1 << WEIGHT_BITS) - sum);
+    pTaps->pFirst[i] = first;
+  }
+  delete[] pExact;
+}
+
+static void FreeTaps(FilterTaps *pTaps) {
+  delete[] pTaps->pFirst;
+  delete[] pTaps->pWeights;
+  ZeroMemory(pTaps, sizeof(FilterTaps));
+}
+
+/**
+ * Two 16-bit weights side by side, as _mm_madd_epi16 pairs them with two interleaved values
+ */
+static __m128i WeightPair(SHORT first, SHORT second) {
+  return _mm_set1_epi32((INT)(((UINT)(WORD)second << 16) | (WORD)first));
+}
+
+/**
+ * One scaling, and the band of it under way
+ */
+struct ResampleBatch {
+  const FilterTaps *pAcross, *pDown;
+  UINT sourceWidth, width;
+  bool sse2;
+  const BYTE *pDecoded;         // Rows of the source from decodedFirst on, tightly packed
+  UINT decodedFirst;
+  SHORT *pRing;                 // Source row n filtered across is row n % ringRows of this
+  UINT ringRows;
+  BYTE *pOut;
+  INT pitch;
+  UINT outFirst;                // The first output row of the band
+};
+
+/**
+ * Filters one decoded source row across into the ring
+ */
+static void FilterAcross(UINT index, void *pContext) {
+  const ResampleBatch *pBatch = (const ResampleBatch *)pContext;
+  const FilterTaps *pTaps = pBatch->pAcross;
+  UINT row = pBatch->decodedFirst + index, taps = pTaps->taps;
+  const BYTE *pIn = pBatch->pDecoded + (SIZE_T)index * pBatch->sourceWidth * 4;
+  SHORT *pOut = pBatch->pRing + (SIZE_T)(row % pBatch->ringRows) * pBatch->width * 4;
+  const INT shift = WEIGHT_BITS - ROW_BITS;
+
+  for (UINT x = 0; x < pBatch->width; ++x) {
+    const BYTE *pPixels = pIn + (SIZE_T)pTaps->pFirst[x] * 4;
+    const SHORT *pWeights = pTaps->pWeights + (SIZE_T)x * taps;
+    if (pBatch->sse2) {
+      // Two pixels at a time, their channels interleaved so each multiply-add does both
+      __m128i zero = _mm_setzero_si128(), sum = zero;
+      for (UINT t = 0; t < taps; t += 2) {
+        bool pair = t + 1 < taps;
+        __m128i a = _mm_cvtsi32_si128(*(const INT *)(pPixels + t * 4)),
+                b = pair ? _mm_cvtsi32_si128(*(const INT *)(pPixels + t * 4 + 4)) : a;
+        __m128i both = _mm_unpacklo_epi8(_mm_unpacklo_epi8(a, b), zero);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(both, WeightPair(pWeights[t],
+                                                                 pair ? pWeights[t + 1] : 0)));
+      }
+      sum = _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(1 << (shift - 1))), shift);
+      _mm_storel_epi64((__m128i *)(pOut + x * 4), _mm_packs_epi32(sum, sum));
+    } else {
+      INT sums[4] = { 0, 0, 0, 0 };
+      for (UINT t = 0; t < taps; ++t) {
+        for (UINT c = 0; c < 4; ++c) sums[c] += pWeights[t] * pPixels[t * 4 + c];
+      }
+      for (UINT c = 0; c < 4; ++c) {
+        pOut[x * 4 + c] = (SHORT)((sums[c] + (1 << (shift - 1))) >> shift);
+      }
+    }
+  }
+}
+
+/**
+ * Filters one output row down from the ring
+ */
+static void FilterDown(UINT index, void *pContext) {
+  const ResampleBatch *pBatch = (const ResampleBatch *)pContext;
+  const FilterTaps *pTaps = pBatch->pDown;
+  UINT y = pBatch->outFirst + index, taps = pTaps->taps, values = pBatch->width * 4;
+  const SHORT *pWeights = pTaps->pWeights + (SIZE_T)y * taps;
+  BYTE *pOut = pBatch->pOut + (SIZE_T)y * pBatch->pitch;
+  const INT shift = WEIGHT_BITS + ROW_BITS;
+
+  // The rows this one is made from, wherever they are in the ring
+  const SHORT *rows[256];
+  const SHORT **pRows = taps <= 256 ? rows : new const SHORT *[taps];
+  for (UINT t = 0; t < taps; ++t) {
+    UINT row = (pTaps->pFirst[y] + t) % pBatch->ringRows;
+    pRows[t] = pBatch->pRing + (SIZE_T)row * values;
+  }
+
+  UINT i = 0;
+  if (pBatch->sse2) {
+    // Two pixels at a time, each pair of rows interleaved so one multiply-add does both
+    const __m128i half = _mm_set1_epi32(1 << (shift - 1));
+    for (; i + 8 <= values; i += 8) {
+      __m128i low = _mm_setzero_si128(), high = low;
+      for (UINT t = 0; t < taps; t += 2) {
+        bool pair = t + 1 < taps;
+        __m128i a = _mm_loadu_si128((const __m128i *)(pRows[t] + i)),
+                b = pair ? _mm_loadu_si128((const __m128i *)(pRows[t + 1] + i)) : a;
+        __m128i weights = WeightPair(pWeights[t], pair ? pWeights[t + 1] : 0);
+        low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weights));
+        high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weights));
+      }
+      low = _mm_srai_epi32(_mm_add_epi32(low, half), shift);
+      high = _mm_srai_epi32(_mm_add_epi32(high, half), shift);
+      __m128i words = _mm_packs_epi32(low, high);
+      _mm_storel_epi64((__m128i *)(pOut + i), _mm_packus_epi16(words, words));
+    }
+  }
+  for (; i < values; ++i) {
+    INT sum = 0;
+    for (UINT t = 0; t < taps; ++t) sum += pWeights[t] * pRows[t][i];
+    sum = (sum + (1 << (shift - 1))) >> shift;
+    pOut[i] = (BYTE)(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
+  }
+  if (pRows != rows) delete[] pRows;
+}
+
+HRESULT ResampleImage(IWICBitmapSource *pSource, WorkQueue *pQueue, UINT width, UINT height,
+                      BYTE *pOut, INT pitch, DECODEPROGRESSPROC pProgress, void *pContext) {
+  UINT sourceWidth = 0, sourceHeight = 0;
+  HRESULT hr = pSource->GetSize(&sourceWidth, &sourceHeight);
+  if (FAILED(hr)) return hr;
+  if (0 == sourceWidth || 0 == sourceHeight || 0 == width || 0 == height) return E_INVALIDARG;
+
+  FilterTaps across, down;
+  BuildTaps(sourceWidth, width, &across);
+  BuildTaps(sourceHeight, height, &down);
+
+  // Enough output rows a band to bring in about RESAMPLE_BAND_ROWS source rows, and a ring that
+  // holds every source row any one band needs
+  UINT bandRows = (UINT)((ULONGLONG)RESAMPLE_BAND_ROWS * height / sourceHeight);
+  if (bandRows < 1) bandRows = 1;
+  UINT ringRows = 0;
+  for (UINT y0 = 0; y0 < height; y0 += bandRows) {
+    UINT y1 = height - y0 < bandRows ? height : y0 + bandRows;
+    UINT span = down.pFirst[y1 - 1] + down.taps - down.pFirst[y0];
+    if (span > ringRows) ringRows = span;
+  }
+
+  ResampleBatch batch;
+  ZeroMemory(&batch, sizeof(batch));
+  batch.pAcross = &across;
+  batch.pDown = &down;
+  batch.sourceWidth = sourceWidth;
+  batch.width = width;
+  batch.sse2 = IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) != FALSE;
+  batch.ringRows = ringRows;
+  batch.pOut = pOut;
+  batch.pitch = pitch;
+  BYTE *pDecoded = (BYTE *)VirtualAlloc(NULL, (SIZE_T)ringRows * sourceWidth * 4,
+                                        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  batch.pRing = (SHORT *)VirtualAlloc(NULL, (SIZE_T)ringRows * width * 4 * sizeof(SHORT),
+                                      MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  batch.pDecoded = pDecoded;
+  if (!pDecoded || !batch.pRing) hr = E_OUTOFMEMORY;
+
+  // Source rows before `filtered` are already across
+  UINT filtered = 0;
+  for (UINT y0 = 0; SUCCEEDED(hr) && y0 < height; y0 += bandRows) {
+    UINT y1 = height - y0 < bandRows ? height : y0 + bandRows;
+    UINT from = down.pFirst[y0] > filtered ? down.pFirst[y0] : filtered,
+         to = down.pFirst[y1 - 1] + down.taps;
+    if (from < to) {
+      WICRect rect = { 0, (INT)from, (INT)sourceWidth, (INT)(to - from) };
+      hr = pSource->CopyPixels(&rect, sourceWidth * 4, sourceWidth * 4 * (to - from), pDecoded);
+      if (FAILED(hr)) break;
+      batch.decodedFirst = from;
+      ParallelFor(pQueue, to - from, FilterAcross, &batch);
+      filtered = to;
+    }
+    batch.outFirst = y0;
+    ParallelFor(pQueue, y1 - y0, FilterDown, &batch);
+    if (pProgress && !pProgress((float)y1 / height, pContext)) hr = E_ABORT;
+  }
+
+  if (pDecoded) VirtualFree(pDecoded, 0, MEM_RELEASE);
+  if (batch.pRing) VirtualFree(batch.pRing, 0, MEM_RELEASE);
+  FreeTaps(&across);
+  FreeTaps(&down);
+  return hr;
+}
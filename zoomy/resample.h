@@ -0,0 +1,30 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Image scaling spread across the work queue, for level 0 of textures that aren't the size of
+// the image: crops loaded at less than full detail, images shrunk to the largest texture the GPU
+// has, and powers of two on GPUs that need them.
+//
+// The filter is a Lanczos window three lobes wide (stretched to cover every source pixel when
+// shrinking), applied across and then down.  Rows come out of the source a band at a time, in
+// order, as decoders want.  Each band's rows are filtered across on every worker at once into a
+// ring of 16-bit rows, and the output rows that band finishes are then filtered down from the
+// ring, again on every worker, straight into the destination.  Both passes use SSE2 where the
+// CPU has it, in fixed point.  Decoding the source is the one part that stays on one thread.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <wincodec.h>
+#include "decode.h"
+#include "workqueue.h"
+
+// Source rows each band brings in, roughly
+#define RESAMPLE_BAND_ROWS 128
+
+/**
+ * Scales the whole of pSource, which must be 32-bit BGRA, to width x height into pOut, whose
+ * rows are pitch bytes apart.  pProgress (which may be NULL) is told how far along it is, from
+ * 0 to 1, after every band, and can cancel it.
+ */
+HRESULT ResampleImage(IWICBitmapSource *pSource, WorkQueue *pQueue, UINT width, UINT height,
+                      BYTE *pOut, INT pitch, DECODEPROGRESSPROC pProgress, void *pContext);
@@ -0,0 +1,131 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Segmented batch renders.  See segment.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "segment.h"
+#include "video.h"
+#include <string.h>
+
+UINT CountZoomFrames(double seconds, UINT fps) {
+  return (UINT)(seconds * fps + 0.5) + 1;
+}
+
+void GetSegmentFrames(UINT frames, UINT segment, UINT segments, UINT *pFirst, UINT *pEnd) {
+  *pFirst = (UINT)((ULONGLONG)frames * (segment - 1) / segments);
+  *pEnd = (UINT)((ULONGLONG)frames * segment / segments);
+}
+
+HRESULT GetSegmentOutputPath(LPCSTR outputPath, UINT segment, UINT segments, char *segmentPath) {
+  if (!IsVideoPath(outputPath)) {
+    lstrcpyn(segmentPath, outputPath, MAX_PATH);
+    return S_OK;
+  }
+
+  // "clip.mp4" becomes "clip.part3of8.mp4"
+  LPCSTR extension = strrchr(outputPath, '.');
+  size_t stem = (size_t)(extension - outputPath);
+  char suffix[32];
+  wsprintf(suffix, ".part%uof%u%s", segment, segments, extension);
+  if (stem + lstrlen(suffix) >= MAX_PATH) return E_INVALIDARG;
+  CopyMemory(segmentPath, outputPath, stem);
+  lstrcpy(segmentPath + stem, suffix);
+  return S_OK;
+}
+
+UINT JoinSegments(const BatchJob *pJobs, UINT jobCount, UINT segments, UINT fps) {
+  char parts[SEGMENT_MAX][MAX_PATH];
+  LPCSTR pParts[SEGMENT_MAX];
+  UINT failed = 0;
+  for (UINT job = 0; job < jobCount; ++job) {
+    const BatchJob *pJob = &pJobs[job];
+    if (!IsVideoPath(pJob->outputPath)) continue;
+
+    // The job's length, added up the way the camera track adds it up
+    double seconds = 0.0;
+    for (UINT key = 0; key + 1 < pJob->keyCount; ++key) seconds += pJob->keys[key].seconds;
+    UINT frames = CountZoomFrames(seconds, fps), count = 0;
+
+    HRESULT hr = S_OK;
+    for (UINT i = 0; SUCCEEDED(hr) && i < segments; ++i) {
+      UINT first, end;
+      GetSegmentFrames(frames, i + 1, segments, &first, &end);
+      if (first == end) continue;
+      hr = GetSegmentOutputPath(pJob->outputPath, i + 1, segments, parts[count]);
+      pParts[count] = parts[count];
+      ++count;
+    }
+    if (SUCCEEDED(hr)) hr = ConcatenateVideos(pParts, count, pJob->outputPath);
+    if (FAILED(hr)) {
+      BatchLog("Couldn't join the parts of %s (error 0x%08X)", pJob->outputPath, (UINT)hr);
+      ++failed;
+      continue;
+    }
+
+    // The parts are only deleted once the whole job is safely in one file
+    for (UINT i = 0; i < count; ++i) DeleteFile(parts[i]);
+    BatchLog("Joined %u parts into %s", count, pJob->outputPath);
+  }
+  return failed;
+}
+
+UINT RenderSegments(LPCSTR commandLine, const BatchJob *pJobs, UINT jobCount, UINT segments,
+                    UINT fps) {
+  char exePath[MAX_PATH];
+  if (!GetModuleFileName(NULL, exePath, MAX_PATH)) return jobCount;
+
+  // The segments only write their own frames of a raw stream, so one left over from an earlier
+  // render could leave frames of its own past the end of this one
+  for (UINT job = 0; job < jobCount; ++job) {
+    LPCSTR extension = strrchr(pJobs[job].outputPath, '.');
+    if (extension && 0 == lstrcmpi(extension, ".raw")) DeleteFile(pJobs[job].outputPath);
+  }
+
+  // Every copy logs to the same place this one does
+  STARTUPINFO startup;
+  ZeroMemory(&startup, sizeof(startup));
+  startup.cb = sizeof(startup);
+  startup.dwFlags = STARTF_USESTDHANDLES;
+  startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+  startup.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+  startup.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+  SIZE_T length = lstrlen(exePath) + lstrlen(commandLine) + 48;
+  char *pLine = new char[length];
+  HANDLE processes[SEGMENT_MAX];
+  UINT started = 0;
+  for (UINT i = 0; i < segments; ++i) {
+    // wsprintf stops at 1024 characters, and command lines can be longer
+    char segment[48];
+    wsprintf(segment, " -segment %u/%u", i + 1, segments);
+    lstrcpy(pLine, "\"");
+    lstrcat(pLine, exePath);
+    lstrcat(pLine, "\" ");
+    lstrcat(pLine, commandLine);
+    lstrcat(pLine, segment);
+    PROCESS_INFORMATION process;
+    if (!CreateProcess(NULL, pLine, NULL, NULL, TRUE, 0, NULL, NULL, &startup, &process)) {
+      BatchLog("Couldn't start segment %u of %u (error %u)", i + 1, segments, GetLastError());
+      continue;
+    }
+    CloseHandle(process.hThread);
+    processes[started++] = process.hProcess;
+  }
+  delete[] pLine;
+
+  // A copy's exit code is how many of its jobs failed, and a job that failed anywhere failed
+  UINT failed = started < segments ? jobCount : 0;
+  if (started) WaitForMultipleObjects(started, processes, TRUE, INFINITE);
+  for (UINT i = 0; i < started; ++i) {
+    DWORD exitCode;
+    if (!GetExitCodeProcess(processes[i], &exitCode)) exitCode = jobCount;
+    if (exitCode > failed) failed = exitCode;
+    CloseHandle(processes[i]);
+  }
+
+  if (started == segments) {
+    UINT unjoined = JoinSegments(pJobs, jobCount, segments, fps);
+    if (unjoined > failed) failed = unjoined;
+  }
+  return failed;
+}
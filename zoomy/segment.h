@@ -0,0 +1,67 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Batch renders split into segments of frames, rendered by separate processes (-segments and
+// -segment).
+//
+// Frame N of a zoom only depends on N, never on the frames before it, so each job's frames can
+// be cut into consecutive runs and every run rendered at once, by another copy of the app on
+// this machine or on any other that can see the same files.  Segment i of n renders frames
+// frames * (i - 1) / n up to frames * i / n of every job in the batch file.  A job with fewer
+// frames than there are segments leaves some of them with none, and those write nothing at all.
+//
+//   - Image sequences are numbered as they would be by a single render, so the segments' files
+//     simply sit side by side.
+//   - Raw streams are shared: each segment writes its frames at their own place in the one file,
+//     and the last one cuts the file off after the last frame.
+//   - MP4s can't be shared, so segment i of "clip.mp4" goes to "clip.part<i>of<n>.mp4".  Every
+//     part starts with a key frame, since it comes from an encoder of its own, so once all have
+//     finished they're joined at those boundaries into "clip.mp4" without being encoded again,
+//     and the parts are deleted.
+//
+// "-segments <n>" does all of that on this machine: it starts n copies of the app, each with
+// "-segment <i>/<n>" added to this one's command line, waits for them, and joins the MP4s.  On a
+// render farm, run "-segment <i>/<n>" on each machine with the same batch file and command line
+// (including -output, so every machine draws the same size), then "-segment join/<n>" once they
+// have all finished.  With a fixed sample count (not -samples auto), the frames come out the
+// same as from a render done in one piece.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include "batch.h"
+
+// Most segments a job can be split into
+#define SEGMENT_MAX 64
+
+/**
+ * How many frames a zoom of seconds has at fps, counting both the first and the last
+ */
+UINT CountZoomFrames(double seconds, UINT fps);
+
+/**
+ * The frames segment (counting from 1) of segments renders, from *pFirst up to but not
+ * including *pEnd, out of frames in all
+ */
+void GetSegmentFrames(UINT frames, UINT segment, UINT segments, UINT *pFirst, UINT *pEnd);
+
+/**
+ * Where segment of segments writes a job's output: its own part for an MP4, or the job's path
+ * for everything else.  segmentPath must hold MAX_PATH characters.  Fails if the part's name
+ * would be too long.
+ */
+HRESULT GetSegmentOutputPath(LPCSTR outputPath, UINT segment, UINT segments, char *segmentPath);
+
+/**
+ * Renders the batch with segments copies of the app at once, each with commandLine (this one's)
+ * plus its -segment, then joins the jobs' parts.  Returns how many jobs failed, as best it can
+ * tell: the most any one copy reported, or the number that couldn't be joined, if that's more.
+ */
+UINT RenderSegments(LPCSTR commandLine, const BatchJob *pJobs, UINT jobCount, UINT segments,
+                    UINT fps);
+
+/**
+ * Joins the parts of every MP4 job rendered in segments at fps, and deletes them.  Segments
+ * that had none of a job's frames have no part to join.  Returns how many jobs couldn't be
+ * joined.
+ */
+UINT JoinSegments(const BatchJob *pJobs, UINT jobCount, UINT segments, UINT fps);
@@ -0,0 +1,155 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Shared-surface output.  See share.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "share.h"
+#include "display.h"
+#include "preview.h"
+
+struct FrameShare {
+  LPDIRECT3DDEVICE9 pd3dDevice;
+  LPDIRECT3DTEXTURE9 pTextures[SHARED_FRAME_RING];
+  LPDIRECT3DSURFACE9 pSurfaces[SHARED_FRAME_RING];
+  LPDIRECT3DSURFACE9 pBackBuffer;       // Held between BeginSharedFrame and EndSharedFrame
+  LPDIRECT3DSURFACE9 pDepthStencil;     // Unbound between them, and held to put back
+  UINT frame;                           // The frame being drawn; it goes in frame % ring
+
+  // How readers find us
+  HANDLE hMapping;
+  SharedFrameInfo *pInfo;
+  HANDLE hReady;
+};
+
+HRESULT CreateFrameShare(LPDIRECT3DDEVICE9 pd3dDevice, UINT width, UINT height,
+                         FrameShare **ppShare) {
+  *ppShare = NULL;
+
+  // Only 9Ex devices can share their resources
+  if (!IsDeviceEx(pd3dDevice)) return E_NOINTERFACE;
+
+  FrameShare *pShare = new FrameShare;
+  ZeroMemory(pShare, sizeof(FrameShare));
+  pShare->pd3dDevice = pd3dDevice;
+  pd3dDevice->AddRef();
+
+  HRESULT hr = S_OK;
+  HANDLE handles[SHARED_FRAME_RING];
+  for (UINT i = 0; SUCCEEDED(hr) && i < SHARED_FRAME_RING; ++i) {
+    handles[i] = NULL;
+    hr = pd3dDevice->CreateTexture(width, height, 1, D3DUSAGE_RENDERTARGET, D3DFMT_X8R8G8B8,
+                                   D3DPOOL_DEFAULT, &pShare->pTextures[i], &handles[i]);
+    if (SUCCEEDED(hr)) hr = pShare->pTextures[i]->GetSurfaceLevel(0, &pShare->pSurfaces[i]);
+  }
+
+  // Another copy of the app may already be publishing, and readers couldn't tell us apart
+  if (SUCCEEDED(hr)) {
+    pShare->hMapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+                                         sizeof(SharedFrameInfo), SHARED_FRAME_MAPPING);
+    if (!pShare->hMapping || ERROR_ALREADY_EXISTS == GetLastError()) {
+      hr = HRESULT_FROM_WIN32(pShare->hMapping ? ERROR_ALREADY_EXISTS : GetLastError());
+    }
+  }
+  if (SUCCEEDED(hr)) {
+    pShare->pInfo = (SharedFrameInfo *)MapViewOfFile(pShare->hMapping, FILE_MAP_WRITE, 0, 0,
+                                                     sizeof(SharedFrameInfo));
+    if (!pShare->pInfo) hr = HRESULT_FROM_WIN32(GetLastError());
+  }
+  if (SUCCEEDED(hr) && NULL == (pShare->hReady = CreateEvent(NULL, FALSE, FALSE, SHARED_FRAME_EVENT))) {
+    hr = HRESULT_FROM_WIN32(GetLastError());
+  }
+
+  if (FAILED(hr)) {
+    ReleaseFrameShare(pShare);
+    return hr;
+  }
+
+  // Nothing has been published yet
+  SharedFrameInfo *pInfo = pShare->pInfo;
+  pInfo->version = SHARED_FRAME_VERSION;
+  pInfo->width = width;
+  pInfo->height = height;
+  pInfo->format = D3DFMT_X8R8G8B8;
+  for (UINT i = 0; i < SHARED_FRAME_RING; ++i) pInfo->handles[i] = (DWORD)(ULONG_PTR)handles[i];
+  InterlockedExchange(&pInfo->frame, -1);
+
+  *ppShare = pShare;
+  return S_OK;
+}
+
+HRESULT BeginSharedFrame(FrameShare *pShare) {
+  LPDIRECT3DDEVICE9 pd3dDevice = pShare->pd3dDevice;
+  HRESULT hr;
+  if (!pShare->pBackBuffer && FAILED(hr = pd3dDevice->GetRenderTarget(0, &pShare->pBackBuffer))) {
+    return hr;
+  }
+
+  // With -output the targets can be bigger than the depth buffer, which is sized for the back
+  // buffer, so it mustn't be bound with them (we don't use it anyway)
+  if (!pShare->pDepthStencil &&
+      FAILED(pd3dDevice->GetDepthStencilSurface(&pShare->pDepthStencil))) {
+    pShare->pDepthStencil = NULL;
+  }
+  pd3dDevice->SetDepthStencilSurface(NULL);
+  return pd3dDevice->SetRenderTarget(0, pShare->pSurfaces[pShare->frame % SHARED_FRAME_RING]);
+}
+
+HRESULT EndSharedFrame(FrameShare *pShare) {
+  LPDIRECT3DSURFACE9 pBackBuffer = pShare->pBackBuffer;
+  if (!pBackBuffer) return E_UNEXPECTED;
+  pShare->pBackBuffer = NULL;
+
+  // A copy on the GPU, for the preview only; readers use the shared target itself.  Frames of
+  // another size from the window (-output) are letterboxed onto it, the way preview.h does.
+  LPDIRECT3DDEVICE9 pd3dDevice = pShare->pd3dDevice;
+  HRESULT hrTarget = pd3dDevice->SetRenderTarget(0, pBackBuffer);
+  if (pShare->pDepthStencil) {
+    pd3dDevice->SetDepthStencilSurface(pShare->pDepthStencil);
+    pShare->pDepthStencil->Release();
+    pShare->pDepthStencil = NULL;
+  }
+  D3DSURFACE_DESC desc;
+  HRESULT hr = pBackBuffer->GetDesc(&desc);
+  if (SUCCEEDED(hr)) {
+    const SharedFrameInfo *pInfo = pShare->pInfo;
+    RECT rect;
+    GetPreviewRect(pInfo->width, pInfo->height, desc.Width, desc.Height, &rect);
+    bool scaled = rect.right - rect.left != (LONG)pInfo->width ||
+                  rect.bottom - rect.top != (LONG)pInfo->height;
+    if (scaled) pd3dDevice->Clear(0, NULL, D3DCLEAR_TARGET, D3DCOLOR_XRGB(0,0,0), 1.0f, 0);
+    hr = pd3dDevice->StretchRect(pShare->pSurfaces[pShare->frame % SHARED_FRAME_RING], NULL,
+                                 pBackBuffer, &rect, scaled ? D3DTEXF_LINEAR : D3DTEXF_NONE);
+  }
+  pBackBuffer->Release();
+  return FAILED(hr) ? hr : hrTarget;
+}
+
+void PublishSharedFrame(FrameShare *pShare) {
+  // Present has flushed the frame to the GPU, so readers' devices see it finished
+  InterlockedExchange(&pShare->pInfo->frame, (LONG)pShare->frame);
+  pShare->frame++;
+  SetEvent(pShare->hReady);
+}
+
+void ReleaseFrameShare(FrameShare *pShare) {
+  if (!pShare) return;
+
+  // Tell readers there's nothing more coming before the textures go away
+  if (pShare->pInfo) {
+    InterlockedExchange(&pShare->pInfo->frame, -1);
+    UnmapViewOfFile(pShare->pInfo);
+  }
+  if (pShare->hReady) {
+    SetEvent(pShare->hReady);
+    CloseHandle(pShare->hReady);
+  }
+  if (pShare->hMapping) CloseHandle(pShare->hMapping);
+  if (pShare->pBackBuffer) pShare->pBackBuffer->Release();
+  if (pShare->pDepthStencil) pShare->pDepthStencil->Release();
+  for (UINT i = 0; i < SHARED_FRAME_RING; ++i) {
+    if (pShare->pSurfaces[i]) pShare->pSurfaces[i]->Release();
+    if (pShare->pTextures[i]) pShare->pTextures[i]->Release();
+  }
+  pShare->pd3dDevice->Release();
+  delete pShare;
+}
@@ -0,0 +1,70 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Shared-surface output (-present shared), so a capture plugin can take each frame straight
+// off the GPU instead of capturing the window, which costs a round trip through system memory
+// and often a frame of lag.
+//
+// Frames are drawn into a ring of Direct3D 9Ex shared render targets instead of the back
+// buffer.  Each is copied to the back buffer on the GPU for the local preview, and after
+// Present the one just finished is published.  Anything that can open a D3D9Ex share handle
+// (another 9Ex device, or D3D10/11 through OpenSharedResource) reads it with no copies at all.
+//
+// Publishing works through a named file mapping holding a SharedFrameInfo, and an auto-reset
+// event set after every published frame:
+//
+//   SHARED_FRAME_MAPPING   "Local\ZoomySharedFrame"
+//   SHARED_FRAME_EVENT     "Local\ZoomySharedFrameReady"
+//
+// A reader waits on the event (or polls frame), then opens handles[frame % SHARED_FRAME_RING].
+// The frame it names won't be drawn into again for SHARED_FRAME_RING - 1 more frames.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <d3d9.h>
+
+#define SHARED_FRAME_MAPPING  "Local\\ZoomySharedFrame"
+#define SHARED_FRAME_EVENT    "Local\\ZoomySharedFrameReady"
+#define SHARED_FRAME_VERSION  1
+#define SHARED_FRAME_RING     3
+
+/**
+ * What's in the mapping.  Share handles are always small enough for 32 bits, even in 64-bit
+ * processes, so readers of either bitness see the same layout.
+ */
+struct SharedFrameInfo {
+  DWORD version;                        // SHARED_FRAME_VERSION
+  DWORD width, height;
+  DWORD format;                         // A D3DFORMAT; DXGI readers see B8G8R8X8_UNORM
+  DWORD handles[SHARED_FRAME_RING];     // Share handles of the ring's textures
+  volatile LONG frame;                  // Number of the newest published frame, or -1
+};
+
+struct FrameShare;
+
+/**
+ * Creates the shared ring and publishes it.  Fails on devices that aren't 9Ex.
+ */
+HRESULT CreateFrameShare(LPDIRECT3DDEVICE9 pd3dDevice, UINT width, UINT height,
+                         FrameShare **ppShare);
+
+/**
+ * Points the device at the next shared target.  Call before BeginScene.
+ */
+HRESULT BeginSharedFrame(FrameShare *pShare);
+
+/**
+ * Copies the frame to the back buffer for the preview and points the device back at it.  Call
+ * after EndScene.
+ */
+HRESULT EndSharedFrame(FrameShare *pShare);
+
+/**
+ * Tells readers the frame is there.  Call after Present.
+ */
+void PublishSharedFrame(FrameShare *pShare);
+
+/**
+ * Stops publishing and frees the ring.  Safe to call with NULL.
+ */
+void ReleaseFrameShare(FrameShare *pShare);
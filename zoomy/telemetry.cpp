@@ -0,0 +1,444 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Frame-time telemetry.  See telemetry.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "telemetry.h"
+#include "clock.h"
+#include <d3dx9.h>
+#include <evntprov.h>
+#include <stdlib.h>
+
+#pragma comment(lib,"advapi32.lib")
+
+// GPU timings in flight at once.  A result that isn't back by the time its queries come around
+// again is given up on rather than waited for.
+#define TELEMETRY_GPU_DEPTH 4
+
+// Frames written to the CSV file at a time
+#define TELEMETRY_CSV_BLOCK 256
+
+// Frames the overlay's graph and percentiles cover, and its size on screen
+#define OVERLAY_FRAMES 240
+#define OVERLAY_LEFT   16.0f
+#define OVERLAY_TOP    16.0f
+#define OVERLAY_HEIGHT 120.0f
+#define OVERLAY_STEP   2.0f     // Pixels across per frame
+#define OVERLAY_SCALE  4.0f     // The graph's height, in refreshes
+
+/**
+ * One frame's record, laid out as the ETW event is
+ */
+struct TelemetryFrame {
+  UINT32 frame;
+  UINT32 total;                         // Microseconds, start of the frame to start of the next
+  UINT32 phases[TELEMETRY_PHASES];      // Microseconds
+  INT32  gpu;                           // Microseconds, or -1 if it isn't known (yet)
+  UINT32 missed;                        // Refreshes missed
+  UINT32 cacheHits, cacheMisses, cacheEvictions;  // The image cache's, so far
+};
+
+/**
+ * The queries timing one frame's draw
+ */
+struct GpuTiming {
+  LPDIRECT3DQUERY9 pDisjoint, pFrequency, pBegin, pEnd;
+  UINT frame;
+  bool issued;
+};
+
+struct Telemetry {
+  LPDIRECT3DDEVICE9 pd3dDevice;
+  double refreshPeriod;                 // Microseconds
+
+  // The ring.  Frame n is at n % TELEMETRY_RING_FRAMES; `frame` is the one in progress.
+  TelemetryFrame *pFrames;
+  UINT frame;
+  bool started;
+  double frameStart, phaseStart;
+
+  // GPU timing, if the device can do it
+  GpuTiming gpu[TELEMETRY_GPU_DEPTH];
+  UINT gpuNext;
+  bool gpuTiming;                       // Between BeginTelemetryGpu and EndTelemetryGpu
+
+  // Where the finished frames go.  Everything before `written` is out.
+  HANDLE hFile;
+  REGHANDLE etw;
+  EVENT_DESCRIPTOR etwFrame;
+  UINT written;
+
+  ImageCache *pImageCache;              // Whose counters go in each frame, or NULL
+  ID3DXFont *pFont;
+};
+
+static void ReleaseGpuQueries(Telemetry *pTelemetry) {
+  for (UINT i = 0; i < TELEMETRY_GPU_DEPTH; ++i) {
+    GpuTiming *pTiming = &pTelemetry->gpu[i];
+    if (pTiming->pDisjoint) pTiming->pDisjoint->Release();
+    if (pTiming->pFrequency) pTiming->pFrequency->Release();
+    if (pTiming->pBegin) pTiming->pBegin->Release();
+    if (pTiming->pEnd) pTiming->pEnd->Release();
+    ZeroMemory(pTiming, sizeof(GpuTiming));
+  }
+  pTelemetry->gpuTiming = false;
+}
+
+/**
+ * Makes the queries for every GPU timing.  Leaves them all NULL if the device can't time itself.
+ */
+static void CreateGpuQueries(Telemetry *pTelemetry) {
+  LPDIRECT3DDEVICE9 pd3dDevice = pTelemetry->pd3dDevice;
+  HRESULT hr = S_OK;
+  for (UINT i = 0; SUCCEEDED(hr) && i < TELEMETRY_GPU_DEPTH; ++i) {
+    GpuTiming *pTiming = &pTelemetry->gpu[i];
+    hr = pd3dDevice->CreateQuery(D3DQUERYTYPE_TIMESTAMPDISJOINT, &pTiming->pDisjoint);
+    if (SUCCEEDED(hr)) hr = pd3dDevice->CreateQuery(D3DQUERYTYPE_TIMESTAMPFREQ, &pTiming->pFrequency);
+    if (SUCCEEDED(hr)) hr = pd3dDevice->CreateQuery(D3DQUERYTYPE_TIMESTAMP, &pTiming->pBegin);
+    if (SUCCEEDED(hr)) hr = pd3dDevice->CreateQuery(D3DQUERYTYPE_TIMESTAMP, &pTiming->pEnd);
+  }
+  if (FAILED(hr)) ReleaseGpuQueries(pTelemetry);
+}
+
+/**
+ * Picks up the result of a GPU timing if it's back, without waiting for it.  Returns false if it
+ * isn't back yet.
+ */
+static bool CollectGpuTiming(Telemetry *pTelemetry, GpuTiming *pTiming, DWORD flags) {
+  BOOL disjoint;
+  UINT64 frequency, begin, end;
+  if (S_OK != pTiming->pDisjoint->GetData(&disjoint, sizeof(disjoint), flags) ||
+      S_OK != pTiming->pFrequency->GetData(&frequency, sizeof(frequency), flags) ||
+      S_OK != pTiming->pBegin->GetData(&begin, sizeof(begin), flags) ||
+      S_OK != pTiming->pEnd->GetData(&end, sizeof(end), flags)) {
+    return false;
+  }
+  pTiming->issued = false;
+
+  // A frequency change in between (the GPU clocking down, say) makes the timestamps meaningless.
+  // Frames that have already left the ring are ignored.
+  if (disjoint || 0 == frequency || end < begin) return true;
+  if (pTelemetry->frame - pTiming->frame >= TELEMETRY_RING_FRAMES) return true;
+  TelemetryFrame *pFrame = &pTelemetry->pFrames[pTiming->frame % TELEMETRY_RING_FRAMES];
+  pFrame->gpu = (INT32)((end - begin) * 1000000 / frequency);
+  return true;
+}
+
+/**
+ * Writes the frames from `written` up to (but not including) `end` to the CSV file or ETW
+ */
+static void WriteFrames(Telemetry *pTelemetry, UINT end) {
+  // Frames overwritten in the ring before they could be written are gone
+  if (end - pTelemetry->written > TELEMETRY_RING_FRAMES) {
+    pTelemetry->written = end - TELEMETRY_RING_FRAMES;
+  }
+
+  if (pTelemetry->etw) {
+    bool enabled = FALSE != EventEnabled(pTelemetry->etw, &pTelemetry->etwFrame);
+    for (; enabled && pTelemetry->written < end; ++pTelemetry->written) {
+      EVENT_DATA_DESCRIPTOR data;
+      const TelemetryFrame *pFrame = &pTelemetry->pFrames[pTelemetry->written % TELEMETRY_RING_FRAMES];
+      EventDataDescCreate(&data, pFrame, sizeof(TelemetryFrame));
+      EventWrite(pTelemetry->etw, &pTelemetry->etwFrame, 1, &data);
+    }
+    pTelemetry->written = end;
+    return;
+  }
+
+  if (INVALID_HANDLE_VALUE == pTelemetry->hFile) {
+    pTelemetry->written = end;
+    return;
+  }
+  char text[TELEMETRY_CSV_BLOCK * 128];
+  while (pTelemetry->written < end) {
+    DWORD length = 0;
+    for (UINT row = 0; row < TELEMETRY_CSV_BLOCK && pTelemetry->written < end; ++row) {
+      UINT frame = pTelemetry->written++;
+      const TelemetryFrame *pFrame = &pTelemetry->pFrames[frame % TELEMETRY_RING_FRAMES];
+      length += wsprintf(text + length, "%u,%u,%u,%u,%u,%u,", pFrame->frame, pFrame->total,
+                         pFrame->phases[0], pFrame->phases[1], pFrame->phases[2], pFrame->phases[3]);
+      if (pFrame->gpu >= 0) length += wsprintf(text + length, "%d", pFrame->gpu);
+      length += wsprintf(text + length, ",%u,%u,%u,%u\r\n", pFrame->missed, pFrame->cacheHits,
+                         pFrame->cacheMisses, pFrame->cacheEvictions);
+    }
+    DWORD bytesWritten;
+    WriteFile(pTelemetry->hFile, text, length, &bytesWritten, NULL);
+  }
+}
+
+HRESULT CreateTelemetry(LPDIRECT3DDEVICE9 pd3dDevice, LPCSTR outputPath, UINT refreshRate,
+                        Telemetry **ppTelemetry) {
+  Telemetry *pTelemetry = new Telemetry;
+  ZeroMemory(pTelemetry, sizeof(Telemetry));
+  pTelemetry->pd3dDevice = pd3dDevice;
+  pd3dDevice->AddRef();
+  pTelemetry->refreshPeriod = 1000000.0 / (refreshRate ? refreshRate : 60);
+  pTelemetry->pFrames = new TelemetryFrame[TELEMETRY_RING_FRAMES];
+  ZeroMemory(pTelemetry->pFrames, sizeof(TelemetryFrame) * TELEMETRY_RING_FRAMES);
+  pTelemetry->hFile = INVALID_HANDLE_VALUE;
+
+  HRESULT hr = S_OK;
+  if (0 == lstrcmpi(outputPath, "etw")) {
+    static const GUID provider = TELEMETRY_ETW_PROVIDER;
+    ULONG error = EventRegister(&provider, NULL, NULL, &pTelemetry->etw);
+    if (ERROR_SUCCESS != error) hr = HRESULT_FROM_WIN32(error);
+    EventDescCreate(&pTelemetry->etwFrame, 1, 0, 0, 4, 0, 0, 0);
+  } else if (outputPath[0]) {
+    pTelemetry->hFile = CreateFile(outputPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                                   FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (INVALID_HANDLE_VALUE == pTelemetry->hFile) {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+    } else {
+      static const char header[] =
+        "frame,frame_us,update_us,draw_us,present_us,pump_us,gpu_draw_us,missed_refreshes,"
+        "image_cache_hits,image_cache_misses,image_cache_evictions\r\n";
+      DWORD bytesWritten;
+      WriteFile(pTelemetry->hFile, header, sizeof(header) - 1, &bytesWritten, NULL);
+    }
+  }
+  if (SUCCEEDED(hr)) {
+    hr = D3DXCreateFont(pd3dDevice, 16, 0, FW_NORMAL, 1, FALSE, DEFAULT_CHARSET,
+                        OUT_DEFAULT_PRECIS, DEFAULT_QUALITY, FIXED_PITCH | FF_MODERN, "Consolas",
+                        &pTelemetry->pFont);
+  }
+  if (FAILED(hr)) {
+    ReleaseTelemetry(pTelemetry);
+    *ppTelemetry = NULL;
+    return hr;
+  }
+
+  CreateGpuQueries(pTelemetry);
+  *ppTelemetry = pTelemetry;
+  return S_OK;
+}
+
+void SetTelemetryImageCache(Telemetry *pTelemetry, ImageCache *pCache) {
+  if (pTelemetry) pTelemetry->pImageCache = pCache;
+}
+
+/**
+ * Closes off the frame that just went round the loop, if one has started
+ */
+static void EndTelemetryFrame(Telemetry *pTelemetry, double now) {
+  if (!pTelemetry->started) return;
+  TelemetryFrame *pFrame = &pTelemetry->pFrames[pTelemetry->frame % TELEMETRY_RING_FRAMES];
+  pFrame->phases[TELEMETRY_PHASE_PUMP] = (UINT32)((now - pTelemetry->phaseStart) * 1000000.0);
+  double total = (now - pTelemetry->frameStart) * 1000000.0;
+  pFrame->total = (UINT32)total;
+  UINT refreshes = (UINT)(total / pTelemetry->refreshPeriod + 0.5);
+  pFrame->missed = refreshes > 1 ? refreshes - 1 : 0;
+  pTelemetry->frame++;
+  pTelemetry->started = false;
+}
+
+void IdleTelemetry(Telemetry *pTelemetry) {
+  if (pTelemetry) EndTelemetryFrame(pTelemetry, ClockSeconds());
+}
+
+void NextTelemetryFrame(Telemetry *pTelemetry) {
+  if (!pTelemetry) return;
+  double now = ClockSeconds();
+  EndTelemetryFrame(pTelemetry, now);
+  pTelemetry->started = true;
+  pTelemetry->frameStart = pTelemetry->phaseStart = now;
+
+  TelemetryFrame *pFrame = &pTelemetry->pFrames[pTelemetry->frame % TELEMETRY_RING_FRAMES];
+  ZeroMemory(pFrame, sizeof(TelemetryFrame));
+  pFrame->frame = pTelemetry->frame;
+  pFrame->gpu = -1;
+  if (pTelemetry->pImageCache) {
+    ImageCacheStats stats;
+    GetImageCacheStats(pTelemetry->pImageCache, &stats);
+    pFrame->cacheHits = stats.hits;
+    pFrame->cacheMisses = stats.misses;
+    pFrame->cacheEvictions = stats.evictions;
+  }
+
+  // Pick up whichever GPU timings have come back
+  for (UINT i = 0; i < TELEMETRY_GPU_DEPTH; ++i) {
+    if (pTelemetry->gpu[i].issued) CollectGpuTiming(pTelemetry, &pTelemetry->gpu[i], 0);
+  }
+
+  // Frames are written once their GPU timings have had every chance to come back
+  UINT frame = pTelemetry->frame, written = pTelemetry->written;
+  UINT settled = frame > TELEMETRY_GPU_DEPTH ? frame - TELEMETRY_GPU_DEPTH : 0;
+  if (settled > written && (pTelemetry->etw || settled - written >= TELEMETRY_CSV_BLOCK)) {
+    WriteFrames(pTelemetry, settled);
+  }
+}
+
+void EndTelemetryPhase(Telemetry *pTelemetry, UINT phase) {
+  if (!pTelemetry) return;
+  double now = ClockSeconds();
+  TelemetryFrame *pFrame = &pTelemetry->pFrames[pTelemetry->frame % TELEMETRY_RING_FRAMES];
+  pFrame->phases[phase] += (UINT32)((now - pTelemetry->phaseStart) * 1000000.0);
+  pTelemetry->phaseStart = now;
+}
+
+void BeginTelemetryGpu(Telemetry *pTelemetry) {
+  if (!pTelemetry) return;
+  GpuTiming *pTiming = &pTelemetry->gpu[pTelemetry->gpuNext];
+  if (!pTiming->pDisjoint) return;
+
+  // A timing that still hasn't come back is given up on
+  if (pTiming->issued) CollectGpuTiming(pTelemetry, pTiming, 0);
+  pTiming->issued = false;
+
+  pTiming->pDisjoint->Issue(D3DISSUE_BEGIN);
+  pTiming->pBegin->Issue(D3DISSUE_END);
+  pTelemetry->gpuTiming = true;
+}
+
+void EndTelemetryGpu(Telemetry *pTelemetry) {
+  if (!pTelemetry || !pTelemetry->gpuTiming) return;
+  pTelemetry->gpuTiming = false;
+
+  GpuTiming *pTiming = &pTelemetry->gpu[pTelemetry->gpuNext];
+  pTiming->pEnd->Issue(D3DISSUE_END);
+  pTiming->pFrequency->Issue(D3DISSUE_END);
+  pTiming->pDisjoint->Issue(D3DISSUE_END);
+  pTiming->frame = pTelemetry->frame;
+  pTiming->issued = true;
+  pTelemetry->gpuNext = (pTelemetry->gpuNext + 1) % TELEMETRY_GPU_DEPTH;
+}
+
+/**
+ * qsort order for the percentiles
+ */
+static int CompareMicroseconds(const void *a, const void *b) {
+  INT32 x = *(const INT32 *)a, y = *(const INT32 *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/**
+ * Writes microseconds as milliseconds to a tenth, since wsprintf has no floating point
+ */
+static void FormatMilliseconds(char *text, INT32 microseconds) {
+  if (microseconds < 0) {
+    lstrcpy(text, "-");
+  } else {
+    wsprintf(text, "%d.%d", microseconds / 1000, (microseconds % 1000) / 100);
+  }
+}
+
+void DrawTelemetryOverlay(Telemetry *pTelemetry, float target_width, float target_height) {
+  if (!pTelemetry) return;
+  LPDIRECT3DDEVICE9 pd3dDevice = pTelemetry->pd3dDevice;
+  UINT count = pTelemetry->frame < OVERLAY_FRAMES ? pTelemetry->frame : OVERLAY_FRAMES;
+  if (0 == count || !pTelemetry->pFont) return;
+  if (FAILED(pd3dDevice->BeginScene())) return;
+
+  // The most recent finished frames, oldest first
+  INT32 totals[OVERLAY_FRAMES], gpus[OVERLAY_FRAMES];
+  UINT gpuCount = 0, missed = 0;
+  struct {
+    FLOAT x, y, z, rhw;
+    D3DCOLOR color;
+  } graph[OVERLAY_FRAMES], panel[6], lines[4];
+  float period = (float)pTelemetry->refreshPeriod, scale = OVERLAY_HEIGHT / (period * OVERLAY_SCALE);
+  float bottom = OVERLAY_TOP + OVERLAY_HEIGHT;
+  for (UINT i = 0; i < count; ++i) {
+    UINT frame = pTelemetry->frame - count + i;
+    const TelemetryFrame *pFrame = &pTelemetry->pFrames[frame % TELEMETRY_RING_FRAMES];
+    totals[i] = (INT32)pFrame->total;
+    if (pFrame->gpu >= 0) gpus[gpuCount++] = pFrame->gpu;
+    missed += pFrame->missed;
+
+    float height = pFrame->total * scale;
+    if (height > OVERLAY_HEIGHT) height = OVERLAY_HEIGHT;
+    graph[i].x = OVERLAY_LEFT + i * OVERLAY_STEP;
+    graph[i].y = bottom - height;
+    graph[i].z = 0.5f;
+    graph[i].rhw = 1.0f;
+    graph[i].color = pFrame->missed ? D3DCOLOR_XRGB(255,64,64) : D3DCOLOR_XRGB(64,255,64);
+  }
+
+  // A dark panel behind it all, with lines at one and two refreshes
+  float right = OVERLAY_LEFT + OVERLAY_FRAMES * OVERLAY_STEP, panelBottom = bottom + 48.0f;
+  float one = bottom - period * scale, two = bottom - period * 2.0f * scale;
+  D3DCOLOR shade = D3DCOLOR_ARGB(160,0,0,0), line = D3DCOLOR_ARGB(255,128,128,128);
+  float x1 = OVERLAY_LEFT - 8.0f, y1 = OVERLAY_TOP - 8.0f, x2 = right + 8.0f, y2 = panelBottom;
+  float corners[6][2] = { { x1, y2 }, { x1, y1 }, { x2, y1 }, { x1, y2 }, { x2, y1 }, { x2, y2 } };
+  for (UINT i = 0; i < 6; ++i) {
+    panel[i].x = corners[i][0];
+    panel[i].y = corners[i][1];
+    panel[i].z = 0.5f;
+    panel[i].rhw = 1.0f;
+    panel[i].color = shade;
+  }
+  float ends[4][2] = { { OVERLAY_LEFT, one }, { right, one }, { OVERLAY_LEFT, two }, { right, two } };
+  for (UINT i = 0; i < 4; ++i) {
+    lines[i].x = ends[i][0];
+    lines[i].y = ends[i][1];
+    lines[i].z = 0.5f;
+    lines[i].rhw = 1.0f;
+    lines[i].color = line;
+  }
+
+  // Untextured, blended by the vertex alpha
+  pd3dDevice->SetTexture(0, NULL);
+  pd3dDevice->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_SELECTARG1);
+  pd3dDevice->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_DIFFUSE);
+  pd3dDevice->SetTextureStageState(0, D3DTSS_ALPHAOP, D3DTOP_SELECTARG1);
+  pd3dDevice->SetTextureStageState(0, D3DTSS_ALPHAARG1, D3DTA_DIFFUSE);
+  pd3dDevice->SetRenderState(D3DRS_ALPHABLENDENABLE, TRUE);
+  pd3dDevice->SetRenderState(D3DRS_SRCBLEND, D3DBLEND_SRCALPHA);
+  pd3dDevice->SetRenderState(D3DRS_DESTBLEND, D3DBLEND_INVSRCALPHA);
+  pd3dDevice->SetFVF(D3DFVF_XYZRHW | D3DFVF_DIFFUSE);
+  pd3dDevice->DrawPrimitiveUP(D3DPT_TRIANGLELIST, 2, (void*)panel, sizeof(panel[0]));
+  pd3dDevice->DrawPrimitiveUP(D3DPT_LINELIST, 2, (void*)lines, sizeof(lines[0]));
+  if (count > 1) pd3dDevice->DrawPrimitiveUP(D3DPT_LINESTRIP, count - 1, (void*)graph, sizeof(graph[0]));
+
+  // Back to the defaults everything else draws with
+  pd3dDevice->SetRenderState(D3DRS_ALPHABLENDENABLE, FALSE);
+  pd3dDevice->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_MODULATE);
+  pd3dDevice->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
+  pd3dDevice->SetTextureStageState(0, D3DTSS_ALPHAOP, D3DTOP_SELECTARG1);
+  pd3dDevice->SetTextureStageState(0, D3DTSS_ALPHAARG1, D3DTA_TEXTURE);
+
+  // The numbers underneath
+  qsort(totals, count, sizeof(INT32), CompareMicroseconds);
+  qsort(gpus, gpuCount, sizeof(INT32), CompareMicroseconds);
+  char p50[16], p99[16], gpu50[16], gpu99[16], text[160];
+  FormatMilliseconds(p50, totals[count / 2]);
+  FormatMilliseconds(p99, totals[(count * 99) / 100]);
+  FormatMilliseconds(gpu50, gpuCount ? gpus[gpuCount / 2] : -1);
+  FormatMilliseconds(gpu99, gpuCount ? gpus[(gpuCount * 99) / 100] : -1);
+  wsprintf(text, "frame p50 %s ms  p99 %s ms\ngpu   p50 %s ms  p99 %s ms  missed %u", p50, p99,
+           gpu50, gpu99, missed);
+  RECT rect = { (LONG)OVERLAY_LEFT, (LONG)bottom + 6, (LONG)target_width, (LONG)target_height };
+  pTelemetry->pFont->DrawText(NULL, text, -1, &rect, DT_NOCLIP, D3DCOLOR_XRGB(255,255,255));
+
+  pd3dDevice->EndScene();
+}
+
+void TelemetryDeviceLost(Telemetry *pTelemetry) {
+  if (!pTelemetry) return;
+  ReleaseGpuQueries(pTelemetry);
+  if (pTelemetry->pFont) pTelemetry->pFont->OnLostDevice();
+}
+
+void TelemetryDeviceReset(Telemetry *pTelemetry) {
+  if (!pTelemetry) return;
+  if (pTelemetry->pFont) pTelemetry->pFont->OnResetDevice();
+  CreateGpuQueries(pTelemetry);
+}
+
+void ReleaseTelemetry(Telemetry *pTelemetry) {
+  if (!pTelemetry) return;
+
+  // Give the last GPU timings what chance there is, then write everything that's finished
+  for (UINT i = 0; i < TELEMETRY_GPU_DEPTH; ++i) {
+    GpuTiming *pTiming = &pTelemetry->gpu[i];
+    if (pTiming->issued) CollectGpuTiming(pTelemetry, pTiming, D3DGETDATA_FLUSH);
+  }
+  WriteFrames(pTelemetry, pTelemetry->frame);
+
+  ReleaseGpuQueries(pTelemetry);
+  if (pTelemetry->pFont) pTelemetry->pFont->Release();
+  if (pTelemetry->etw) EventUnregister(pTelemetry->etw);
+  if (INVALID_HANDLE_VALUE != pTelemetry->hFile) CloseHandle(pTelemetry->hFile);
+  delete[] pTelemetry->pFrames;
+  pTelemetry->pd3dDevice->Release();
+  delete pTelemetry;
+}
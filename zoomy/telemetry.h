@@ -0,0 +1,104 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Frame-time telemetry, for finding out where a hitch in a take came from.
+//
+// Each frame of the live loop is split into phases timed with the high-resolution clock:
+// updating the picture, drawing, Present, and the message pump (which, since it's where the loop
+// comes back around, also holds anything else that kept the thread away).  The draw is also
+// bracketed with GPU timestamp queries, so its cost on the GPU shows separately from the CPU
+// time spent submitting it.  A frame that took longer than a refresh counts the refreshes it
+// missed.  If the loop loads through the decoded image cache (imagecache.h), each frame also
+// carries the cache's hits, misses and evictions so far, so a hitch can be matched to a decode.
+//
+// Frames go into a fixed ring of records, so recording costs nothing but a few stores.  GPU
+// results come back a few frames later, without ever stalling for them, and fill in their
+// frame's record when they do.  Finished records can be streamed to a CSV file, a block at a
+// time, or written as ETW events (see TELEMETRY_ETW_PROVIDER).
+//
+// The overlay draws a graph of recent frame times with their p50 and p99 and the missed
+// refreshes.  It's drawn last, straight onto the back buffer, so it's never in an export or in
+// the shared frames.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <d3d9.h>
+#include "imagecache.h"
+
+// Phases of a frame, in the order they happen
+#define TELEMETRY_PHASE_UPDATE  0
+#define TELEMETRY_PHASE_DRAW    1
+#define TELEMETRY_PHASE_PRESENT 2
+#define TELEMETRY_PHASE_PUMP    3
+#define TELEMETRY_PHASES        4
+
+// Frames kept in the ring
+#define TELEMETRY_RING_FRAMES 4096
+
+// ETW provider the events are written with, {6C3D2B1E-5A0F-4F7B-9E2C-1D8A7B3C4E5F}.  Each event
+// (id 1, level 4) is eleven 32-bit integers: the frame number, the whole frame, each phase in
+// order, and the GPU draw time, all in microseconds (the GPU time is -1 when it isn't known),
+// the missed refreshes, then the image cache's hits, misses and evictions so far (all 0 with no
+// cache).  The CSV file has the same columns.
+#define TELEMETRY_ETW_PROVIDER \
+  { 0x6c3d2b1e, 0x5a0f, 0x4f7b, { 0x9e, 0x2c, 0x1d, 0x8a, 0x7b, 0x3c, 0x4e, 0x5f } }
+
+struct Telemetry;
+
+// Everything but CreateTelemetry does nothing when passed NULL, so the loops can call them
+// whether or not there's any telemetry.
+
+/**
+ * Starts recording.  outputPath is a CSV file to write the frames to, "etw" to write them as
+ * ETW events instead, or empty to only keep them for the overlay.  refreshRate is in Hz (0 if
+ * unknown, taken as 60).  If the GPU can't time itself, everything else is still recorded.
+ */
+HRESULT CreateTelemetry(LPDIRECT3DDEVICE9 pd3dDevice, LPCSTR outputPath, UINT refreshRate,
+                        Telemetry **ppTelemetry);
+
+/**
+ * Has every frame from the next one on record pCache's counters.  pCache must outlive the
+ * telemetry, or be taken away again with NULL.
+ */
+void SetTelemetryImageCache(Telemetry *pTelemetry, ImageCache *pCache);
+
+/**
+ * Ends the previous frame, with the pump phase, and starts the next one.  Called once per loop,
+ * straight after the message pump.
+ */
+void NextTelemetryFrame(Telemetry *pTelemetry);
+
+/**
+ * Ends the current frame now, because the loop is about to sleep until there's something to
+ * do.  The sleep then isn't part of any frame, so it doesn't show as a hitch; the next frame
+ * starts at the next NextTelemetryFrame.
+ */
+void IdleTelemetry(Telemetry *pTelemetry);
+
+/**
+ * Ends a phase of the current frame; it covers the time since the previous phase ended.
+ */
+void EndTelemetryPhase(Telemetry *pTelemetry, UINT phase);
+
+/**
+ * Bracket the draw with these, outside BeginScene and EndScene, to time it on the GPU
+ */
+void BeginTelemetryGpu(Telemetry *pTelemetry);
+void EndTelemetryGpu(Telemetry *pTelemetry);
+
+/**
+ * Draws the overlay onto the current render target.  Call it after the frame's own drawing
+ * (and after EndSharedFrame), just before Present.
+ */
+void DrawTelemetryOverlay(Telemetry *pTelemetry, float target_width, float target_height);
+
+/**
+ * Frees what a device reset would, before the reset, and makes it again afterwards
+ */
+void TelemetryDeviceLost(Telemetry *pTelemetry);
+void TelemetryDeviceReset(Telemetry *pTelemetry);
+
+/**
+ * Writes out whatever is still unwritten and frees everything.  Safe to call with NULL.
+ */
+void ReleaseTelemetry(Telemetry *pTelemetry);
@@ -0,0 +1,257 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Texture cache.  See texcache.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "texcache.h"
+#include <string.h>
+
+// How much of each end of the source file goes into its hash.  Reading the whole file would
+// cost as much as decoding it on a slow share; the size and write time catch the rest.
+#define CACHE_SAMPLE_BYTES (64 * 1024)
+
+// Most bytes asked of one ReadFile when reading an entry back
+#define CACHE_READ_CHUNK (4 * 1024 * 1024)
+
+// The parts of the DDS header we need
+#define DDSD_CAPS         0x00000001
+#define DDSD_HEIGHT       0x00000002
+#define DDSD_WIDTH        0x00000004
+#define DDSD_PITCH        0x00000008
+#define DDSD_PIXELFORMAT  0x00001000
+#define DDSD_MIPMAPCOUNT  0x00020000
+#define DDSD_LINEARSIZE   0x00080000
+#define DDPF_ALPHAPIXELS  0x00000001
+#define DDPF_FOURCC       0x00000004
+#define DDPF_RGB          0x00000040
+#define DDSCAPS_COMPLEX   0x00000008
+#define DDSCAPS_TEXTURE   0x00001000
+#define DDSCAPS_MIPMAP    0x00400000
+
+struct DdsPixelFormat {
+  DWORD size, flags, fourCC, rgbBitCount, rBitMask, gBitMask, bBitMask, aBitMask;
+};
+
+struct DdsFileHeader {
+  DWORD magic;                        // "DDS "
+  DWORD size, flags, height, width, pitchOrLinearSize, depth, mipMapCount, reserved1[11];
+  DdsPixelFormat pixelFormat;
+  DWORD caps, caps2, caps3, caps4, reserved2;
+};
+
+/**
+ * 64-bit FNV-1a, continued from hash
+ */
+static ULONGLONG HashBytes(ULONGLONG hash, const void *pBytes, SIZE_T size) {
+  const BYTE *p = (const BYTE *)pBytes;
+  for (SIZE_T i = 0; i < size; ++i) {
+    hash ^= p[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+/**
+ * Bytes per row of texels (or of blocks) and number of rows, for one level
+ */
+static void LevelLayout(D3DFORMAT format, UINT width, UINT height, UINT *pRowBytes, UINT *pRows) {
+  if (D3DFMT_DXT1 == format || D3DFMT_DXT5 == format) {
+    *pRowBytes = ((width + 3) / 4) * (D3DFMT_DXT1 == format ? 8 : 16);
+    *pRows = (height + 3) / 4;
+  } else {
+    *pRowBytes = width * 4;
+    *pRows = height;
+  }
+}
+
+/**
+ * Reads up to `size` bytes at an offset into pBuffer, returning how many there were
+ */
+static DWORD ReadSample(HANDLE hFile, ULONGLONG offset, BYTE *pBuffer, DWORD size) {
+  OVERLAPPED overlapped;
+  ZeroMemory(&overlapped, sizeof(overlapped));
+  overlapped.Offset = (DWORD)offset;
+  overlapped.OffsetHigh = (DWORD)(offset >> 32);
+  DWORD read = 0;
+  if (!ReadFile(hFile, pBuffer, size, &read, &overlapped)) return 0;
+  return read;
+}
+
+HRESULT HashImageFile(LPCSTR imagePath, ULONGLONG *pHash) {
+  HANDLE hFile = CreateFile(imagePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, NULL);
+  if (INVALID_HANDLE_VALUE == hFile) return HRESULT_FROM_WIN32(GetLastError());
+
+  BY_HANDLE_FILE_INFORMATION info;
+  if (!GetFileInformationByHandle(hFile, &info)) {
+    HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+    CloseHandle(hFile);
+    return hr;
+  }
+
+  ULONGLONG hash = 0xCBF29CE484222325ULL;
+  hash = HashBytes(hash, &info.nFileSizeHigh, sizeof(DWORD));
+  hash = HashBytes(hash, &info.nFileSizeLow, sizeof(DWORD));
+  hash = HashBytes(hash, &info.ftLastWriteTime, sizeof(FILETIME));
+  ULONGLONG fileSize = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+  BYTE *pSample = new BYTE[CACHE_SAMPLE_BYTES];
+  hash = HashBytes(hash, pSample, ReadSample(hFile, 0, pSample, CACHE_SAMPLE_BYTES));
+  if (fileSize > CACHE_SAMPLE_BYTES) {
+    hash = HashBytes(hash, pSample,
+                     ReadSample(hFile, fileSize - CACHE_SAMPLE_BYTES, pSample, CACHE_SAMPLE_BYTES));
+  }
+  delete[] pSample;
+  CloseHandle(hFile);
+  *pHash = hash;
+  return S_OK;
+}
+
+HRESULT TextureCachePath(LPCSTR cacheDirectory, LPCSTR imagePath, const RECT *pRegion,
+                         const TextureLevels *pLevels, D3DFORMAT format, CHAR *pCachePath) {
+  // What the source is...
+  ULONGLONG hash;
+  HRESULT hr = HashImageFile(imagePath, &hash);
+  if (FAILED(hr)) return hr;
+
+  // ...and what was made from it, and how
+  UINT version = TEXTURE_CACHE_VERSION;
+  hash = HashBytes(hash, &version, sizeof(version));
+  hash = HashBytes(hash, &format, sizeof(format));
+  hash = HashBytes(hash, &pLevels->count, sizeof(UINT));
+  hash = HashBytes(hash, &pLevels->width[0], sizeof(UINT));
+  hash = HashBytes(hash, &pLevels->height[0], sizeof(UINT));
+  if (pRegion) hash = HashBytes(hash, pRegion, sizeof(RECT));
+
+  // The directory is made the first time it's needed
+  CreateDirectory(cacheDirectory, NULL);
+  int length = lstrlen(cacheDirectory);
+  bool slash = length > 0 && cacheDirectory[length - 1] != '\\' && cacheDirectory[length - 1] != '/';
+  if (length + 1 + 16 + 4 >= MAX_PATH) return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+  wsprintf(pCachePath, "%s%s%08x%08x.dds", cacheDirectory, slash ? "\\" : "",
+           (DWORD)(hash >> 32), (DWORD)hash);
+  return S_OK;
+}
+
+/**
+ * Fills in the header a DDS file of this texture would have
+ */
+static void MakeHeader(const TextureLevels *pLevels, D3DFORMAT format, DdsFileHeader *pHeader) {
+  ZeroMemory(pHeader, sizeof(DdsFileHeader));
+  UINT rowBytes, rows;
+  LevelLayout(format, pLevels->width[0], pLevels->height[0], &rowBytes, &rows);
+  bool compressed = D3DFMT_DXT1 == format || D3DFMT_DXT5 == format;
+
+  pHeader->magic = MAKEFOURCC('D', 'D', 'S', ' ');
+  pHeader->size = sizeof(DdsFileHeader) - sizeof(DWORD);
+  pHeader->flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT |
+                   (compressed ? DDSD_LINEARSIZE : DDSD_PITCH);
+  pHeader->height = pLevels->height[0];
+  pHeader->width = pLevels->width[0];
+  pHeader->pitchOrLinearSize = compressed ? rowBytes * rows : rowBytes;
+  pHeader->mipMapCount = pLevels->count;
+  pHeader->pixelFormat.size = sizeof(DdsPixelFormat);
+  if (compressed) {
+    pHeader->pixelFormat.flags = DDPF_FOURCC;
+    pHeader->pixelFormat.fourCC = D3DFMT_DXT1 == format ? MAKEFOURCC('D', 'X', 'T', '1')
+                                                        : MAKEFOURCC('D', 'X', 'T', '5');
+  } else {
+    pHeader->pixelFormat.flags = DDPF_RGB | DDPF_ALPHAPIXELS;
+    pHeader->pixelFormat.rgbBitCount = 32;
+    pHeader->pixelFormat.rBitMask = 0x00FF0000;
+    pHeader->pixelFormat.gBitMask = 0x0000FF00;
+    pHeader->pixelFormat.bBitMask = 0x000000FF;
+    pHeader->pixelFormat.aBitMask = 0xFF000000;
+  }
+  pHeader->caps = DDSCAPS_TEXTURE | DDSCAPS_MIPMAP | DDSCAPS_COMPLEX;
+}
+
+/**
+ * Reads exactly `size` bytes from the file's current position, a chunk at a time so a whole
+ * level can be asked for at once
+ */
+static HRESULT ReadBytes(HANDLE hFile, BYTE *pBuffer, SIZE_T size) {
+  while (size > 0) {
+    DWORD chunk = size < CACHE_READ_CHUNK ? (DWORD)size : CACHE_READ_CHUNK;
+    DWORD read = 0;
+    if (!ReadFile(hFile, pBuffer, chunk, &read, NULL)) return HRESULT_FROM_WIN32(GetLastError());
+    if (read != chunk) return E_FAIL;
+    pBuffer += read;
+    size -= read;
+  }
+  return S_OK;
+}
+
+HRESULT ReadTextureCache(LPCSTR cachePath, const TextureLevels *pLevels, D3DFORMAT format) {
+  HANDLE hFile = CreateFile(cachePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                            FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (INVALID_HANDLE_VALUE == hFile) return HRESULT_FROM_WIN32(GetLastError());
+
+  // The levels are read straight into the texture rather than through a view of the file: a
+  // large entry is as big as the texture it fills, and a 32-bit process has no room to map
+  // both.  ReadFile also reports a failing disk or share as an error, where a view would
+  // fault.
+  DdsFileHeader expected, header;
+  MakeHeader(pLevels, format, &expected);
+  HRESULT hr = ReadBytes(hFile, (BYTE *)&header, sizeof(header));
+
+  // The name already says which source and texture this is; make sure the file agrees
+  if (SUCCEEDED(hr) && 0 != memcmp(&header, &expected, sizeof(DdsFileHeader))) hr = E_FAIL;
+
+  for (UINT level = 0; SUCCEEDED(hr) && level < pLevels->count; ++level) {
+    UINT rowBytes, rows;
+    LevelLayout(format, pLevels->width[level], pLevels->height[level], &rowBytes, &rows);
+    if ((INT)rowBytes == pLevels->pitch[level]) {
+      hr = ReadBytes(hFile, pLevels->pBits[level], (SIZE_T)rowBytes * rows);
+      continue;
+    }
+    for (UINT row = 0; SUCCEEDED(hr) && row < rows; ++row) {
+      hr = ReadBytes(hFile, pLevels->pBits[level] + (SIZE_T)row * pLevels->pitch[level],
+                     rowBytes);
+    }
+  }
+
+  CloseHandle(hFile);
+  return hr;
+}
+
+HRESULT WriteTextureCache(LPCSTR cachePath, const TextureLevels *pLevels, D3DFORMAT format) {
+  // Write under another name and rename it into place, so a crash or a full disk never leaves
+  // a half-written entry behind to be read later
+  CHAR partialPath[MAX_PATH];
+  if (lstrlen(cachePath) + 9 >= MAX_PATH) return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+  wsprintf(partialPath, "%s.partial", cachePath);
+  HANDLE hFile = CreateFile(partialPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                            FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (INVALID_HANDLE_VALUE == hFile) return HRESULT_FROM_WIN32(GetLastError());
+
+  DdsFileHeader header;
+  MakeHeader(pLevels, format, &header);
+  DWORD written;
+  HRESULT hr = S_OK;
+  if (!WriteFile(hFile, &header, sizeof(header), &written, NULL)) {
+    hr = HRESULT_FROM_WIN32(GetLastError());
+  }
+  for (UINT level = 0; SUCCEEDED(hr) && level < pLevels->count; ++level) {
+    UINT rowBytes, rows;
+    LevelLayout(format, pLevels->width[level], pLevels->height[level], &rowBytes, &rows);
+    if ((INT)rowBytes == pLevels->pitch[level]) {
+      if (!WriteFile(hFile, pLevels->pBits[level], rowBytes * rows, &written, NULL)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+      }
+      continue;
+    }
+    for (UINT row = 0; SUCCEEDED(hr) && row < rows; ++row) {
+      if (!WriteFile(hFile, pLevels->pBits[level] + (SIZE_T)row * pLevels->pitch[level],
+                     rowBytes, &written, NULL)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+      }
+    }
+  }
+  CloseHandle(hFile);
+
+  if (SUCCEEDED(hr) && !MoveFileEx(partialPath, cachePath, MOVEFILE_REPLACE_EXISTING)) {
+    hr = HRESULT_FROM_WIN32(GetLastError());
+  }
+  if (FAILED(hr)) DeleteFile(partialPath);
+  return hr;
+}
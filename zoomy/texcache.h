@@ -0,0 +1,52 @@
+//--------------------------------------------------------------------------------------------------
+//
+// An on-disk cache of finished textures, so opening the same image again skips decoding,
+// filtering and compressing it.
+//
+// Each entry is a DDS file holding one texture exactly as it's laid out in the GPU format, with
+// its whole mip chain.  Entries are named after a hash of the source file's size, its last write
+// time and a sample of its contents, plus the texture's size and format; if any of those change
+// the name does too, and the stale entry simply stops being used.  Nothing is ever evicted;
+// the cache directory can be emptied at any time.
+//
+// Entries are only valid for the build of the pipeline that made them: the name also covers
+// TEXTURE_CACHE_VERSION, which goes up whenever the pixels that go into a texture change (how
+// mips are filtered, how level 0 is scaled), so older entries stop being used rather than
+// bringing back the old pixels.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <d3d9.h>
+#include "decode.h"
+
+// How textures are made.  Goes up whenever a change to decoding, scaling or filtering changes
+// the pixels they end up with.
+#define TEXTURE_CACHE_VERSION 3
+
+/**
+ * Hashes what identifies an image file's contents: its size, its last write time and a sample
+ * of its bytes.  Fails if it can't be opened.
+ */
+HRESULT HashImageFile(LPCSTR imagePath, ULONGLONG *pHash);
+
+/**
+ * Works out where the cached copy of an image's texture lives (whether or not it exists yet).
+ * pLevels gives the size of the texture; only the sizes in it are looked at.  pRegion is the
+ * part of the image the texture was made from, or NULL for all of it.  Fails if the image
+ * can't be opened.
+ */
+HRESULT TextureCachePath(LPCSTR cacheDirectory, LPCSTR imagePath, const RECT *pRegion,
+                         const TextureLevels *pLevels, D3DFORMAT format, CHAR *pCachePath);
+
+/**
+ * Copies a cached texture into pLevels (usually a texture's locked levels), which must match
+ * it in size and format.  Fails, leaving pLevels in an unknown state, if there's no such entry
+ * or it can't be read in full.
+ */
+HRESULT ReadTextureCache(LPCSTR cachePath, const TextureLevels *pLevels, D3DFORMAT format);
+
+/**
+ * Saves a filled-in texture to the cache.  The entry only appears once it's completely written.
+ */
+HRESULT WriteTextureCache(LPCSTR cachePath, const TextureLevels *pLevels, D3DFORMAT format);
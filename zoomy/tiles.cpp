@@ -0,0 +1,374 @@
+//--------------------------------------------------------------------------------------------------
+//
+// GPU tile residency.  See tiles.h.
+//
+// Every tile in the pyramid has an entry in pSlotOfTile saying which texture in the pool holds
+// it, if any.  Pool slots remember the last frame they were on screen, and the least recently
+// used one is recycled when a new tile needs a home.  Tiles are kept in the managed pool, so
+// they survive a lost device without any help from us.  9Ex devices have no managed pool, so
+// there the tiles are in the default pool and each one is read into a system-memory staging
+// texture first, then copied across.
+//
+//--------------------------------------------------------------------------------------------------
+#include "tiles.h"
+#include "display.h"
+#include <math.h>
+#include <stdlib.h>
+
+struct TileSlot {
+  LPDIRECT3DTEXTURE9 pTexture;
+  INT tile;               // Pyramid tile held here, or -1 if the slot is empty
+  UINT level, column, row;
+  UINT lastUsed;          // The last frame this tile was on screen
+};
+
+struct TileCandidate {
+  UINT column, row;
+  float distance;         // From the middle of the view, in tiles
+};
+
+struct TileCache {
+  LPDIRECT3DDEVICE9 pd3dDevice;
+  TilePyramid *pPyramid;
+  TileSlot *pSlots;
+  UINT slotCount;
+  LPDIRECT3DTEXTURE9 pStaging;  // Where tiles are read to first, when the slots can't be locked
+  INT *pSlotOfTile;       // One entry per pyramid tile; -1 when it isn't resident
+  UINT frame;
+  bool pending;           // Whether the last UpdateTileCache left tiles on screen for later
+  TileCandidate *pCandidates;
+  UINT candidateCapacity;
+};
+
+// An inclusive-exclusive range of tiles within one level
+struct TileRange {
+  INT column0, row0, column1, row1;
+};
+
+/**
+ * Picks the pyramid level whose texels come closest to one per screen pixel
+ */
+static UINT ChooseLevel(const TilePyramid *pPyramid, const ZoomRect &view, float target_width) {
+  float texelsPerPixel = (view.right - view.left) / target_width;
+  if (texelsPerPixel <= 1.0f) return 0;
+  INT level = (INT)floorf(logf(texelsPerPixel) / logf(2.0f) + 0.5f);
+  if (level >= (INT)pPyramid->levelCount) level = pPyramid->levelCount - 1;
+  return (UINT)level;
+}
+
+/**
+ * Works out which tiles of a level fall under view.  Returns FALSE if none do.
+ */
+static BOOL VisibleTiles(const TilePyramid *pPyramid, UINT level, const ZoomRect &view,
+                         TileRange *pRange) {
+  float scaleX = (float)pPyramid->width[0] / pPyramid->width[level],
+        scaleY = (float)pPyramid->height[0] / pPyramid->height[level];
+  INT columns = (INT)pPyramid->columns[level], rows = (INT)pPyramid->rows[level];
+
+  pRange->column0 = (INT)floorf(view.left / scaleX / TILE_CONTENT_SIZE);
+  pRange->row0 = (INT)floorf(view.top / scaleY / TILE_CONTENT_SIZE);
+  pRange->column1 = (INT)floorf(view.right / scaleX / TILE_CONTENT_SIZE) + 1;
+  pRange->row1 = (INT)floorf(view.bottom / scaleY / TILE_CONTENT_SIZE) + 1;
+  if (pRange->column0 < 0) pRange->column0 = 0;
+  if (pRange->row0 < 0) pRange->row0 = 0;
+  if (pRange->column1 > columns) pRange->column1 = columns;
+  if (pRange->row1 > rows) pRange->row1 = rows;
+  return pRange->column0 < pRange->column1 && pRange->row0 < pRange->row1;
+}
+
+static INT TileIndex(const TilePyramid *pPyramid, UINT level, UINT column, UINT row) {
+  return (INT)(pPyramid->firstTile[level] + row * pPyramid->columns[level] + column);
+}
+
+/**
+ * Finds a slot for a new tile: an empty one if there is one, otherwise the least recently used
+ * tile that isn't on screen this frame.  The coarsest level is never given up.  Returns -1 if
+ * every slot is busy.
+ */
+static INT FindFreeSlot(TileCache *pCache) {
+  INT best = -1;
+  UINT top = pCache->pPyramid->levelCount - 1;
+  for (UINT i = 0; i < pCache->slotCount; ++i) {
+    const TileSlot *pSlot = &pCache->pSlots[i];
+    if (pSlot->tile < 0) return (INT)i;
+    if (pSlot->lastUsed == pCache->frame || pSlot->level == top) continue;
+    if (best < 0 || pSlot->lastUsed < pCache->pSlots[best].lastUsed) best = (INT)i;
+  }
+  return best;
+}
+
+/**
+ * Reads a tile from the pyramid into a free slot's texture
+ */
+static HRESULT LoadTile(TileCache *pCache, UINT level, UINT column, UINT row) {
+  INT slotIndex = FindFreeSlot(pCache);
+  if (slotIndex < 0) return S_FALSE;
+  TileSlot *pSlot = &pCache->pSlots[slotIndex];
+
+  // Evict whatever was there
+  if (pSlot->tile >= 0) pCache->pSlotOfTile[pSlot->tile] = -1;
+  pSlot->tile = -1;
+
+  LPDIRECT3DTEXTURE9 pTarget = pCache->pStaging ? pCache->pStaging : pSlot->pTexture;
+  D3DLOCKED_RECT locked;
+  HRESULT hr = pTarget->LockRect(0, &locked, NULL, 0);
+  if (FAILED(hr)) return hr;
+  hr = ReadPyramidTile(pCache->pPyramid, level, column, row, (BYTE *)locked.pBits, locked.Pitch);
+  pTarget->UnlockRect(0);
+  if (SUCCEEDED(hr) && pCache->pStaging) {
+    hr = pCache->pd3dDevice->UpdateTexture(pCache->pStaging, pSlot->pTexture);
+  }
+  if (FAILED(hr)) return hr;
+
+  pSlot->tile = TileIndex(pCache->pPyramid, level, column, row);
+  pSlot->level = level;
+  pSlot->column = column;
+  pSlot->row = row;
+  pSlot->lastUsed = pCache->frame;
+  pCache->pSlotOfTile[pSlot->tile] = slotIndex;
+  return S_OK;
+}
+
+static int CompareCandidates(const void *pA, const void *pB) {
+  float a = ((const TileCandidate *)pA)->distance, b = ((const TileCandidate *)pB)->distance;
+  return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+HRESULT CreateTileCache(LPDIRECT3DDEVICE9 pd3dDevice, TilePyramid *pPyramid, UINT poolSize,
+                        TileCache **ppCache) {
+  *ppCache = NULL;
+
+  TileCache *pCache = new TileCache;
+  ZeroMemory(pCache, sizeof(TileCache));
+  pCache->pd3dDevice = pd3dDevice;
+  pCache->pPyramid = pPyramid;
+  pd3dDevice->AddRef();
+
+  pCache->pSlotOfTile = new INT[pPyramid->tileCount];
+  for (UINT i = 0; i < pPyramid->tileCount; ++i) pCache->pSlotOfTile[i] = -1;
+
+  // Make the pool.  If we run out of memory part way through, make do with what we got.
+  D3DPOOL pool = DrawTexturePool(pd3dDevice);
+  pCache->pSlots = new TileSlot[poolSize];
+  ZeroMemory(pCache->pSlots, sizeof(TileSlot) * poolSize);
+  for (UINT i = 0; i < poolSize; ++i) {
+    TileSlot *pSlot = &pCache->pSlots[pCache->slotCount];
+    if (FAILED(pd3dDevice->CreateTexture(TILE_TEXTURE_SIZE, TILE_TEXTURE_SIZE, 1, 0,
+                                         D3DFMT_A8R8G8B8, pool, &pSlot->pTexture, NULL))) {
+      break;
+    }
+    pSlot->tile = -1;
+    pCache->slotCount++;
+  }
+
+  // Default-pool slots can't be locked, so they're filled through a staging texture
+  HRESULT hr = pCache->slotCount > 1 ? S_OK : E_OUTOFMEMORY;
+  if (SUCCEEDED(hr) && D3DPOOL_DEFAULT == pool) {
+    hr = pd3dDevice->CreateTexture(TILE_TEXTURE_SIZE, TILE_TEXTURE_SIZE, 1, 0, D3DFMT_A8R8G8B8,
+                                   D3DPOOL_SYSTEMMEM, &pCache->pStaging, NULL);
+  }
+
+  // The coarsest level is a single tile, and it stays loaded for good
+  if (SUCCEEDED(hr)) hr = LoadTile(pCache, pPyramid->levelCount - 1, 0, 0);
+  if (FAILED(hr)) {
+    ReleaseTileCache(pCache);
+    return hr;
+  }
+
+  *ppCache = pCache;
+  return S_OK;
+}
+
+/**
+ * Marks the resident tiles of one level that fall under view as in use this frame, so they
+ * aren't evicted to make room for others
+ */
+static void TouchTiles(TileCache *pCache, const ZoomRect &view, UINT level) {
+  const TilePyramid *pPyramid = pCache->pPyramid;
+  TileRange range;
+  if (!VisibleTiles(pPyramid, level, view, &range)) return;
+  for (INT row = range.row0; row < range.row1; ++row) {
+    for (INT column = range.column0; column < range.column1; ++column) {
+      INT slot = pCache->pSlotOfTile[TileIndex(pPyramid, level, column, row)];
+      if (slot >= 0) pCache->pSlots[slot].lastUsed = pCache->frame;
+    }
+  }
+}
+
+/**
+ * Loads the tiles of one level under view that aren't resident yet, nearest the middle of the
+ * view first, taking one from *pBudget for each, and says in *pLeft whether the budget ran out
+ * before they were all in.  Returns S_FALSE if the pool ran out of slots that aren't in use
+ * this frame.
+ */
+static HRESULT LoadMissingTiles(TileCache *pCache, const ZoomRect &view, UINT level,
+                                UINT *pBudget, bool *pLeft) {
+  const TilePyramid *pPyramid = pCache->pPyramid;
+  TileRange range;
+  *pLeft = false;
+  if (0 == *pBudget || !VisibleTiles(pPyramid, level, view, &range)) return S_OK;
+  UINT visible = (UINT)((range.column1 - range.column0) * (range.row1 - range.row0));
+  if (visible > pCache->candidateCapacity) {
+    delete[] pCache->pCandidates;
+    pCache->pCandidates = new TileCandidate[visible];
+    pCache->candidateCapacity = visible;
+  }
+
+  float scaleX = (float)pPyramid->width[0] / pPyramid->width[level],
+        scaleY = (float)pPyramid->height[0] / pPyramid->height[level];
+  float centerColumn = (view.left + view.right) * 0.5f / scaleX / TILE_CONTENT_SIZE,
+        centerRow = (view.top + view.bottom) * 0.5f / scaleY / TILE_CONTENT_SIZE;
+  UINT missing = 0;
+  for (INT row = range.row0; row < range.row1; ++row) {
+    for (INT column = range.column0; column < range.column1; ++column) {
+      if (pCache->pSlotOfTile[TileIndex(pPyramid, level, column, row)] >= 0) continue;
+      TileCandidate *pCandidate = &pCache->pCandidates[missing++];
+      float dx = column + 0.5f - centerColumn, dy = row + 0.5f - centerRow;
+      pCandidate->column = (UINT)column;
+      pCandidate->row = (UINT)row;
+      pCandidate->distance = dx * dx + dy * dy;
+    }
+  }
+
+  // The middle of the screen is where people are looking, so it gets loaded first
+  qsort(pCache->pCandidates, missing, sizeof(TileCandidate), CompareCandidates);
+  UINT loaded = 0;
+  for (; loaded < missing && *pBudget > 0; ++loaded) {
+    HRESULT hr = LoadTile(pCache, level, pCache->pCandidates[loaded].column,
+                          pCache->pCandidates[loaded].row);
+    if (FAILED(hr) || S_FALSE == hr) return hr;
+    --*pBudget;
+  }
+  *pLeft = loaded < missing;
+
+  // Success
+  return S_OK;
+}
+
+HRESULT UpdateTileCache(TileCache *pCache, const ZoomRect &view, float target_width,
+                        UINT maxLoads) {
+  const TilePyramid *pPyramid = pCache->pPyramid;
+  UINT level = ChooseLevel(pPyramid, view, target_width);
+  pCache->frame++;
+
+  // Everything on screen at this level or coarser is drawn, so none of it can go
+  for (UINT coarser = level; coarser < pPyramid->levelCount; ++coarser) {
+    TouchTiles(pCache, view, coarser);
+  }
+
+  // An S_FALSE here means every slot is on screen; the pool is too small for this view, and
+  // what's missing won't ever come
+  bool left;
+  HRESULT hr = LoadMissingTiles(pCache, view, level, &maxLoads, &left);
+  pCache->pending = S_OK == hr && left;
+  return FAILED(hr) ? hr : S_OK;
+}
+
+HRESULT PrefetchTiles(TileCache *pCache, const ZoomRect *pViews, UINT viewCount,
+                      float target_width, UINT maxLoads) {
+  const TilePyramid *pPyramid = pCache->pPyramid;
+
+  // Claim everything the upcoming views need that's already here before loading anything, so
+  // a tile needed in half a second isn't evicted to make room for one needed in two
+  for (UINT i = 0; i < viewCount; ++i) {
+    TouchTiles(pCache, pViews[i], ChooseLevel(pPyramid, pViews[i], target_width));
+  }
+
+  // Then fill in the gaps in the order they'll be needed
+  for (UINT i = 0; i < viewCount && maxLoads > 0; ++i) {
+    bool left;
+    HRESULT hr = LoadMissingTiles(pCache, pViews[i], ChooseLevel(pPyramid, pViews[i], target_width),
+                                  &maxLoads, &left);
+    if (FAILED(hr)) return hr;
+    if (S_FALSE == hr) break;   // The lookahead needs more tiles than the pool can hold
+  }
+
+  // Success
+  return S_OK;
+}
+
+void DrawTiles(TileCache *pCache, const ZoomRect &view, float target_width, float target_height) {
+  LPDIRECT3DDEVICE9 pd3dDevice = pCache->pd3dDevice;
+  const TilePyramid *pPyramid = pCache->pPyramid;
+  UINT level = ChooseLevel(pPyramid, view, target_width);
+
+  // The gutters take care of filtering across tile edges, so clamp rather than wrap
+  pd3dDevice->SetSamplerState(0, D3DSAMP_ADDRESSU, D3DTADDRESS_CLAMP);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_ADDRESSV, D3DTADDRESS_CLAMP);
+  pd3dDevice->SetFVF(D3DFVF_XYZRHW | D3DFVF_TEX1);
+
+  float pixelsPerTexelX = target_width / (view.right - view.left),
+        pixelsPerTexelY = target_height / (view.bottom - view.top);
+
+  for (INT coarser = (INT)pPyramid->levelCount - 1; coarser >= (INT)level; --coarser) {
+    TileRange range;
+    if (!VisibleTiles(pPyramid, coarser, view, &range)) continue;
+
+    float scaleX = (float)pPyramid->width[0] / pPyramid->width[coarser],
+          scaleY = (float)pPyramid->height[0] / pPyramid->height[coarser];
+    for (INT row = range.row0; row < range.row1; ++row) {
+      for (INT column = range.column0; column < range.column1; ++column) {
+        INT slot = pCache->pSlotOfTile[TileIndex(pPyramid, coarser, column, row)];
+        if (slot < 0) continue;
+
+        // The part of the level this tile covers; the last row and column are cut short
+        UINT x0 = column * TILE_CONTENT_SIZE, y0 = row * TILE_CONTENT_SIZE;
+        UINT x1 = x0 + TILE_CONTENT_SIZE, y1 = y0 + TILE_CONTENT_SIZE;
+        if (x1 > pPyramid->width[coarser]) x1 = pPyramid->width[coarser];
+        if (y1 > pPyramid->height[coarser]) y1 = pPyramid->height[coarser];
+
+        float sx0 = (x0 * scaleX - view.left) * pixelsPerTexelX,
+              sy0 = (y0 * scaleY - view.top) * pixelsPerTexelY,
+              sx1 = (x1 * scaleX - view.left) * pixelsPerTexelX,
+              sy1 = (y1 * scaleY - view.top) * pixelsPerTexelY;
+        float u0 = (float)TILE_GUTTER / TILE_TEXTURE_SIZE,
+              v0 = u0,
+              u1 = (float)(TILE_GUTTER + x1 - x0) / TILE_TEXTURE_SIZE,
+              v1 = (float)(TILE_GUTTER + y1 - y0) / TILE_TEXTURE_SIZE;
+
+        struct {
+          FLOAT x,y,z,rhw;
+          FLOAT u, v;
+        } vertices[] = {
+          {sx0,sy1,0.5f,1,u0,v1},{sx0,sy0,0.5f,1,u0,v0},{sx1,sy0,0.5f,1,u1,v0},
+          {sx0,sy1,0.5f,1,u0,v1},{sx1,sy0,0.5f,1,u1,v0},{sx1,sy1,0.5f,1,u1,v1}
+        };
+        pd3dDevice->SetTexture(0, pCache->pSlots[slot].pTexture);
+        pd3dDevice->DrawPrimitiveUP(D3DPT_TRIANGLELIST, 2, (void*)vertices, sizeof(FLOAT)*6);
+      }
+    }
+  }
+
+  pd3dDevice->SetSamplerState(0, D3DSAMP_ADDRESSU, D3DTADDRESS_WRAP);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_ADDRESSV, D3DTADDRESS_WRAP);
+}
+
+void PreloadTileCache(TileCache *pCache) {
+  for (UINT i = 0; i < pCache->slotCount; ++i) {
+    if (pCache->pSlots[i].tile >= 0) pCache->pSlots[i].pTexture->PreLoad();
+  }
+}
+
+bool TilesPending(const TileCache *pCache) {
+  return pCache->pending;
+}
+
+float TileCacheImageWidth(const TileCache *pCache) {
+  return (float)pCache->pPyramid->width[0];
+}
+
+float TileCacheImageHeight(const TileCache *pCache) {
+  return (float)pCache->pPyramid->height[0];
+}
+
+void ReleaseTileCache(TileCache *pCache) {
+  if (!pCache) return;
+  for (UINT i = 0; i < pCache->slotCount; ++i) pCache->pSlots[i].pTexture->Release();
+  if (pCache->pStaging) pCache->pStaging->Release();
+  delete[] pCache->pSlots;
+  delete[] pCache->pSlotOfTile;
+  delete[] pCache->pCandidates;
+  ReleaseTilePyramid(pCache->pPyramid);
+  pCache->pd3dDevice->Release();
+  delete pCache;
+}
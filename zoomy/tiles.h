@@ -0,0 +1,71 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Streams the tiles of a TilePyramid through a fixed pool of textures.  Only the tiles covering
+// the current view, at the level of detail the view needs, are kept on the GPU.  While a tile
+// is on its way the coarser tiles behind it show through, and the coarsest level (a single
+// tile) never leaves, so there is always something on screen.
+//
+//   UpdateTileCache() - once per frame, before drawing; loads missing tiles within a budget
+//   PrefetchTiles()   - optionally, after that; loads tiles for where the camera is headed
+//   DrawTiles()       - between BeginScene and EndScene
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <d3d9.h>
+#include "pyramid.h"
+#include "zoomy.h"
+
+struct TileCache;
+
+/**
+ * Creates a cache of poolSize tile textures in front of pPyramid.  The cache takes ownership of
+ * the pyramid, even if creation fails, and releases it along with itself.
+ */
+HRESULT CreateTileCache(LPDIRECT3DDEVICE9 pd3dDevice, TilePyramid *pPyramid, UINT poolSize,
+                        TileCache **ppCache);
+
+/**
+ * Loads up to maxLoads of the tiles needed to draw view into a target target_width texels wide,
+ * nearest the middle of the view first.  Pass UINT_MAX to load everything that's missing, which
+ * is what offline export does so that no frame is ever drawn with blurry tiles.
+ */
+HRESULT UpdateTileCache(TileCache *pCache, const ZoomRect &view, float target_width,
+                        UINT maxLoads);
+
+/**
+ * Loads, within maxLoads, the tiles that the views in pViews will need.  The views are where the
+ * camera is going to be, soonest first, so that by the time the camera gets there its tiles are
+ * already on the GPU.  Tiles for these views are kept in preference to everything except what's
+ * on screen.  Call after UpdateTileCache.
+ */
+HRESULT PrefetchTiles(TileCache *pCache, const ZoomRect *pViews, UINT viewCount,
+                      float target_width, UINT maxLoads);
+
+/**
+ * Draws every resident tile under view, coarsest first, so the finest available detail ends
+ * up on top.
+ */
+void DrawTiles(TileCache *pCache, const ZoomRect &view, float target_width, float target_height);
+
+/**
+ * Uploads every resident tile now rather than when it's next drawn
+ */
+void PreloadTileCache(TileCache *pCache);
+
+/**
+ * Whether the last UpdateTileCache ran out of budget before the view's tiles were all in, so
+ * drawing the same view again would show more detail
+ */
+bool TilesPending(const TileCache *pCache);
+
+/**
+ * Size of the full-resolution image, in texels
+ */
+float TileCacheImageWidth(const TileCache *pCache);
+float TileCacheImageHeight(const TileCache *pCache);
+
+/**
+ * Frees the textures and the pyramid.  Safe to call with NULL.
+ */
+void ReleaseTileCache(TileCache *pCache);
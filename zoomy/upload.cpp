@@ -0,0 +1,163 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Chunked texture uploads.  See upload.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "upload.h"
+#include "clock.h"
+
+// How much each new measurement of the upload rate counts for against the ones before
+#define UPLOAD_RATE_WEIGHT 0.25
+
+struct TextureUpload {
+  LPDIRECT3DDEVICE9 pd3dDevice;
+  LPDIRECT3DTEXTURE9 pSource;   // In system memory
+  LPDIRECT3DTEXTURE9 pTarget;   // In the default pool, until it's taken
+  UINT levelCount;
+  UINT level;                   // The level being copied
+  UINT row;                     // The first row of it not copied yet
+};
+
+void InitUploadBudget(UploadBudget *pBudget, UINT refreshRate) {
+  ZeroMemory(pBudget, sizeof(UploadBudget));
+  pBudget->refreshSeconds = 1.0 / (refreshRate ? refreshRate : 60);
+  pBudget->frameStart = ClockSeconds();
+  pBudget->frameBytes = UPLOAD_MIN_FRAME_BYTES;
+}
+
+void BeginUploadFrame(UploadBudget *pBudget) {
+  pBudget->frameStart = ClockSeconds();
+
+  // Until an upload has been timed there's nothing to go on, so start small
+  double bytes = pBudget->bytesPerSecond > 0.0
+                     ? pBudget->slackSeconds * 0.5 * pBudget->bytesPerSecond
+                     : UPLOAD_MIN_FRAME_BYTES;
+  if (bytes < UPLOAD_MIN_FRAME_BYTES) bytes = UPLOAD_MIN_FRAME_BYTES;
+  if (bytes > UPLOAD_MAX_FRAME_BYTES) bytes = UPLOAD_MAX_FRAME_BYTES;
+  pBudget->frameBytes = (SIZE_T)bytes;
+}
+
+void EndUploadFrame(UploadBudget *pBudget) {
+  double slack = pBudget->refreshSeconds - (ClockSeconds() - pBudget->frameStart);
+  pBudget->slackSeconds = slack > 0.0 ? slack : 0.0;
+}
+
+/**
+ * Whether a format is stored in 4x4 blocks
+ */
+static bool IsBlockFormat(D3DFORMAT format) {
+  return D3DFMT_DXT1 == format || D3DFMT_DXT2 == format || D3DFMT_DXT3 == format ||
+         D3DFMT_DXT4 == format || D3DFMT_DXT5 == format;
+}
+
+/**
+ * How many rows of a level are copied together, and how many bytes each such run takes
+ */
+static void LevelRows(const D3DSURFACE_DESC &desc, UINT *pRowsPerUnit, UINT *pBytesPerUnit) {
+  if (IsBlockFormat(desc.Format)) {
+    *pRowsPerUnit = 4;
+    *pBytesPerUnit = (desc.Width + 3) / 4 * (D3DFMT_DXT1 == desc.Format ? 8 : 16);
+  } else {
+    *pRowsPerUnit = 1;
+    *pBytesPerUnit = desc.Width * 4;
+  }
+}
+
+HRESULT CreateTextureUpload(LPDIRECT3DDEVICE9 pd3dDevice, LPDIRECT3DTEXTURE9 pSource,
+                            DWORD usage, UINT levels, TextureUpload **ppUpload) {
+  *ppUpload = NULL;
+  D3DSURFACE_DESC desc;
+  HRESULT hr = pSource->GetLevelDesc(0, &desc);
+  if (FAILED(hr)) return hr;
+  if (D3DPOOL_SYSTEMMEM != desc.Pool) return E_INVALIDARG;
+
+  LPDIRECT3DTEXTURE9 pTarget;
+  UINT levelCount = pSource->GetLevelCount();
+  hr = pd3dDevice->CreateTexture(desc.Width, desc.Height, levels ? levels : levelCount, usage,
+                                 desc.Format, D3DPOOL_DEFAULT, &pTarget, NULL);
+  if (FAILED(hr)) return hr;
+  if (pTarget->GetLevelCount() < levelCount) levelCount = pTarget->GetLevelCount();
+
+  TextureUpload *pUpload = new TextureUpload;
+  ZeroMemory(pUpload, sizeof(TextureUpload));
+  pUpload->pd3dDevice = pd3dDevice;
+  pd3dDevice->AddRef();
+  pUpload->pSource = pSource;
+  pSource->AddRef();
+  pUpload->pTarget = pTarget;
+  pUpload->levelCount = levelCount;
+  *ppUpload = pUpload;
+  return S_OK;
+}
+
+HRESULT ContinueTextureUpload(TextureUpload *pUpload, UploadBudget *pBudget) {
+  if (pUpload->level == pUpload->levelCount) return S_OK;
+
+  double start = ClockSeconds();
+  ULONGLONG copied = 0;
+  HRESULT hr = S_OK;
+  while (pUpload->level < pUpload->levelCount && (!pBudget || pBudget->frameBytes > 0)) {
+    D3DSURFACE_DESC desc;
+    UINT rowsPerUnit, bytesPerUnit;
+    if (FAILED(hr = pUpload->pSource->GetLevelDesc(pUpload->level, &desc))) break;
+    LevelRows(desc, &rowsPerUnit, &bytesPerUnit);
+
+    // As many whole rows (or rows of blocks) as the budget has room for, but always at least one
+    UINT units = (desc.Height - pUpload->row + rowsPerUnit - 1) / rowsPerUnit;
+    if (pBudget) {
+      SIZE_T fit = pBudget->frameBytes / bytesPerUnit;
+      if (fit < 1) fit = 1;
+      if (fit < units) units = (UINT)fit;
+    }
+    UINT bottom = pUpload->row + units * rowsPerUnit;
+    if (bottom > desc.Height) bottom = desc.Height;
+
+    LPDIRECT3DSURFACE9 pSourceSurface, pTargetSurface;
+    if (FAILED(hr = pUpload->pSource->GetSurfaceLevel(pUpload->level, &pSourceSurface))) break;
+    if (SUCCEEDED(hr = pUpload->pTarget->GetSurfaceLevel(pUpload->level, &pTargetSurface))) {
+      RECT band = { 0, (LONG)pUpload->row, (LONG)desc.Width, (LONG)bottom };
+      POINT at = { 0, (LONG)pUpload->row };
+      hr = pUpload->pd3dDevice->UpdateSurface(pSourceSurface, &band, pTargetSurface, &at);
+      pTargetSurface->Release();
+    }
+    pSourceSurface->Release();
+    if (FAILED(hr)) break;
+
+    SIZE_T bytes = (SIZE_T)units * bytesPerUnit;
+    copied += bytes;
+    if (pBudget) {
+      pBudget->frameBytes = bytes < pBudget->frameBytes ? pBudget->frameBytes - bytes : 0;
+    }
+    pUpload->row = bottom;
+    if (pUpload->row == desc.Height) {
+      pUpload->row = 0;
+      ++pUpload->level;
+    }
+  }
+
+  // Keep up with how fast the copies go, so later frames know how much fits
+  double seconds = ClockSeconds() - start;
+  if (pBudget && copied && seconds > 0.0) {
+    double rate = copied / seconds;
+    pBudget->bytesPerSecond = pBudget->bytesPerSecond > 0.0
+                                  ? pBudget->bytesPerSecond +
+                                        (rate - pBudget->bytesPerSecond) * UPLOAD_RATE_WEIGHT
+                                  : rate;
+  }
+  if (FAILED(hr)) return hr;
+  return pUpload->level == pUpload->levelCount ? S_OK : S_FALSE;
+}
+
+LPDIRECT3DTEXTURE9 TakeUploadedTexture(TextureUpload *pUpload) {
+  LPDIRECT3DTEXTURE9 pTarget = pUpload->pTarget;
+  pUpload->pTarget = NULL;
+  return pTarget;
+}
+
+void ReleaseTextureUpload(TextureUpload *pUpload) {
+  if (!pUpload) return;
+  if (pUpload->pTarget) pUpload->pTarget->Release();
+  pUpload->pSource->Release();
+  pUpload->pd3dDevice->Release();
+  delete pUpload;
+}
@@ -0,0 +1,84 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Textures copied to the GPU a few rows at a time, so a big one never holds up a frame.
+//
+// On 9Ex devices every texture is filled in system memory and then copied into the default
+// pool.  Copying a full-resolution image in one UpdateTexture can take hundreds of milliseconds,
+// all inside one frame.  A TextureUpload does the same copy in bands of rows with UpdateSurface,
+// as many each frame as the frame has room for, while the proxy stays on screen.  The system-
+// memory texture the image was decoded into is itself the staging copy, so nothing is copied
+// twice.
+//
+// The room each frame has comes from an UploadBudget, which the live loops keep: how much of
+// the last refresh was left over once the frame was drawn, and how fast uploads have been going,
+// give how many bytes fit in this one.
+//
+//   BeginUploadFrame()      - at the top of each frame
+//   ContinueTextureUpload() - whenever there's something to upload
+//   EndUploadFrame()        - just before Present
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <d3d9.h>
+
+// However little room a frame has, it uploads at least this much, so an upload always finishes
+#define UPLOAD_MIN_FRAME_BYTES (256 * 1024)
+
+// And never more than this, however much room it seems to have
+#define UPLOAD_MAX_FRAME_BYTES (32 * 1024 * 1024)
+
+struct UploadBudget {
+  double refreshSeconds;        // How long one refresh lasts
+  double frameStart;            // When the current frame began
+  double slackSeconds;          // What the last frame left of its refresh
+  double bytesPerSecond;        // How fast uploads have been going, or 0 before the first
+  SIZE_T frameBytes;            // What the current frame can still upload
+};
+
+struct TextureUpload;
+
+/**
+ * Starts a budget for a display refreshing at refreshRate Hz (0 if unknown, taken as 60)
+ */
+void InitUploadBudget(UploadBudget *pBudget, UINT refreshRate);
+
+/**
+ * Works out how much this frame can upload.  A frame takes half of the last one's slack, so the
+ * upload never eats into what drawing needs.
+ */
+void BeginUploadFrame(UploadBudget *pBudget);
+
+/**
+ * Notes how much of the refresh the frame left over.  Call once the frame has been drawn, before
+ * Present (which waits for the refresh, so isn't work).
+ */
+void EndUploadFrame(UploadBudget *pBudget);
+
+/**
+ * Makes a default-pool texture like pSource, which must be in system memory, to copy it into,
+ * with usage and levels levels (0 for as many as pSource has).  Only pSource's levels are
+ * copied, so a target with more, such as a render target for a MipChainBuild to finish, gets
+ * just its top ones.  The upload holds a reference to pSource until it's released.
+ */
+HRESULT CreateTextureUpload(LPDIRECT3DDEVICE9 pd3dDevice, LPDIRECT3DTEXTURE9 pSource,
+                            DWORD usage, UINT levels, TextureUpload **ppUpload);
+
+/**
+ * Copies as much more of the texture as pBudget has room for this frame, and takes it out of
+ * the budget; with pBudget NULL, copies everything that's left.  Returns S_FALSE while there's
+ * more to copy, and S_OK once it's all on the GPU.
+ */
+HRESULT ContinueTextureUpload(TextureUpload *pUpload, UploadBudget *pBudget);
+
+/**
+ * Hands over the default-pool texture once ContinueTextureUpload has returned S_OK.  The
+ * caller owns the reference.
+ */
+LPDIRECT3DTEXTURE9 TakeUploadedTexture(TextureUpload *pUpload);
+
+/**
+ * Frees the upload, and the texture it was copying into if that wasn't taken.  Safe to call
+ * with NULL.
+ */
+void ReleaseTextureUpload(TextureUpload *pUpload);
@@ -0,0 +1,339 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Hardware video encoding through Media Foundation.  See video.h.
+//
+//--------------------------------------------------------------------------------------------------
+#include "video.h"
+#include <mfapi.h>
+#include <mfidl.h>
+#include <mfreadwrite.h>
+#include <dxva2api.h>
+#include <evr.h>
+#include <string.h>
+
+#pragma comment(lib,"mfplat.lib")
+#pragma comment(lib,"mfreadwrite.lib")
+#pragma comment(lib,"mfuuid.lib")
+#pragma comment(lib,"dxva2.lib")
+#pragma comment(lib,"evr.lib")
+
+// These come from SDKs newer than the one the project builds with.  HEVC is the 'HEVC' FOURCC
+// subtype; the attribute asking for hardware encoders is simply ignored by systems that don't
+// know it.
+static const GUID VIDEO_FORMAT_HEVC =
+    { 0x43564548, 0x0000, 0x0010, { 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 } };
+static const GUID VIDEO_ENABLE_HARDWARE_TRANSFORMS =
+    { 0xa634a91c, 0x822b, 0x41b9, { 0xa4, 0x94, 0x4d, 0xe4, 0x64, 0x36, 0x12, 0xb0 } };
+
+// Media Foundation times are in 100 ns units
+#define VIDEO_TIME_UNITS_PER_SECOND 10000000LL
+
+struct VideoFrame;
+
+/**
+ * Media Foundation calls this once everything else has released a frame's sample, handing the
+ * sample back to us
+ */
+class FrameReleasedCallback : public IMFAsyncCallback {
+public:
+  VideoFrame *pFrame;
+
+  STDMETHODIMP QueryInterface(REFIID riid, void **ppObject) {
+    if (IID_IUnknown == riid || IID_IMFAsyncCallback == riid) {
+      *ppObject = static_cast<IMFAsyncCallback *>(this);
+      return S_OK;
+    }
+    *ppObject = NULL;
+    return E_NOINTERFACE;
+  }
+
+  // It lives exactly as long as its frame, so there's nothing to count
+  STDMETHODIMP_(ULONG) AddRef() { return 1; }
+  STDMETHODIMP_(ULONG) Release() { return 1; }
+
+  STDMETHODIMP GetParameters(DWORD *, DWORD *) { return E_NOTIMPL; }
+  STDMETHODIMP Invoke(IMFAsyncResult *pResult);
+};
+
+struct VideoFrame {
+  LPDIRECT3DSURFACE9 pSurface;
+  IMFSample *pSample;           // Ours while the frame is idle, NULL while the encoder has it
+  HANDLE hIdle;                 // Set while the frame is idle
+  FrameReleasedCallback released;
+};
+
+struct VideoEncoder {
+  LPDIRECT3DDEVICE9 pd3dDevice;
+  bool started;                 // Whether MFStartup succeeded
+  IDirect3DDeviceManager9 *pDeviceManager;
+  IMFSinkWriter *pWriter;
+  DWORD stream;
+  UINT fps;
+  UINT framesWritten;
+  VideoFrame frames[VIDEO_FRAME_DEPTH];
+};
+
+STDMETHODIMP FrameReleasedCallback::Invoke(IMFAsyncResult *pResult) {
+  // If the sample can't be had back, EndVideoFrame just makes a new one
+  IUnknown *pObject;
+  if (SUCCEEDED(pResult->GetObject(&pObject))) {
+    if (FAILED(pObject->QueryInterface(IID_IMFSample, (void **)&pFrame->pSample))) {
+      pFrame->pSample = NULL;
+    }
+    pObject->Release();
+  }
+  SetEvent(pFrame->hIdle);
+  return S_OK;
+}
+
+bool IsVideoPath(LPCSTR path) {
+  LPCSTR extension = strrchr(path, '.');
+  return extension && 0 == lstrcmpi(extension, ".mp4");
+}
+
+/**
+ * Makes an uncompressed or encoded video media type for the frames
+ */
+static HRESULT CreateVideoType(REFGUID subtype, UINT width, UINT height, UINT fps, UINT bitrate,
+                               IMFMediaType **ppType) {
+  IMFMediaType *pType;
+  HRESULT hr = MFCreateMediaType(&pType);
+  if (FAILED(hr)) return hr;
+  hr = pType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
+  if (SUCCEEDED(hr)) hr = pType->SetGUID(MF_MT_SUBTYPE, subtype);
+  if (SUCCEEDED(hr) && bitrate) hr = pType->SetUINT32(MF_MT_AVG_BITRATE, bitrate);
+  if (SUCCEEDED(hr)) hr = pType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
+  if (SUCCEEDED(hr)) hr = MFSetAttributeSize(pType, MF_MT_FRAME_SIZE, width, height);
+  if (SUCCEEDED(hr)) hr = MFSetAttributeRatio(pType, MF_MT_FRAME_RATE, fps, 1);
+  if (SUCCEEDED(hr)) hr = MFSetAttributeRatio(pType, MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
+  if (FAILED(hr)) {
+    pType->Release();
+    return hr;
+  }
+  *ppType = pType;
+  return S_OK;
+}
+
+/**
+ * Creates the sink writer, with the display device shared through a DXVA2 device manager,
+ * and sets up its one stream
+ */
+static HRESULT CreateSinkWriter(VideoEncoder *pEncoder, UINT width, UINT height,
+                                const VideoSettings *pSettings, LPCSTR path) {
+  WCHAR widePath[MAX_PATH];
+  if (!MultiByteToWideChar(CP_ACP, 0, path, -1, widePath, MAX_PATH)) {
+    return HRESULT_FROM_WIN32(GetLastError());
+  }
+
+  UINT resetToken;
+  HRESULT hr = DXVA2CreateDirect3DDeviceManager9(&resetToken, &pEncoder->pDeviceManager);
+  if (SUCCEEDED(hr)) hr = pEncoder->pDeviceManager->ResetDevice(pEncoder->pd3dDevice, resetToken);
+
+  IMFAttributes *pAttributes = NULL;
+  if (SUCCEEDED(hr)) hr = MFCreateAttributes(&pAttributes, 2);
+  if (SUCCEEDED(hr)) hr = pAttributes->SetUnknown(MF_SINK_WRITER_D3D_MANAGER, pEncoder->pDeviceManager);
+  if (SUCCEEDED(hr)) hr = pAttributes->SetUINT32(VIDEO_ENABLE_HARDWARE_TRANSFORMS, TRUE);
+  if (SUCCEEDED(hr)) hr = MFCreateSinkWriterFromURL(widePath, NULL, pAttributes, &pEncoder->pWriter);
+  if (pAttributes) pAttributes->Release();
+
+  // About a tenth of a bit per pixel: 12 Mbit/s for 1080p60, 50 for 4K60
+  UINT bitrate = pSettings->bitrate ? pSettings->bitrate : width * height / 10 * pEncoder->fps;
+  REFGUID codec = CODEC_HEVC == pSettings->codec ? VIDEO_FORMAT_HEVC : MFVideoFormat_H264;
+  IMFMediaType *pOutputType = NULL, *pInputType = NULL;
+  if (SUCCEEDED(hr)) hr = CreateVideoType(codec, width, height, pEncoder->fps, bitrate, &pOutputType);
+  if (SUCCEEDED(hr)) hr = pEncoder->pWriter->AddStream(pOutputType, &pEncoder->stream);
+  if (SUCCEEDED(hr)) hr = CreateVideoType(MFVideoFormat_RGB32, width, height, pEncoder->fps, 0, &pInputType);
+  if (SUCCEEDED(hr)) hr = pEncoder->pWriter->SetInputMediaType(pEncoder->stream, pInputType, NULL);
+  if (pInputType)  pInputType->Release();
+  if (pOutputType) pOutputType->Release();
+  return hr;
+}
+
+HRESULT CreateVideoEncoder(LPDIRECT3DDEVICE9 pd3dDevice, UINT width, UINT height, UINT fps,
+                           const VideoSettings *pSettings, LPCSTR path, VideoEncoder **ppEncoder) {
+  *ppEncoder = NULL;
+  if ((width & 1) || (height & 1) || 0 == fps) return E_INVALIDARG;
+
+  // The encoder uses the device from its own threads
+  D3DDEVICE_CREATION_PARAMETERS creation;
+  HRESULT hr = pd3dDevice->GetCreationParameters(&creation);
+  if (FAILED(hr)) return hr;
+  if (!(creation.BehaviorFlags & D3DCREATE_MULTITHREADED)) return E_INVALIDARG;
+
+  VideoEncoder *pEncoder = new VideoEncoder;
+  ZeroMemory(pEncoder, sizeof(VideoEncoder));
+  pEncoder->pd3dDevice = pd3dDevice;
+  pEncoder->fps = fps;
+  pd3dDevice->AddRef();
+
+  if (SUCCEEDED(hr = MFStartup(MF_VERSION))) pEncoder->started = true;
+  if (SUCCEEDED(hr)) hr = CreateSinkWriter(pEncoder, width, height, pSettings, path);
+
+  // The frames are lockable so that, where the encoder can only take system memory, Media
+  // Foundation can still read them
+  for (UINT i = 0; SUCCEEDED(hr) && i < VIDEO_FRAME_DEPTH; ++i) {
+    VideoFrame *pFrame = &pEncoder->frames[i];
+    pFrame->released.pFrame = pFrame;
+    if (NULL == (pFrame->hIdle = CreateEvent(NULL, TRUE, TRUE, NULL))) {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    if (SUCCEEDED(hr)) {
+      hr = pd3dDevice->CreateRenderTarget(width, height, D3DFMT_X8R8G8B8, D3DMULTISAMPLE_NONE, 0,
+                                          TRUE, &pFrame->pSurface, NULL);
+    }
+    if (SUCCEEDED(hr)) hr = MFCreateVideoSampleFromSurface(pFrame->pSurface, &pFrame->pSample);
+  }
+
+  if (SUCCEEDED(hr)) hr = pEncoder->pWriter->BeginWriting();
+  if (FAILED(hr)) {
+    ReleaseVideoEncoder(pEncoder);
+    return hr;
+  }
+
+  *ppEncoder = pEncoder;
+  return S_OK;
+}
+
+LPDIRECT3DSURFACE9 BeginVideoFrame(VideoEncoder *pEncoder) {
+  VideoFrame *pFrame = &pEncoder->frames[pEncoder->framesWritten % VIDEO_FRAME_DEPTH];
+  WaitForSingleObject(pFrame->hIdle, INFINITE);
+  return pFrame->pSurface;
+}
+
+HRESULT EndVideoFrame(VideoEncoder *pEncoder) {
+  UINT frame = pEncoder->framesWritten;
+  VideoFrame *pFrame = &pEncoder->frames[frame % VIDEO_FRAME_DEPTH];
+
+  // Frame N starts at exactly N / fps seconds
+  LONGLONG start = (LONGLONG)frame * VIDEO_TIME_UNITS_PER_SECOND / pEncoder->fps;
+  LONGLONG next = (LONGLONG)(frame + 1) * VIDEO_TIME_UNITS_PER_SECOND / pEncoder->fps;
+  HRESULT hr = S_OK;
+  if (!pFrame->pSample) hr = MFCreateVideoSampleFromSurface(pFrame->pSurface, &pFrame->pSample);
+  if (SUCCEEDED(hr)) hr = pFrame->pSample->SetSampleTime(start);
+  if (SUCCEEDED(hr)) hr = pFrame->pSample->SetSampleDuration(next - start);
+
+  // Ask to be told when the encoder is done with the sample
+  IMFTrackedSample *pTracked = NULL;
+  if (SUCCEEDED(hr)) hr = pFrame->pSample->QueryInterface(IID_IMFTrackedSample, (void **)&pTracked);
+  if (SUCCEEDED(hr)) hr = pTracked->SetAllocator(&pFrame->released, NULL);
+  if (pTracked) pTracked->Release();
+  if (FAILED(hr)) return hr;
+
+  // Give our reference up whether or not the write worked.  The callback hands the sample
+  // back once nothing else holds it.
+  ResetEvent(pFrame->hIdle);
+  IMFSample *pSample = pFrame->pSample;
+  pFrame->pSample = NULL;
+  hr = pEncoder->pWriter->WriteSample(pEncoder->stream, pSample);
+  pSample->Release();
+  if (FAILED(hr)) return hr;
+
+  pEncoder->framesWritten++;
+  return S_OK;
+}
+
+HRESULT FinishVideoEncoder(VideoEncoder *pEncoder) {
+  return pEncoder->pWriter->Finalize();
+}
+
+void ReleaseVideoEncoder(VideoEncoder *pEncoder) {
+  if (!pEncoder) return;
+
+  // Shutting the writer down releases any samples it still has, which hands them back to us
+  if (pEncoder->pWriter) pEncoder->pWriter->Release();
+  for (UINT i = 0; i < VIDEO_FRAME_DEPTH; ++i) {
+    VideoFrame *pFrame = &pEncoder->frames[i];
+    if (pFrame->hIdle) {
+      WaitForSingleObject(pFrame->hIdle, INFINITE);
+      CloseHandle(pFrame->hIdle);
+    }
+    if (pFrame->pSample)  pFrame->pSample->Release();
+    if (pFrame->pSurface) pFrame->pSurface->Release();
+  }
+  if (pEncoder->pDeviceManager) pEncoder->pDeviceManager->Release();
+  if (pEncoder->started) MFShutdown();
+  pEncoder->pd3dDevice->Release();
+  delete pEncoder;
+}
+
+/**
+ * Copies every sample of the reader's video stream into the writer, offset to start at
+ * *pOffset, and moves *pOffset on to where the last one ends
+ */
+static HRESULT CopyVideoSamples(IMFSourceReader *pReader, IMFSinkWriter *pWriter, DWORD stream,
+                                LONGLONG *pOffset) {
+  LONGLONG end = *pOffset;
+  for (;;) {
+    DWORD flags;
+    LONGLONG time;
+    IMFSample *pSample = NULL;
+    HRESULT hr = pReader->ReadSample((DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM, 0, NULL, &flags,
+                                     &time, &pSample);
+    if (FAILED(hr)) return hr;
+
+    // Only the end of the stream is a clean finish; stopping on an error would leave a short
+    // file that looks complete
+    if (flags & MF_SOURCE_READERF_ERROR) {
+      if (pSample) pSample->Release();
+      return E_FAIL;
+    }
+    if (!pSample) {
+      if (flags & MF_SOURCE_READERF_ENDOFSTREAM) break;
+      continue;
+    }
+
+    LONGLONG duration = 0;
+    pSample->GetSampleDuration(&duration);
+    hr = pSample->SetSampleTime(time + *pOffset);
+    if (SUCCEEDED(hr)) hr = pWriter->WriteSample(stream, pSample);
+    pSample->Release();
+    if (FAILED(hr)) return hr;
+    if (time + *pOffset + duration > end) end = time + *pOffset + duration;
+    if (flags & MF_SOURCE_READERF_ENDOFSTREAM) break;
+  }
+  *pOffset = end;
+  return S_OK;
+}
+
+HRESULT ConcatenateVideos(const LPCSTR *pPaths, UINT count, LPCSTR path) {
+  WCHAR widePath[MAX_PATH];
+  if (!MultiByteToWideChar(CP_ACP, 0, path, -1, widePath, MAX_PATH)) {
+    return HRESULT_FROM_WIN32(GetLastError());
+  }
+  HRESULT hr = MFStartup(MF_VERSION);
+  if (FAILED(hr)) return hr;
+
+  // The writer's stream takes the first file's encoded type as both its input and output, so
+  // it's written as it is, with no encoder in between
+  IMFSinkWriter *pWriter = NULL;
+  DWORD stream = 0;
+  LONGLONG offset = 0;
+  for (UINT i = 0; SUCCEEDED(hr) && i < count; ++i) {
+    WCHAR widePart[MAX_PATH];
+    if (!MultiByteToWideChar(CP_ACP, 0, pPaths[i], -1, widePart, MAX_PATH)) {
+      hr = HRESULT_FROM_WIN32(GetLastError());
+      break;
+    }
+    IMFSourceReader *pReader = NULL;
+    IMFMediaType *pType = NULL;
+    hr = MFCreateSourceReaderFromURL(widePart, NULL, &pReader);
+    if (SUCCEEDED(hr)) hr = pReader->SetStreamSelection((DWORD)MF_SOURCE_READER_ALL_STREAMS, FALSE);
+    if (SUCCEEDED(hr)) hr = pReader->SetStreamSelection((DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM, TRUE);
+    if (SUCCEEDED(hr)) {
+      hr = pReader->GetNativeMediaType((DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM, 0, &pType);
+    }
+    if (SUCCEEDED(hr) && !pWriter) {
+      hr = MFCreateSinkWriterFromURL(widePath, NULL, NULL, &pWriter);
+      if (SUCCEEDED(hr)) hr = pWriter->AddStream(pType, &stream);
+      if (SUCCEEDED(hr)) hr = pWriter->SetInputMediaType(stream, pType, NULL);
+      if (SUCCEEDED(hr)) hr = pWriter->BeginWriting();
+    }
+    if (SUCCEEDED(hr)) hr = CopyVideoSamples(pReader, pWriter, stream, &offset);
+    if (pType)   pType->Release();
+    if (pReader) pReader->Release();
+  }
+  if (SUCCEEDED(hr) && pWriter) hr = pWriter->Finalize();
+  if (pWriter) pWriter->Release();
+  MFShutdown();
+  return hr;
+}
@@ -0,0 +1,83 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Hardware video encoding of exported frames, straight into an MP4 file, through the Media
+// Foundation sink writer.
+//
+// The sink writer is given the display device through a DXVA2 device manager, so frames never
+// leave the GPU: each one is rendered into one of a small ring of render targets, which is
+// handed to the encoder as it is.  Once the encoder lets go of a frame (Media Foundation
+// tracks this for us), its target is drawn into again.  Where the encoder can't take Direct3D 9
+// surfaces, Media Foundation locks them and it works, just with a copy.
+//
+// The device has to be created with D3DCREATE_MULTITHREADED, since the encoder uses it from its
+// own threads.
+//
+// Files rendered in parts (see segment.h) are put back together by ConcatenateVideos, which
+// copies the encoded frames across without decoding them.
+//
+// Usage:
+//   CreateVideoEncoder(...)
+//   for each frame:
+//     BeginVideoFrame()  - returns the target to draw the frame into
+//     ... draw ...
+//     EndVideoFrame()    - hands it to the encoder
+//   FinishVideoEncoder() - finishes the file
+//   ReleaseVideoEncoder()
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+#include <d3d9.h>
+#include "options.h"
+
+// Render targets in flight.  The hardware encoders we've tried hold on to two or three frames
+// of lookahead.
+#define VIDEO_FRAME_DEPTH 4
+
+struct VideoSettings {
+  UINT codec;                   // One of the CODEC_ values
+  UINT bitrate;                 // Bits per second, or 0 to pick one from the size and frame rate
+};
+
+struct VideoEncoder;
+
+/**
+ * Whether a path is written as video (it ends in ".mp4") rather than as frames
+ */
+bool IsVideoPath(LPCSTR path);
+
+/**
+ * Starts an MP4 file at path encoded from width x height frames at fps.  Both dimensions must
+ * be even.
+ */
+HRESULT CreateVideoEncoder(LPDIRECT3DDEVICE9 pd3dDevice, UINT width, UINT height, UINT fps,
+                           const VideoSettings *pSettings, LPCSTR path, VideoEncoder **ppEncoder);
+
+/**
+ * Waits until the next frame's render target is free and returns it (not AddRef'd)
+ */
+LPDIRECT3DSURFACE9 BeginVideoFrame(VideoEncoder *pEncoder);
+
+/**
+ * Sends the frame drawn into the target from BeginVideoFrame to the encoder
+ */
+HRESULT EndVideoFrame(VideoEncoder *pEncoder);
+
+/**
+ * Encodes whatever frames the encoder is still holding and closes the file
+ */
+HRESULT FinishVideoEncoder(VideoEncoder *pEncoder);
+
+/**
+ * Frees everything.  If FinishVideoEncoder wasn't called the file is left incomplete.  Safe to
+ * call with NULL.
+ */
+void ReleaseVideoEncoder(VideoEncoder *pEncoder);
+
+/**
+ * Writes the video of count MP4 files, one after the other, into one MP4 at path.  The frames
+ * are copied as they are, not encoded again, so the files must all have been encoded the same
+ * way (by the same encoder, at the same size and settings), and each must start on a key frame,
+ * as every file CreateVideoEncoder makes does.
+ */
+HRESULT ConcatenateVideos(const LPCSTR *pPaths, UINT count, LPCSTR path);
@@ -0,0 +1,196 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Worker thread pool.  See workqueue.h.
+//
+// Items sit in a singly linked FIFO protected by a critical section; a semaphore counts them so
+// idle threads sleep until there's something to do.
+//
+//--------------------------------------------------------------------------------------------------
+#include "workqueue.h"
+#include <objbase.h>
+#include <process.h>
+
+struct WorkItem {
+  WORKPROC pProc;
+  void *pContext;
+  WorkItem *pNext;
+};
+
+struct WorkQueue {
+  CRITICAL_SECTION lock;
+  WorkItem *pHead, *pTail;
+  HANDLE hItems;                      // Semaphore counting queued items
+  bool stopping;
+  HANDLE hThreads[WORKQUEUE_MAX_THREADS];
+  UINT threadCount;
+};
+
+/**
+ * One ParallelFor call.  It lives on the heap and is reference counted, because helper items
+ * can start after the caller has already finished all the work and returned.
+ */
+struct ParallelBatch {
+  volatile LONG refs;
+  volatile LONG next;                 // Next index to hand out
+  volatile LONG done;                 // How many indices have finished
+  LONG count;
+  PARALLELPROC pProc;
+  void *pContext;
+  HANDLE hDone;
+};
+
+static unsigned __stdcall WorkerThread(void *pParameter) {
+  WorkQueue *pQueue = (WorkQueue *)pParameter;
+  CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+  for (;;) {
+    WaitForSingleObject(pQueue->hItems, INFINITE);
+
+    EnterCriticalSection(&pQueue->lock);
+    WorkItem *pItem = pQueue->pHead;
+    if (pItem) {
+      pQueue->pHead = pItem->pNext;
+      if (!pQueue->pHead) pQueue->pTail = NULL;
+    }
+    bool stopping = pQueue->stopping;
+    LeaveCriticalSection(&pQueue->lock);
+
+    // An empty queue after a wake-up only happens when we're being shut down
+    if (!pItem) {
+      if (stopping) break;
+      continue;
+    }
+    pItem->pProc(pItem->pContext);
+    delete pItem;
+  }
+
+  CoUninitialize();
+  return 0;
+}
+
+HRESULT CreateWorkQueue(UINT threadCount, WorkQueue **ppQueue) {
+  *ppQueue = NULL;
+
+  if (0 == threadCount) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    threadCount = info.dwNumberOfProcessors > 1 ? info.dwNumberOfProcessors - 1 : 1;
+  }
+  if (threadCount > WORKQUEUE_MAX_THREADS) threadCount = WORKQUEUE_MAX_THREADS;
+
+  WorkQueue *pQueue = new WorkQueue;
+  ZeroMemory(pQueue, sizeof(WorkQueue));
+  InitializeCriticalSection(&pQueue->lock);
+  pQueue->hItems = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+  if (!pQueue->hItems) {
+    DeleteCriticalSection(&pQueue->lock);
+    delete pQueue;
+    return HRESULT_FROM_WIN32(GetLastError());
+  }
+
+  for (UINT i = 0; i < threadCount; ++i) {
+    HANDLE hThread = (HANDLE)_beginthreadex(NULL, 0, WorkerThread, pQueue, 0, NULL);
+    if (!hThread) break;
+    pQueue->hThreads[pQueue->threadCount++] = hThread;
+  }
+  if (0 == pQueue->threadCount) {
+    ReleaseWorkQueue(pQueue);
+    return E_OUTOFMEMORY;
+  }
+
+  *ppQueue = pQueue;
+  return S_OK;
+}
+
+void QueueWork(WorkQueue *pQueue, WORKPROC pProc, void *pContext) {
+  WorkItem *pItem = new WorkItem;
+  pItem->pProc = pProc;
+  pItem->pContext = pContext;
+  pItem->pNext = NULL;
+
+  EnterCriticalSection(&pQueue->lock);
+  if (pQueue->pTail) pQueue->pTail->pNext = pItem;
+  else               pQueue->pHead = pItem;
+  pQueue->pTail = pItem;
+  LeaveCriticalSection(&pQueue->lock);
+
+  ReleaseSemaphore(pQueue->hItems, 1, NULL);
+}
+
+static void ReleaseBatch(ParallelBatch *pBatch) {
+  if (0 == InterlockedDecrement(&pBatch->refs)) {
+    CloseHandle(pBatch->hDone);
+    delete pBatch;
+  }
+}
+
+/**
+ * Takes indices from the batch until they run out.  Run by the caller and by every helper.
+ */
+static void RunBatch(ParallelBatch *pBatch) {
+  for (;;) {
+    LONG index = InterlockedIncrement(&pBatch->next) - 1;
+    if (index >= pBatch->count) break;
+    pBatch->pProc((UINT)index, pBatch->pContext);
+    if (InterlockedIncrement(&pBatch->done) == pBatch->count) SetEvent(pBatch->hDone);
+  }
+}
+
+static void BatchHelper(void *pContext) {
+  ParallelBatch *pBatch = (ParallelBatch *)pContext;
+  RunBatch(pBatch);
+  ReleaseBatch(pBatch);
+}
+
+void ParallelFor(WorkQueue *pQueue, UINT count, PARALLELPROC pProc, void *pContext) {
+  if (0 == count) return;
+
+  // Don't bother the pool with a single item, or when there's no pool
+  UINT helpers = pQueue ? pQueue->threadCount : 0;
+  if (helpers > count - 1) helpers = count - 1;
+  if (0 == helpers) {
+    for (UINT i = 0; i < count; ++i) pProc(i, pContext);
+    return;
+  }
+
+  ParallelBatch *pBatch = new ParallelBatch;
+  pBatch->refs = (LONG)helpers + 1;
+  pBatch->next = 0;
+  pBatch->done = 0;
+  pBatch->count = (LONG)count;
+  pBatch->pProc = pProc;
+  pBatch->pContext = pContext;
+  pBatch->hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+  for (UINT i = 0; i < helpers; ++i) QueueWork(pQueue, BatchHelper, pBatch);
+  RunBatch(pBatch);
+  WaitForSingleObject(pBatch->hDone, INFINITE);
+  ReleaseBatch(pBatch);
+}
+
+UINT WorkQueueThreadCount(const WorkQueue *pQueue) {
+  return pQueue->threadCount;
+}
+
+void ReleaseWorkQueue(WorkQueue *pQueue) {
+  if (!pQueue) return;
+
+  // Wake every thread once more; each one leaves when it finds the queue empty
+  EnterCriticalSection(&pQueue->lock);
+  pQueue->stopping = true;
+  LeaveCriticalSection(&pQueue->lock);
+  ReleaseSemaphore(pQueue->hItems, pQueue->threadCount, NULL);
+
+  WaitForMultipleObjects(pQueue->threadCount, pQueue->hThreads, TRUE, INFINITE);
+  for (UINT i = 0; i < pQueue->threadCount; ++i) CloseHandle(pQueue->hThreads[i]);
+
+  // Anything queued by a work item after the last thread left is dropped
+  while (pQueue->pHead) {
+    WorkItem *pNext = pQueue->pHead->pNext;
+    delete pQueue->pHead;
+    pQueue->pHead = pNext;
+  }
+  CloseHandle(pQueue->hItems);
+  DeleteCriticalSection(&pQueue->lock);
+  delete pQueue;
+}
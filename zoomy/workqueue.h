@@ -0,0 +1,47 @@
+//--------------------------------------------------------------------------------------------------
+//
+// A pool of worker threads for the slow parts of loading images, so the UI thread never has to
+// wait on them.  Work items are plain function pointers with a context; whoever queues an item
+// is responsible for finding out when it's done (usually with an event).
+//
+// Worker threads initialize COM for the multithreaded apartment, so items can use WIC.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+#include <windows.h>
+
+// Upper limit on the pool size, however many cores the machine has
+#define WORKQUEUE_MAX_THREADS 32
+
+typedef void (*WORKPROC)(void *pContext);
+typedef void (*PARALLELPROC)(UINT index, void *pContext);
+
+struct WorkQueue;
+
+/**
+ * Starts threadCount worker threads.  Passing 0 starts one per core, less one for the UI
+ * thread, and at least one.
+ */
+HRESULT CreateWorkQueue(UINT threadCount, WorkQueue **ppQueue);
+
+/**
+ * Runs pProc(pContext) on the next free worker thread
+ */
+void QueueWork(WorkQueue *pQueue, WORKPROC pProc, void *pContext);
+
+/**
+ * Runs pProc(i, pContext) for every i in [0, count) across the pool and waits for them all.
+ * The calling thread works through the items too, so this is safe to call from inside a work
+ * item without deadlocking a busy pool.
+ */
+void ParallelFor(WorkQueue *pQueue, UINT count, PARALLELPROC pProc, void *pContext);
+
+/**
+ * Number of worker threads in the pool
+ */
+UINT WorkQueueThreadCount(const WorkQueue *pQueue);
+
+/**
+ * Finishes everything that's been queued, then stops the threads.  Safe to call with NULL.
+ */
+void ReleaseWorkQueue(WorkQueue *pQueue);
@@ -8,11 +8,30 @@
 //        W + left-click: set starting bottom-right
 //        E + left-click: set ending top-left
 //        R + left-click: set ending bottom-right
-//  4. Hold down the space bar to zoom from the start coordinates to the end coordinates.
+//        A: keep the ending box as a stop on the way, so E/R can set up the next one
+//        Z: take all the stops out again
+//  4. Hold down the space bar to zoom from the start coordinates, through any stops, to the end
+//     coordinates.
+//        P: play or pause the zoom without holding anything down
+//        B: turn it around, so it plays (and space runs it) backwards
+//        Left/Right arrows, mouse wheel: scrub through it
+//        Page Up/Page Down: jump back or on by a tenth of it
+//        Home/End: jump to the start or the end
 //
 // If you want to record this zooming, open up a screen recorder like Open Broadcaster Software
-// (available from http://obsproject.com/) and use this app as an input.  Be sure your monitor is
-// in 1920x1080 resolution if you want a 1080p recording.
+// (available from http://obsproject.com/) and use this app as an input.  Everything is drawn at
+// the display's resolution unless "-output 1080p" (or another size) says otherwise, in which
+// case the window shows it letterboxed; capture it with "-present shared" to get it full size.
+//
+// T shows how long frames are taking in an overlay (see telemetry.h).
+//
+// Alternatively, start the app with "-export <path>" and press X once the coordinates are set.
+// The zoom is then rendered offscreen at a fixed frame rate and written straight to disk, which
+// never drops a frame and gives the same output every time.  See options.h for the details.
+// "-benchmark <report.json>" times loading and zooming a fixed set of images (see bench.h).
+// Whole shot lists can be rendered the same way, with nobody at the keyboard, using
+// "-batch <file>" (see batch.h), and "-slideshow <file>" plays a list of images live, one
+// crossfading into the next.
 //
 // Happy coding!
 // @OgreYonder
@@ -23,9 +42,33 @@
 #include <windows.h>    // Standard Windows header
 #include <d3dx9.h>      // Extended functions for managing Direct3D
 #include <d3d9.h>       // Basic Direct3D functionality
+#include <limits.h>     // UINT_MAX
+#include <string.h>     // memcmp
+#include <float.h>      // FLT_MAX
+#include "options.h"    // Command-line switches
+#include "accum.h"      // Supersampled export frames
+#include "batch.h"      // Shot lists rendered without a window
+#include "bench.h"      // Synthetic images and the benchmark report
+#include "export.h"     // Offline rendering to image sequences, raw streams and video
+#include "filter.h"     // The shader filter for -filter lanczos
+#include "imagecache.h" // Decoded images shared between batch jobs and slides
+#include "camera.h"     // Where the view is at each point of the zoom
+#include "clock.h"      // High-resolution timing
+#include "display.h"    // Device creation for each present mode
+#include "picture.h"    // Loading and drawing the image
+#include "preview.h"    // Letterboxed preview of an output resolution that isn't the display's
+#include "project.h"    // Sessions saved between runs
+#include "segment.h"    // Batch renders split across processes
+#include "share.h"      // Frames shared with capture software
+#include "telemetry.h"  // Frame-time measurements and the overlay
+#include "texcache.h"   // Image hashes for projects
+#include "tiles.h"      // Tiled streaming for images bigger than a texture
+#include "workqueue.h"  // Worker threads for decoding
+#include "zoomy.h"      // Types shared with the other modules
 
 // Link required libraries
 #pragma comment(lib,"d3d9.lib")
+#pragma comment(lib,"winmm.lib")
 #ifdef _DEBUG
   #pragma comment(lib,"d3dx9d.lib")
 #else
@@ -33,42 +76,27 @@
 #endif
 
 /**
- * Sets up the Direct3D device
+ * Sets the render states we draw with.  A device reset puts them back to their defaults, so
+ * this is called again after every reset.
  */
-LPDIRECT3DDEVICE9 CreateD3DDevice(HWND hWnd,
-                                  LPDIRECT3D9 pD3D,
-                                  D3DPRESENT_PARAMETERS *pPresentationParameters) {
-
-  // Set up the structure used to create the Direct3D device.
-  D3DPRESENT_PARAMETERS d3dpp; 
-  ZeroMemory(&d3dpp, sizeof(d3dpp));
-  d3dpp.Windowed = TRUE;
-  d3dpp.SwapEffect = D3DSWAPEFFECT_DISCARD;
-  d3dpp.EnableAutoDepthStencil = TRUE;
-  d3dpp.AutoDepthStencilFormat = D3DFMT_D16;
-  d3dpp.hDeviceWindow = hWnd;
-  d3dpp.PresentationInterval = D3DPRESENT_INTERVAL_ONE; // Lock to VSYNC
-
-  // Create the device
-  LPDIRECT3DDEVICE9 pd3dDevice;
-  if (FAILED(pD3D->CreateDevice(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, hWnd,
-                                D3DCREATE_SOFTWARE_VERTEXPROCESSING,
-                                &d3dpp, &pd3dDevice))) {
-    return NULL;
-  }
-
-  // Copy the parameters structure
-  CopyMemory(pPresentationParameters, &d3dpp, sizeof(d3dpp));
-
-  // Return the device
-  return pd3dDevice;
+void SetRenderStates(LPDIRECT3DDEVICE9 pd3dDevice) {
+  pd3dDevice->SetRenderState(D3DRS_ZENABLE,  FALSE);
+  pd3dDevice->SetRenderState(D3DRS_LIGHTING, FALSE);
+  pd3dDevice->SetRenderState(D3DRS_FOGENABLE,    FALSE);
+  pd3dDevice->SetRenderState(D3DRS_DITHERENABLE, TRUE);
+  pd3dDevice->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+
+  // Set the filters for texture sampling and mipmapping
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MIPFILTER, D3DTEXF_ANISOTROPIC);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MINFILTER, D3DTEXF_ANISOTROPIC);
+  pd3dDevice->SetSamplerState(0, D3DSAMP_MAGFILTER, D3DTEXF_ANISOTROPIC);
 }
 
 /**
  * Handles the Windows message pump
  */
 BOOL HandleMessagePump(FLOAT *pElapsedTime) {
-  static FLOAT last_frame_time = GetTickCount() / 1000.0f;
+  static double last_frame_time = ClockSeconds();
 
   // Used to process messages
   MSG msg;
@@ -86,11 +114,11 @@ BOOL HandleMessagePump(FLOAT *pElapsedTime) {
 
   // Calculate the number of seconds since the last frame
   if(pElapsedTime) {
-    float fTime = GetTickCount() / 1000.0f;
-    *pElapsedTime = fTime - last_frame_time;
+    double fTime = ClockSeconds();
+    *pElapsedTime = (FLOAT)(fTime - last_frame_time);
     last_frame_time = fTime;
   } else {
-    last_frame_time = GetTickCount() / 1000.0f;
+    last_frame_time = ClockSeconds();
   }
 
   // Success
@@ -98,14 +126,19 @@ BOOL HandleMessagePump(FLOAT *pElapsedTime) {
 }
 
 
+// How far the mouse wheel has turned since the main loop last looked, in WHEEL_DELTA a notch
+static int wheel_turned = 0;
+
 /**
  * Windows message handler.  Our version simply posts a quit message when the window is closed,
- * and gives all other messages to the default procedure.
+ * keeps count of the mouse wheel, and gives all other messages to the default procedure.
  */
 LRESULT WINAPI WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
     // Exit when the window is closed
     if(uMsg == WM_CLOSE) {
       PostQuitMessage(0);
+    } else if(uMsg == WM_MOUSEWHEEL) {
+      wheel_turned += GET_WHEEL_DELTA_WPARAM(wParam);
     } else {
       // Pass this message to the default processor
       return DefWindowProc(hWnd, uMsg, wParam, lParam);
@@ -195,25 +228,1089 @@ float PutScreenOverCoordinates(bool coords_in_dimensions, float *top, float *lef
   return scaling;
 }
 
+// How many tiles may be read from disk per frame during live playback.  Export ignores this and
+// always waits for every tile.
+#define TILE_LOADS_PER_FRAME 4
+
+// How many on the frame after a seek, so the view it lands on comes in sharp straight away
+#define SEEK_TILE_LOADS 32
+
+// How fast holding the left or right arrow scrubs through the zoom, in seconds per second
+#define SCRUB_SPEED 4.0
+
+// How far each notch of the mouse wheel moves the zoom, in seconds
+#define WHEEL_SEEK_SECONDS 0.25
+
+// How much of the zoom Page Up and Page Down jump over
+#define PAGE_SEEK_SHARE 0.1
+
+// The prefetcher looks at where the camera will be this many times per second of lookahead
+#define PREFETCH_SAMPLES_PER_SECOND 8
+#define PREFETCH_MAX_SAMPLES        128
+
+// How often the zoom is looked at to find the part of the image -crop loads
+#define CROP_SAMPLES_PER_SECOND 30
+
+// While idle with a load under way, how often the loop wakes to show its progress (milliseconds)
+#define IDLE_LOAD_POLL_MS 100
+
+// Samples per frame -samples auto starts out with, before it has timed anything
+#define EXPORT_AUTO_FIRST_SAMPLES 4
+
+/**
+ * Fits every key's view to the screen's shape, the way the boxes picked with Q/W/E/R always
+ * have been, into pFitted.  *pNarrowest gets the width of the narrowest view.
+ */
+void FitCameraKeys(const CameraKey *pKeys, UINT keyCount, float screen_width, float screen_height,
+                   CameraKey *pFitted, float *pNarrowest) {
+  *pNarrowest = FLT_MAX;
+  for (UINT i = 0; i < keyCount; ++i) {
+    pFitted[i] = pKeys[i];
+    ZoomRect &view = pFitted[i].view;
+    PutScreenOverCoordinates(false, &view.top, &view.left, &view.bottom, &view.right, screen_width, screen_height);
+    if (view.right - view.left < *pNarrowest) *pNarrowest = view.right - view.left;
+  }
+}
+
+/**
+ * The keys of a tour picked with Q/W/E/R: the start box, any stops, then the end box, each leg
+ * taking the same share of `time`.  Returns how many there are.
+ */
+UINT MakeTourKeys(const ZoomRect &start, const ZoomRect *pStops, UINT stopCount,
+                  const ZoomRect &end, float time, CameraKey *pKeys) {
+  UINT key_count = 0;
+  float leg = time / (stopCount + 1);
+  CameraKey first = { start, leg, EASE_LINEAR };
+  pKeys[key_count++] = first;
+  for (UINT i = 0; i < stopCount; ++i) {
+    CameraKey stop = { pStops[i], leg, EASE_LINEAR };
+    pKeys[key_count++] = stop;
+  }
+  CameraKey last = { end, 0.0f, EASE_LINEAR };
+  pKeys[key_count++] = last;
+  return key_count;
+}
+
+/**
+ * The path of the zoom is known ahead of time, so rather than waiting to find out which tiles
+ * are missing when they come on screen, ask for the ones it will need over the next
+ * pOptions->lookahead seconds, starting `seconds` into it, and going back towards the start if
+ * it's playing backwards.  Does nothing for untiled pictures.
+ */
+void PrefetchZoomPath(const Picture *pPicture, const ZoomyOptions *pOptions,
+                      const CameraTrack *pTrack, double seconds, float target_width,
+                      bool backwards) {
+  if (!pPicture->pTiles || 0 == pOptions->prefetchBudget) return;
+
+  ZoomRect views[PREFETCH_MAX_SAMPLES];
+  UINT count = 0;
+  for (UINT sample = 0; count < PREFETCH_MAX_SAMPLES; ++sample) {
+    float ahead = (float)sample / PREFETCH_SAMPLES_PER_SECOND;
+    if (ahead > pOptions->lookahead) break;
+    double when = backwards ? seconds - ahead : seconds + ahead;
+    views[count++] = CameraTrackView(pTrack, when);
+
+    // Past either end of the zoom the camera stops moving
+    if (when <= 0.0 || when >= pTrack->duration) break;
+  }
+  PrefetchTiles(pPicture->pTiles, views, count, target_width, pOptions->prefetchBudget);
+}
+
+/**
+ * With -crop, has the picture load only the part of the image pTrack shows, with the margin
+ * around it, at the detail its narrowest view needs.  A zoom can swing out between its keys, so
+ * the track is looked at all along its length rather than only at them.  Returns what
+ * CropPicture does, or S_FALSE with -crop off.
+ */
+HRESULT CropToZoomPath(Picture *pPicture, const ZoomyOptions *pOptions,
+                       const CameraTrack *pTrack, float screen_width) {
+  if (pOptions->cropMargin < 0.0f || !pTrack->pSamples) return S_FALSE;
+
+  ZoomRect region = CameraTrackView(pTrack, 0.0);
+  float narrowest = region.right - region.left;
+  UINT samples = (UINT)(pTrack->duration * CROP_SAMPLES_PER_SECOND) + 1;
+  for (UINT sample = 1; sample <= samples; ++sample) {
+    ZoomRect view = CameraTrackView(pTrack, pTrack->duration * sample / samples);
+    if (view.left < region.left) region.left = view.left;
+    if (view.top < region.top) region.top = view.top;
+    if (view.right > region.right) region.right = view.right;
+    if (view.bottom > region.bottom) region.bottom = view.bottom;
+    if (view.right - view.left < narrowest) narrowest = view.right - view.left;
+  }
+
+  float margin_x = (region.right - region.left) * pOptions->cropMargin,
+        margin_y = (region.bottom - region.top) * pOptions->cropMargin;
+  region.left -= margin_x;
+  region.top -= margin_y;
+  region.right += margin_x;
+  region.bottom += margin_y;
+  float scale = narrowest > 0.0f ? screen_width * (1.0f + pOptions->cropMargin) / narrowest : 1.0f;
+  return CropPicture(pPicture, region, scale);
+}
+
+/**
+ * Starts loading the image for the interactive session.  When the project already has the
+ * boxes, -crop is asked for straight away, while the proxy is still decoding, so the crop is
+ * loaded in place of the full-resolution image rather than after it.
+ */
+HRESULT OpenProjectPicture(LPDIRECT3DDEVICE9 pd3dDevice, WorkQueue *pQueue,
+                           const ZoomyOptions *pOptions, const Project *pProject,
+                           LPCSTR imagePath, UINT proxy_width, UINT proxy_height,
+                           float screen_width, float screen_height, Picture *pPicture) {
+  HRESULT hr = OpenPicture(pd3dDevice, pQueue, imagePath, pOptions, proxy_width, proxy_height,
+                           NULL, false, pPicture);
+  if (FAILED(hr) || !pProject->hasBoxes || pOptions->cropMargin < 0.0f) return hr;
+
+  CameraKey keys[CAMERA_MAX_KEYS], fitted[CAMERA_MAX_KEYS];
+  UINT key_count = MakeTourKeys(pProject->start, pProject->stops, pProject->stopCount,
+                                pProject->end, pOptions->time, keys);
+  float narrowest;
+  FitCameraKeys(keys, key_count, screen_width, screen_height, fitted, &narrowest);
+  CameraTrack track;
+  if (SUCCEEDED(BakeCameraTrack(fitted, key_count, &track))) {
+    CropToZoomPath(pPicture, pOptions, &track, screen_width);
+    ReleaseCameraTrack(&track);
+  }
+  return hr;
+}
+
+/**
+ * Writes the project out if it has changed since it was last saved
+ */
+void SaveProjectChanges(LPCSTR path, const Project *pProject, Project *pSaved) {
+  if (0 == memcmp(pProject, pSaved, sizeof(Project))) return;
+  if (FAILED(WriteProject(path, pProject))) {
+    OutputDebugString("Pan-Zoom Image: couldn't save the project\n");
+  }
+  *pSaved = *pProject;
+}
+
+/**
+ * Shows how far along the full-resolution load is in the title bar while it runs
+ */
+void ShowLoadProgress(HWND hWnd, const Picture *pPicture) {
+  static int shown = -1;
+  int percent = IsPictureLoading(pPicture) ? (int)(PictureLoadProgress(pPicture) * 100.0f) : -1;
+  if (percent == shown) return;
+  shown = percent;
+
+  char title[64];
+  if (percent < 0) {
+    lstrcpy(title, "Pan-Zoom Image");
+  } else if (pPicture->pTexture || pPicture->pTiles) {
+    wsprintf(title, "Pan-Zoom Image - loading full resolution %d%%", percent);
+  } else {
+    lstrcpy(title, "Pan-Zoom Image - loading");
+  }
+  SetWindowText(hWnd, title);
+}
+
+/**
+ * Shows where live playback is in the title bar, to a tenth of a second
+ */
+void ShowPlayhead(HWND hWnd, const CameraPlayhead *pPlayhead, const CameraTrack *pTrack) {
+  UINT at = (UINT)(pPlayhead->seconds * 10.0 + 0.5), length = (UINT)(pTrack->duration * 10.0 + 0.5);
+  char title[96];
+  wsprintf(title, "Pan-Zoom Image - %u.%u of %u.%u seconds, %s%s", at / 10, at % 10, length / 10,
+           length % 10, pPlayhead->playing ? "playing" : "paused",
+           pPlayhead->rate < 0.0 ? " backwards" : "");
+  SetWindowText(hWnd, title);
+}
+
+/**
+ * Keeps the window alive until the picture has something to show or, with full_resolution,
+ * until it has finished loading.  Returns S_FALSE if the user closed the window or pressed ESC
+ * in the meantime.
+ */
+HRESULT WaitForPicture(HWND hWnd, Picture *pPicture, bool full_resolution) {
+  for (;;) {
+    HRESULT hr = UpdatePicture(pPicture, NULL);
+    ShowLoadProgress(hWnd, pPicture);
+    if (S_FALSE != hr) return hr;
+    if (!full_resolution && (pPicture->pTexture || pPicture->pTiles)) return S_OK;
+
+    // Wake up for input, or every so often to check on the workers
+    MsgWaitForMultipleObjects(0, NULL, FALSE, 15, QS_ALLINPUT);
+    if (!HandleMessagePump(NULL)) {
+      PostQuitMessage(0);
+      return S_FALSE;
+    }
+    if (GetKeyState(VK_ESCAPE) & 0x80) return S_FALSE;
+  }
+}
+
+/**
+ * Renders the whole zoom along pTrack into outputPath at a fixed timestep.  Frame N
+ * always shows the view at N / fps seconds, no matter how long it takes to draw, so the result
+ * is identical on every run.  Messages are pumped between frames so the window stays alive;
+ * ESC stops the export (and, as usual, the app) early, in which case S_FALSE is returned.
+ *
+ * With -samples, every frame averages that many jittered views (see accum.h).  With -samples
+ * auto, the count is worked out again after every second of output, from how long the frames
+ * of the second before took, so the export runs at about real time.  GPUs that can't add up
+ * samples get one per frame.
+ *
+ * With -segment, only that segment's frames are rendered (see segment.h).  Frames are drawn
+ * through pFilter, if it isn't NULL (see filter.h).
+ *
+ * If pNext is set, that picture is kept loading in the background while this one renders, and
+ * the first error it hits is left in *pNextResult.
+ */
+HRESULT ExportZoom(HWND hWnd, LPDIRECT3DDEVICE9 pd3dDevice, WorkQueue *pQueue,
+                   ImageFilter *pFilter, const Picture *pPicture, const ZoomyOptions *pOptions,
+                   LPCSTR outputPath, const CameraTrack *pTrack, float screen_width,
+                   float screen_height, Picture *pNext, HRESULT *pNextResult) {
+  UINT exportFps = pOptions->exportFps;
+  float fps = (float)exportFps;
+
+  // Include both the start and the end frame
+  UINT first = 0, frames = CountZoomFrames(pTrack->duration, exportFps);
+  bool segment = pOptions->segment && SEGMENT_JOIN != pOptions->segment,
+       last = !segment || pOptions->segment == pOptions->segmentCount;
+  char segmentPath[MAX_PATH];
+  if (segment) {
+    GetSegmentFrames(frames, pOptions->segment, pOptions->segmentCount, &first, &frames);
+    if (first == frames) {
+      BatchLog("  segment %u of %u has none of its frames", pOptions->segment,
+               pOptions->segmentCount);
+      return S_OK;
+    }
+    HRESULT hr = GetSegmentOutputPath(outputPath, pOptions->segment, pOptions->segmentCount,
+                                      segmentPath);
+    if (FAILED(hr)) return hr;
+    outputPath = segmentPath;
+  }
+
+  VideoSettings video = { pOptions->codec, pOptions->bitrate };
+  FrameExporter *pExporter;
+  HRESULT hr = CreateFrameExporter(pd3dDevice, pQueue, (UINT)screen_width, (UINT)screen_height,
+                                   exportFps, &video, outputPath, first, segment, last,
+                                   &pExporter);
+  if (FAILED(hr)) return hr;
+
+  UINT samples = pOptions->exportSamples;
+  SampleAccumulator *pAccum = NULL;
+  if (1 != samples &&
+      FAILED(CreateSampleAccumulator(pd3dDevice, (UINT)screen_width, (UINT)screen_height,
+                                     &pAccum))) {
+    samples = 1;
+  }
+  bool adapt = 0 == samples;
+  if (adapt) samples = EXPORT_AUTO_FIRST_SAMPLES;
+  double second_start = ClockSeconds();
+
+  for (UINT frame = first; SUCCEEDED(hr) && frame < frames; ++frame) {
+
+    // Keep the window alive, and give the user a way out
+    if (!HandleMessagePump(NULL)) {
+      PostQuitMessage(0);
+      hr = S_FALSE;
+      break;
+    }
+    if (GetKeyState(VK_ESCAPE) & 0x80) {
+      hr = S_FALSE;
+      break;
+    }
+
+    // The device can still be lost while we're rendering offscreen (e.g. the workstation is
+    // locked).  Give up on this export rather than writing garbage frames.
+    if (FAILED(hr = pd3dDevice->TestCooperativeLevel())) break;
+
+    // Let the user know how far along we are, once per second of output, and fit the sample
+    // count to how long the last second took
+    if ((frame - first) % exportFps == 0) {
+      double now = ClockSeconds();
+      if (adapt && frame > first) {
+        samples = AdaptSampleCount(samples, (now - second_start) / exportFps, 1.0 / fps);
+      }
+      second_start = now;
+      char title[96];
+      if (pAccum) {
+        wsprintf(title, "Pan-Zoom Image - exporting frame %u of %u, %u samples", frame + 1,
+                 frames, samples);
+      } else {
+        wsprintf(title, "Pan-Zoom Image - exporting frame %u of %u", frame + 1, frames);
+      }
+      SetWindowText(hWnd, title);
+    }
+
+    // Move the next picture along while this one renders
+    if (pNext && SUCCEEDED(*pNextResult)) {
+      HRESULT hrNext = UpdatePicture(pNext, NULL);
+      if (FAILED(hrNext)) *pNextResult = hrNext;
+    }
+
+    if (FAILED(hr = BeginExportFrame(pExporter))) break;
+    if (SUCCEEDED(pd3dDevice->BeginScene())) {
+      // Every frame waits for all of its tiles, so no frame ever shows blurry ones
+      if (pAccum && samples > 1 && SUCCEEDED(hr = BeginSamples(pAccum, samples))) {
+        float opacity = SampleOpacity(samples);
+        for (UINT sample = 0; sample < samples; ++sample) {
+          float t, dx, dy;
+          GetSampleJitter(sample, samples, pOptions->shutter, &t, &dx, &dy);
+          ZoomRect view = CameraTrackView(pTrack, (frame + t) / fps);
+          float sx = (view.right - view.left) / screen_width,
+                sy = (view.bottom - view.top) / screen_height;
+          view.left += dx * sx;
+          view.right += dx * sx;
+          view.top += dy * sy;
+          view.bottom += dy * sy;
+          DrawPictureBlended(pd3dDevice, pPicture, view, screen_width, screen_height, UINT_MAX,
+                             pFilter, opacity);
+        }
+        hr = ResolveSamples(pAccum);
+      } else if (SUCCEEDED(hr)) {
+        ZoomRect view = CameraTrackView(pTrack, (double)frame / fps);
+        pd3dDevice->Clear(0, NULL, D3DCLEAR_TARGET, D3DCOLOR_XRGB(0,0,0), 1.0f, 0);
+        DrawPicture(pd3dDevice, pPicture, view, screen_width, screen_height, UINT_MAX, pFilter);
+      }
+      pd3dDevice->EndScene();
+    }
+    if (SUCCEEDED(hr)) hr = EndExportFrame(pExporter);
+  }
+
+  // Write whatever is still in flight, even if we were cancelled
+  HRESULT hrFinish = FinishFrameExporter(pExporter);
+  ReleaseFrameExporter(pExporter);
+  ReleaseSampleAccumulator(pAccum);
+  SetWindowText(hWnd, "Pan-Zoom Image");
+  return FAILED(hr) ? hr : (FAILED(hrFinish) ? hrFinish : hr);
+}
+
+/**
+ * Reads the session's project, if there is one yet, and applies its switches underneath the
+ * command line's own.  Returns false, once it has said why, if the project can't be used.
+ */
+bool ResumeProject(LPCSTR projectPath, LPCSTR lpCmdLine, ZoomyOptions *pOptions,
+                   Project *pProject) {
+  ZeroMemory(pProject, sizeof(Project));
+  if (INVALID_FILE_ATTRIBUTES == GetFileAttributes(projectPath)) return true;
+
+  UINT errorLine;
+  HRESULT hr = ReadProject(projectPath, pProject, &errorLine);
+  if (FAILED(hr)) {
+    char message[MAX_PATH + 96];
+    if (errorLine) {
+      wsprintf(message, "%s(%u): didn't understand this line of the project", projectPath,
+               errorLine);
+    } else {
+      wsprintf(message, "Couldn't read the project %s (error 0x%08X)", projectPath, (UINT)hr);
+    }
+    MessageBox(NULL, message, "Pan-Zoom Image", MB_OK | MB_ICONERROR);
+    return false;
+  }
+
+  // Parse the project's switches first, so the command line's win
+  CHAR savedPath[MAX_PATH];
+  lstrcpy(savedPath, projectPath);
+  char *pLine = new char[lstrlen(pProject->switches) + lstrlen(lpCmdLine) + 2];
+  lstrcpy(pLine, pProject->switches);
+  lstrcat(pLine, " ");
+  lstrcat(pLine, lpCmdLine);
+  BOOL parsed = ParseCommandLine(pLine, pOptions);
+  delete[] pLine;
+  if (!parsed) return false;
+  lstrcpy(pOptions->projectPath, savedPath);
+
+  // The boxes are in image pixels, so they only fit the image they were set on
+  ULONGLONG hash;
+  if (pProject->sourceHash && SUCCEEDED(HashImageFile(pProject->imagePath, &hash)) &&
+      hash != pProject->sourceHash) {
+    MessageBox(NULL, "The image has changed since this project was saved, so its boxes may not "
+               "be where they were.", "Pan-Zoom Image", MB_OK | MB_ICONWARNING);
+  }
+  return true;
+}
+
+/**
+ * Whether any job after `job` uses the same image, so it's worth keeping in the image cache
+ */
+bool ImageUsedLater(const BatchJob *pJobs, UINT jobCount, UINT job) {
+  for (UINT later = job + 1; later < jobCount; ++later) {
+    if (0 == lstrcmpi(pJobs[later].imagePath, pJobs[job].imagePath)) return true;
+  }
+  return false;
+}
+
+/**
+ * Reports how the image cache did, at the end of a batch or slideshow.  Does nothing without one.
+ */
+void LogImageCache(ImageCache *pImageCache) {
+  if (!pImageCache) return;
+  ImageCacheStats stats;
+  GetImageCacheStats(pImageCache, &stats);
+  BatchLog("Image cache: %u hits, %u misses, %u evictions", stats.hits, stats.misses,
+           stats.evictions);
+}
+
+/**
+ * Starts loading a batch job's image.  The whole zoom is known up front, so with -compress auto
+ * it's loaded uncompressed from the start if it ever magnifies the image, and with -crop only
+ * the part it shows is loaded at all.  The image comes from pImageCache (which may be NULL) if
+ * it's there, and with keepImage goes into it if it isn't.
+ */
+HRESULT OpenBatchPicture(LPDIRECT3DDEVICE9 pd3dDevice, WorkQueue *pQueue,
+                         const ZoomyOptions *pOptions, const BatchJob *pJob,
+                         ImageCache *pImageCache, bool keepImage,
+                         UINT proxy_width, UINT proxy_height,
+                         float screen_width, float screen_height, Picture *pPicture) {
+  CameraKey keys[CAMERA_MAX_KEYS];
+  float narrowest;
+  FitCameraKeys(pJob->keys, pJob->keyCount, screen_width, screen_height, keys, &narrowest);
+  ZoomyOptions jobOptions = *pOptions;
+  if (COMPRESS_AUTO == jobOptions.compress && narrowest < screen_width) {
+    jobOptions.compress = COMPRESS_OFF;
+  }
+  HRESULT hr = OpenPicture(pd3dDevice, pQueue, pJob->imagePath, &jobOptions, proxy_width,
+                           proxy_height, pImageCache, keepImage, pPicture);
+
+  // A slide that's only an image has its zoom made once its size is known
+  CameraTrack track;
+  if (SUCCEEDED(hr) && pJob->keyCount && SUCCEEDED(BakeCameraTrack(keys, pJob->keyCount, &track))) {
+    CropToZoomPath(pPicture, pOptions, &track, screen_width);
+    ReleaseCameraTrack(&track);
+  }
+  return hr;
+}
+
+/**
+ * Renders every job of a batch file, one after another.  Job N + 1 starts decoding as soon as
+ * job N has finished loading, so it's decoded while job N renders, and every frame is encoded
+ * on the work queue while the next ones render, so the GPU doesn't wait between clips.  A job
+ * that fails is reported and skipped.  Images more than one job uses are kept in pImageCache
+ * (if it isn't NULL) until the last of them.  Returns how many jobs weren't rendered.
+ */
+UINT RunBatch(HWND hWnd, LPDIRECT3DDEVICE9 pd3dDevice, WorkQueue *pQueue, ImageCache *pImageCache,
+              ImageFilter *pFilter, const ZoomyOptions *pOptions, const BatchJob *pJobs,
+              UINT jobCount, UINT proxy_width, UINT proxy_height, float screen_width,
+              float screen_height) {
+  if (0 == jobCount) return 0;
+
+  // Jobs alternate between the two pictures
+  Picture pictures[2];
+  HRESULT results[2] = { S_OK, S_OK };
+  ZeroMemory(pictures, sizeof(pictures));
+  results[0] = OpenBatchPicture(pd3dDevice, pQueue, pOptions, &pJobs[0], pImageCache,
+                                ImageUsedLater(pJobs, jobCount, 0), proxy_width, proxy_height,
+                                screen_width, screen_height, &pictures[0]);
+
+  UINT rendered = 0;
+  double batch_start = ClockSeconds();
+  for (UINT job = 0; job < jobCount; ++job) {
+    const BatchJob *pJob = &pJobs[job];
+    Picture *pPicture = &pictures[job % 2], *pNext = &pictures[(job + 1) % 2];
+    HRESULT *pResult = &results[job % 2], *pNextResult = &results[(job + 1) % 2];
+    BatchLog("Job %u of %u: %s", job + 1, jobCount, pJob->imagePath);
+
+    // Exports are always made from the full-resolution image
+    HRESULT hr = *pResult;
+    if (SUCCEEDED(hr)) hr = WaitForPicture(hWnd, pPicture, true);
+    if (S_FALSE == hr) break;
+    if (SUCCEEDED(hr) && !pPicture->pTexture && !pPicture->pTiles) hr = E_FAIL;
+
+    // Get the next image decoding on the workers while this one renders
+    bool more = job + 1 < jobCount;
+    if (more) {
+      *pNextResult = OpenBatchPicture(pd3dDevice, pQueue, pOptions, &pJobs[job + 1], pImageCache,
+                                      ImageUsedLater(pJobs, jobCount, job + 1), proxy_width,
+                                      proxy_height, screen_width, screen_height, pNext);
+    }
+
+    double job_start = ClockSeconds();
+    CameraKey keys[CAMERA_MAX_KEYS];
+    CameraTrack track;
+    float narrowest;
+    FitCameraKeys(pJob->keys, pJob->keyCount, screen_width, screen_height, keys, &narrowest);
+    if (SUCCEEDED(hr)) hr = BakeCameraTrack(keys, pJob->keyCount, &track);
+    if (SUCCEEDED(hr)) {
+      hr = ExportZoom(hWnd, pd3dDevice, pQueue, pFilter, pPicture, pOptions, pJob->outputPath,
+                      &track, screen_width, screen_height, more ? pNext : NULL, pNextResult);
+      ReleaseCameraTrack(&track);
+    }
+    ReleasePicture(pPicture);
+    if (S_FALSE == hr) break;
+
+    if (SUCCEEDED(hr)) {
+      BatchLog("  wrote %s in %u ms", pJob->outputPath,
+               (UINT)((ClockSeconds() - job_start) * 1000.0));
+      ++rendered;
+    } else {
+      BatchLog("  failed (error 0x%08X)", (UINT)hr);
+    }
+  }
+
+  // Stop anything left over from a cancelled batch
+  ReleasePicture(&pictures[0]);
+  ReleasePicture(&pictures[1]);
+  BatchLog("%u of %u jobs rendered in %u s", rendered, jobCount,
+           (UINT)(ClockSeconds() - batch_start + 0.5));
+  LogImageCache(pImageCache);
+  return jobCount - rendered;
+}
+
+/**
+ * Starts loading the first slide from `job` on whose image can be opened.  Returns its index, or
+ * slideCount if there are none left.
+ */
+UINT OpenSlide(LPDIRECT3DDEVICE9 pd3dDevice, WorkQueue *pQueue, ImageCache *pImageCache,
+               const ZoomyOptions *pOptions, const BatchJob *pSlides, UINT slideCount, UINT job,
+               UINT proxy_width, UINT proxy_height, float screen_width, float screen_height,
+               Picture *pPicture) {
+  for (; job < slideCount; ++job) {
+    if (SUCCEEDED(OpenBatchPicture(pd3dDevice, pQueue, pOptions, &pSlides[job], pImageCache,
+                                   ImageUsedLater(pSlides, slideCount, job), proxy_width,
+                                   proxy_height, screen_width, screen_height, pPicture))) {
+      break;
+    }
+    BatchLog("Couldn't open %s", pSlides[job].imagePath);
+  }
+  return job;
+}
+
+/**
+ * Bakes the zoom for a slide once its picture knows how big it is.  A slide that's only an image
+ * zooms from the whole of it to the middle over -time seconds.  With -compress auto, brings the
+ * uncompressed texture back if the zoom magnifies the image.
+ */
+HRESULT BakeSlideTrack(const ZoomyOptions *pOptions, const BatchJob *pSlide, Picture *pPicture,
+                       float screen_width, float screen_height, CameraTrack *pTrack) {
+  CameraKey keys[CAMERA_MAX_KEYS], fitted[CAMERA_MAX_KEYS];
+  UINT key_count = pSlide->keyCount;
+  if (key_count) {
+    CopyMemory(keys, pSlide->keys, key_count * sizeof(CameraKey));
+  } else {
+    float w = pPicture->width, h = pPicture->height;
+    CameraKey whole = { { 0.0f, 0.0f, w, h }, pOptions->time, EASE_LINEAR },
+              middle = { { w / 6.0f, h / 6.0f, w * 5.0f / 6.0f, h * 5.0f / 6.0f }, 0.0f, EASE_LINEAR };
+    keys[0] = whole;
+    keys[1] = middle;
+    key_count = 2;
+  }
+
+  float narrowest;
+  FitCameraKeys(keys, key_count, screen_width, screen_height, fitted, &narrowest);
+  if (COMPRESS_AUTO == pOptions->compress && narrowest < screen_width &&
+      IsPictureCompressed(pPicture)) {
+    ReloadPicture(pPicture, false);
+  }
+  return BakeCameraTrack(fitted, key_count, pTrack);
+}
+
+/**
+ * Plays every slide of a playlist, live, one after another.  Only two pictures are ever
+ * resident: the slide on screen and the one after it.  The one after it starts decoding on the
+ * workers as soon as the one on screen has finished loading, and its proxy is up long before
+ * it's needed, so changing slides never waits on a load.  Each slide crossfades into the next
+ * over the last -fade seconds of its zoom, with both drawn in the same scene, while the next one
+ * is already moving.  Slides that can't be loaded are reported and skipped.  The last slide
+ * stays up at the end of its zoom until ESC.  Images the playlist comes back to are kept in
+ * pImageCache (if it isn't NULL) until their last slide.
+ */
+void RunSlideshow(HWND hWnd, LPDIRECT3DDEVICE9 pd3dDevice, D3DPRESENT_PARAMETERS *pD3DParams,
+                  WorkQueue *pQueue, ImageCache *pImageCache, ImageFilter *pFilter,
+                  FrameShare *pShare, PreviewTarget *pPreview, Telemetry *pTelemetry,
+                  const ZoomyOptions *pOptions,
+                  const BatchJob *pSlides, UINT slideCount, UINT proxy_width, UINT proxy_height,
+                  float screen_width, float screen_height) {
+
+  // Slides alternate between the two pictures.  `shown` is on screen in pictures[current];
+  // `coming` is loading in the other one once next_open is set, or is slideCount if there
+  // isn't another slide.
+  Picture pictures[2];
+  CameraTrack tracks[2];
+  double clocks[2] = { 0.0, 0.0 };    // Seconds into each slide's zoom
+  ZeroMemory(pictures, sizeof(pictures));
+  ZeroMemory(tracks, sizeof(tracks));
+  UINT current = 0, coming = slideCount;
+  bool next_open = false, fading = false;
+
+  // Wait for the first slide that loads
+  UINT shown = OpenSlide(pd3dDevice, pQueue, pImageCache, pOptions, pSlides, slideCount, 0,
+                         proxy_width, proxy_height, screen_width, screen_height, &pictures[0]);
+  while (shown < slideCount) {
+    HRESULT hr = WaitForPicture(hWnd, &pictures[0], false);
+    if (S_FALSE == hr) {
+      ReleasePicture(&pictures[0]);
+      return;
+    }
+    if (SUCCEEDED(hr) && SUCCEEDED(BakeSlideTrack(pOptions, &pSlides[shown], &pictures[0],
+                                                  screen_width, screen_height, &tracks[0]))) {
+      break;
+    }
+    BatchLog("Couldn't load %s", pSlides[shown].imagePath);
+    ReleasePicture(&pictures[0]);
+    shown = OpenSlide(pd3dDevice, pQueue, pImageCache, pOptions, pSlides, slideCount, shown + 1,
+                      proxy_width, proxy_height, screen_width, screen_height, &pictures[0]);
+  }
+  if (shown == slideCount) return;
+  BatchLog("Slide %u of %u: %s", shown + 1, slideCount, pSlides[shown].imagePath);
+
+  // Both pictures' uploads share what each frame has to spare
+  D3DDISPLAYMODE mode;
+  UploadBudget upload_budget;
+  InitUploadBudget(&upload_budget,
+                   SUCCEEDED(pd3dDevice->GetDisplayMode(0, &mode)) ? mode.RefreshRate : 0);
+
+  FLOAT fElapsedTime;
+  bool show_overlay = false, overlay_key_was_down = false;
+  HandleMessagePump(NULL);
+  while (HandleMessagePump(&fElapsedTime)) {
+    NextTelemetryFrame(pTelemetry);
+    BeginUploadFrame(&upload_budget);
+    if (GetKeyState(VK_ESCAPE) & 0x80) break;
+    bool overlay_key_down = (GetKeyState('T') & 0x80) != 0;
+    if (overlay_key_down && !overlay_key_was_down) show_overlay = !show_overlay;
+    overlay_key_was_down = overlay_key_down;
+    UINT next = 1 - current;
+    Picture *pPicture = &pictures[current], *pNext = &pictures[next];
+
+    // Swap in the full-resolution image as soon as it's ready; the proxy stays up if it fails
+    if (FAILED(UpdatePicture(pPicture, &upload_budget))) {
+      BatchLog("Couldn't load all of %s, so its preview is shown", pSlides[shown].imagePath);
+    }
+    ShowLoadProgress(hWnd, pPicture);
+
+    // One full-resolution decode at a time: the next slide starts once this one is done
+    if (!next_open && !IsPictureLoading(pPicture)) {
+      coming = OpenSlide(pd3dDevice, pQueue, pImageCache, pOptions, pSlides, slideCount,
+                         shown + 1, proxy_width, proxy_height, screen_width, screen_height, pNext);
+      next_open = true;
+    }
+    if (next_open && coming < slideCount && FAILED(UpdatePicture(pNext, &upload_budget))) {
+      if (pNext->pTexture || pNext->pTiles) {
+        BatchLog("Couldn't load all of %s, so its preview will be shown", pSlides[coming].imagePath);
+      } else {
+        BatchLog("Couldn't load %s", pSlides[coming].imagePath);
+        ReleasePicture(pNext);
+        coming = OpenSlide(pd3dDevice, pQueue, pImageCache, pOptions, pSlides, slideCount,
+                           coming + 1, proxy_width, proxy_height, screen_width, screen_height,
+                           pNext);
+      }
+    }
+
+    // Fade into the next slide over the end of this one's zoom.  If the next one isn't up yet,
+    // this one holds its last view until it is.
+    clocks[current] += fElapsedTime;
+    double fade = pOptions->fade < tracks[current].duration ? pOptions->fade : tracks[current].duration;
+    if (!fading && next_open && coming < slideCount && (pNext->pTexture || pNext->pTiles) &&
+        clocks[current] >= tracks[current].duration - fade) {
+      if (SUCCEEDED(BakeSlideTrack(pOptions, &pSlides[coming], pNext, screen_width,
+                                   screen_height, &tracks[next]))) {
+        fading = true;
+        clocks[next] = 0.0;
+        BatchLog("Slide %u of %u: %s", coming + 1, slideCount, pSlides[coming].imagePath);
+      } else {
+        BatchLog("Couldn't zoom %s", pSlides[coming].imagePath);
+        ReleasePicture(pNext);
+        coming = OpenSlide(pd3dDevice, pQueue, pImageCache, pOptions, pSlides, slideCount,
+                           coming + 1, proxy_width, proxy_height, screen_width, screen_height,
+                           pNext);
+      }
+    } else if (fading) {
+      clocks[next] += fElapsedTime;
+    }
+    float opacity = 1.0f;
+    if (fading) opacity = fade > 0.0 && clocks[next] < fade ? (float)(clocks[next] / fade) : 1.0f;
+
+    // Once the fade is over the old slide goes, which makes room for the one after
+    if (fading && opacity >= 1.0f) {
+      ReleasePicture(pPicture);
+      ReleaseCameraTrack(&tracks[current]);
+      current = next;
+      shown = coming;
+      coming = slideCount;
+      next_open = fading = false;
+      pPicture = pNext;
+      pNext = NULL;
+    }
+    EndTelemetryPhase(pTelemetry, TELEMETRY_PHASE_UPDATE);
+
+    BeginTelemetryGpu(pTelemetry);
+    if (pShare) BeginSharedFrame(pShare);
+    BeginPreviewFrame(pPreview);
+    if (SUCCEEDED(pd3dDevice->BeginScene())) {
+      ZoomRect view = CameraTrackView(&tracks[current], clocks[current]);
+      if (fading) {
+        ZoomRect next_view = CameraTrackView(&tracks[next], clocks[next]);
+        pd3dDevice->Clear(0, NULL, D3DCLEAR_TARGET, D3DCOLOR_XRGB(0,0,0), 1.0f, 0);
+        DrawPictureBlended(pd3dDevice, pPicture, view, screen_width, screen_height,
+                           TILE_LOADS_PER_FRAME, pFilter, 1.0f - opacity);
+        DrawPictureBlended(pd3dDevice, pNext, next_view, screen_width, screen_height,
+                           TILE_LOADS_PER_FRAME, pFilter, opacity);
+        PrefetchZoomPath(pNext, pOptions, &tracks[next], clocks[next], screen_width, false);
+      } else {
+        DrawPicture(pd3dDevice, pPicture, view, screen_width, screen_height, TILE_LOADS_PER_FRAME,
+                    pFilter);
+      }
+      PrefetchZoomPath(pPicture, pOptions, &tracks[current], clocks[current], screen_width, false);
+      pd3dDevice->EndScene();
+    }
+    EndPreviewFrame(pPreview);
+    if (pShare) EndSharedFrame(pShare);
+    EndTelemetryGpu(pTelemetry);
+    if (show_overlay) {
+      DrawTelemetryOverlay(pTelemetry, (float)pD3DParams->BackBufferWidth,
+                           (float)pD3DParams->BackBufferHeight);
+    }
+    EndTelemetryPhase(pTelemetry, TELEMETRY_PHASE_DRAW);
+    EndUploadFrame(&upload_budget);
+
+    HRESULT hrPresent = pd3dDevice->Present(NULL, NULL, NULL, NULL);
+    EndTelemetryPhase(pTelemetry, TELEMETRY_PHASE_PRESENT);
+    if (SUCCEEDED(hrPresent)) {
+      if (pShare) PublishSharedFrame(pShare);
+    } else if (IsDeviceEx(pd3dDevice)) {
+      MessageBox(hWnd, "The graphics device stopped responding.", "Pan-Zoom Image",
+                 MB_OK | MB_ICONERROR);
+      break;
+    } else {
+      TelemetryDeviceLost(pTelemetry);
+      PreviewDeviceLost(pPreview);
+      if (FAILED(WaitForLostDevice(pd3dDevice, pD3DParams)) || FAILED(PreviewDeviceReset(pPreview))) {
+        break;
+      }
+      SetRenderStates(pd3dDevice);
+      TelemetryDeviceReset(pTelemetry);
+      PreloadPicture(&pictures[0]);
+      PreloadPicture(&pictures[1]);
+
+      // Don't count the time the device was gone as part of the slide
+      HandleMessagePump(NULL);
+    }
+  }
+
+  ReleaseCameraTrack(&tracks[0]);
+  ReleaseCameraTrack(&tracks[1]);
+  ReleasePicture(&pictures[0]);
+  ReleasePicture(&pictures[1]);
+  LogImageCache(pImageCache);
+}
+
+// How many zooms each benchmark image plays
+#define BENCH_ZOOM_COUNT 3
+
+/**
+ * The keys of one of the benchmark's zooms over a width x height image, in image pixels before
+ * fitting, and its name in the report.  Returns how many keys there are.
+ */
+UINT GetBenchZoom(UINT zoom, float width, float height, float screen_width, float screen_height,
+                  CameraKey *pKeys, LPCSTR *pName) {
+  ZoomRect whole = { 0.0f, 0.0f, width, height };
+  CameraKey fit = { whole, 8.0f, EASE_LINEAR };
+  pKeys[0] = fit;
+  if (0 == zoom || 1 == zoom) {
+    // In to one image pixel per screen pixel, or four screen pixels per image pixel, off center
+    // so the camera moves as well as zooms
+    float scale = 0 == zoom ? 1.0f : 0.25f, x = width * 0.3f, y = height * 0.6f;
+    ZoomRect close = { x - screen_width * scale * 0.5f, y - screen_height * scale * 0.5f,
+                       x + screen_width * scale * 0.5f, y + screen_height * scale * 0.5f };
+    CameraKey end = { close, 0.0f, EASE_LINEAR };
+    pKeys[1] = end;
+    *pName = 0 == zoom ? "fit_to_1to1" : "fit_to_4x";
+    return 2;
+  }
+
+  // Around the corners at 1:1 and back out
+  float right = width - screen_width, bottom = height - screen_height;
+  float corners[4][2] = { { 0.0f, 0.0f }, { right, 0.0f }, { right, bottom }, { 0.0f, bottom } };
+  for (UINT i = 0; i < 4; ++i) {
+    ZoomRect corner = { corners[i][0], corners[i][1], corners[i][0] + screen_width,
+                        corners[i][1] + screen_height };
+    CameraKey key = { corner, 3.0f, EASE_SMOOTH };
+    pKeys[1 + i] = key;
+  }
+  CameraKey back = { whole, 0.0f, EASE_LINEAR };
+  pKeys[5] = back;
+  *pName = "corner_tour_1to1";
+  return 6;
+}
+
+/**
+ * Loads a benchmark image all the way, timing how long the proxy and the full image take.
+ * Returns S_FALSE if the user stopped the benchmark.
+ */
+HRESULT LoadBenchPicture(HWND hWnd, LPDIRECT3DDEVICE9 pd3dDevice, WorkQueue *pQueue,
+                         const ZoomyOptions *pOptions, LPCSTR path, UINT proxy_width,
+                         UINT proxy_height, Picture *pPicture, BenchMemory *pMemory,
+                         UINT *pProxyTime, UINT *pLoadTime) {
+  *pProxyTime = *pLoadTime = 0;
+  double start = ClockSeconds();
+  HRESULT hr = OpenPicture(pd3dDevice, pQueue, path, pOptions, proxy_width, proxy_height, NULL,
+                           false, pPicture);
+  for (bool proxy = false; SUCCEEDED(hr); ) {
+    hr = UpdatePicture(pPicture, NULL);
+    SampleBenchMemory(pd3dDevice, pMemory);
+    UINT elapsed = (UINT)((ClockSeconds() - start) * 1000000.0);
+    if (!proxy && (pPicture->pTexture || pPicture->pTiles)) {
+      proxy = true;
+      *pProxyTime = elapsed;
+    }
+    if (S_OK == hr) {
+      *pLoadTime = elapsed;
+      break;
+    }
+    MsgWaitForMultipleObjects(0, NULL, FALSE, 1, QS_ALLINPUT);
+    if (!HandleMessagePump(NULL)) {
+      PostQuitMessage(0);
+      return S_FALSE;
+    }
+    if (GetKeyState(VK_ESCAPE) & 0x80) return S_FALSE;
+  }
+  return hr;
+}
+
+/**
+ * Plays one zoom over a benchmark image at one frame per refresh, drawn through pFilter (or
+ * the fixed-function sampler, if it's NULL), putting each frame's time (Present to Present, in
+ * microseconds) in pFrameTimes.  Returns S_FALSE if the user stopped the benchmark.
+ */
+HRESULT PlayBenchZoom(LPDIRECT3DDEVICE9 pd3dDevice, ImageFilter *pFilter, const Picture *pPicture,
+                      const ZoomyOptions *pOptions, const CameraTrack *pTrack, UINT refresh,
+                      float screen_width, float screen_height, UINT *pFrameTimes, UINT frames,
+                      BenchMemory *pMemory) {
+  HandleMessagePump(NULL);
+  double last = ClockSeconds();
+  for (UINT frame = 0; frame < frames; ++frame) {
+    if (!HandleMessagePump(NULL)) {
+      PostQuitMessage(0);
+      return S_FALSE;
+    }
+    if (GetKeyState(VK_ESCAPE) & 0x80) return S_FALSE;
+
+    double seconds = (double)frame / refresh;
+    if (SUCCEEDED(pd3dDevice->BeginScene())) {
+      ZoomRect view = CameraTrackView(pTrack, seconds);
+      DrawPicture(pd3dDevice, pPicture, view, screen_width, screen_height, TILE_LOADS_PER_FRAME,
+                  pFilter);
+      PrefetchZoomPath(pPicture, pOptions, pTrack, seconds, screen_width, false);
+      pd3dDevice->EndScene();
+    }
+
+    // A lost device would spoil the numbers, so it ends the run
+    HRESULT hr = pd3dDevice->Present(NULL, NULL, NULL, NULL);
+    if (FAILED(hr)) return hr;
+    double now = ClockSeconds();
+    pFrameTimes[frame] = (UINT)((now - last) * 1000000.0);
+    last = now;
+    SampleBenchMemory(pd3dDevice, pMemory);
+  }
+  return S_OK;
+}
+
+/**
+ * Runs the benchmark (see bench.h) and writes its report to pOptions->benchmarkPath.  Every
+ * zoom is played with the fixed-function sampler and then, if pFilter isn't NULL, again through
+ * it.  Returns how many images couldn't be run.
+ */
+UINT RunBenchmark(HWND hWnd, LPDIRECT3DDEVICE9 pd3dDevice, WorkQueue *pQueue, ImageFilter *pFilter,
+                  const ZoomyOptions *pOptions, UINT refresh, UINT proxy_width, UINT proxy_height,
+                  float screen_width, float screen_height) {
+  BenchReport *pReport;
+  if (FAILED(CreateBenchReport(pOptions->benchmarkPath, &pReport))) {
+    BatchLog("Couldn't write %s", pOptions->benchmarkPath);
+    return BENCH_IMAGE_COUNT;
+  }
+
+  // Every load decodes, rather than coming out of the cache from the last run
+  ZoomyOptions benchOptions = *pOptions;
+  benchOptions.cacheDirectory[0] = '\0';
+  static const LPCSTR tiles[] = { "auto", "on", "off" }, compress[] = { "auto", "on", "off" },
+                      present[] = { "windowed", "flipex", "fullscreen", "shared" };
+  BenchWrite(pReport, "{\r\n  \"version\": %u,\r\n", BENCH_REPORT_VERSION);
+  BenchWrite(pReport, "  \"screen\": { \"width\": %u, \"height\": %u, \"refresh_hz\": %u },\r\n",
+             (UINT)screen_width, (UINT)screen_height, refresh);
+  BenchWrite(pReport, "  \"options\": { \"tiles\": \"%s\", \"compress\": \"%s\", "
+             "\"present\": \"%s\", \"tile_pool\": %u },\r\n", tiles[pOptions->tiles],
+             compress[pOptions->compress], present[pOptions->present], pOptions->tilePoolSize);
+  BenchWrite(pReport, "  \"images\": [");
+
+  // Sleeps in the load loop wake up to the millisecond, not the usual 15.6
+  timeBeginPeriod(1);
+  UINT succeeded = 0;
+  HRESULT hr = S_OK;
+  for (UINT image = 0; image < BENCH_IMAGE_COUNT && S_FALSE != hr; ++image) {
+    const BenchImage *pImage = GetBenchImage(image);
+    BatchLog("Benchmark image %u of %u: %s", image + 1, BENCH_IMAGE_COUNT, pImage->name);
+    BenchWrite(pReport, "%s\r\n    { \"name\": \"%s\", \"width\": %u, \"height\": %u",
+               image ? "," : "", pImage->name, pImage->width, pImage->height);
+
+    char path[MAX_PATH];
+    BenchMemory memory;
+    ZeroMemory(&memory, sizeof(memory));
+    Picture picture = { NULL, NULL, 0.0f, 0.0f, NULL };
+    UINT proxy_time = 0, load_time = 0;
+    SetWindowText(hWnd, "Pan-Zoom Image - benchmark: making images");
+    hr = MakeBenchImage(pImage, path);
+    if (SUCCEEDED(hr)) {
+      SetWindowText(hWnd, "Pan-Zoom Image - benchmark: loading");
+      SampleBenchMemory(pd3dDevice, &memory);
+      hr = LoadBenchPicture(hWnd, pd3dDevice, pQueue, &benchOptions, path, proxy_width,
+                            proxy_height, &picture, &memory, &proxy_time, &load_time);
+    }
+    if (SUCCEEDED(hr) && S_FALSE != hr) {
+      BenchWrite(pReport, ", \"tiled\": %s, \"compressed\": %s,\r\n"
+                 "      \"proxy_us\": %u, \"load_us\": %u", picture.pTiles ? "true" : "false",
+                 IsPictureCompressed(&picture) ? "true" : "false", proxy_time, load_time);
+      BenchWrite(pReport, ",\r\n      \"zooms\": [");
+      SetWindowText(hWnd, "Pan-Zoom Image - benchmark: zooming");
+      UINT played = 0;
+      for (UINT zoom = 0; zoom < BENCH_ZOOM_COUNT && S_OK == hr; ++zoom) {
+        CameraKey keys[CAMERA_MAX_KEYS], fitted[CAMERA_MAX_KEYS];
+        LPCSTR name;
+        float narrowest;
+        UINT key_count = GetBenchZoom(zoom, picture.width, picture.height, screen_width,
+                                      screen_height, keys, &name);
+        FitCameraKeys(keys, key_count, screen_width, screen_height, fitted, &narrowest);
+        CameraTrack track;
+        if (FAILED(hr = BakeCameraTrack(fitted, key_count, &track))) break;
+
+        UINT frames = (UINT)(track.duration * refresh) + 1;
+        UINT *pFrameTimes = new UINT[frames];
+        for (UINT pass = 0; pass < (pFilter ? 2u : 1u) && S_OK == hr; ++pass) {
+          hr = PlayBenchZoom(pd3dDevice, pass ? pFilter : NULL, &picture, &benchOptions, &track,
+                             refresh, screen_width, screen_height, pFrameTimes, frames, &memory);
+          if (S_OK == hr) {
+            BenchWrite(pReport, "%s\r\n        { \"name\": \"%s\", \"filter\": \"%s\", "
+                       "\"frame_times\": ", played++ ? "," : "", name, pass ? "lanczos" : "fixed");
+            BenchWriteFrameTimes(pReport, pFrameTimes, frames, 1000000 / refresh);
+            BenchWrite(pReport, " }");
+          }
+        }
+        delete[] pFrameTimes;
+        ReleaseCameraTrack(&track);
+      }
+      BenchWrite(pReport, "\r\n      ]");
+    }
+    ReleasePicture(&picture);
+
+    // Memory is reported whether or not the image got through; it's often why it didn't
+    BenchWrite(pReport, ",\r\n      \"peak_working_set_mb\": %u, \"vram_mb\": %u",
+               (UINT)(memory.peakWorkingSet / (1024 * 1024)),
+               (memory.textureMemoryStart - memory.textureMemoryLowest) / (1024 * 1024));
+    if (S_FALSE == hr) {
+      BenchWrite(pReport, ", \"error\": \"cancelled\"");
+    } else if (FAILED(hr)) {
+      BenchWrite(pReport, ", \"error\": \"0x%08X\"", (UINT)hr);
+      BatchLog("  failed (error 0x%08X)", (UINT)hr);
+    } else {
+      ++succeeded;
+    }
+    BenchWrite(pReport, " }");
+    if (S_FALSE != hr) hr = S_OK;
+  }
+  timeEndPeriod(1);
+
+  BenchWrite(pReport, "\r\n  ]\r\n}\r\n");
+  ReleaseBenchReport(pReport);
+  SetWindowText(hWnd, "Pan-Zoom Image");
+  return BENCH_IMAGE_COUNT - succeeded;
+}
+
 //-------------------------------------------------------------------------------------------------
 // Entry point to the app.  See the top of this file for description.
 //-------------------------------------------------------------------------------------------------
-int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR, int) {
+int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR lpCmdLine, int) {
+
+  ZoomyOptions options;
+  if (!ParseCommandLine(lpCmdLine, &options)) {
+      return 0;
+  }
 
   // Structures used in the program
   HWND hWnd;
   D3DPRESENT_PARAMETERS d3dpp;
   LPDIRECT3D9 pD3D = NULL;
   LPDIRECT3DDEVICE9 pd3dDevice = NULL;
-  LPDIRECT3DTEXTURE9 pTexture = NULL;
+  D3DDISPLAYMODE d3ddm;
+  PresentStats present_stats;
+  ZeroMemory(&present_stats, sizeof(present_stats));
+  Picture picture = { NULL, NULL, 0.0f, 0.0f, NULL };
+  WorkQueue *pQueue = NULL;
+  FrameShare *pShare = NULL;
+  PreviewTarget *pPreview = NULL;
+  Telemetry *pTelemetry = NULL;
+  ImageCache *pImageCache = NULL;
+  ImageFilter *pFilter = NULL;
   FLOAT fElapsedTime;
+  Project project;
+  ZeroMemory(&project, sizeof(project));
   D3DXVECTOR3 vCamera(0.5f, 0.5f, 10.0f), vCameraLookAt(0.5f, 0.5f, 0.0f);
 
+  // A batch run renders its jobs and exits, and the exit code says how many of them failed.
+  // Otherwise, ask for the image to zoom.
+  BatchJob *pJobs = NULL, *pSlides = NULL;
+  UINT jobCount = 0, slideCount = 0;
+  int exitCode = 0;
   CHAR imagePath[MAX_PATH];
-  if (!OpenFileDialog(NULL, "Select Image File", "Image Files (*.JPG; *.JPEG; *.PNG; *.BMP; *.DDS)\0*.JPG;*.JPEG;*.PNG;*.BMP;*.DDS\0\0", imagePath, MAX_PATH)) {
+  if (options.batchPath[0]) {
+    UINT errorLine;
+    HRESULT hr = ReadBatchFile(options.batchPath, false, &pJobs, &jobCount, &errorLine);
+    if (FAILED(hr)) {
+      if (errorLine) {
+        BatchLog("%s(%u): expected an image, its views with the seconds between them, and an output", options.batchPath, errorLine);
+      } else {
+        BatchLog("Couldn't read %s (error 0x%08X)", options.batchPath, (UINT)hr);
+      }
+      return 1;
+    }
+
+    // A render split into segments is done by other copies of the app, and only needs joining
+    // up here
+    if (options.segmentCount && (0 == options.segment || SEGMENT_JOIN == options.segment)) {
+      CoInitializeEx(NULL, COINIT_APARTMENTTHREADED);
+      if (0 == options.segment) {
+        exitCode = (int)RenderSegments(lpCmdLine, pJobs, jobCount, options.segmentCount,
+                                       options.exportFps);
+      } else {
+        exitCode = (int)JoinSegments(pJobs, jobCount, options.segmentCount, options.exportFps);
+      }
+      CoUninitialize();
+      ReleaseBatchJobs(pJobs);
+      return exitCode;
+    }
+
+    // There's nobody to show anything to, so draw into a hidden window
+    options.present = PRESENT_WINDOWED;
+    exitCode = (int)jobCount;
+  } else if (options.benchmarkPath[0]) {
+    // The benchmark makes its own images
+  } else if (options.slideshowPath[0]) {
+    // A slideshow plays its playlist instead
+    UINT errorLine;
+    HRESULT hr = ReadBatchFile(options.slideshowPath, true, &pSlides, &slideCount, &errorLine);
+    if (SUCCEEDED(hr) && 0 == slideCount) hr = E_INVALIDARG;
+    if (FAILED(hr)) {
+      char message[MAX_PATH + 96];
+      if (errorLine) {
+        wsprintf(message, "%s(%u): expected an image, optionally with its views and the seconds between them", options.slideshowPath, errorLine);
+      } else {
+        wsprintf(message, "Couldn't read any slides from %s", options.slideshowPath);
+      }
+      MessageBox(NULL, message, "Pan-Zoom Image", MB_OK | MB_ICONERROR);
+      return 1;
+    }
+  } else {
+    // An existing project names its image, so there's nothing to ask.  Otherwise the image's
+    // own project, if it has one, picks up where the last session left off.
+    project.imagePath[0] = '\0';
+    if (options.projectPath[0] &&
+        !ResumeProject(options.projectPath, lpCmdLine, &options, &project)) {
+      return 1;
+    }
+    if (project.imagePath[0]) {
+      lstrcpy(imagePath, project.imagePath);
+    } else if (!OpenFileDialog(NULL, "Select Image File", "Image Files (*.JPG; *.JPEG; *.PNG; *.BMP; *.DDS; *.TIF; *.TIFF)\0*.JPG;*.JPEG;*.PNG;*.BMP;*.DDS;*.TIF;*.TIFF\0\0", imagePath, MAX_PATH)) {
       return 0;
+    } else if (options.projects && !options.projectPath[0] &&
+               SUCCEEDED(GetImageProjectPath(imagePath, options.projectPath)) &&
+               !ResumeProject(options.projectPath, lpCmdLine, &options, &project)) {
+      return 1;
+    }
   }
 
+  // WIC, which decodes images, needs COM
+  CoInitializeEx(NULL, COINIT_APARTMENTTHREADED);
+
   // Register a standard window class
   WNDCLASS wc = { 0, WndProc, 0, 0, hInstance,
                   NULL,
@@ -223,40 +1320,119 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR, int) {
   RegisterClass(&wc);
 
   // Create a window
-  if (NULL != (hWnd = CreateWindow(wc.lpszClassName, "Pan-Zoom Image", WS_POPUP | WS_SYSMENU | WS_VISIBLE,
+  // The video encoder shares the device with its own threads, so only if there's video to make
+  // does the device need to pay for being thread safe
+  bool encodes_video = IsVideoPath(options.exportPath);
+  for (UINT job = 0; job < jobCount; ++job) {
+    if (IsVideoPath(pJobs[job].outputPath)) encodes_video = true;
+  }
+
+  DWORD style = WS_POPUP | WS_SYSMENU | (pJobs ? 0 : WS_VISIBLE);
+  if (NULL != (hWnd = CreateWindow(wc.lpszClassName, "Pan-Zoom Image", style,
                                    CW_USEDEFAULT, CW_USEDEFAULT, GetSystemMetrics(SM_CXSCREEN),
                                    GetSystemMetrics(SM_CYSCREEN), GetDesktopWindow(), NULL,
                                    hInstance, NULL)) &&
-      NULL != (pD3D = Direct3DCreate9(D3D_SDK_VERSION)) &&
-      NULL != (pd3dDevice = CreateD3DDevice(hWnd, pD3D, &d3dpp))) {
+      NULL != (pD3D = CreateDirect3D(options.present)) &&
+      SUCCEEDED(pD3D->GetAdapterDisplayMode(D3DADAPTER_DEFAULT, &d3ddm)) &&
+      NULL != (pd3dDevice = CreateDisplayDevice(hWnd, pD3D, options.present, encodes_video, &d3ddm,
+                                                &d3dpp)) &&
+      SUCCEEDED(CreateWorkQueue(0, &pQueue))) {
+
+    // Frames are drawn at the display's resolution, or -output's if it's one the GPU can draw
+    D3DCAPS9 caps;
+    pd3dDevice->GetDeviceCaps(&caps);
+    UINT output_width = d3ddm.Width, output_height = d3ddm.Height;
+    if (options.outputWidth) {
+      if (options.outputWidth <= caps.MaxTextureWidth &&
+          options.outputHeight <= caps.MaxTextureHeight) {
+        output_width = options.outputWidth;
+        output_height = options.outputHeight;
+      } else if (!pJobs) {
+        MessageBox(hWnd, "The graphics card can't draw frames the size -output asks for, so the display's resolution will be used.",
+                   "Pan-Zoom Image", MB_OK | MB_ICONWARNING);
+      } else {
+        BatchLog("The graphics card can't draw %ux%u frames, so they'll be %ux%u",
+                 options.outputWidth, options.outputHeight, output_width, output_height);
+      }
+    }
+
+    // Start loading, with a proxy the size of the output (or the biggest texture, if that's
+    // smaller), and get going as soon as the proxy is up
+    UINT proxy_width = output_width < caps.MaxTextureWidth ? output_width : caps.MaxTextureWidth,
+         proxy_height = output_height < caps.MaxTextureHeight ? output_height : caps.MaxTextureHeight;
 
-    // Get the current display mode
-    D3DDISPLAYMODE d3ddm;
-    if (FAILED(pD3D->GetAdapterDisplayMode(D3DADAPTER_DEFAULT, &d3ddm))) {
-        return NULL;
+    // Publish frames for capture software, if asked to
+    if (!pJobs && PRESENT_SHARED == options.present &&
+        FAILED(CreateFrameShare(pd3dDevice, output_width, output_height, &pShare))) {
+      MessageBox(hWnd, "Frames can't be shared on this system (it needs Direct3D 9Ex, and only one copy of the app can share at a time), so only the window will show them.",
+                 "Pan-Zoom Image", MB_OK | MB_ICONWARNING);
     }
 
-    D3DXIMAGE_INFO imageInfo;
-    D3DXGetImageInfoFromFile(imagePath, &imageInfo);
+    // Live frames of another size from the display are drawn offscreen and letterboxed, unless
+    // they're already going into the shared targets, which do the same
+    bool letterboxed = output_width != d3ddm.Width || output_height != d3ddm.Height;
+    if (!pJobs && !options.benchmarkPath[0] && !pShare && letterboxed &&
+        FAILED(CreatePreviewTarget(pd3dDevice, output_width, output_height, &pPreview))) {
+      MessageBox(hWnd, "The frames couldn't be drawn at the -output resolution, so the display's will be used.",
+                 "Pan-Zoom Image", MB_OK | MB_ICONWARNING);
+      output_width = d3ddm.Width;
+      output_height = d3ddm.Height;
+      letterboxed = false;
+    }
 
-    float screen_width = (float)d3ddm.Width,
-          screen_height = (float)d3ddm.Height,
-          image_width = (float)imageInfo.Width,
-          image_height = (float)imageInfo.Height;
+    // Time the live frames.  If the output can't be made, the overlay still works.
+    if (!pJobs && !options.benchmarkPath[0] && FAILED(CreateTelemetry(pd3dDevice, options.telemetryPath, d3ddm.RefreshRate,
+                                         &pTelemetry))) {
+      MessageBox(hWnd, "The telemetry output couldn't be opened, so frame times will only be shown in the overlay.",
+                 "Pan-Zoom Image", MB_OK | MB_ICONWARNING);
+      CreateTelemetry(pd3dDevice, "", d3ddm.RefreshRate, &pTelemetry);
+    }
 
-    if (SUCCEEDED(D3DXCreateTextureFromFile(pd3dDevice, imagePath, &pTexture))) {
+    // Batches and slideshows keep the images they use again decoded in memory
+    if ((pJobs || pSlides) && options.imageCacheBudget) {
+      CreateImageCache(options.imageCacheBudget, &pImageCache);
+      SetTelemetryImageCache(pTelemetry, pImageCache);
+    }
 
-      // Set rendering states
-      pd3dDevice->SetRenderState(D3DRS_ZENABLE,  FALSE);
-      pd3dDevice->SetRenderState(D3DRS_LIGHTING, FALSE);
-      pd3dDevice->SetRenderState(D3DRS_FOGENABLE,    FALSE);
-      pd3dDevice->SetRenderState(D3DRS_DITHERENABLE, TRUE);
-      pd3dDevice->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+    // The shader filter, if it was asked for.  The benchmark always tries it, to compare it with
+    // the fixed-function sampler.
+    if (FILTER_LANCZOS == options.filter || options.benchmarkPath[0]) {
+      if (FAILED(CreateImageFilter(pd3dDevice, &pFilter)) && FILTER_LANCZOS == options.filter) {
+        if (pJobs) {
+          BatchLog("The graphics card can't run the Lanczos filter, so it won't be used");
+        } else {
+          MessageBox(hWnd, "The graphics card can't run the Lanczos filter (it needs pixel shader 3.0), so the image will be drawn the usual way.",
+                     "Pan-Zoom Image", MB_OK | MB_ICONWARNING);
+        }
+      }
+    }
 
-      // Set the filters for texture sampling and mipmapping
-      pd3dDevice->SetSamplerState(0, D3DSAMP_MIPFILTER, D3DTEXF_ANISOTROPIC);
-      pd3dDevice->SetSamplerState(0, D3DSAMP_MINFILTER, D3DTEXF_ANISOTROPIC);
-      pd3dDevice->SetSamplerState(0, D3DSAMP_MAGFILTER, D3DTEXF_ANISOTROPIC);
+    if (pJobs) {
+      SetRenderStates(pd3dDevice);
+      exitCode = (int)RunBatch(hWnd, pd3dDevice, pQueue, pImageCache, pFilter, &options, pJobs,
+                               jobCount, proxy_width, proxy_height, (float)output_width,
+                               (float)output_height);
+    } else if (options.benchmarkPath[0]) {
+      SetRenderStates(pd3dDevice);
+      exitCode = (int)RunBenchmark(hWnd, pd3dDevice, pQueue, pFilter, &options,
+                                   d3ddm.RefreshRate ? d3ddm.RefreshRate : 60, proxy_width,
+                                   proxy_height, (float)d3ddm.Width, (float)d3ddm.Height);
+    } else if (pSlides) {
+      SetRenderStates(pd3dDevice);
+      RunSlideshow(hWnd, pd3dDevice, &d3dpp, pQueue, pImageCache, pFilter, pShare, pPreview,
+                   pTelemetry, &options, pSlides, slideCount, proxy_width, proxy_height,
+                   (float)output_width, (float)output_height);
+    } else if (SUCCEEDED(OpenProjectPicture(pd3dDevice, pQueue, &options, &project, imagePath,
+                                            proxy_width, proxy_height, (float)output_width,
+                                            (float)output_height, &picture)) &&
+        S_OK == WaitForPicture(hWnd, &picture, false)) {
+
+      float screen_width = (float)output_width,
+            screen_height = (float)output_height,
+            image_width = picture.width,
+            image_height = picture.height;
+
+      SetRenderStates(pd3dDevice);
 
       float start_x1 = 0,
             start_y1 = 0,
@@ -268,160 +1444,440 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR, int) {
             end_x2 = screen_width,
             end_y2 = screen_height;
 
-      float time = 30.0f;
-
-      float dx1 = (end_x1 - start_x1) / time,
-            dx2 = (end_x2 - start_x2) / time,
-            dy1 = (end_y1 - start_y1) / time,
-            dy2 = (end_y2 - start_y2) / time;
-      float left = start_x1, top = start_y1, right = start_x2, bottom = start_y2;
-
-      bool first_loop = true, initialized = false;
+      float time = options.time;
+
+      // Stops on the way from the start to the end, added with A, and the zoom baked from all
+      // of the boxes.  The track is baked again whenever any box changes.
+      ZoomRect waypoints[CAMERA_MAX_KEYS - 2];
+      UINT waypoint_count = 0;
+
+      // Put the boxes back the way the project had them.  The project is saved again whenever
+      // they change (once a drag is over), but not before they've been set at all, so just
+      // looking at an image doesn't leave a project behind.
+      bool boxes_set = project.hasBoxes;
+      if (project.hasBoxes) {
+        start_x1 = project.start.left;
+        start_y1 = project.start.top;
+        start_x2 = project.start.right;
+        start_y2 = project.start.bottom;
+        end_x1 = project.end.left;
+        end_y1 = project.end.top;
+        end_x2 = project.end.right;
+        end_y2 = project.end.bottom;
+        waypoint_count = project.stopCount;
+        CopyMemory(waypoints, project.stops, sizeof(ZoomRect) * project.stopCount);
+      }
+      lstrcpyn(project.imagePath, imagePath, MAX_PATH);
+      if (FAILED(HashImageFile(imagePath, &project.sourceHash))) project.sourceHash = 0;
+      GetProjectSwitches(&options, project.switches);
+      Project saved = project;
+      CameraTrack track;
+      ZeroMemory(&track, sizeof(track));
+      float narrowest = screen_width;
+      bool track_dirty = true, prepared = false;
+
+      // Where the whole image sits on screen while the boxes are picked with Q/W/E/R.  If the
+      // image is more horizontal than the screen, it will repeat on the top/bottom edges.  If it
+      // is more vertical, it will repeat on the left/right edges.  This only depends on the image
+      // and the screen, so it's worked out once.
+      float fit_top = 0, fit_left = 0, fit_right = image_width, fit_bottom = image_height;
+      float fit_scaling = PutScreenOverCoordinates(true, &fit_top, &fit_left, &fit_bottom,
+                                                   &fit_right, screen_width, screen_height);
+
+      float left = fit_left, top = fit_top, right = fit_right, bottom = fit_bottom;
+
+      // How far into the zoom we are, and whether it's playing by itself and which way
+      CameraPlayhead playhead = { 0.0, 1.0, false };
+
+      bool initialized = false, export_key_was_down = false,
+           was_zooming = false, add_key_was_down = false, show_overlay = false,
+           overlay_key_was_down = false, was_idle = false, play_key_was_down = false,
+           reverse_key_was_down = false, page_up_was_down = false, page_down_was_down = false;
+
+      // The full-resolution texture goes up to the GPU in whatever each frame has to spare
+      UploadBudget upload_budget;
+      InitUploadBudget(&upload_budget, d3ddm.RefreshRate);
 
       // This is the main application loop.  HandleMessagePump runs each loop to 
       while (HandleMessagePump(&fElapsedTime)) {
+        NextTelemetryFrame(pTelemetry);
+        BeginUploadFrame(&upload_budget);
+
+        // Time spent asleep isn't time the zoom should move on by
+        if (was_idle) fElapsedTime = 0.0f;
+        was_idle = false;
 
         // Exit on ESC key
         if (GetKeyState(VK_ESCAPE) & 0x80) break;
 
-        if (SUCCEEDED(pd3dDevice->BeginScene())) {
+        // Space runs the zoom live; X (when an export path was given) renders it offline.  Only
+        // start an export when X goes down, so holding it doesn't export over and over.
+        bool zooming = (GetKeyState(VK_SPACE) & 0x80) != 0,
+             export_key_down = options.exportPath[0] && (GetKeyState('X') & 0x80),
+             exporting = export_key_down && !export_key_was_down;
+        export_key_was_down = export_key_down;
+
+        // Count the frames of each live run of the zoom, and say afterwards whether any of the
+        // refreshes it covered were missed
+        if (zooming && !was_zooming) {
+          ResetPresentStats(&present_stats);
+        } else if (!zooming && was_zooming && present_stats.available) {
+          char report[96];
+          wsprintf(report, "Pan-Zoom Image - %u frames presented, %u refreshes missed",
+                   present_stats.presents, present_stats.missedRefreshes);
+          SetWindowText(hWnd, report);
+          lstrcat(report, "\n");
+          OutputDebugString(report);
+        }
+        was_zooming = zooming;
+
+        // P starts and stops the zoom playing by itself, and B turns it around
+        bool play_key_down = (GetKeyState('P') & 0x80) != 0,
+             reverse_key_down = (GetKeyState('B') & 0x80) != 0,
+             play_pressed = play_key_down && !play_key_was_down,
+             reverse_pressed = reverse_key_down && !reverse_key_was_down;
+        play_key_was_down = play_key_down;
+        reverse_key_was_down = reverse_key_down;
+        if (play_pressed) playhead.playing = !playhead.playing;
+        if (reverse_pressed) playhead.rate = -playhead.rate;
+
+        // Seeking: the arrows scrub while held, the wheel steps, Page Up and Page Down jump, and
+        // Home and End go to either end
+        bool scrubbing = (GetKeyState(VK_LEFT) & 0x80) || (GetKeyState(VK_RIGHT) & 0x80),
+             page_up_down = (GetKeyState(VK_PRIOR) & 0x80) != 0,
+             page_down_down = (GetKeyState(VK_NEXT) & 0x80) != 0,
+             seek_home = (GetKeyState(VK_HOME) & 0x80) != 0,
+             seek_end = (GetKeyState(VK_END) & 0x80) != 0;
+        double seek_by = (double)wheel_turned / WHEEL_DELTA * WHEEL_SEEK_SECONDS;
+        wheel_turned = 0;
+        if (GetKeyState(VK_LEFT) & 0x80) seek_by -= SCRUB_SPEED * fElapsedTime;
+        if (GetKeyState(VK_RIGHT) & 0x80) seek_by += SCRUB_SPEED * fElapsedTime;
+        if (page_up_down && !page_up_was_down) seek_by -= PAGE_SEEK_SHARE * time;
+        if (page_down_down && !page_down_was_down) seek_by += PAGE_SEEK_SHARE * time;
+        page_up_was_down = page_up_down;
+        page_down_was_down = page_down_down;
+        bool seeking = seek_by != 0.0 || seek_home || seek_end;
+
+        // A keeps the end box as a stop, so E/R go on to set up the one after it.  Z takes the
+        // stops out again.
+        bool add_key_down = (GetKeyState('A') & 0x80) != 0;
+        if (add_key_down && !add_key_was_down && waypoint_count < CAMERA_MAX_KEYS - 2) {
+          ZoomRect waypoint = { end_x1, end_y1, end_x2, end_y2 };
+          waypoints[waypoint_count++] = waypoint;
+          track_dirty = true;
+          boxes_set = true;
+        }
+        add_key_was_down = add_key_down;
+        bool overlay_key_down = (GetKeyState('T') & 0x80) != 0;
+        if (overlay_key_down && !overlay_key_was_down) show_overlay = !show_overlay;
+        overlay_key_was_down = overlay_key_down;
+        if ((GetKeyState('Z') & 0x80) && waypoint_count > 0) {
+          waypoint_count = 0;
+          track_dirty = true;
+          boxes_set = true;
+        }
+
+        // Bake the boxes into the zoom, each leg taking the same share of the time.  When only
+        // boxes have moved, just the part of the zoom around them is baked again, and the
+        // playhead stays where it is.
+        if (track_dirty) {
+          CameraKey keys[CAMERA_MAX_KEYS], fitted[CAMERA_MAX_KEYS];
+          ZoomRect start = { start_x1, start_y1, start_x2, start_y2 },
+                   end = { end_x1, end_y1, end_x2, end_y2 };
+          UINT key_count = MakeTourKeys(start, waypoints, waypoint_count, end, time, keys);
+
+          FitCameraKeys(keys, key_count, screen_width, screen_height, fitted, &narrowest);
+          if (S_FALSE != UpdateCameraTrack(fitted, key_count, &track)) prepared = false;
+          if (track.pSamples) {
+            SeekCameraPlayhead(&playhead, &track, playhead.seconds);
+          } else {
+            initialized = false;
+          }
+          track_dirty = false;
+
+          // Keep the project up to date, so closing (or crashing) loses nothing
+          project.hasBoxes = boxes_set;
+          project.start = start;
+          project.end = end;
+          project.stopCount = waypoint_count;
+          CopyMemory(project.stops, waypoints, sizeof(ZoomRect) * waypoint_count);
+        }
 
-          // When space-bar is held, run the zoom.
-          if (GetKeyState(VK_SPACE) & 0x80) {
-
-            // If we haven't updated the screen since the user last picked coordinates using Q/W/E/R,
-            // do the calculations.
-            if (!initialized) {
-              initialized = true;
-              PutScreenOverCoordinates(false, &start_y1, &start_x1, &start_y2, &start_x2, screen_width, screen_height);
-              PutScreenOverCoordinates(false, &end_y1,   &end_x1,   &end_y2,   &end_x2, screen_width, screen_height);
-              dx1 = (end_x1 - start_x1) / time;
-              dx2 = (end_x2 - start_x2) / time;
-              dy1 = (end_y1 - start_y1) / time;
-              dy2 = (end_y2 - start_y2) / time;
-              left = start_x1;
-              top = start_y1;
-              right = start_x2;
-              bottom = start_y2;
+        // Each save goes through to the disk, so while a box is being dragged it waits for the
+        // mouse button to come up rather than going out on every frame
+        if (options.projectPath[0] && boxes_set && !(GetKeyState(VK_LBUTTON) & 0x80)) {
+          SaveProjectChanges(options.projectPath, &project, &saved);
+        }
+
+        // The first time the zoom is played or sought through, start it at the beginning
+        bool starting = zooming || exporting || playhead.playing || seeking;
+        if (starting && !initialized && track.pSamples) {
+          initialized = true;
+          SeekCameraPlayhead(&playhead, &track, 0.0);
+        }
+
+        // Then, and whenever the boxes have changed since, with -crop, load only what this zoom
+        // shows.  Otherwise, once a texel covers more than a pixel, compression blocks start to
+        // show.  If this zoom gets that close, bring the uncompressed texture back (an export
+        // waits for it).  Neither can start while the full-resolution load is under way, so
+        // until it's finished this is tried again every frame.
+        if ((starting || initialized) && !prepared && track.pSamples) {
+          HRESULT hr = CropToZoomPath(&picture, &options, &track, screen_width);
+          bool cropping = S_OK == hr;
+          prepared = cropping || !IsPictureLoading(&picture);
+          if (prepared && !cropping && COMPRESS_AUTO == options.compress &&
+              narrowest < screen_width && IsPictureCompressed(&picture)) {
+            ReloadPicture(&picture, false);
+          }
+        }
+
+        // Seeks only move the playhead, since every view comes straight from it.  Playing from
+        // the end it's heading for starts it over from the other end.
+        if (initialized && seeking) {
+          double to = playhead.seconds + seek_by;
+          if (seek_home) to = 0.0;
+          if (seek_end) to = track.duration;
+          SeekCameraPlayhead(&playhead, &track, to);
+        }
+        if (initialized && play_pressed && playhead.playing &&
+            IsCameraPlayheadAtEnd(&playhead, &track)) {
+          SeekCameraPlayhead(&playhead, &track, playhead.rate < 0.0 ? track.duration : 0.0);
+        }
+        if (initialized && (seeking || play_pressed || reverse_pressed)) {
+          ShowPlayhead(hWnd, &playhead, &track);
+        }
+
+        // Swap in the full-resolution image as soon as it's ready
+        if (FAILED(UpdatePicture(&picture, &upload_budget))) {
+          MessageBox(hWnd, "The full-resolution image couldn't be loaded, so the preview will be used.",
+                     "Pan-Zoom Image", MB_OK | MB_ICONWARNING);
+        }
+        ShowLoadProgress(hWnd, &picture);
+        EndTelemetryPhase(pTelemetry, TELEMETRY_PHASE_UPDATE);
+
+        if (exporting) {
+          // Exports are always made from the full-resolution image, or from the crop if the one
+          // above had to wait for the full-resolution load to finish
+          HRESULT hr = WaitForPicture(hWnd, &picture, true);
+          if (S_OK == hr && !prepared && track.pSamples) {
+            prepared = true;
+            if (S_OK == CropToZoomPath(&picture, &options, &track, screen_width)) {
+              hr = WaitForPicture(hWnd, &picture, true);
             }
+          }
+          if (S_FALSE == hr) break;
 
-            // This is really lame.  Hold down a key to change the speed.
-            if (GetKeyState('1') & 0x80)        { fElapsedTime *= 0.15f;
-            } else if (GetKeyState('2') & 0x80) { fElapsedTime *= 0.25f;
-            } else if (GetKeyState('3') & 0x80) { fElapsedTime *= 0.5f;
-            } else if (GetKeyState('4') & 0x80) { fElapsedTime *= 0.6f;
-            } else if (GetKeyState('5') & 0x80) { fElapsedTime *= 0.8f;
-            } else if (GetKeyState('6') & 0x80) { fElapsedTime *= 1.2f;
-            } else if (GetKeyState('7') & 0x80) { fElapsedTime *= 1.5f;
-            } else if (GetKeyState('8') & 0x80) { fElapsedTime *= 1.8f;
-            } else if (GetKeyState('9') & 0x80) { fElapsedTime *= 2.0f;
-            } else if (GetKeyState('0') & 0x80) { fElapsedTime *= 2.5f; }
-
-            // Advance the coordinates of the screen's corners based on the deltas
-            left += dx1 * fElapsedTime;
-            top += dy1 * fElapsedTime;
-            right += dx2 * fElapsedTime;
-            bottom += dy2 * fElapsedTime;
+          if (SUCCEEDED(hr) && !track.pSamples) hr = E_INVALIDARG;
+          if (SUCCEEDED(hr)) {
+            hr = ExportZoom(hWnd, pd3dDevice, pQueue, pFilter, &picture, &options,
+                            options.exportPath, &track, screen_width, screen_height, NULL, NULL);
+          }
+          if (FAILED(hr)) {
+            MessageBox(hWnd, "The export failed.  Check that the output path can be written.",
+                       "Pan-Zoom Image", MB_OK | MB_ICONERROR);
           }
 
-          // Select the image
-          pd3dDevice->SetTexture(0, pTexture);
-
-          // Render vertices directly from a structure in system memory. This is not
-          // good as a general-purpose way of drawing vertices, but what we are doing
-          // doesn't tax the GPU at all so efficiency doesn't matter.
-          struct {
-            FLOAT x,y,z,rhw;
-            FLOAT u, v;
-          } vertices[] = {
-            {0.0f,screen_height,0.5f,1,left/image_width,bottom/image_height},{0.0f,0.0f,0.5f,1,left/image_width,top/image_height},{screen_width,0.0f,0.5f,1,right/image_width,top/image_height},
-            {0.0f,screen_height,0.5f,1,left/image_width,bottom/image_height},{screen_width,0.0f,0.5f,1,right/image_width,top/image_height},{screen_width,screen_height,0.5f,1,right/image_width,bottom/image_height}
-          };
-          pd3dDevice->SetFVF(D3DFVF_XYZRHW | D3DFVF_TEX1);
-          pd3dDevice->DrawPrimitiveUP(D3DPT_TRIANGLELIST, 2, (void*)vertices, sizeof(FLOAT)*6);
+          // Don't count the time spent exporting as a frame of the live zoom
+          if (!HandleMessagePump(NULL)) break;
+          continue;
+        }
 
+        // When sharing, the frame is drawn into the shared target and then copied to the window,
+        // and with -output into the preview target the same way
+        BeginTelemetryGpu(pTelemetry);
+        if (pShare) BeginSharedFrame(pShare);
+        BeginPreviewFrame(pPreview);
+        if (SUCCEEDED(pd3dDevice->BeginScene())) {
+
+          // Holding Q/W/E/R shows the whole image, for picking that corner of a box with the mouse
           bool sp1 = 0x80 == (GetKeyState('Q') & 0x80),
                sp2 = 0x80 == (GetKeyState('W') & 0x80),
                ep1 = 0x80 == (GetKeyState('E') & 0x80),
-               ep2 = 0x80 == (GetKeyState('R') & 0x80);
+               ep2 = 0x80 == (GetKeyState('R') & 0x80),
+               editing = sp1 || sp2 || ep1 || ep2;
 
-          if (first_loop||sp1||sp2||ep1||ep2) {
+          // When space-bar is held, or P has set it playing, run the zoom.
+          if (initialized && !editing && (zooming || playhead.playing)) {
 
-            // This flag is used to initialize the top/left/bottom/right variables on the first loop.
-            // It just makes it so that we don't have to call the initialization function the same way
-            // in multiple places.
-            first_loop = false;
+            // This is really lame.  Hold down a key to change the speed.
+            double rate = 1.0;
+            if (GetKeyState('1') & 0x80)        { rate = 0.15;
+            } else if (GetKeyState('2') & 0x80) { rate = 0.25;
+            } else if (GetKeyState('3') & 0x80) { rate = 0.5;
+            } else if (GetKeyState('4') & 0x80) { rate = 0.6;
+            } else if (GetKeyState('5') & 0x80) { rate = 0.8;
+            } else if (GetKeyState('6') & 0x80) { rate = 1.2;
+            } else if (GetKeyState('7') & 0x80) { rate = 1.5;
+            } else if (GetKeyState('8') & 0x80) { rate = 1.8;
+            } else if (GetKeyState('9') & 0x80) { rate = 2.0;
+            } else if (GetKeyState('0') & 0x80) { rate = 2.5; }
+
+            // Move along the zoom, whichever way it's going; the speed keys only change how fast
+            AdvanceCameraPlayhead(&playhead, &track, fElapsedTime * rate);
+          }
 
-            // Start the animation over again the next time the user hits the space-bar.
-            initialized = false;
+          // Once the zoom has been set up, the view comes straight from how far along it we are
+          if (editing) {
+            left = fit_left;
+            top = fit_top;
+            right = fit_right;
+            bottom = fit_bottom;
+          } else if (initialized) {
+            ZoomRect current = CameraTrackView(&track, playhead.seconds);
+            left = current.left;
+            top = current.top;
+            right = current.right;
+            bottom = current.bottom;
+          }
 
-            // Reset image location so that it is entirely on-screen.  If the image is more horizontal
-            // than the screen, it will repeat on the top/bottom edges.  If it is more vertical, it will
-            // repeat on the left/right edges.
-            float scaling;
-            top = 0;
-            left = 0;
-            right = image_width;
-            bottom = image_height;
-            scaling = PutScreenOverCoordinates(true, &top, &left, &bottom, &right, screen_width, screen_height);
-
-            // This logic handles setting whichever coordinate is selected
+          // Draw the current view of the image
+          ZoomRect view = { left, top, right, bottom };
+          DrawPicture(pd3dDevice, &picture, view, screen_width, screen_height,
+                      seeking ? SEEK_TILE_LOADS : TILE_LOADS_PER_FRAME, pFilter);
+
+          // Keep the tiles the zoom is about to need coming in, in the direction it plays.
+          // Until it starts, that's the beginning of the zoom, so the first frames after
+          // pressing space are sharp too.
+          if (picture.pTiles && track.pSamples) {
+            PrefetchZoomPath(&picture, &options, &track, initialized ? playhead.seconds : 0.0,
+                             screen_width, initialized && playhead.rate < 0.0);
+          }
+
+          // This logic handles setting whichever coordinate is selected, on the frame as it's shown
+          // in the window.  Only a box that actually moves has the zoom baked again.
+          if (editing && (GetKeyState(VK_LBUTTON) & 0x80)) {
             POINT pt;
             GetCursorPos(&pt);
-            if (GetKeyState(VK_LBUTTON) & 0x80) {
-
-              // Clear the screen to green when the user sets a coordinate to give them some feedback
-              pd3dDevice->Clear(0, NULL, D3DCLEAR_TARGET|D3DCLEAR_ZBUFFER, D3DCOLOR_XRGB(0,255,0), 1.0f, 0);
-
-              if (sp1) {
-                start_x1 = pt.x * scaling + left;
-                start_y1 = pt.y * scaling + top;
-              }
-              if (sp2) {
-                start_x2 = pt.x * scaling + left;
-                start_y2 = pt.y * scaling + top;
-              }
-              if (ep1) {
-                end_x1 = pt.x * scaling + left;
-                end_y1 = pt.y * scaling + top;
-              }
-              if (ep2) {
-                end_x2 = pt.x * scaling + left;
-                end_y2 = pt.y * scaling + top;
-              }
+            if (letterboxed) {
+              PreviewToOutput(output_width, output_height, d3ddm.Width, d3ddm.Height, &pt);
+            }
+
+            // Clear the screen to green when the user sets a coordinate to give them some
+            // feedback.  Only the target: the preview and shared targets have no depth buffer.
+            if (FAILED(pd3dDevice->Clear(0, NULL, D3DCLEAR_TARGET, D3DCOLOR_XRGB(0,255,0), 1.0f, 0))) {
+              OutputDebugString("Pan-Zoom Image: couldn't show the pick feedback\n");
+            }
+
+            float x = pt.x * fit_scaling + fit_left, y = pt.y * fit_scaling + fit_top;
+            float was[8] = { start_x1, start_y1, start_x2, start_y2,
+                             end_x1, end_y1, end_x2, end_y2 };
+            if (sp1) {
+              start_x1 = x;
+              start_y1 = y;
             }
+            if (sp2) {
+              start_x2 = x;
+              start_y2 = y;
+            }
+            if (ep1) {
+              end_x1 = x;
+              end_y1 = y;
+            }
+            if (ep2) {
+              end_x2 = x;
+              end_y2 = y;
+            }
+            float now[8] = { start_x1, start_y1, start_x2, start_y2,
+                             end_x1, end_y1, end_x2, end_y2 };
+            if (!boxes_set || 0 != memcmp(was, now, sizeof(was))) track_dirty = true;
+            boxes_set = true;
           }
 
           // End scene rendering
           pd3dDevice->EndScene();
         }
+        EndPreviewFrame(pPreview);
+        if (pShare) EndSharedFrame(pShare);
+        EndTelemetryGpu(pTelemetry);
 
-        // Flip the scene to the monitor
-        if (FAILED(pd3dDevice->Present(NULL, NULL, NULL, NULL))) {
-
-          // Free the device-dependant objects
-          pTexture->Release();
+        // The overlay goes on the window only, never into what's recorded
+        if (show_overlay) {
+          DrawTelemetryOverlay(pTelemetry, (float)d3ddm.Width, (float)d3ddm.Height);
+        }
+        EndTelemetryPhase(pTelemetry, TELEMETRY_PHASE_DRAW);
+        EndUploadFrame(&upload_budget);
 
-          // Wait for the device to return
-          if (FAILED(WaitForLostDevice(pd3dDevice, &d3dpp)))
+        // Flip the scene to the monitor
+        HRESULT hrPresent = pd3dDevice->Present(NULL, NULL, NULL, NULL);
+        EndTelemetryPhase(pTelemetry, TELEMETRY_PHASE_PRESENT);
+        bool restored = false;
+        if (SUCCEEDED(hrPresent)) {
+          UpdatePresentStats(pd3dDevice, &present_stats);
+          if (pShare) PublishSharedFrame(pShare);
+        } else if (IsDeviceEx(pd3dDevice)) {
+
+          // 9Ex devices are only lost when the driver hangs or the GPU goes away, and then their
+          // textures are gone along with them
+          MessageBox(hWnd, "The graphics device stopped responding.", "Pan-Zoom Image",
+                     MB_OK | MB_ICONERROR);
+          break;
+        } else {
+
+          // Wait for the device to return.  The picture's textures and tiles all live in the
+          // managed pool, so they survive without being reloaded.
+          TelemetryDeviceLost(pTelemetry);
+          PreviewDeviceLost(pPreview);
+          if (FAILED(WaitForLostDevice(pd3dDevice, &d3dpp)) || FAILED(PreviewDeviceReset(pPreview)))
               break;
+          SetRenderStates(pd3dDevice);
+          TelemetryDeviceReset(pTelemetry);
+
+          // Put them back on the GPU straight away, and say how long it took
+          double restore_start = ClockSeconds();
+          PreloadPicture(&picture);
+          char message[64];
+          wsprintf(message, "Pan-Zoom Image: device restored in %u ms\n",
+                   (UINT)((ClockSeconds() - restore_start) * 1000.0));
+          OutputDebugString(message);
+          restored = true;
+        }
 
-          // Reload the device objects
-          if (FAILED(D3DXCreateTextureFromFile(pd3dDevice, imagePath, &pTexture))) break;
+        // Go straight round again only while something on screen is moving by itself: the zoom
+        // (until it reaches the end it's heading for, or while an arrow scrubs it), tiles still
+        // streaming in, a texture going up to the GPU, the overlay (which is measuring frames),
+        // or a frame that was lost with the device.  Otherwise sleep until there's input or a
+        // window message, since nothing would change, and while a load is under way wake now
+        // and then to show how far it's got.
+        bool playing = zooming || playhead.playing,
+             at_end = initialized && IsCameraPlayheadAtEnd(&playhead, &track);
+        bool animating = (playing && !at_end) || scrubbing || show_overlay || restored ||
+                         IsPictureStreaming(&picture) || IsPictureUploading(&picture);
+        if (!animating) {
+          // The sleep isn't a frame, for the telemetry or the present statistics
+          IdleTelemetry(pTelemetry);
+          DWORD timeout = IsPictureLoading(&picture) ? IDLE_LOAD_POLL_MS : INFINITE;
+          MsgWaitForMultipleObjects(0, NULL, FALSE, timeout, QS_ALLINPUT);
+          RestartPresentStats(&present_stats);
+          was_idle = true;
         }
       }
+
+      // Don't lose a drag that was still going when the loop ended
+      if (options.projectPath[0] && boxes_set) {
+        SaveProjectChanges(options.projectPath, &project, &saved);
+      }
+      ReleaseCameraTrack(&track);
     }
   }
 
   // Release Direct3D resources
-  if (pTexture)   pTexture->Release();
+  ReleaseTelemetry(pTelemetry);
+  ReleaseImageCache(pImageCache);
+  ReleaseImageFilter(pFilter);
+  ReleasePreviewTarget(pPreview);
+  ReleaseFrameShare(pShare);
+  ReleasePicture(&picture);
+  ReleaseWorkQueue(pQueue);
   if (pd3dDevice) pd3dDevice->Release();
   if (pD3D)       pD3D->Release();
 
   // Get rid of the window class
   DestroyWindow(hWnd);
   UnregisterClass(wc.lpszClassName, hInstance);
+  CoUninitialize();
+  ReleaseBatchJobs(pJobs);
+  ReleaseBatchJobs(pSlides);
 
-  // Success
-  return S_OK;
+  // Success, unless a batch job failed
+  return exitCode;
 }
@@ -0,0 +1,13 @@
+//--------------------------------------------------------------------------------------------------
+//
+// Small types shared between the parts of the app.
+//
+//--------------------------------------------------------------------------------------------------
+#pragma once
+
+/**
+ * A view of the image, in image pixel coordinates
+ */
+struct ZoomRect {
+  float left, top, right, bottom;
+};